@@ -0,0 +1,89 @@
+/* -----------------------------------------------------------------------
+ * Title: Framed single-wire protocol, Pi side, see framelink.h
+ * -----------------------------------------------------------------------*/
+
+#include <framelink.h>
+#include <errno.h>
+#include <time.h>
+
+#define US      1000ull                     // ns
+
+uint64_t mono_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//---------------------------------------------------------------
+int FrameRx::feed(const GpioEdge &e) {
+    uint64_t gap = e.ns - last_;
+    uint8_t p;
+
+    last_ = e.ns;
+    if (e.rising) {
+        if (bits_ >= 0 && gap > FR_LOW_MAX * US)
+            bits_ = -1;                     // low too long: frame lost
+        rise_ = e.ns;
+        high_ = true;
+        return NONE;
+    }
+    if (!high_)                             // end of our own pulse
+        return NONE;
+    high_ = false;
+
+    p = fr_pulse((e.ns - rise_) / US);
+    switch (p) {
+    case FR_P_START:
+        bits_ = 0;
+        return NONE;
+    case FR_P_ZERO:
+    case FR_P_ONE:
+        if (bits_ < 0)
+            return NONE;
+        buf_[bits_ >> 3] = buf_[bits_ >> 3] << 1 | (p == FR_P_ONE);
+        if ((++bits_ & 7) || (bits_ >> 3) < FR_LEN(buf_[0]) + 2)
+            return NONE;
+        len_ = bits_ >> 3;
+        bits_ = -1;
+        if (fr_valid(buf_, len_))
+            return FRAME;
+        bad_++;
+        return NONE;
+    case FR_P_LONG:
+        bits_ = -1;
+        return LONG;
+    default:                                // glitch
+        bits_ = -1;
+        return NONE;
+    }
+}
+
+bool FrameRx::busy(uint64_t now) const {
+    return bits_ >= 0 || high_ || now - last_ < FR_IDLE * FR_UNIT_US * US;
+}
+
+//---------------------------------------------------------------
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        ;
+}
+
+bool frame_send(GpioLine &line, uint8_t op, const uint8_t *data, uint8_t len,
+                unsigned int lead_us) {
+    uint8_t buf[FR_MAX];
+    int pulses = fr_build(buf, op, data, len) * 8 + 1;
+    uint64_t t = mono_ns() + lead_us * US;
+    bool ok = true;
+
+    for (int i = 0; i < pulses && ok; i++) {
+        int w = i == 0 ? FR_START : (buf[(i - 1) >> 3] & (0x80 >> ((i - 1) & 7))) ? FR_ONE : FR_ZERO;
+        sleep_until(t);
+        ok = line.output(1);
+        t += w * FR_UNIT_US * US;
+        sleep_until(t);
+        ok = line.input(GpioLine::NONE) && ok;
+        t += FR_LOW * FR_UNIT_US * US;
+    }
+    return line.input(GpioLine::BOTH) && ok;
+}
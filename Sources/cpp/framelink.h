@@ -0,0 +1,48 @@
+/* -----------------------------------------------------------------------
+ * Title: Framed single-wire protocol, Pi side
+ * Protocol and constants: ../tiny44/frame.h, shared with the firmware.
+ *
+ * FrameRx decodes the kernel timestamped edges of the line into frames,
+ * pulses longer than a start pulse are reported as LONG (command pulses
+ * of the old protocol). frame_send() puts a frame on the line: the Pi
+ * drives high and releases the line (input, no edge detection) for low,
+ * each edge at an absolute CLOCK_MONOTONIC time.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _FRAMELINK_H
+#define _FRAMELINK_H
+
+#include <gpioline.h>
+#include <frame.h>
+
+class FrameRx {
+public:
+    enum { NONE, FRAME, LONG };
+
+    FrameRx() { reset(); }
+    void reset() { bits_ = -1; high_ = false; }
+
+    int  feed(const GpioEdge &e);           // FRAME: valid frame in frame(), length()
+    bool busy(uint64_t now) const;          // receiving, or line not yet idle for FR_IDLE
+    uint64_t last() const { return last_; } // ns of the last edge
+
+    const uint8_t *frame() const { return buf_; }
+    int  length() const { return len_; }
+    unsigned int bad() const { return bad_; }
+
+private:
+    uint64_t rise_ = 0, last_ = 0;
+    int      bits_;                         // bits of the frame so far, -1: no frame
+    bool     high_;                         // rising edge seen
+    int      len_ = 0;
+    unsigned int bad_ = 0;                  // frames with wrong crc or length
+    uint8_t  buf_[FR_MAX];
+};
+
+uint64_t mono_ns();
+
+// frame after lead_us, returns when its last bit is done (< 70 ms)
+bool frame_send(GpioLine &line, uint8_t op, const uint8_t *data, uint8_t len,
+                unsigned int lead_us);
+
+#endif  // ifndef _FRAMELINK_H
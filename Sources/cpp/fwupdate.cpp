@@ -0,0 +1,250 @@
+/* -----------------------------------------------------------------------
+ * Title: Firmware update of ISWITCHPI over the line, see fwupdate.h
+ * -----------------------------------------------------------------------*/
+
+#include <fwupdate.h>
+#include <framelink.h>                      // mono_ns()
+#include <errno.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#define US      1000ull                     // ns
+#define MS      1000000ull
+
+//---------------------------------------------------------------
+// Intel HEX: data, end of file, segment and linear base address
+static int hex_byte(const char *s) {
+    int v = 0;
+    for (int i = 0; i < 2; i++) {
+        char c = s[i];
+        v <<= 4;
+        if (c >= '0' && c <= '9')      v |= c - '0';
+        else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+        else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+        else return -1;
+    }
+    return v;
+}
+
+bool FwImage::load(const char *path, char *err, size_t size) {
+    char text[600];
+    uint8_t rec[260];
+    unsigned int base = 0, end = 0, lineno = 0;
+    bool eof = false;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        snprintf(err, size, "%s: %s", path, strerror(errno));
+        return false;
+    }
+    memset(data, 0xff, sizeof(data));
+    pages = 0;
+    while (!eof && fgets(text, sizeof(text), f)) {
+        int n = 0, b;
+        uint8_t sum = 0;
+
+        lineno++;
+        if (text[0] != ':') {
+            if (strspn(text, " \t\r\n") == strlen(text))
+                continue;                   // empty line
+            break;
+        }
+        while ((b = hex_byte(text + 1 + 2 * n)) >= 0 && n < (int)sizeof(rec)) {
+            rec[n++] = b;
+            sum += b;
+        }
+        if (n < 5 || n != rec[0] + 5 || sum != 0)
+            break;                          // length or checksum wrong
+        unsigned int addr = base + (rec[1] << 8 | rec[2]);
+        switch (rec[3]) {
+        case 0x00:
+            if (addr + rec[0] > FB_BOOT) {
+                fclose(f);
+                snprintf(err, size, "%s: data at 0x%04x, the bootloader starts at 0x%04x",
+                         path, addr + rec[0] - 1, FB_BOOT);
+                return false;
+            }
+            memcpy(data + addr, rec + 4, rec[0]);
+            if (addr + rec[0] > end)
+                end = addr + rec[0];
+            continue;
+        case 0x01:
+            eof = true;
+            continue;
+        case 0x02:
+        case 0x04:
+            if (rec[0] != 2)
+                break;
+            base = (rec[4] << 8 | rec[5]) << (rec[3] == 0x02 ? 4 : 16);
+            continue;
+        case 0x03:
+        case 0x05:                          // start address, the reset vector counts
+            continue;
+        }
+        break;
+    }
+    fclose(f);
+    if (!eof) {
+        snprintf(err, size, "%s: not Intel HEX (line %u)", path, lineno);
+        return false;
+    }
+    if (((data[0] | data[1] << 8) & 0xf000) != 0xc000) {
+        snprintf(err, size, "%s: no rjmp at the reset vector", path);
+        return false;                       // the bootloader needs it, boot.c
+    }
+    pages = (end + FB_PAGE - 1) / FB_PAGE;
+    return true;
+}
+
+//---------------------------------------------------------------
+// boot frame out. The line goes back to input with edge detection on
+// the last falling edge: the answer starts FR_RESP (200 us) later.
+// Edges are 100 us apart or more: sleep to SPIN_US before each one,
+// spin only the rest (the wakeup latency), the CPU stays usable
+#define SPIN_US 50
+
+static void edge_at(uint64_t ns) {
+    uint64_t now = mono_ns();
+    if (now + SPIN_US * US < ns) {
+        uint64_t w = ns - SPIN_US * US;
+        struct timespec ts = { (time_t)(w / 1000000000ull), (long)(w % 1000000000ull) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+            ;
+    }
+    while (mono_ns() < ns)
+        ;
+}
+
+static bool boot_send(GpioLine &line, const uint8_t *buf, int n) {
+    int pulses = n * 8 + 1;
+    uint64_t t = mono_ns();
+    bool ok = true;
+
+    for (int i = 0; i < pulses && ok; i++) {
+        int w = i == 0 ? FR_START : (buf[(i - 1) >> 3] & (0x80 >> ((i - 1) & 7))) ? FR_ONE : FR_ZERO;
+        edge_at(t);
+        ok = line.output(1);
+        t += w * FB_UNIT_US * US;
+        edge_at(t);
+        ok = line.input(i == pulses - 1 ? GpioLine::BOTH : GpioLine::NONE) && ok;
+        t += FR_LOW * FB_UNIT_US * US;
+    }
+    return ok;
+}
+
+// answer of the bootloader by 'end': op, 0 if none. arg: its arg
+static uint8_t boot_answer(GpioLine &line, uint64_t end, uint8_t &arg) {
+    GpioEdge edges[16];
+    uint8_t buf[3];
+    uint64_t rise = 0, last = 0;
+    int bits = -1;
+    bool high = false;
+
+    for (uint64_t now = mono_ns(); now < end; now = mono_ns()) {
+        struct pollfd p = { line.fd(), POLLIN, 0 };
+        if (poll(&p, 1, (end - now) / MS + 1) <= 0)
+            continue;
+        int k = line.read(edges, 16);
+        for (int i = 0; i < k; i++) {
+            const GpioEdge &e = edges[i];
+            uint64_t gap = e.ns - last;
+
+            last = e.ns;
+            if (e.rising) {
+                if (bits >= 0 && gap > FR_LOW_MAX / (FR_UNIT_US / FB_UNIT_US) * US)
+                    bits = -1;              // low too long: frame lost
+                rise = e.ns;
+                high = true;
+                continue;
+            }
+            if (!high)                      // end of our own pulse
+                continue;
+            high = false;
+            uint8_t w = fb_pulse((e.ns - rise) / US);
+            if (w == FR_P_START) {
+                bits = 0;
+            } else if ((w == FR_P_ZERO || w == FR_P_ONE) && bits >= 0) {
+                buf[bits >> 3] = buf[bits >> 3] << 1 | (w == FR_P_ONE);
+                if (++bits < 24)
+                    continue;
+                bits = -1;
+                if (fr_crc8(fr_crc8(fr_crc8(0, buf[0]), buf[1]), buf[2]) == 0) {
+                    arg = buf[1];
+                    return buf[0];
+                }
+            } else {
+                bits = -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// one boot frame, again until the answer it wants: FB_READY for HELLO,
+// else FB_ACK with the same arg. Returns the op of the answer, 0: none
+static uint8_t boot_frame(GpioLine &line, uint8_t op, uint8_t arg, const uint8_t *data,
+                          uint8_t &reply, FwStats &st) {
+    uint8_t buf[FB_MAX], n = 0, crc = 0, got = 0;
+
+    buf[n++] = op;
+    buf[n++] = arg;
+    for (int i = 0; i < fb_len(op); i++)
+        buf[n++] = data[i];
+    for (int i = 0; i < n; i++)
+        crc = fr_crc8(crc, buf[i]);
+    buf[n++] = crc;
+
+    for (int tries = 0; tries < FB_TRIES; tries++) {
+        if (tries)
+            st.retries++;
+        if (!boot_send(line, buf, n))
+            return 0;
+        got = boot_answer(line, mono_ns() + (op == FB_DONE ? FB_DONE_MS : FB_REPLY_MS) * MS, reply);
+        if (op == FB_HELLO ? got == FB_READY : got == FB_ACK && reply == arg)
+            return got;
+    }
+    return got;
+}
+
+//---------------------------------------------------------------
+bool fw_upload(GpioLine &line, const FwImage &img, FwStats &st) {
+    struct sched_param rt = {}, old = {};
+    int policy = sched_getscheduler(0);
+    uint16_t crc = 0xffff;
+    uint8_t reply = 0;
+    bool ok = false, raise;
+
+    memset(&st, 0, sizeof(st));
+    sched_getparam(0, &old);
+    rt.sched_priority = sched_get_priority_max(SCHED_FIFO) / 2;
+    raise = !((policy == SCHED_FIFO || policy == SCHED_RR) && old.sched_priority >= rt.sched_priority);
+    if (raise)                                  // never lower a real-time priority set by the caller
+        sched_setscheduler(0, SCHED_FIFO, &rt); // without: only more retries
+    uint64_t t0 = mono_ns();
+
+    if (boot_frame(line, FB_HELLO, 0, nullptr, reply, st) != FB_READY) {
+        snprintf(st.err, sizeof(st.err), "no bootloader");
+    } else if (reply < img.pages) {
+        snprintf(st.err, sizeof(st.err), "image of %d pages, room for %u", img.pages, reply);
+    } else {
+        while (st.pages < img.pages
+               && boot_frame(line, FB_WRITE, st.pages, img.data + st.pages * FB_PAGE, reply, st) == FB_ACK)
+            st.pages++;
+        for (int a = 0; a < img.pages * FB_PAGE; a++)
+            crc = fb_crc16(crc, img.data[a]);
+        uint8_t check[2] = { (uint8_t)(crc >> 8), (uint8_t)(crc & 0xff) };
+        if (st.pages < img.pages)
+            snprintf(st.err, sizeof(st.err), "page %d not written", st.pages);
+        else if (boot_frame(line, FB_DONE, img.pages, check, reply, st) != FB_ACK)
+            snprintf(st.err, sizeof(st.err), "image check failed");
+        else
+            ok = true;
+    }
+    st.ns = mono_ns() - t0;
+    if (raise)
+        sched_setscheduler(0, policy, &old);
+    return ok;
+}
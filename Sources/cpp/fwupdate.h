@@ -0,0 +1,40 @@
+/* -----------------------------------------------------------------------
+ * Title: Firmware update of ISWITCHPI over the line, Pi side
+ * Protocol: FR_UPDATE and the boot frames in ../tiny44/frame.h, the
+ * bootloader is ../tiny44/boot/boot.c.
+ *
+ * FwImage::load() reads the Intel HEX file of the firmware (make in
+ * Sources/tiny44: iswitchpi.hex, not iswitchpi-boot.hex) and pads it
+ * with 0xff to whole pages. fw_upload() talks to the bootloader once
+ * FR_UPDATE is ACKed: HELLO, the pages, DONE with the CRC-16 of the
+ * image. Each boot frame goes again, up to FB_TRIES times, on a NAK or
+ * without an answer within FB_REPLY_MS.
+ * The pulses of the boot frames are 100 us wide: they are timed by
+ * spinning on CLOCK_MONOTONIC under SCHED_FIFO, clock_nanosleep() is
+ * too coarse for them. A 3.5 KB image takes ~9 s.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _FWUPDATE_H
+#define _FWUPDATE_H
+
+#include <stddef.h>
+#include <gpioline.h>
+#include <frame.h>
+
+struct FwImage {
+    uint8_t  data[FB_BOOT];
+    int      pages;
+
+    bool load(const char *path, char *err, size_t size);   // err: why not
+};
+
+struct FwStats {
+    int      pages;                         // written
+    int      retries;                       // frames sent again
+    uint64_t ns;                            // HELLO to the ACK of DONE
+    char     err[64];                       // fw_upload() false: why
+};
+
+bool fw_upload(GpioLine &line, const FwImage &img, FwStats &st);
+
+#endif  // ifndef _FWUPDATE_H
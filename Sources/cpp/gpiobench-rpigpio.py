@@ -0,0 +1,31 @@
+#!/usr/bin/python3
+#--------------------------------------------------------------------------
+#   RPi.GPIO side of gpiobench (mode rpi-gpio), not for use on its own
+#   Callback on rising edges as in ../examples/example-interrupt.py, it
+#   only notes time.monotonic_ns() (same clock as the benchmark).
+#   Prints "ready" when the edge detection is on, then the times, one per
+#   line, when stdin is closed.
+#   On gpio-sim RPi.GPIO is rpi-lgpio, the chip comes from RPI_LGPIO_CHIP
+#
+#   usage: gpiobench-rpigpio.py LINE
+#--------------------------------------------------------------------------
+import sys
+import time
+import RPi.GPIO as GPIO
+
+stamps = []
+
+def edge(channel):
+    stamps.append(time.monotonic_ns())
+
+pin = int(sys.argv[1])
+GPIO.setwarnings(False)
+GPIO.setmode(GPIO.BCM)
+GPIO.setup(pin, GPIO.IN)
+GPIO.add_event_detect(pin, GPIO.RISING, callback=edge)
+print("ready", flush=True)
+sys.stdin.read()                            # until gpiobench closes the pipe
+time.sleep(0.05)
+GPIO.remove_event_detect(pin)
+GPIO.cleanup()
+sys.stdout.write("".join("%d\n" % t for t in stamps))
@@ -0,0 +1,338 @@
+/* -----------------------------------------------------------------------
+ *   GPIO edge latency benchmark for the Pi side
+ *   Run through gpiobench.sh (make bench), needs root and gpio-sim
+ *
+ *   A gpio-sim line stands in for the iSwitchPi output. Its edges are
+ *   made by writing the line's pull attribute in sysfs at a fixed rate
+ *   (absolute CLOCK_MONOTONIC deadlines). The time of each write is
+ *   noted, the receiving side notes when its handler sees the edge.
+ *   Modes, each receiving rising edges only:
+ *     gpiod-blocking  libgpiod: wait for an edge, read one (Pi programs
+ *                     written like example-interrupt.py)
+ *     gpiod-epoll     epoll, then all pending edges in one read (iswitchpid,
+ *                     squareclock.h)
+ *     rpi-gpio        RPi.GPIO add_event_detect callback, gpiobench-rpigpio.py
+ *                     (on gpio-sim through rpi-lgpio, RPI_LGPIO_CHIP is set)
+ *   Per mode and rate: edge to handler latency (p50/p99/max, us), for
+ *   libgpiod also kernel timestamp to handler, and events dropped.
+ *   Output is JSON on stdout.
+ *
+ *   usage: gpiobench -c CHIP -l LINE -s PULLFILE [-m MODES] [-f RATES]
+ *                    [-t SECONDS] [-n MAXEDGES] [-P SCRIPT]
+ *   MODES and RATES comma separated, default all modes and 1,10,100,1000,10000 Hz
+ * -----------------------------------------------------------------------*/
+
+#include <gpioline.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/select.h>
+#include <sys/utsname.h>
+#include <sys/wait.h>
+
+#define CONSUMER        "gpiobench"
+#define SETTLE_MS       20                  // after pull-down, before the line is requested
+#define DRAIN_MS        200                 // after the last edge: late events still count
+#define BATCH           16                  // EVENT_BUFFER of GpioLine
+#define PYTHON_READY_S  10                  // interpreter and RPi.GPIO start
+
+struct Got {
+    uint64_t      user_ns;                  // handler saw it
+    uint64_t      kernel_ns;                // kernel timestamp, 0: none (rpi-gpio)
+    unsigned long seqno;                    // 0: none, matched by order
+};
+
+struct Result {
+    const char *mode;
+    double      hz;
+    int         sent;
+    int         received;
+    int         dropped;
+    bool        by_order;                   // rpi-gpio with drops: nearest earlier edge
+    std::vector<double> lat, k2u;           // us
+    const char *error;
+};
+
+static const char *pull_path;
+static const char *chip = nullptr;
+static unsigned int offset;
+static const char *script = nullptr;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { (time_t)(ns / 1000000000ull), (long)(ns % 1000000000ull) };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        ;
+}
+
+//---------------------------------------------------------------
+// edge generator: square wave on the pull attribute, rising edge times
+static bool pull(int fd, bool up) {
+    const char *v = up ? "pull-up" : "pull-down";
+    return pwrite(fd, v, strlen(v), 0) == (ssize_t)strlen(v);
+}
+
+static void generate(int fd, double hz, int n, std::vector<uint64_t> &sent) {
+    uint64_t period = 1e9 / hz;
+    uint64_t t = now_ns() + 10 * 1000000ull;
+
+    sent.clear();
+    for (int i = 0; i < n; i++) {
+        sleep_until(t);
+        sent.push_back(now_ns());
+        pull(fd, true);
+        sleep_until(t + period / 2);
+        pull(fd, false);
+        t += period;
+    }
+}
+
+//---------------------------------------------------------------
+// libgpiod receivers, run in their own thread while generate() runs
+static void rx_blocking(GpioLine &line, std::atomic<bool> &done, std::vector<Got> &got) {
+    GpioEdge e;
+    while (!done) {
+        if (line.wait(DRAIN_MS / 4 * 1000000ll) <= 0)
+            continue;
+        if (line.read(&e, 1) == 1)
+            got.push_back({ now_ns(), e.ns, e.seqno });
+    }
+}
+
+static void rx_epoll(GpioLine &line, std::atomic<bool> &done, std::vector<Got> &got) {
+    GpioEdge ev[BATCH];
+    struct epoll_event ee = {};
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+
+    ee.events = EPOLLIN;
+    epoll_ctl(efd, EPOLL_CTL_ADD, line.fd(), &ee);
+    while (!done) {
+        if (epoll_wait(efd, &ee, 1, DRAIN_MS / 4) <= 0)
+            continue;
+        int n = line.read(ev, BATCH);
+        uint64_t now = now_ns();
+        for (int i = 0; i < n; i++)
+            got.push_back({ now, ev[i].ns, ev[i].seqno });
+    }
+    close(efd);
+}
+
+static bool run_gpiod(Result &r, int fd, bool epoll, std::vector<uint64_t> &sent,
+                      std::vector<Got> &got) {
+    GpioLine line;
+    std::atomic<bool> done(false);
+
+    if (!line.open(chip, offset, CONSUMER) || !line.input(GpioLine::RISING)) {
+        r.error = "cannot request the line";
+        return false;
+    }
+    std::thread rx(epoll ? rx_epoll : rx_blocking, std::ref(line), std::ref(done), std::ref(got));
+    generate(fd, r.hz, r.sent, sent);
+    usleep(DRAIN_MS * 1000);
+    done = true;
+    rx.join();
+    return true;
+}
+
+//---------------------------------------------------------------
+// rpi-gpio: the python helper notes callback times, prints them at the end
+static bool run_python(Result &r, int fd, std::vector<uint64_t> &sent, std::vector<Got> &got) {
+    int in[2], out[2];
+    char buf[64];
+
+    if (pipe2(in, O_CLOEXEC) < 0 || pipe2(out, O_CLOEXEC) < 0) {
+        r.error = "pipe";
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        char num[16];
+        const char *c = strpbrk(chip, "0123456789");
+        dup2(in[0], 0);
+        dup2(out[1], 1);
+        if (c)
+            setenv("RPI_LGPIO_CHIP", c, 1);  // rpi-lgpio: gpio-sim chip, not the Pi's
+        snprintf(num, sizeof(num), "%u", offset);
+        execlp("python3", "python3", script, num, (char *)nullptr);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    FILE *f = fdopen(out[0], "r");
+    struct timeval tv = { PYTHON_READY_S, 0 };
+    fd_set rd;
+    FD_ZERO(&rd);
+    FD_SET(out[0], &rd);
+    bool ready = select(out[0] + 1, &rd, nullptr, nullptr, &tv) > 0
+                 && fgets(buf, sizeof(buf), f) && strncmp(buf, "ready", 5) == 0;
+    if (ready) {
+        generate(fd, r.hz, r.sent, sent);
+        usleep(DRAIN_MS * 1000);
+    }
+    close(in[1]);                           // helper: stop and print
+    while (ready && fgets(buf, sizeof(buf), f))
+        got.push_back({ strtoull(buf, nullptr, 10), 0, 0 });
+    fclose(f);
+    if (!ready)
+        kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    if (!ready)
+        r.error = "python3 with RPi.GPIO (rpi-lgpio on gpio-sim) not available";
+    return ready;
+}
+
+//---------------------------------------------------------------
+// match handler times to the edges sent
+static void evaluate(Result &r, const std::vector<uint64_t> &sent, const std::vector<Got> &got) {
+    size_t k = 0;
+
+    r.received = got.size();
+    r.dropped = r.sent - r.received;
+    r.by_order = got.size() && got[0].seqno == 0 && r.dropped != 0;
+    for (size_t i = 0; i < got.size(); i++) {
+        const Got &g = got[i];
+        size_t j;
+        if (g.seqno) {                      // libgpiod: seqno counts from 1 per request,
+            j = g.seqno - 1;                // gaps: kernel buffer full, counted in dropped
+        } else if (!r.by_order) {
+            j = i;
+        } else {                            // last edge sent before the callback
+            while (k + 1 < sent.size() && sent[k + 1] <= g.user_ns)
+                k++;
+            j = k;
+        }
+        if (j >= sent.size() || g.user_ns < sent[j])
+            continue;
+        r.lat.push_back((g.user_ns - sent[j]) / 1e3);
+        if (g.kernel_ns && g.user_ns >= g.kernel_ns)
+            r.k2u.push_back((g.user_ns - g.kernel_ns) / 1e3);
+    }
+}
+
+static void json_dist(const char *name, std::vector<double> &v, bool comma) {
+    double sum = 0;
+    if (v.empty()) {
+        printf("      \"%s\": null%s\n", name, comma ? "," : "");
+        return;
+    }
+    std::sort(v.begin(), v.end());
+    for (double x : v)
+        sum += x;
+    printf("      \"%s\": { \"p50\": %.1f, \"p99\": %.1f, \"max\": %.1f, \"mean\": %.1f }%s\n",
+           name, v[v.size() / 2], v[std::min(v.size() - 1, v.size() * 99 / 100)],
+           v.back(), sum / v.size(), comma ? "," : "");
+}
+
+static void json_result(Result &r, bool last) {
+    printf("    {\n      \"mode\": \"%s\",\n      \"hz\": %g,\n", r.mode, r.hz);
+    if (r.error) {
+        printf("      \"error\": \"%s\"\n    }%s\n", r.error, last ? "" : ",");
+        return;
+    }
+    printf("      \"sent\": %d,\n      \"received\": %d,\n      \"dropped\": %d,\n",
+           r.sent, r.received, r.dropped);
+    if (r.by_order)
+        printf("      \"matched\": \"nearest earlier edge\",\n");
+    json_dist("latency_us", r.lat, true);
+    json_dist("kernel_to_user_us", r.k2u, false);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+//---------------------------------------------------------------
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s -c CHIP -l LINE -s PULLFILE [-m gpiod-blocking,gpiod-epoll,rpi-gpio]\n"
+                    "       [-f 1,10,100,1000,10000] [-t SECONDS] [-n MAXEDGES] [-P gpiobench-rpigpio.py]\n",
+            name);
+}
+
+int main(int argc, char **argv) {
+    static const char *const all_modes[] = { "gpiod-blocking", "gpiod-epoll", "rpi-gpio" };
+    std::vector<const char *> modes;
+    std::vector<double> rates;
+    double seconds = 5;
+    int maxedges = 2000, opt;
+    char path[512];
+
+    while ((opt = getopt(argc, argv, "c:l:s:m:f:t:n:P:h")) != -1) {
+        switch (opt) {
+        case 'c': chip = optarg; break;
+        case 'l': offset = atoi(optarg); break;
+        case 's': pull_path = optarg; break;
+        case 'm':
+            for (char *m = strtok(optarg, ","); m; m = strtok(nullptr, ","))
+                for (const char *a : all_modes)
+                    if (strcmp(m, a) == 0)
+                        modes.push_back(a);
+            break;
+        case 'f':
+            for (char *f = strtok(optarg, ","); f; f = strtok(nullptr, ","))
+                if (atof(f) > 0)
+                    rates.push_back(atof(f));
+            break;
+        case 't': seconds = atof(optarg); break;
+        case 'n': maxedges = atoi(optarg); break;
+        case 'P': script = optarg; break;
+        default:  usage(argv[0]); return 2;
+        }
+    }
+    if (!chip || !pull_path) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (modes.empty())
+        modes.assign(all_modes, all_modes + 3);
+    if (rates.empty())
+        rates = { 1, 10, 100, 1000, 10000 };
+    if (!script) {                          // next to the binary
+        snprintf(path, sizeof(path), "%s", argv[0]);
+        char *s = strrchr(path, '/');
+        snprintf(s ? s + 1 : path, sizeof(path) - (s ? s + 1 - path : 0), "gpiobench-rpigpio.py");
+        script = path;
+    }
+    int fd = open(pull_path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || !pull(fd, false)) {
+        fprintf(stderr, "gpiobench: %s: %s\n", pull_path, strerror(errno));
+        return 1;
+    }
+
+    struct utsname u;
+    uname(&u);
+    printf("{\n  \"kernel\": \"%s\",\n  \"machine\": \"%s\",\n  \"chip\": \"%s\",\n"
+           "  \"line\": %u,\n  \"results\": [\n", u.release, u.machine, chip, offset);
+    for (size_t m = 0; m < modes.size(); m++)
+        for (size_t i = 0; i < rates.size(); i++) {
+            Result r = {};
+            std::vector<uint64_t> sent;
+            std::vector<Got> got;
+            r.mode = modes[m];
+            r.hz = rates[i];
+            r.sent = std::max(5, std::min(maxedges, (int)(rates[i] * seconds)));
+            pull(fd, false);
+            usleep(SETTLE_MS * 1000);
+            fprintf(stderr, "gpiobench: %s %g Hz, %d edges\n", r.mode, r.hz, r.sent);
+            bool ok = strcmp(r.mode, "rpi-gpio") == 0
+                      ? run_python(r, fd, sent, got)
+                      : run_gpiod(r, fd, strcmp(r.mode, "gpiod-epoll") == 0, sent, got);
+            if (ok)
+                evaluate(r, sent, got);
+            json_result(r, m + 1 == modes.size() && i + 1 == rates.size());
+        }
+    printf("  ]\n}\n");
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,28 @@
+#!/bin/sh
+#--------------------------------------------------------------------------
+#   GPIO edge latency benchmark on a gpio-sim chip, see gpiobench.cpp
+#   Sets up the chip as gpiosim-test.sh does, runs gpiobench, JSON on stdout
+#
+#   usage: sudo ./gpiobench.sh [gpiobench options, e.g. -f 1,100 -m gpiod-epoll]
+#   rpi-gpio mode needs python3 with rpi-lgpio (pip install rpi-lgpio)
+#--------------------------------------------------------------------------
+
+BENCH=$(dirname $0)/gpiobench
+PIN=20
+CFG=/sys/kernel/config/gpio-sim/iswitchpi-bench
+
+modprobe gpio-sim 2>/dev/null
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+mkdir $CFG $CFG/bank0 || exit 1
+echo 32 > $CFG/bank0/num_lines
+echo 1 > $CFG/live
+CHIP=$(cat $CFG/bank0/chip_name)
+LINE=/sys/devices/platform/$(cat $CFG/dev_name)/$CHIP/sim_gpio$PIN
+
+cleanup() {
+    echo 0 > $CFG/live
+    rmdir $CFG/bank0 $CFG
+}
+trap cleanup EXIT
+
+$BENCH -c $CHIP -l $PIN -s $LINE/pull "$@"
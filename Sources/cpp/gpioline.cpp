@@ -0,0 +1,131 @@
+/* -----------------------------------------------------------------------
+ * Title: One GPIO line on the gpiochip character device, see gpioline.h
+ * -----------------------------------------------------------------------*/
+
+#include <gpioline.h>
+#include <gpiod.h>
+#include <stdio.h>
+#include <string.h>
+
+#define EVENT_BUFFER    16                  // edges fetched per read()
+
+//---------------------------------------------------------------
+bool GpioLine::open(const char *chip, unsigned int offset, const char *consumer) {
+    char path[64];
+
+    close();
+    if (strchr(chip, '/') == nullptr) {
+        snprintf(path, sizeof(path), "/dev/%s", chip);
+        chip = path;
+    }
+    chip_ = gpiod_chip_open(chip);
+    if (chip_ == nullptr)
+        return false;
+    offset_ = offset;
+
+    gpiod_line_settings  *settings = gpiod_line_settings_new();
+    gpiod_line_config    *lcfg     = gpiod_line_config_new();
+    gpiod_request_config *rcfg     = gpiod_request_config_new();
+    if (settings && lcfg && rcfg) {
+        gpiod_line_settings_set_direction(settings, GPIOD_LINE_DIRECTION_INPUT);
+        gpiod_line_config_add_line_settings(lcfg, &offset_, 1, settings);
+        gpiod_request_config_set_consumer(rcfg, consumer);
+        gpiod_request_config_set_event_buffer_size(rcfg, EVENT_BUFFER);
+        req_ = gpiod_chip_request_lines(chip_, rcfg, lcfg);
+    }
+    gpiod_request_config_free(rcfg);
+    gpiod_line_config_free(lcfg);
+    gpiod_line_settings_free(settings);
+
+    buf_ = gpiod_edge_event_buffer_new(EVENT_BUFFER);
+    if (req_ == nullptr || buf_ == nullptr) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+//---------------------------------------------------------------
+void GpioLine::close() {
+    if (buf_)
+        gpiod_edge_event_buffer_free(buf_);
+    if (req_)
+        gpiod_line_request_release(req_);
+    if (chip_)
+        gpiod_chip_close(chip_);
+    buf_  = nullptr;
+    req_  = nullptr;
+    chip_ = nullptr;
+}
+
+//---------------------------------------------------------------
+// apply settings to the line, the request (and its fd) stays
+bool GpioLine::reconfigure(gpiod_line_settings *settings) {
+    bool ok = false;
+    gpiod_line_config *lcfg = gpiod_line_config_new();
+
+    if (settings && lcfg
+        && gpiod_line_config_add_line_settings(lcfg, &offset_, 1, settings) == 0)
+        ok = gpiod_line_request_reconfigure_lines(req_, lcfg) == 0;
+    gpiod_line_config_free(lcfg);
+    gpiod_line_settings_free(settings);
+    return ok;
+}
+
+bool GpioLine::input(int edges) {
+    gpiod_line_settings *s = gpiod_line_settings_new();
+    if (s) {
+        gpiod_line_settings_set_direction(s, GPIOD_LINE_DIRECTION_INPUT);
+        gpiod_line_settings_set_edge_detection(s,
+            edges == BOTH    ? GPIOD_LINE_EDGE_BOTH :
+            edges == FALLING ? GPIOD_LINE_EDGE_FALLING :
+            edges == RISING  ? GPIOD_LINE_EDGE_RISING : GPIOD_LINE_EDGE_NONE);
+        gpiod_line_settings_set_event_clock(s, GPIOD_LINE_CLOCK_MONOTONIC);
+    }
+    return reconfigure(s);
+}
+
+bool GpioLine::output(int value) {
+    gpiod_line_settings *s = gpiod_line_settings_new();
+    if (s) {
+        gpiod_line_settings_set_direction(s, GPIOD_LINE_DIRECTION_OUTPUT);
+        gpiod_line_settings_set_output_value(s,
+            value ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE);
+    }
+    return reconfigure(s);
+}
+
+bool GpioLine::set(int value) {
+    return gpiod_line_request_set_value(req_, offset_,
+        value ? GPIOD_LINE_VALUE_ACTIVE : GPIOD_LINE_VALUE_INACTIVE) == 0;
+}
+
+int GpioLine::get() {
+    return gpiod_line_request_get_value(req_, offset_);
+}
+
+int GpioLine::fd() const {
+    return gpiod_line_request_get_fd(req_);
+}
+
+int GpioLine::wait(int64_t timeout_ns) {
+    return gpiod_line_request_wait_edge_events(req_, timeout_ns);
+}
+
+//---------------------------------------------------------------
+int GpioLine::read(GpioEdge *ev, int max) {
+    int n = gpiod_line_request_wait_edge_events(req_, 0);
+    if (n <= 0)
+        return n;                           // 0: nothing pending
+
+    if (max > EVENT_BUFFER)
+        max = EVENT_BUFFER;
+    n = gpiod_line_request_read_edge_events(req_, buf_, max);
+    for (int i = 0; i < n; i++) {
+        gpiod_edge_event *e = gpiod_edge_event_buffer_get_event(buf_, i);
+        ev[i].ns     = gpiod_edge_event_get_timestamp_ns(e);
+        ev[i].rising = gpiod_edge_event_get_event_type(e) == GPIOD_EDGE_EVENT_RISING_EDGE;
+        ev[i].seqno  = gpiod_edge_event_get_line_seqno(e);
+    }
+    return n;
+}
@@ -0,0 +1,62 @@
+/* -----------------------------------------------------------------------
+ * Title: One GPIO line on the gpiochip character device
+ * Hardware: Raspberry Pi (any gpiochip, also the kernel gpio-sim module)
+ *
+ * Thin wrapper around a libgpiod v2 line request for a single line.
+ * The line is requested once and only reconfigured afterwards:
+ * switching between output and input with edge detection does not
+ * release the line (no teardown as with RPi.GPIO add_event_detect).
+ * Edge events carry the kernel timestamp (CLOCK_MONOTONIC, ns) and the
+ * per line sequence number, so lost edges can be detected by the caller.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _GPIOLINE_H
+#define _GPIOLINE_H
+
+#include <stdint.h>
+
+struct gpiod_chip;
+struct gpiod_line_request;
+struct gpiod_line_settings;
+struct gpiod_edge_event_buffer;
+
+struct GpioEdge {
+    uint64_t      ns;                       // kernel timestamp, CLOCK_MONOTONIC
+    bool          rising;
+    unsigned long seqno;                    // per line sequence number, starts at 1
+};
+
+class GpioLine {
+public:
+    enum Edges { NONE = 0, RISING = 1, FALLING = 2, BOTH = 3 };
+
+    GpioLine() = default;
+    ~GpioLine() { close(); }
+    GpioLine(const GpioLine &) = delete;
+    GpioLine &operator=(const GpioLine &) = delete;
+
+    // chip: "gpiochip0" or "/dev/gpiochip0", offset: BCM number on the Pi
+    bool open(const char *chip, unsigned int offset, const char *consumer);
+    void close();
+
+    bool input(int edges);                  // input, edge detection on (NONE: off)
+    bool output(int value);                 // output, drive value
+    bool set(int value);                    // change level, line must be output
+    int  get();                             // level, -1 on error
+
+    int  fd() const;                        // readable when edges are pending, for epoll
+    int  read(GpioEdge *ev, int max);       // pending edges, never blocks; -1 on error
+    int  wait(int64_t timeout_ns);          // 1: edges pending, 0: timeout, -1 on error (< 0: forever)
+
+    unsigned int offset() const { return offset_; }
+
+private:
+    bool reconfigure(gpiod_line_settings *settings);
+
+    gpiod_chip              *chip_ = nullptr;
+    gpiod_line_request      *req_  = nullptr;
+    gpiod_edge_event_buffer *buf_  = nullptr;
+    unsigned int             offset_ = 0;
+};
+
+#endif  // ifndef _GPIOLINE_H
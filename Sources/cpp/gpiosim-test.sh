@@ -0,0 +1,113 @@
+#!/bin/sh
+#--------------------------------------------------------------------------
+#   Test of iswitchpid without Raspberry Pi and without iSwitchPi
+#   A gpio-sim chip (kernel module gpio-sim, Linux 5.19 or later) stands in
+#   for the Pi's gpiochip. The ISWITCHPI side is played by this script:
+#   its pulses are made by switching the pull of the simulated line.
+#
+#   usage: sudo ./gpiosim-test.sh [path to iswitchpid]
+#
+#   Checks: heartbeat is sent, 1 pulse -> halt, 2 pulses -> reboot, the
+#   command pulses of the old protocol (nobody answers the heartbeat
+#   frames here), the stop hooks: parallel, in order, killed at their
+#   timeout. iswitchpid runs with -d 2, so nothing is really halted.
+#   The framed protocol is covered by the host simulation in Sources/tiny44
+#--------------------------------------------------------------------------
+
+DAEMON=${1:-./iswitchpid}
+PIN=20
+CFG=/sys/kernel/config/gpio-sim/iswitchpi-test
+fail=0
+
+modprobe gpio-sim 2>/dev/null
+mountpoint -q /sys/kernel/config || mount -t configfs none /sys/kernel/config
+mkdir $CFG $CFG/bank0 || exit 1
+echo 32 > $CFG/bank0/num_lines
+echo 1 > $CFG/live
+CHIP=$(cat $CFG/bank0/chip_name)
+LINE=/sys/devices/platform/$(cat $CFG/dev_name)/$CHIP/sim_gpio$PIN
+
+cleanup() {
+    echo 0 > $CFG/live
+    rmdir $CFG/bank0 $CFG
+}
+trap cleanup EXIT
+
+# pulse of the ISWITCHPI: 80 ms high (PULSELENGTH1 in iswitchpi.c)
+pulse() {
+    echo pull-up > $LINE/pull
+    sleep 0.08
+    echo pull-down > $LINE/pull
+}
+
+# run one case, $1: pulses to send, $2: expected text in the output,
+# $3: more options
+run() {
+    echo pull-down > $LINE/pull
+    out=$(mktemp)
+    $DAEMON -d 2 -p $PIN -c $CHIP $3 > $out &
+    pid=$!
+    sleep 0.3                               # inside the first listen interval
+    n=0
+    while [ $n -lt $1 ]; do
+        pulse
+        sleep 0.5                           # PULSELENGTH2
+        n=$((n+1))
+    done
+    if [ $1 -eq 0 ]; then                   # no pulses: look for the heartbeat
+        seen=0
+        for i in $(seq 150); do
+            [ "$(cat $LINE/value)" = 1 ] && seen=1 && break
+            sleep 0.01
+        done
+        kill $pid
+        [ $seen = 1 ] && echo "heartbeat: ok" || { echo "heartbeat: FAILED"; fail=1; }
+    fi
+    wait $pid
+    if grep -q "$2" $out; then
+        echo "$2: ok"
+    else
+        echo "$2: FAILED"; cat $out; fail=1
+    fi
+    [ -z "$3" ] && rm -f $out
+}
+
+# stop hooks: a and c 1 s at the same time, b after a, d ignores SIGTERM
+hook() {
+    { echo '#!/bin/sh'; echo "$2"; echo "$3"; } > $HOOKS/$1
+    chmod +x $HOOKS/$1
+}
+# $1: hook, $2: expected text in its report line
+hooked() {
+    if grep "stop hook $1 " $out | grep -q "$2"; then
+        echo "hook $1 $2: ok"
+    else
+        echo "hook $1 $2: FAILED"; grep "stop hook" $out; fail=1
+    fi
+}
+
+run 0 "End reached"
+run 1 "Halting"
+run 2 "Rebooting"
+
+HOOKS=$(mktemp -d)
+hook a "" "sleep 1"
+hook b "# after: a" '[ "$1" = reboot ]'
+hook c "" "sleep 1; exit 3"
+hook d "# timeout: 1" "trap '' TERM; sleep 10"
+run 2 "Rebooting" "-H $HOOKS"
+hooked a "ok"
+hooked b "ok"
+hooked c "exit 3"
+hooked d "killed"
+# start +ms and duration ms of a hook
+at() { sed -n "s/.*stop hook $1 *+ *\([0-9]*\) ms *\([0-9]*\) ms.*/\1 \2/p" $out; }
+set -- $(at a) $(at b) $(at c) $(at d)
+if [ $# -eq 8 ] && [ $3 -ge $(($1 + $2)) ] && [ $5 -lt $(($1 + 100)) ] &&
+   [ $8 -lt 2500 ] && [ $(($7 - $1)) -lt 100 ]; then
+    echo "hooks in parallel, b after a: ok"
+else
+    echo "hooks in parallel, b after a: FAILED"; grep "stop hook" $out; fail=1
+fi
+rm -rf $out $HOOKS
+exit $fail
@@ -0,0 +1,872 @@
+/* -----------------------------------------------------------------------
+ *   Pi  Shutdown Daemon
+ *   Works together with the Intelligent Power Switch ISWITCHPI
+ *   Native replacement of Sources/python/iswitchpi.py, same commandline.
+ *
+ *   Talks the framed protocol of ../tiny44/frame.h on the line:
+ *   - every ~1.1 s a HEARTBEAT frame with sequence number, ISWITCHPI
+ *     answers with ACK
+ *   - HALT/REBOOT frames from ISWITCHPI are answered with ACK and the
+ *     shutdown starts at once (decoded within ~50 ms)
+ *   - status and config requests from the command line (-q), passed in
+ *     over a unix datagram socket
+ *   Old firmware: after FR_RETRIES heartbeats without ACK the daemon sends
+ *   the 50 ms I-am-alive pulses of the script again, every FRAMED_PROBE-th
+ *   heartbeat is still a frame. 80 ms command pulses are always understood,
+ *   1 pulse means halt, 2 or more mean reboot.
+ *
+ *   Communication GPIO Pin selectable with commandline option -p
+ *   Default Pin is GPIO 20
+ *   Valid Pin Number 13,19,20 and 26  (as defined on the iSwitchPI PCB)
+ *   GPIO chip selectable with -c (default gpiochip0), e.g. a gpio-sim chip
+ *
+ *   Testing: run with commandline option -d 0 , -d 1 or -d 2
+ *            -d 2 prints the decoded command but does not halt/reboot
+ *            see gpiosim-test.sh for a test without hardware
+ *   Query:   iswitchpid -q status | -q get KEY | -q set KEY SECONDS
+ *            KEY: poweron, halt or reboot, SECONDS 0: back to DIP switch
+ *            iswitchpid -q set recover N: a hung Pi is power cycled up
+ *            to N times (backoff 5 s doubling), 0: off. Kept in EEPROM
+ *            iswitchpid -q set vcc N: halt and power off when the supply
+ *            of ISWITCHPI drops below N/10 V, 0: off. Kept in EEPROM
+ *            iswitchpid -q set missed K: the Pi is lost after K missed
+ *            heartbeats (default 2, 0: default). Kept in EEPROM
+ *            iswitchpid -q set click|long|hold N: key timing in 0.1 s, the
+ *            gap of a double click (3), long press (10) and hold
+ *            (50), 0: default. Kept in EEPROM
+ *            iswitchpid -q square [HZ DUTY | dip]
+ *            square wave on PA5, HZ 0.1 to 5000, DUTY % (0: off)
+ *            iswitchpid -q log
+ *            event log and lifetime counters from the EEPROM of ISWITCHPI,
+ *            read 3 bytes per frame, heartbeats go on in between
+ *            iswitchpid -q update FILE.hex
+ *            new firmware for ISWITCHPI over the line: UPDATE, then the
+ *            image to its bootloader in ~9 s, no heartbeats meanwhile.
+ *            The Pi keeps its power, ISWITCHPI starts warm. See fwupdate.h
+ *   Stop hooks: before halt/reboot the hooks in /etc/iswitchpi/stop.d
+ *            (-H DIR) run, at the same time unless ordered by "# after:",
+ *            each with a deadline, see stophooks.h. killjobs.sh of the
+ *            script is one of them. All of them end HALT_RESERVE_S
+ *            before the halt delay ISWITCHPI uses runs out, asked for
+ *            at the start and every HALT_POLL_S (CONFIG_GET, without
+ *            make CONFIG=1 the DIP switch in STATUS, 15 s until then).
+ *            How long each took goes to stdout (-d 1) and to
+ *            SHUTDOWN_REPORT. With -d 2 hooks only run if -H is given.
+ *   Metrics: -m PORT or -m /PATH: Prometheus text over HTTP on 127.0.0.1
+ *            or a unix socket, -T FILE: the same for the textfile
+ *            collector, also with the stop hook times before halt/reboot.
+ *            Heartbeats, commands, time since the last signal of
+ *            ISWITCHPI, its state (STATUS every 30 s), with -S GPIO the
+ *            square wave (17, 22, 23 or 27) measured. See metrics.h
+ *   Down:    iswitchpid -D [-p pin], run by the systemd shutdown hook
+ *            iswitchpi-poweroff: the Pi is down, ISWITCHPI cuts the power
+ *            now instead of after its power off delay
+ *   WARNING: Do not change time values, they correspond to what iswitchpi does
+ *
+ *   Event driven: one epoll loop over the line's edge events (libgpiod),
+ *   the control socket, a timerfd for the next deadline and a signalfd
+ *   for SIGINT/SIGTERM. Between two heartbeats the process sleeps in
+ *   epoll_wait(). A frame is sent synchronously (< 70 ms), see framelink.h
+ * -----------------------------------------------------------------------*/
+
+#include <framelink.h>
+#include <stophooks.h>
+#include <fwupdate.h>
+#include <metrics.h>
+#include <squareclock.h>
+#include <fsm.h>                            // event names of the log
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+#define PULSE_MS        50                  // Pulse length for I am alive pulses to ISWITCHPI
+#define INTERVAL_MS     1100                // INTERVALLMAX plus one sleeptime of the script
+#define DECIDE_MS       700                 // old protocol: command pulses come 580 ms apart
+#define FRAMED_PROBE    8                   // old protocol: every 8th heartbeat is a frame
+#define KILL_SHELLSCRIPT "/home/pi/myservices/killjobs.sh"
+#define HALT_SHORT_S    15                  // power off delay after HALT, DIP switch short
+#define HALT_LONG_S     30                  // and long, see POWEROFF_Delay_HALT of iswitchpi.c
+#define HALT_RESERVE_S  5                   // of it left to the OS halt after the stop hooks
+#define HALT_POLL_S     300                 // the halt delay asked for this often
+#define SHUTDOWN_DIR    "/var/lib/iswitchpid"
+#define SHUTDOWN_REPORT SHUTDOWN_DIR "/last-shutdown"
+#define CONSUMER        "iswitchpid"
+#define SOCKET_PATH     "/run/iswitchpid.sock"
+#define QUERY_MS        2000                // -q: wait this long for the answer
+#define QUERY_LOG_MS    20000               // -q log: ~60 frames
+#define QUERY_UPDATE_MS 120000              // -q update: ~9 s, FB_TRIES per boot frame
+#define PATH_LEN        256                 // -q update: file name
+#define ANSWER_MAX      4096                // answer text, -q log: one line per record
+
+#define MS              1000000ull          // ns
+#define NEVER           UINT64_MAX
+
+static int debug = 1;                       // set this to 0, 1 or 2 with -d
+static Metrics metrics;
+static const char *textfile;                // -T
+static int halt_s = HALT_SHORT_S;           // halt delay ISWITCHPI uses, the shorter one until it says
+static bool halt_cfg = true;                // it answers CONFIG_GET, else the DIP switch of STATUS
+
+static const char *const cfg_keys[FR_CFG_KEYS] = { "poweron", "halt", "reboot", "recover", "vcc", "missed",
+                                                     "click", "long", "hold" };
+static const char *const ev_names[EVENTS] = {
+    "pi alive", "pi lost", "key test", "key short", "key long",
+    "pi down", "timeout", "auto power", "recover", "vcc low", "vcc ok",
+    "key double", "key triple", "key hold", "none"
+};
+
+struct Request {                            // from the control socket, one at a time
+    bool        active;
+    uint8_t     op, len, data[3];
+    int         tries;
+    uint64_t    at;                         // next attempt
+    sockaddr_un from;
+    socklen_t   fromlen;
+    uint8_t     raw[FR_LOG_LIFE_LEN + 2];   // -q log: the record read so far
+    uint32_t    clock;                      // -q log: clock of ISWITCHPI at the start
+    time_t      wall;                       //          and the time here
+    size_t      used;                       // -q log: text so far
+    char        path[PATH_LEN];             // -q update: the image
+    char        text[ANSWER_MAX];
+};
+
+//---------------------------------------------------------------
+// arm the one shot timer for the next deadline (CLOCK_MONOTONIC, ns)
+static void timer_at(int tfd, uint64_t ns) {
+    struct itimerspec its = {};
+    its.it_value.tv_sec  = ns / 1000000000ull;
+    its.it_value.tv_nsec = ns % 1000000000ull;
+    timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+// run a program and wait for it, like subprocess.call()
+static int call(const char *prog) {
+    char *argv[] = { const_cast<char *>(prog), nullptr };
+    pid_t pid;
+    int status;
+
+    if (posix_spawnp(&pid, prog, nullptr, nullptr, argv, environ) != 0)
+        return -1;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    return status;
+}
+
+//---------------------------------------------------------------
+// check selected GPIO Pin
+static bool gpio_pincheck(int pin) {
+    if (pin == 13 || pin == 19 || pin == 20 || pin == 26) {
+        if (debug == 1) printf("iSwitchPi: Selected ComPin: %d\n\n", pin);
+        return true;
+    }
+    printf("iSwitchPi: Selected GPIO %d not valid (use 13,19,20 or 26)\n", pin);
+    printf("iSwitchPi: Terminating\n");
+    return false;
+}
+
+//---------------------------------------------------------------
+// what do we need to do: halt or reboot the Pi
+//  t0: when the command came (ns), hooks: -H, 0: HOOK_DIR
+static void shutdown(GpioLine &line, int what, uint64_t t0, const char *hooks) {
+    const char *cmd = what == 1 ? "halt" : "reboot";
+    static StopHooks stop;
+
+    if (debug == 1) printf("\niSwitchPi: detected %s\n", what == 1 ? "HALT" : "REBOOT");
+    if (debug != 2 || hooks) {              // -d 2 runs test hooks only
+        if (stop.load(hooks ? hooks : HOOK_DIR) < 0 && hooks)
+            fprintf(stderr, "iSwitchPi: no hook directory %s\n", hooks);
+        if (!hooks)
+            stop.add(KILL_SHELLSCRIPT);
+        int s = halt_s > HALT_RESERVE_S ? halt_s - HALT_RESERVE_S : 0;
+        if (debug == 1) printf("iSwitchPi: stop hooks for %d s of the %d s halt delay\n", s, halt_s);
+        stop.run(cmd, t0 + s * 1000 * MS);  // reboot: its delay is longer still
+    }
+    if (textfile)                           // with the hook times, for after the boot
+        metrics_file(textfile, metrics, mono_ns(), &stop);
+    line.output(0);
+    if (debug == 2) {                       // debug mode do nothing exept print
+        stop.report(stdout, t0);
+        printf("iSwitchPi: Shutdown reached... %s\n", what == 1 ? "Halting" : "Rebooting");
+        return;
+    }
+    line.close();
+
+    mkdir(SHUTDOWN_DIR, 0755);              // how long it took, kept for after the boot
+    FILE *f = fopen(SHUTDOWN_REPORT, "w");
+    if (f) {
+        stop.report(f, t0);
+        fprintf(f, "iSwitchPi: %s %llu ms after the command\n", cmd,
+                (unsigned long long)((mono_ns() - t0) / MS));
+        fflush(f);
+        fsync(fileno(f));
+        fclose(f);
+    }
+    if (debug == 1) {
+        stop.report(stdout, t0);
+        printf("iSwitchPi: %s %llu ms after the command\n", cmd, (unsigned long long)((mono_ns() - t0) / MS));
+    }
+    call(cmd);                              // halt or reboot the Linux System
+}
+
+//---------------------------------------------------------------
+// control socket: requests are text, "status", "get KEY", "set KEY VALUE",
+// "square", "square HZ DUTY", "square dip", "log", "update PATH"
+static int ctl_open() {
+    sockaddr_un a = {};
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+
+    a.sun_family = AF_UNIX;
+    strcpy(a.sun_path, SOCKET_PATH);
+    unlink(SOCKET_PATH);
+    if (fd >= 0 && bind(fd, (sockaddr *)&a, sizeof(a)) == 0)
+        return fd;
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+static void ctl_close(int cfd) {
+    if (cfd >= 0) {
+        close(cfd);
+        unlink(SOCKET_PATH);
+    }
+}
+
+static bool parse_request(char *text, Request &r) {
+    char *save;
+    char *cmd = strtok_r(text, " \n", &save);
+    char *key = strtok_r(nullptr, " \n", &save);
+    char *val = strtok_r(nullptr, " \n", &save);
+    int k = -1;
+
+    for (int i = 0; key && i < FR_CFG_KEYS; i++)
+        if (strcmp(key, cfg_keys[i]) == 0)
+            k = i;
+    r.data[0] = k;
+    if (cmd && strcmp(cmd, "status") == 0 && !key) {
+        r.op = FR_STATUS_GET;
+        r.len = 0;
+    } else if (cmd && strcmp(cmd, "get") == 0 && k >= 0 && !val) {
+        r.op = FR_CONFIG_GET;
+        r.len = 1;
+    } else if (cmd && strcmp(cmd, "log") == 0 && !key) {
+        r.op = FR_LOG_GET;                  // counters first, then record 0, 1, ..
+        r.data[0] = FR_LOG_LIFE;
+        r.data[1] = 0;
+        r.len = 2;
+        r.used = 0;
+    } else if (cmd && strcmp(cmd, "update") == 0 && key && !val && strlen(key) < sizeof(r.path)) {
+        strcpy(r.path, key);                // absolute, see query()
+        r.op = FR_UPDATE;
+        r.data[0] = FR_UPDATE_KEY >> 8;
+        r.data[1] = FR_UPDATE_KEY & 0xff;
+        r.len = 2;
+    } else if (cmd && strcmp(cmd, "square") == 0 && !key) {
+        r.op = FR_SQUARE_GET;
+        r.len = 0;
+    } else if (cmd && strcmp(cmd, "square") == 0 && (strcmp(key, "dip") == 0) == !val) {
+        double hz = val ? atof(key) : 0;
+        int duty = val ? atoi(val) : 0;
+        if (val && (hz < 0.1 || hz > 6553.5 || duty < 0 || duty > 255))
+            return false;                   // 16 bit; the range check is iSwitchPi's
+        unsigned int dhz = hz * 10 + 0.5;
+        r.op = FR_SQUARE_SET;
+        r.data[0] = dhz >> 8;
+        r.data[1] = dhz & 0xff;
+        r.data[2] = duty;
+        r.len = 3;
+    } else if (cmd && strcmp(cmd, "set") == 0 && k >= 0 && val) {
+        int v = atoi(val);
+        if (v < 0 || v > 255)
+            return false;
+        r.op = FR_CONFIG_SET;
+        r.data[1] = v;
+        r.len = 2;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// does frame f answer the request
+static bool is_answer(const Request &r, const uint8_t *f) {
+    uint8_t op = FR_OP(f[0]);
+    if (r.op == FR_STATUS_GET)
+        return op == FR_STATUS;
+    if (r.op == FR_SQUARE_GET || r.op == FR_SQUARE_SET)
+        return op == FR_SQUARE || (op == FR_NAK && f[1] == r.op);
+    if (r.op == FR_LOG_GET)
+        return op == FR_LOG || (op == FR_NAK && f[1] == r.op);
+    if (r.op == FR_UPDATE)
+        return (op == FR_ACK || op == FR_NAK) && f[1] == r.op;
+    return op == FR_CONFIG || (op == FR_NAK && f[1] == r.op);
+}
+
+static uint32_t le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// one LOG frame of -q log into r.raw, a whole record into r.text.
+// true: the next frame is due, false: the text is full
+static bool log_part(Request &r, const uint8_t *f) {
+    bool life = r.data[0] == FR_LOG_LIFE;
+    unsigned int size = life ? FR_LOG_LIFE_LEN : FR_LOG_REC;
+    char *t = r.text + r.used;
+    size_t room = sizeof(r.text) - r.used;
+    int k;
+
+    memcpy(r.raw + r.data[1] * 3, f + 1, 3);
+    if (++r.data[1] * 3u < size)
+        return true;
+    r.data[1] = 0;
+    if (life) {
+        r.clock = le32(r.raw);
+        r.wall = time(nullptr);
+        k = snprintf(t, room, "clock %u s, Pi on %u s, boots %u, power cycles %u, heartbeat lost %u, "
+                     "watchdog/brown-out resets %u\n",
+                     r.clock, le32(r.raw + 4), r.raw[8] | r.raw[9] << 8,
+                     r.raw[10] | r.raw[11] << 8, r.raw[12] | r.raw[13] << 8, r.raw[14] | r.raw[15] << 8);
+        r.data[0] = 0;
+    } else {
+        char when[32];
+        time_t at = r.wall - (time_t)(r.clock - le32(r.raw));
+        uint8_t cause = r.raw[4], st = r.raw[5];
+        strftime(when, sizeof(when), "%F %T", localtime(&at));
+        if (cause == FR_LOG_BOOT)           // MCUSR: PORF, EXTRF, BORF, WDRF
+            k = snprintf(t, room, "%s  boot%s%s%s%s\n", when,
+                         st & 0x01 ? " power on" : "", st & 0x02 ? " reset pin" : "",
+                         st & 0x04 ? " brown out" : "", st & 0x08 ? " watchdog" : "");
+        else
+            k = snprintf(t, room, "%s  state%u -> state%u  %s\n", when, st >> 4, st & 0x0f,
+                         cause < EVENTS ? ev_names[cause] : "?");
+        r.data[0]++;
+    }
+    if (k < 0 || (size_t)k >= room)
+        return false;                       // the older records are left out
+    r.used += k;
+    return true;
+}
+
+// answer to the client, f == nullptr: none from ISWITCHPI. No client
+// (fromlen 0): the STATUS poll for the metrics or the halt delay poll.
+// Every answer with the halt delay in it updates halt_s
+static void answer(int cfd, Request &r, const uint8_t *f) {
+    char *text = r.text;
+    size_t size = sizeof(r.text);
+
+    if (f && FR_OP(f[0]) == FR_LOG && log_part(r, f)) {
+        r.tries = 0;                        // next part at once
+        r.at = mono_ns();
+        return;
+    }
+    if (f && FR_OP(f[0]) == FR_NAK && r.op == FR_CONFIG_GET && r.fromlen == 0) {
+        halt_cfg = false;                   // no make CONFIG=1: the DIP switch counts
+        r.op = FR_STATUS_GET;               // at once
+        r.len = 0;
+        r.tries = 0;
+        r.at = mono_ns();
+        return;
+    }
+    Metrics::add(metrics.requests);
+    if (f == nullptr)
+        Metrics::add(metrics.requests_failed);
+    else if (FR_OP(f[0]) == FR_STATUS) {
+        Metrics::set(metrics.fw_state, f[1]);
+        Metrics::set(metrics.fw_flags, f[2]);
+        Metrics::set(metrics.fw_heartbeats, f[3]);
+        Metrics::set(metrics.fw_ms, Metrics::ms(mono_ns()));
+        Metrics::add(metrics.fw_status);
+        if (!halt_cfg)
+            halt_s = f[2] & FR_ST_SHORT ? HALT_SHORT_S : HALT_LONG_S;
+    } else if (FR_OP(f[0]) == FR_CONFIG && f[1] == FR_CFG_HALT)
+        halt_s = f[2];                      // in use: DIP, Pi or calibration
+    r.active = false;
+    if (r.fromlen == 0)
+        return;
+    if (r.op == FR_LOG_GET && r.used) {     // NAK: end of the log
+        text[--r.used] = 0;                 // without the last newline
+        if (f == nullptr)
+            snprintf(text + r.used, size - r.used, "\nerror: no answer from iSwitchPi");
+    }
+    else if (f == nullptr)
+        snprintf(text, size, "error: no answer from iSwitchPi");
+    else if (FR_OP(f[0]) == FR_STATUS)
+        snprintf(text, size,
+                 "state %u power %u short %u square %u auto %u freq %u heartbeats %u",
+                 f[1], !!(f[2] & FR_ST_VPOWER), !!(f[2] & FR_ST_SHORT),
+                 !!(f[2] & FR_ST_SQUARE), !!(f[2] & FR_ST_AUTO),
+                 (f[2] & FR_ST_FREQ) >> 4, f[3]);
+    else if (FR_OP(f[0]) == FR_CONFIG && f[1] < FR_CFG_KEYS)
+        snprintf(text, size, "%s %u", cfg_keys[f[1]], f[2]);
+    else if (FR_OP(f[0]) == FR_SQUARE)
+        snprintf(text, size, "square %.1f Hz duty %u %s",
+                 (f[1] << 8 | f[2]) / 10.0, f[3] & ~FR_SQ_PI, f[3] & FR_SQ_PI ? "pi" : "dip");
+    else
+        snprintf(text, size, "error: refused by iSwitchPi");
+    sendto(cfd, text, strlen(text), 0, (sockaddr *)&r.from, r.fromlen);
+}
+
+// -q update: the image goes to the bootloader, FR_UPDATE was ACKed (or
+// not answered: the bootloader may be waiting already). Synchronous,
+// the new firmware starts warm and gets the next heartbeat
+static void update(int cfd, GpioLine &line, Request &r, const FwImage &fw) {
+    FwStats st;
+
+    Metrics::add(metrics.requests);
+    if (fw_upload(line, fw, st))
+        snprintf(r.text, sizeof(r.text), "update: %d pages in %.1f s, %d retries",
+                 st.pages, st.ns / 1e9, st.retries);
+    else {
+        snprintf(r.text, sizeof(r.text), "error: update: %s, %d of %d pages written",
+                 st.err, st.pages, fw.pages);
+        Metrics::add(metrics.requests_failed);
+    }
+    if (debug == 1) printf("iSwitchPi: %s\n", r.text);
+    sendto(cfd, r.text, strlen(r.text), 0, (sockaddr *)&r.from, r.fromlen);
+    r.active = false;
+}
+
+// -q: send the request to the running daemon, print its answer
+static int query(int argc, char **argv) {
+    char text[PATH_LEN + 64] = "", reply[ANSWER_MAX], path[PATH_MAX];
+    sockaddr_un me = {}, to = {};
+    struct timeval tv = { QUERY_MS / 1000, 0 };
+
+    if (argc == 2 && strcmp(argv[0], "update") == 0) {
+        if (!realpath(argv[1], path)) {     // the daemon runs in /
+            fprintf(stderr, "iSwitchPi: %s: %s\n", argv[1], strerror(errno));
+            return 1;
+        }
+        argv[1] = path;
+        tv.tv_sec = QUERY_UPDATE_MS / 1000;
+    }
+    for (int i = 0; i < argc; i++) {
+        if (i) strncat(text, " ", sizeof(text) - strlen(text) - 1);
+        strncat(text, argv[i], sizeof(text) - strlen(text) - 1);
+    }
+    if (strcmp(text, "log") == 0)
+        tv.tv_sec = QUERY_LOG_MS / 1000;
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    me.sun_family = to.sun_family = AF_UNIX;
+    strcpy(to.sun_path, SOCKET_PATH);
+    if (fd < 0 || bind(fd, (sockaddr *)&me, sizeof(sa_family_t)) < 0   // autobind, for the answer
+        || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0
+        || sendto(fd, text, strlen(text), 0, (sockaddr *)&to, sizeof(to)) < 0) {
+        fprintf(stderr, "iSwitchPi: %s: %s\n", SOCKET_PATH, strerror(errno));
+        return 1;
+    }
+    ssize_t n = recv(fd, reply, sizeof(reply) - 1, 0);
+    if (n < 0) {
+        fprintf(stderr, "iSwitchPi: no answer from iswitchpid\n");
+        return 1;
+    }
+    reply[n] = 0;
+    printf("%s\n", reply);
+    return strncmp(reply, "error", 5) == 0;
+}
+
+// -S: edges of the square wave, its estimate and statistics into the metrics
+static void square(SquareClock &sq) {
+    Tick t[16];
+    int k;
+
+    while ((k = sq.read(t, 16)) > 0)
+        Metrics::set(metrics.sq_ms, Metrics::ms(t[k - 1].ns));
+    TickStats st = sq.stats();
+    Metrics::set(metrics.sq_mhz, sq.hz() * 1000 + 0.5);
+    Metrics::set(metrics.sq_edges, st.edges);
+    Metrics::set(metrics.sq_missed, st.missed);
+    Metrics::set(metrics.sq_relocks, st.relocks);
+    Metrics::set(metrics.sq_jitter_ns, st.jitter_ns + 0.5);
+    Metrics::set(metrics.sq_jitter_max_ns, st.jitter_max_ns + 0.5);
+}
+
+//---------------------------------------------------------------
+// -D: poweroff-ready, the daemon is gone by now. DOWN frame, wait for
+// the ACK, again up to FR_RETRIES times
+static int poweroff_ready(GpioLine &line) {
+    FrameRx rx;
+    GpioEdge edges[16];
+
+    for (int tries = 0; tries < FR_RETRIES; tries++) {
+        frame_send(line, FR_DOWN, nullptr, 0, FR_IDLE * FR_UNIT_US);
+        uint64_t end = mono_ns() + FR_REPLY_MS * MS;
+        for (uint64_t now = mono_ns(); now < end; now = mono_ns()) {
+            struct pollfd p = { line.fd(), POLLIN, 0 };
+            if (poll(&p, 1, (end - now) / MS + 1) <= 0)
+                continue;
+            int k = line.read(edges, 16);
+            for (int i = 0; i < k; i++)
+                if (rx.feed(edges[i]) == FrameRx::FRAME
+                    && FR_OP(rx.frame()[0]) == FR_ACK && rx.frame()[1] == FR_DOWN) {
+                    if (debug == 1) printf("iSwitchPi: poweroff-ready acknowledged\n");
+                    return 0;
+                }
+        }
+    }
+    if (debug == 1) printf("iSwitchPi: poweroff-ready not acknowledged\n");
+    return 1;
+}
+
+//---------------------------------------------------------------
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-d 0|1|2] [-p 13|19|20|26] [-c gpiochip] [-H hookdir]\n", name);
+    fprintf(stderr, "       %*s [-m PORT|/PATH] [-T FILE] [-S 17|22|23|27]   (metrics, square wave GPIO)\n",
+            (int)strlen(name), "");
+    fprintf(stderr, "       %s -q status | get KEY | set KEY SECONDS   (KEY: poweron, halt, reboot, recover, vcc, missed,\n"
+            "       %*s click, long, hold)\n", name, (int)strlen(name), "");
+    fprintf(stderr, "       %s -q square [HZ DUTY | dip]   (HZ: 0.1 .. 5000, DUTY: %%, 0 off)\n", name);
+    fprintf(stderr, "       %s -q log   (event log and counters of iSwitchPi)\n", name);
+    fprintf(stderr, "       %s -q update FILE.hex   (new firmware for iSwitchPi)\n", name);
+    fprintf(stderr, "       %s -D [-p pin] [-c gpiochip]   (shutdown hook: Pi is down)\n", name);
+}
+
+// Main starts here ---------------------------------------------
+//---------------------------------------------------------------
+int main(int argc, char **argv) {
+    const char *chip = "gpiochip0";
+    int pin = 20;
+    const char *hooks = nullptr;            // stop hooks, 0: HOOK_DIR
+    int opt;
+    bool client = false, down = false;
+    const char *serve = nullptr;            // -m
+    int sqpin = 0;                          // -S, 0: square wave not watched
+
+    while ((opt = getopt(argc, argv, "d:p:c:H:m:T:S:qDh")) != -1) {
+        switch (opt) {
+        case 'd': debug = atoi(optarg); break;
+        case 'H': hooks = optarg; break;
+        case 'p': pin = atoi(optarg); break;
+        case 'c': chip = optarg; break;
+        case 'q': client = true; break;
+        case 'D': down = true; break;
+        case 'm': serve = optarg; break;
+        case 'T': textfile = optarg; break;
+        case 'S': sqpin = atoi(optarg); break;
+        default:  usage(argv[0]); return 2;
+        }
+    }
+    if (client)
+        return query(argc - optind, argv + optind);
+    if (debug > 2) debug = 1;               // accept only 0,1 or 2
+    setvbuf(stdout, nullptr, _IOLBF, 0);    // journal sees every line at once
+
+    if (debug == 1) printf("\niSwitchPi: Started: %s  Chip: %s\n", argv[0], chip);
+    if (!gpio_pincheck(pin))
+        return 1;
+
+    GpioLine line;
+    if (!line.open(chip, pin, CONSUMER) || !line.input(GpioLine::BOTH)) {
+        fprintf(stderr, "iSwitchPi: cannot request GPIO %d on %s: %s\n", pin, chip, strerror(errno));
+        return 1;
+    }
+    if (down)
+        return poweroff_ready(line);
+
+    // SIGINT/SIGTERM are read from a signalfd, we need this to catch a
+    // Pi reboot or Pi halt that was executed from the commandline
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &mask, nullptr);
+    int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    if (sfd < 0 || tfd < 0 || efd < 0) {
+        perror("iSwitchPi");
+        return 1;
+    }
+    int cfd = ctl_open();                   // without it only -q does not work
+    if (cfd < 0)
+        fprintf(stderr, "iSwitchPi: no control socket %s: %s\n", SOCKET_PATH, strerror(errno));
+    MetricsServer ms;
+    if (serve && !ms.open(serve))
+        fprintf(stderr, "iSwitchPi: no metrics on %s: %s\n", serve, strerror(errno));
+    SquareClock sq;
+    if (sqpin && ((sqpin != 17 && sqpin != 22 && sqpin != 23 && sqpin != 27) || !sq.open(chip, sqpin, CONSUMER))) {
+        fprintf(stderr, "iSwitchPi: cannot watch the square wave on GPIO %d (17,22,23 or 27)\n", sqpin);
+        sqpin = 0;
+    }
+    Metrics::set(metrics.sq_on, sqpin != 0);
+    Metrics::set(metrics.framed, 1);
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.fd = line.fd();
+    epoll_ctl(efd, EPOLL_CTL_ADD, ev.data.fd, &ev);
+    ev.data.fd = tfd;
+    epoll_ctl(efd, EPOLL_CTL_ADD, tfd, &ev);
+    ev.data.fd = sfd;
+    epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev);
+    if (cfd >= 0) {
+        ev.data.fd = cfd;
+        epoll_ctl(efd, EPOLL_CTL_ADD, cfd, &ev);
+    }
+    if (ms.fd() >= 0) {
+        ev.data.fd = ms.fd();
+        epoll_ctl(efd, EPOLL_CTL_ADD, ms.fd(), &ev);
+    }
+    if (sqpin) {
+        ev.data.fd = sq.fd();
+        epoll_ctl(efd, EPOLL_CTL_ADD, sq.fd(), &ev);
+    }
+
+    if (debug == 2) printf("iSwitchPi: initialize done\n");
+
+    FrameRx rx;
+    static Request req, r;                  // answer text, not on the stack
+    static Request queued;                  // client behind a poll of our own
+    static FwImage fw;                      // -q update
+    GpioEdge edges[16];
+    bool framed = true;                     // ISWITCHPI answers frames
+    bool hb_open = false;                   // heartbeat frame without ACK so far
+    int unacked = 0, probe = 0;
+    uint8_t seq = 0;
+    int anzir = 0;                          // command pulses of the old protocol
+    uint64_t long_ns = 0;                   // end of the last one
+    uint64_t pulse_end = NEVER;             // old protocol heartbeat pulse is on
+    uint64_t hb_at = mono_ns() + INTERVAL_MS * MS;
+    int cmd = 0;                            // HALT/REBOOT frame: 1 halt, 2 reboot
+    uint64_t cmd_ns = 0;                    // the command came, first pulse or the frame
+    bool poll_status = ms.fd() >= 0 || textfile;    // firmware state for the metrics
+    uint64_t status_at = mono_ns();
+    uint64_t halt_at = mono_ns();           // ask for the halt delay, stop hooks
+    uint64_t file_at = mono_ns() + METRICS_FILE_S * 1000 * MS;
+
+    timer_at(tfd, hb_at);
+
+//   Loop forever - until iSwitchPi tells us to go down
+    for (;;) {
+        struct epoll_event ready[8];
+        int n = epoll_wait(efd, ready, 8, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("iSwitchPi");
+            break;
+        }
+
+        bool killed = false;
+        for (int i = 0; i < n; i++) {
+            if (ready[i].data.fd == tfd) {
+                uint64_t count;
+                if (::read(tfd, &count, sizeof(count)) < 0)
+                    continue;
+            } else if (ready[i].data.fd == sfd) {
+                struct signalfd_siginfo si;
+                if (::read(sfd, &si, sizeof(si)) == sizeof(si) && debug == 2)
+                    printf("iSwitchPi: Signal received:%u\n", si.ssi_signo);
+                killed = true;
+            } else if (ready[i].data.fd == ms.fd()) {
+                ms.accept(efd, mono_ns());
+            } else if (ms.owns(ready[i].data.fd)) {
+                ms.serve(efd, ready[i].data.fd, metrics, mono_ns());
+            } else if (sqpin && ready[i].data.fd == sq.fd()) {
+                square(sq);
+            } else if (ready[i].data.fd == cfd) {
+                char text[PATH_LEN + 64], why[ANSWER_MAX];
+                r.tries = 0;
+                r.fromlen = sizeof(r.from);
+                ssize_t k = recvfrom(cfd, text, sizeof(text) - 1, 0, (sockaddr *)&r.from, &r.fromlen);
+                if (k < 0)
+                    continue;
+                text[k] = 0;
+                const char *err = req.active && (req.fromlen || queued.active) ? "error: busy"
+                                : !parse_request(text, r) ? "error: usage: status | get KEY | set KEY SECONDS | square [HZ DUTY | dip] | log | update FILE"
+                                : nullptr;
+                if (!err && r.op == FR_UPDATE && !fw.load(r.path, why + 7, sizeof(why) - 7)) {
+                    memcpy(why, "error: ", 7);
+                    err = why;
+                }
+                if (err) {
+                    sendto(cfd, err, strlen(err), 0, (sockaddr *)&r.from, r.fromlen);
+                    continue;
+                }
+                Request &to = req.active ? queued : req;    // a poll: the client next
+                to = r;
+                to.active = true;
+                to.at = mono_ns();
+            }
+        }
+        if (killed) {
+            if (debug == 2) printf("iSwitchPi: OK, Kill myself\n");
+            break;
+        }
+
+        // edges in the order of their kernel timestamps
+        int k;
+        while (cmd == 0 && (k = line.read(edges, 16)) > 0)
+            for (int i = 0; i < k && cmd == 0; i++) {
+                switch (rx.feed(edges[i])) {
+                case FrameRx::LONG:
+                    Metrics::set(metrics.signal_ms, Metrics::ms(edges[i].ns));
+                    Metrics::set(metrics.signals, 1);
+                    if (anzir++ == 0)
+                        cmd_ns = edges[i].ns;
+                    long_ns = edges[i].ns;
+                    if (debug == 2) printf("iSwitchPi: Shutdown GPIO-Pin pulse: %d\n", pin);
+                    break;
+                case FrameRx::FRAME: {
+                    const uint8_t *f = rx.frame();
+                    uint8_t op = FR_OP(f[0]);
+                    Metrics::set(metrics.signal_ms, Metrics::ms(edges[i].ns));
+                    Metrics::set(metrics.signals, 1);
+                    if (op == FR_HALT || op == FR_REBOOT) {
+                        uint8_t ack[2] = { op, 0 };
+                        frame_send(line, FR_ACK, ack, 2, FR_RESP * FR_UNIT_US);
+                        Metrics::add(op == FR_HALT ? metrics.halts : metrics.reboots);
+                        cmd = op == FR_HALT ? 1 : 2;
+                        cmd_ns = edges[i].ns;
+                    } else if (op == FR_ACK && f[1] == FR_HEARTBEAT) {
+                        if (f[2] == seq) {
+                            if (!framed && debug == 1) printf("iSwitchPi: frames answered\n");
+                            Metrics::add(metrics.hb_acked);
+                            Metrics::set(metrics.framed, 1);
+                            framed = true;
+                            hb_open = false;
+                            unacked = 0;
+                        }
+                    } else if (req.active && is_answer(req, f)) {
+                        if (req.op == FR_UPDATE && op == FR_ACK) {
+                            update(cfd, line, req, fw);
+                            rx.reset();
+                            hb_at = mono_ns() + INTERVAL_MS * MS;
+                            k = 0;          // the edges before it are stale
+                        } else {
+                            answer(cfd, req, f);
+                        }
+                    }
+                    break;
+                }
+                default:
+                    break;
+                }
+            }
+        Metrics::set(metrics.frames_bad, rx.bad());
+        if (cmd) {
+            ctl_close(cfd);
+            shutdown(line, cmd, cmd_ns, hooks);
+            return 0;                       // terminate, OS will do the rest
+        }
+
+        uint64_t now = mono_ns();
+        if (queued.active && !req.active) { // before the polls
+            req = queued;
+            req.at = now;
+            queued.active = false;
+        }
+        if (framed && !req.active && now >= halt_at) {
+            req = Request();                // no client, as the STATUS poll
+            req.op = halt_cfg ? FR_CONFIG_GET : FR_STATUS_GET;
+            req.data[0] = FR_CFG_HALT;
+            req.len = halt_cfg;
+            req.active = true;
+            req.at = now;
+            halt_at = now + HALT_POLL_S * 1000 * MS;
+        }
+        if (poll_status && framed && !req.active && now >= status_at) {
+            req = Request();                // no client: answer() only takes it
+            req.op = FR_STATUS_GET;
+            req.active = true;
+            req.at = now;
+            status_at = now + METRICS_STATUS_S * 1000 * MS;
+        }
+        if (textfile && now >= file_at) {
+            if (!metrics_file(textfile, metrics, now, nullptr) && debug == 1)
+                printf("iSwitchPi: cannot write %s: %s\n", textfile, strerror(errno));
+            file_at = now + METRICS_FILE_S * 1000 * MS;
+        }
+        ms.expire(efd, now);
+        if (now >= pulse_end) {             // end of an old protocol heartbeat pulse
+            line.input(GpioLine::BOTH);     // release, same line request
+            rx.reset();
+            pulse_end = NEVER;
+            if (debug == 2) printf("iSwitchPi: pulses sent...\n");
+        }
+        if (pulse_end == NEVER && !rx.busy(now) && line.get() == 0) {
+            if (anzir > 0) {
+                if (now >= long_ns + DECIDE_MS * MS) {  // did we have pulses ?
+                    if (debug == 2) printf("iSwitchPi: Number of IR:%d\n", anzir);
+                    Metrics::add(anzir == 1 ? metrics.halts : metrics.reboots);
+                    ctl_close(cfd);
+                    shutdown(line, anzir, cmd_ns, hooks);
+                    return 0;
+                }
+            } else if (req.active && now >= req.at && now < hb_at) {
+                if (req.tries++ < FR_RETRIES) {
+                    frame_send(line, req.op, req.data, req.len, 0);
+                    req.at = mono_ns() + FR_REPLY_MS * MS;
+                } else if (req.op == FR_UPDATE) {
+                    update(cfd, line, req, fw);
+                    rx.reset();
+                    hb_at = mono_ns() + INTERVAL_MS * MS;
+                } else {
+                    answer(cfd, req, nullptr);
+                }
+            } else if (now >= hb_at) {      // first: -q log takes many frames
+                if (hb_open && framed && ++unacked >= FR_RETRIES) {
+                    framed = false;
+                    Metrics::set(metrics.framed, 0);
+                    if (debug == 1) printf("iSwitchPi: no answer to frames, sending pulses\n");
+                }
+                if (framed || ++probe % FRAMED_PROBE == 0) {
+                    seq++;
+                    frame_send(line, FR_HEARTBEAT, &seq, 1, 0);
+                    Metrics::add(metrics.hb_frames);
+                    hb_open = true;
+                } else {
+                    line.output(1);         // send a pulse to iSwitchPi
+                    Metrics::add(metrics.hb_pulses);
+                    pulse_end = now + PULSE_MS * MS;
+                }
+                hb_at = now + INTERVAL_MS * MS;
+            }
+        }
+
+        // next deadline, a busy line is looked at again after FR_IDLE
+        uint64_t wake = hb_at;
+        if (pulse_end < wake)
+            wake = pulse_end;
+        if (req.active && req.at < wake)
+            wake = req.at;
+        if (anzir > 0 && long_ns + DECIDE_MS * MS < wake)
+            wake = long_ns + DECIDE_MS * MS;
+        if (poll_status && status_at < wake)
+            wake = status_at;
+        if (framed && halt_at < wake)
+            wake = halt_at;
+        if (textfile && file_at < wake)
+            wake = file_at;
+        if (ms.deadline() < wake)
+            wake = ms.deadline();
+        now = mono_ns();
+        if (wake <= now)
+            wake = now + FR_IDLE * FR_UNIT_US * 1000ull;
+        timer_at(tfd, wake);
+    }
+
+    // we reach this if Pi is halted/rebooted from commandline or else
+    ctl_close(cfd);
+    if (textfile)
+        metrics_file(textfile, metrics, mono_ns(), nullptr);
+    line.output(0);
+    if (debug == 2) printf("iSwitchPi: End reached\n");
+    return 0;
+}
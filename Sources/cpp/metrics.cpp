@@ -0,0 +1,255 @@
+/* -----------------------------------------------------------------------
+ * Title: Metrics of iswitchpid, see metrics.h
+ * -----------------------------------------------------------------------*/
+
+#include <metrics.h>
+#include <stophooks.h>
+#include <frame.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define MS      1000000ull                  // ns
+
+//---------------------------------------------------------------
+static void head(FILE *f, const char *name, const char *type, const char *help) {
+    fprintf(f, "# HELP iswitchpi_%s %s\n# TYPE iswitchpi_%s %s\n", name, help, name, type);
+}
+
+static void one(FILE *f, const char *name, const char *type, const char *help, double v) {
+    head(f, name, type, help);
+    fprintf(f, "iswitchpi_%s %.10g\n", name, v);
+}
+
+void metrics_label(FILE *f, const char *value) {
+    fputc('"', f);
+    for (; *value; value++) {
+        if (*value == '"' || *value == '\\')
+            fputc('\\', f);
+        if (*value == '\n')
+            fputs("\\n", f);
+        else
+            fputc(*value, f);
+    }
+    fputc('"', f);
+}
+
+void metrics_write(FILE *f, const Metrics &m, uint64_t now, const StopHooks *hooks) {
+    uint32_t t = Metrics::ms(now), flags = Metrics::get(m.fw_flags);
+
+    head(f, "heartbeats_sent_total", "counter", "Heartbeats sent to the iSwitchPi.");
+    fprintf(f, "iswitchpi_heartbeats_sent_total{kind=\"frame\"} %u\n", Metrics::get(m.hb_frames));
+    fprintf(f, "iswitchpi_heartbeats_sent_total{kind=\"pulse\"} %u\n", Metrics::get(m.hb_pulses));
+    one(f, "heartbeats_acked_total", "counter", "Heartbeat frames acknowledged by the iSwitchPi.",
+        Metrics::get(m.hb_acked));
+    head(f, "commands_received_total", "counter", "Halt and reboot commands from the iSwitchPi.");
+    fprintf(f, "iswitchpi_commands_received_total{command=\"halt\"} %u\n", Metrics::get(m.halts));
+    fprintf(f, "iswitchpi_commands_received_total{command=\"reboot\"} %u\n", Metrics::get(m.reboots));
+    one(f, "frames_bad_total", "counter", "Frames with a wrong CRC or length.", Metrics::get(m.frames_bad));
+    one(f, "requests_total", "counter", "Requests to the iSwitchPi (-q, status poll).", Metrics::get(m.requests));
+    one(f, "requests_failed_total", "counter", "Requests without an answer.", Metrics::get(m.requests_failed));
+    one(f, "framed", "gauge", "1 if the iSwitchPi answers frames, 0: old firmware, pulses.",
+        Metrics::get(m.framed));
+    if (Metrics::get(m.signals))
+        one(f, "last_signal_seconds", "gauge", "Time since the last frame or pulse from the iSwitchPi.",
+            (uint32_t)(t - Metrics::get(m.signal_ms)) / 1000.0);
+
+    if (Metrics::get(m.fw_status)) {        // FR_STATUS
+        one(f, "firmware_state", "gauge", "State of the iSwitchPi (0 standby .. 5 halting, see fsm.h).",
+            Metrics::get(m.fw_state));
+        one(f, "firmware_power", "gauge", "1 if the iSwitchPi powers the Pi.", !!(flags & FR_ST_VPOWER));
+        one(f, "firmware_short_delays", "gauge", "DIP switch: short delays.", !!(flags & FR_ST_SHORT));
+        one(f, "firmware_square_switch", "gauge", "DIP switch: square wave on.", !!(flags & FR_ST_SQUARE));
+        one(f, "firmware_auto_power", "gauge", "Power on after a power failure.", !!(flags & FR_ST_AUTO));
+        one(f, "firmware_square_freq_switch", "gauge", "DIP switches of the square wave frequency (0..3).",
+            (flags & FR_ST_FREQ) >> 4);
+        one(f, "firmware_heartbeats_in_row", "gauge", "Heartbeats in a row the iSwitchPi has seen.",
+            Metrics::get(m.fw_heartbeats));
+        one(f, "firmware_status_age_seconds", "gauge", "Time since these firmware values came.",
+            (uint32_t)(t - Metrics::get(m.fw_ms)) / 1000.0);
+    }
+
+    if (Metrics::get(m.sq_on)) {            // -S
+        one(f, "square_hz", "gauge", "Square wave frequency, measured (0: not locked).",
+            Metrics::get(m.sq_mhz) / 1000.0);
+        one(f, "square_edges_total", "counter", "Rising edges of the square wave.", Metrics::get(m.sq_edges));
+        one(f, "square_missed_total", "counter", "Square wave edges lost.", Metrics::get(m.sq_missed));
+        one(f, "square_relocks_total", "counter", "Square wave estimate started over.", Metrics::get(m.sq_relocks));
+        one(f, "square_jitter_seconds", "gauge", "Period jitter since the start, standard deviation.",
+            Metrics::get(m.sq_jitter_ns) / 1e9);
+        one(f, "square_jitter_max_seconds", "gauge", "Largest deviation of one period since the start.",
+            Metrics::get(m.sq_jitter_max_ns) / 1e9);
+        if (Metrics::get(m.sq_edges))
+            one(f, "square_last_edge_seconds", "gauge", "Time since the last edge of the square wave.",
+                (uint32_t)(t - Metrics::get(m.sq_ms)) / 1000.0);
+    }
+
+    if (hooks)
+        hooks->metrics(f);
+}
+
+// FILE.tmp, then renamed: the collector never sees half a file
+bool metrics_file(const char *path, const Metrics &m, uint64_t now, const StopHooks *hooks) {
+    char tmp[512];
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f)
+        return false;
+    metrics_write(f, m, now, hooks);
+    fflush(f);
+    if (hooks)
+        fsync(fileno(f));                   // before halt/reboot
+    bool ok = !ferror(f);
+    fclose(f);
+    return ok && rename(tmp, path) == 0;
+}
+
+//---------------------------------------------------------------
+bool MetricsServer::open(const char *where) {
+    int one = 1;
+
+    if (where[0] == '/') {
+        sockaddr_un a = {};
+        if (strlen(where) >= sizeof(a.sun_path))
+            return false;
+        a.sun_family = AF_UNIX;
+        strcpy(a.sun_path, where);
+        fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        unlink(where);
+        if (fd_ < 0 || bind(fd_, (sockaddr *)&a, sizeof(a)) < 0 || listen(fd_, METRICS_CLIENTS) < 0) {
+            close();
+            return false;
+        }
+        strcpy(path_, where);
+        chmod(path_, 0666);                 // node_exporter, prometheus do not run as root
+        return true;
+    }
+
+    sockaddr_in a = {};
+    int port = atoi(where);
+    if (port <= 0 || port > 65535)
+        return false;
+    a.sin_family = AF_INET;
+    a.sin_port = htons(port);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (fd_ < 0 || setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+        || bind(fd_, (sockaddr *)&a, sizeof(a)) < 0 || listen(fd_, METRICS_CLIENTS) < 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MetricsServer::close() {
+    for (int i = 0; i < METRICS_CLIENTS; i++)
+        if (client_[i] >= 0) {
+            ::close(client_[i]);            // leaves the epoll set with it
+            client_[i] = -1;
+        }
+    if (fd_ >= 0)
+        ::close(fd_);
+    fd_ = -1;
+    if (path_[0])
+        unlink(path_);
+    path_[0] = 0;
+}
+
+bool MetricsServer::owns(int fd) const {
+    for (int i = 0; i < METRICS_CLIENTS; i++)
+        if (fd >= 0 && client_[i] == fd)
+            return true;
+    return false;
+}
+
+void MetricsServer::drop(int efd, int i) {
+    epoll_ctl(efd, EPOLL_CTL_DEL, client_[i], nullptr);
+    ::close(client_[i]);
+    client_[i] = -1;
+}
+
+void MetricsServer::accept(int efd, uint64_t now) {
+    int c, i;
+
+    while ((c = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        struct epoll_event ev = {};
+        for (i = 0; i < METRICS_CLIENTS && client_[i] >= 0; i++)
+            ;
+        ev.events = EPOLLIN;
+        ev.data.fd = c;
+        if (i == METRICS_CLIENTS || epoll_ctl(efd, EPOLL_CTL_ADD, c, &ev) < 0) {
+            ::close(c);                     // too many at once
+            continue;
+        }
+        client_[i] = c;
+        end_[i] = 0;
+        until_[i] = now + METRICS_CLIENT_MS * MS;
+    }
+}
+
+// the request is read up to its empty line, it does not matter what it
+// asks for. Then the answer in one go, the socket buffer takes it
+void MetricsServer::serve(int efd, int fd, const Metrics &m, uint64_t now) {
+    static char body[METRICS_MAX];
+    char buf[512], hdr[160];
+    bool done = false;
+    int i, k;
+    ssize_t n = 0;
+
+    for (i = 0; i < METRICS_CLIENTS && client_[i] != fd; i++)
+        ;
+    if (i == METRICS_CLIENTS)
+        return;
+    while (!done && (n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+        for (k = 0; k < n && !done; k++) {
+            end_[i] = end_[i] << 8 | (uint8_t)buf[k];
+            done = (end_[i] & 0xffff) == 0x0a0a || end_[i] == 0x0d0a0d0a;
+        }
+    if (!done && n < 0 && errno == EAGAIN)
+        return;                             // more to come
+    if (!done && (n < 0 || end_[i] == 0)) {
+        drop(efd, i);                       // gone without a request
+        return;
+    }
+
+    FILE *f = fmemopen(body, sizeof(body), "w");
+    if (!f) {
+        drop(efd, i);
+        return;
+    }
+    metrics_write(f, m, now, nullptr);
+    size_t len = ftell(f);
+    fclose(f);
+    k = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                 "Content-Length: %zu\r\nConnection: close\r\n\r\n", len);
+    struct iovec iov[2] = { { hdr, (size_t)k }, { body, len } };
+    struct msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    drop(efd, i);
+}
+
+void MetricsServer::expire(int efd, uint64_t now) {
+    for (int i = 0; i < METRICS_CLIENTS; i++)
+        if (client_[i] >= 0 && now >= until_[i])
+            drop(efd, i);
+}
+
+uint64_t MetricsServer::deadline() const {
+    uint64_t d = UINT64_MAX;
+    for (int i = 0; i < METRICS_CLIENTS; i++)
+        if (client_[i] >= 0 && until_[i] < d)
+            d = until_[i];
+    return d;
+}
@@ -0,0 +1,92 @@
+/* -----------------------------------------------------------------------
+ * Title: Metrics of iswitchpid, Prometheus text format
+ * iswitchpid -m PORT | -m /PATH: HTTP on 127.0.0.1:PORT or on a unix
+ * socket (curl --unix-socket PATH http://localhost/metrics), any
+ * request gets the metrics. -T FILE: the same text every METRICS_FILE_S
+ * and once more before halt/reboot, written to FILE.tmp and renamed,
+ * for the textfile collector of node_exporter.
+ *
+ * The daemon counts into Metrics on its event path: relaxed atomic
+ * increments and stores, no lock, no system call. Collection reads
+ * them with relaxed loads, 32 bit so they stay lock-free on the ARMv6
+ * of the Pi Zero. The server is part of the epoll loop of the daemon,
+ * its sockets never block: a client that does not send its request
+ * within METRICS_CLIENT_MS is dropped, one that does not read its
+ * answer loses it.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _METRICS_H
+#define _METRICS_H
+
+#include <atomic>
+#include <stdint.h>
+#include <stdio.h>
+
+#define METRICS_FILE_S      15              // -T: written this often
+#define METRICS_STATUS_S    30              // STATUS asked for this often (-m or -T)
+#define METRICS_CLIENTS     4               // connections at the same time
+#define METRICS_CLIENT_MS   1000            // request must be in by then
+#define METRICS_MAX         8192            // text of the answer
+
+typedef std::atomic<uint32_t> Counter;
+static_assert(Counter::is_always_lock_free, "metrics need lock-free 32 bit atomics");
+
+struct Metrics {
+    Counter hb_frames{0};                   // heartbeats sent as frame
+    Counter hb_pulses{0};                   //                 as 50 ms pulse
+    Counter hb_acked{0};
+    Counter halts{0}, reboots{0};           // commands from ISWITCHPI, frame or pulses
+    Counter frames_bad{0};                  // wrong crc or length
+    Counter requests{0}, requests_failed{0};        // to ISWITCHPI: -q and the STATUS poll
+    Counter framed{0};                      // 1: ISWITCHPI answers frames
+    Counter signal_ms{0};                   // CLOCK_MONOTONIC ms (wraps) of its last frame or pulse
+    Counter signals{0};                     // signal_ms set at all
+
+    Counter fw_status{0};                   // STATUS answers
+    Counter fw_ms{0};                       // CLOCK_MONOTONIC ms of the last one
+    Counter fw_state{0}, fw_flags{0}, fw_heartbeats{0};     // FR_STATUS, as it came
+
+    Counter sq_on{0};                       // -S: square wave watched
+    Counter sq_mhz{0};                      // estimate, mHz, 0: not locked
+    Counter sq_edges{0}, sq_missed{0}, sq_relocks{0};
+    Counter sq_jitter_ns{0}, sq_jitter_max_ns{0};
+    Counter sq_ms{0};                       // last edge
+
+    static void add(Counter &c, uint32_t n = 1) { c.fetch_add(n, std::memory_order_relaxed); }
+    static void set(Counter &c, uint32_t v) { c.store(v, std::memory_order_relaxed); }
+    static uint32_t get(const Counter &c) { return c.load(std::memory_order_relaxed); }
+    static uint32_t ms(uint64_t ns) { return (uint32_t)(ns / 1000000ull); }
+};
+
+class StopHooks;
+
+// the text, now: CLOCK_MONOTONIC ns; hooks: after a shutdown, else nullptr
+void metrics_write(FILE *f, const Metrics &m, uint64_t now, const StopHooks *hooks);
+bool metrics_file(const char *path, const Metrics &m, uint64_t now, const StopHooks *hooks);
+void metrics_label(FILE *f, const char *value);         // quoted, escaped
+
+class MetricsServer {
+public:
+    ~MetricsServer() { close(); }
+
+    bool open(const char *where);           // "PORT" on 127.0.0.1 or "/path" of a unix socket
+    void close();
+    int  fd() const { return fd_; }
+    bool owns(int fd) const;                // a client of ours
+
+    void accept(int efd, uint64_t now);     // fd() readable: new clients, onto epoll efd
+    void serve(int efd, int fd, const Metrics &m, uint64_t now);    // client readable
+    void expire(int efd, uint64_t now);     // drop clients that are too slow
+    uint64_t deadline() const;              // next expire(), UINT64_MAX: none
+
+private:
+    void drop(int efd, int i);
+
+    int      fd_ = -1;
+    char     path_[108] = "";               // unix socket, removed at close()
+    int      client_[METRICS_CLIENTS] = { -1, -1, -1, -1 };
+    uint64_t until_[METRICS_CLIENTS] = {};
+    uint32_t end_[METRICS_CLIENTS] = {};    // last 4 bytes of the request: its empty line
+};
+
+#endif  // ifndef _METRICS_H
@@ -0,0 +1,165 @@
+/* -----------------------------------------------------------------------
+ * Title: Square wave of the iSwitchPi as a clock, see squareclock.h
+ * -----------------------------------------------------------------------*/
+
+#include <squareclock.h>
+#include <math.h>
+#include <poll.h>
+#include <time.h>
+
+#define SLIP            0.25                // interval this far off the grid: relock
+#define BATCH           16                  // edges per read, EVENT_BUFFER of GpioLine
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+SquareClock::SquareClock(double nominal_hz, unsigned int every)
+    : nominal_(nominal_hz), every_(every ? every : 1) {
+    if (nominal_ > 0)
+        period_ = 1e9 / nominal_;           // until the first interval is measured
+}
+
+bool SquareClock::open(const char *chip, unsigned int offset, const char *consumer) {
+    return line_.open(chip, offset, consumer) && line_.input(GpioLine::RISING);
+}
+
+//---------------------------------------------------------------
+// estimate from the oldest anchor to now, anchors move with the window
+void SquareClock::relock(uint64_t ns, double period) {
+    period_ = period;
+    anchors_ = 1;
+    head_ = 0;
+    anchor_[0].n = edge_;
+    anchor_[0].ns = ns;
+}
+
+bool SquareClock::feed(const GpioEdge &e, uint64_t now, Tick &t) {
+    uint64_t prev = edge_, due = 0;
+    unsigned int lost = 0;
+
+    if (!e.rising)
+        return false;
+    st_.edges++;
+    if (now > e.ns) {
+        double lat = now - e.ns;
+        st_.latency_ns += (lat - st_.latency_ns) / st_.edges;
+        if (lat > st_.latency_max_ns)
+            st_.latency_max_ns = lat;
+    }
+    if (seq_ && e.seqno > seq_ + 1)
+        lost = e.seqno - seq_ - 1;          // kernel buffer overflowed, timing decides when locked
+    seq_ = e.seqno;
+
+    if (last_ == 0) {                       // first edge: tick 0
+        relock(e.ns, period_);
+        last_ = e.ns;
+        t = { 0, e.ns, predict(0), 0 };
+        return true;
+    }
+
+    double dt = e.ns - last_;
+    double m = period_ > 0 ? dt / period_ : 0;
+    uint64_t k = llround(m);
+    last_ = e.ns;
+    if (k == 0 || fabs(m - k) > SLIP) {     // new frequency or a glitch
+        edge_ += 1 + lost;
+        if (period_ > 0)
+            st_.relocks++;
+        relock(e.ns, dt / (1 + lost));      // first interval without nominal: learn
+        measured_ = true;
+    } else {
+        lost = k - 1;                       // whole periods missing, the kernel's or ours
+        edge_ += 1 + lost;
+        due = predict(edge_ / every_);      // before this edge goes into the estimate
+        double dev = dt / (1 + lost) - period_;
+        if (measured_) {                    // not against the nominal period
+            jn_++;
+            jmean_ += (dev - jmean_) / jn_;
+            jm2_ += dev * (dev - jmean_);
+            if (fabs(dev) > st_.jitter_max_ns)
+                st_.jitter_max_ns = fabs(dev);
+        }
+        measured_ = true;
+
+        int oldest = (head_ + 1) % anchors_;
+        period_ = (double)(e.ns - anchor_[oldest].ns) / (edge_ - anchor_[oldest].n);
+        if (e.ns - anchor_[head_].ns >= WINDOW_S * 1000000000ull / ANCHORS) {
+            if (anchors_ < ANCHORS)
+                anchors_++;
+            head_ = (head_ + 1) % anchors_;  // the oldest one goes
+            anchor_[head_].n = edge_;
+            anchor_[head_].ns = e.ns;
+        }
+    }
+    st_.missed += lost;
+    lost_ += lost;
+
+    if (edge_ / every_ == prev / every_)
+        return false;
+    t.n = edge_ / every_;
+    t.ns = e.ns;
+    t.due_ns = due;
+    t.missed = lost_;
+    lost_ = 0;
+    return true;
+}
+
+//---------------------------------------------------------------
+int SquareClock::read(Tick *t, int max) {
+    GpioEdge ev[BATCH];
+    int n, k = 0;
+
+    if (max > BATCH)
+        max = BATCH;                        // at most one tick per edge
+    n = line_.read(ev, max);
+    if (n <= 0)
+        return n;
+    uint64_t now = now_ns();
+    for (int i = 0; i < n; i++)
+        if (feed(ev[i], now, t[k]))
+            k++;
+    return k;
+}
+
+int SquareClock::wait(Tick &t, int timeout_ms) {
+    uint64_t end = now_ns() + (uint64_t)timeout_ms * 1000000;
+
+    for (;;) {
+        int n = read(&t, 1);
+        if (n != 0)
+            return n;
+        uint64_t now = now_ns();
+        if (timeout_ms >= 0 && now >= end)
+            return 0;
+        struct pollfd p = { fd(), POLLIN, 0 };
+        if (poll(&p, 1, timeout_ms < 0 ? -1 : (int)((end - now) / 1000000) + 1) < 0)
+            return -1;
+    }
+}
+
+//---------------------------------------------------------------
+double SquareClock::ppm() const {
+    return nominal_ > 0 && period_ > 0 ? (1e9 / period_ / nominal_ - 1) * 1e6 : 0;
+}
+
+uint64_t SquareClock::predict(uint64_t n) const {
+    if (period_ <= 0 || anchors_ == 0)
+        return 0;
+    int oldest = (head_ + 1) % anchors_;
+    return anchor_[oldest].ns + llround(((double)n * every_ - anchor_[oldest].n) * period_);
+}
+
+TickStats SquareClock::stats() const {
+    TickStats s = st_;
+    s.jitter_ns = jn_ > 1 ? sqrt(jm2_ / (jn_ - 1)) : 0;
+    return s;
+}
+
+void SquareClock::reset_stats() {
+    st_ = {};
+    jn_ = 0;
+    jmean_ = jm2_ = 0;
+}
@@ -0,0 +1,86 @@
+/* -----------------------------------------------------------------------
+ * Title: Square wave of the iSwitchPi as a clock, Pi side
+ * Hardware: Raspberry Pi, square wave on GPIO 17, 22, 23 or 27 (DIP switch)
+ *
+ * Replaces the per edge Python callback of ../examples/example-interrupt.py
+ * for pacing work off the square wave. Rising edges are read in batches
+ * with their kernel timestamps (CLOCK_MONOTONIC) through libgpiod.
+ *
+ * SquareClock estimates the real frequency of the wave over a sliding
+ * window (the ATtiny runs on its RC oscillator, a few % off) and its
+ * drift against CLOCK_MONOTONIC. It hands out one Tick every `every`
+ * edges. Lost edges are counted, not hidden, and tick numbers stay on
+ * the grid of the hardware edges. An edge is lost when a whole period
+ * is missing, dropped by the kernel (sequence number gap) or not seen.
+ *
+ * An interval off the grid starts the estimate over. That happens when
+ * the frequency changes (DIP switch, iswitchpid -q square) or on a glitch.
+ *
+ * Use: open(), then epoll/poll on fd(). On POLLIN, read() returns the
+ * ticks due. Or call wait() for the next one, see squaretick.cpp.
+ * feed() is the estimator alone, for edges from elsewhere.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _SQUARECLOCK_H
+#define _SQUARECLOCK_H
+
+#include <gpioline.h>
+
+struct Tick {
+    uint64_t     n;                         // tick number: edge number / every
+    uint64_t     ns;                        // kernel timestamp of its edge
+    uint64_t     due_ns;                    // where the estimate expected it, 0: not locked
+    unsigned int missed;                    // edges lost since the last tick
+};
+
+struct TickStats {
+    uint64_t edges;                         // rising edges read
+    uint64_t missed;                        // edges lost: seqno gaps, missing periods
+    uint64_t relocks;                       // interval off the grid: estimate started over
+    double   jitter_ns;                     // period jitter, standard deviation
+    double   jitter_max_ns;                 // largest deviation of one period
+    double   latency_ns;                    // edge to read(), mean
+    double   latency_max_ns;
+};
+
+class SquareClock {
+public:
+    enum { WINDOW_S = 60, ANCHORS = 8 };    // frequency estimate over the last minute
+
+    explicit SquareClock(double nominal_hz = 0, unsigned int every = 1);
+
+    bool open(const char *chip, unsigned int offset, const char *consumer);
+    void close() { line_.close(); }
+    int  fd() const { return line_.fd(); }
+
+    int  read(Tick *t, int max);            // ticks from the pending edges, never blocks; -1 on error
+    int  wait(Tick &t, int timeout_ms);     // next tick: 1, 0 on timeout, -1 on error
+    bool feed(const GpioEdge &e, uint64_t now, Tick &t);   // one edge, true: it is a tick
+
+    bool     locked() const { return period_ > 0; }
+    double   hz() const { return period_ > 0 ? 1e9 / period_ : 0; }
+    double   ppm() const;                   // wave against CLOCK_MONOTONIC, 0 without nominal
+    uint64_t predict(uint64_t n) const;     // ns tick n is due, 0 if not locked
+    TickStats stats() const;
+    void     reset_stats();
+
+private:
+    void relock(uint64_t ns, double period);
+
+    GpioLine     line_;
+    double       nominal_;                  // Hz, as set on the iSwitchPi, 0: unknown
+    unsigned int every_;
+    double       period_ = 0;               // ns, estimate
+    bool         measured_ = false;         // period_ from edges, not the nominal one
+    uint64_t     edge_ = 0;                 // number of the last edge, lost ones counted
+    uint64_t     last_ = 0;                 // ns of the last edge, 0: none yet
+    unsigned long seq_ = 0;                 // kernel seqno of the last edge
+    unsigned int lost_ = 0;                 // edges lost since the last tick
+    struct { uint64_t n, ns; } anchor_[ANCHORS];
+    int          anchors_ = 0, head_ = 0;   // anchors in use, newest
+    TickStats    st_ = {};
+    uint64_t     jn_ = 0;                   // periods in the jitter statistics
+    double       jmean_ = 0, jm2_ = 0;      // running mean and sum of squares (Welford)
+};
+
+#endif  // ifndef _SQUARECLOCK_H
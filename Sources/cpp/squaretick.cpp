@@ -0,0 +1,103 @@
+/* -----------------------------------------------------------------------
+ *   Pi  Square Wave Tick Example
+ *   Native counterpart of Sources/examples/example-interrupt.py
+ *
+ *   Uses the square wave output of the iSwitchPi as a clock through
+ *   SquareClock (squareclock.h): one tick every N rising edges, the work
+ *   of a tick (here: a line of output) runs in the main loop. Edges are
+ *   read with kernel timestamps, so the timing no longer depends on what
+ *   else the process does. Every 10 ticks the measured frequency, its
+ *   drift against CLOCK_MONOTONIC and the jitter are printed.
+ *
+ *   The square wave can be routed (by Dip switch on the iSwitchPi board)
+ *   to one of 4 GPIO pins: 17, 22, 23 or 27, selected with -p (default 17)
+ *   -f HZ   frequency set on the iSwitchPi (DIP or iswitchpid -q square),
+ *           reference for the drift; without it only the estimate is shown
+ *   -n N    one tick every N edges (default 10, as IR_COUNT of the script)
+ *   -c      GPIO chip (default gpiochip0), e.g. a gpio-sim chip
+ *   -d 0|1  debug: 1 prints every tick
+ * -----------------------------------------------------------------------*/
+
+#include <squareclock.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define CONSUMER        "squaretick"
+#define REPORT_TICKS    10
+#define TIMEOUT_MS      15000               // no edge: square wave off?
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int) { stop = 1; }
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-p 17|22|23|27] [-f HZ] [-n EDGES] [-c gpiochip] [-d 0|1]\n", name);
+}
+
+int main(int argc, char **argv) {
+    const char *chip = "gpiochip0";
+    int pin = 17, every = 10, debug = 0, opt;
+    double nominal = 0;
+
+    while ((opt = getopt(argc, argv, "p:f:n:c:d:h")) != -1) {
+        switch (opt) {
+        case 'p': pin = atoi(optarg); break;
+        case 'f': nominal = atof(optarg); break;
+        case 'n': every = atoi(optarg); break;
+        case 'c': chip = optarg; break;
+        case 'd': debug = atoi(optarg); break;
+        default:  usage(argv[0]); return 2;
+        }
+    }
+    if (pin != 17 && pin != 22 && pin != 23 && pin != 27) {
+        fprintf(stderr, "squaretick: ERROR Selected GPIO %d not valid (use 17,22,23 or 27)\n", pin);
+        return 2;
+    }
+    if (every < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    SquareClock clk(nominal, every);
+    if (!clk.open(chip, pin, CONSUMER)) {
+        fprintf(stderr, "squaretick: cannot request GPIO %d on %s: %s\n", pin, chip, strerror(errno));
+        return 1;
+    }
+    struct sigaction sa = {};
+    sa.sa_handler = on_signal;              // no SA_RESTART: poll() returns
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    Tick t;
+    while (!stop) {
+        int n = clk.wait(t, TIMEOUT_MS);
+        if (n < 0 && errno != EINTR) {
+            perror("squaretick");
+            return 1;
+        }
+        if (n == 0) {
+            printf("squaretick: no edge for %d s\n", TIMEOUT_MS / 1000);
+            continue;
+        }
+        if (n < 0)
+            continue;
+        if (debug)
+            printf("tick %llu  late %+.3f ms  missed %u\n", (unsigned long long)t.n,
+                   t.due_ns ? ((double)t.ns - t.due_ns) / 1e6 : 0.0, t.missed);
+        if (t.n % REPORT_TICKS == 0 && t.n) {
+            TickStats s = clk.stats();
+            printf("tick %llu  %.6f Hz  %+.0f ppm  jitter %.1f us (max %.1f)  "
+                   "latency %.1f us (max %.1f)  missed %llu  relocks %llu\n",
+                   (unsigned long long)t.n, clk.hz(), clk.ppm(), s.jitter_ns / 1e3,
+                   s.jitter_max_ns / 1e3, s.latency_ns / 1e3, s.latency_max_ns / 1e3,
+                   (unsigned long long)s.missed, (unsigned long long)s.relocks);
+        }
+    }
+    clk.close();
+    return 0;
+}
@@ -0,0 +1,324 @@
+/* -----------------------------------------------------------------------
+ *   Stop hooks before halt/reboot, see stophooks.h
+ *
+ *   Every hook is its own process group (posix_spawn), so a timeout
+ *   takes its children down too. The hooks start with an empty signal
+ *   mask, iswitchpid itself blocks SIGINT/SIGTERM (signalfd) and here
+ *   SIGCHLD: run() sleeps in sigtimedwait() until a hook ends or the
+ *   next deadline, whichever comes first.
+ * -----------------------------------------------------------------------*/
+
+#include <stophooks.h>
+#include <metrics.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+#define MS              1000000ull          // ns
+#define SYSTEMD_RUNNING "/run/systemd/system"   // as sd_booted()
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool is_unit(const char *name) {
+    static const char *const suffix[] = { ".service", ".target", ".socket", ".mount", ".scope" };
+    size_t n = strlen(name);
+
+    for (const char *s : suffix)
+        if (n > strlen(s) && strcmp(name + n - strlen(s), s) == 0)
+            return true;
+    return false;
+}
+
+// name as written in "# after:", with or without the suffix
+static bool same_hook(const char *name, const char *ref) {
+    size_t n = strlen(ref);
+    return strcmp(name, ref) == 0 || (strncmp(name, ref, n) == 0 && name[n] == '.');
+}
+
+static int by_name(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+//---------------------------------------------------------------
+// "# after:" and "# timeout:" lines, for scripts the header only
+bool StopHooks::parse(StopHook &h, const char *path) {
+    char line[256];
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+        return false;
+    for (int i = 0; fgets(line, sizeof(line), f) && (h.unit || i < 20); i++) {
+        char *p = line + strspn(line, " \t");
+        if (*p != '#')
+            continue;
+        p += 1 + strspn(p + 1, " \t");
+        if (strncmp(p, "after:", 6) == 0) {
+            for (char *tok = strtok(p + 6, " \t\r\n,"); tok && h.nafter < HOOK_AFTER_MAX;
+                 tok = strtok(nullptr, " \t\r\n,"))
+                snprintf(h.after[h.nafter++], sizeof(h.after[0]), "%s", tok);
+        } else if (strncmp(p, "timeout:", 8) == 0) {
+            int t = atoi(p + 8);
+            if (t > 0)
+                h.timeout_s = t;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+//---------------------------------------------------------------
+int StopHooks::load(const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    char *names[HOOKS_MAX];
+    int k = 0;
+
+    if (!d)
+        return -1;
+    while ((e = readdir(d)) && k < HOOKS_MAX) {
+        if (e->d_name[0] == '.' || e->d_name[strlen(e->d_name) - 1] == '~')
+            continue;
+        names[k++] = strdup(e->d_name);
+    }
+    closedir(d);
+    qsort(names, k, sizeof(names[0]), by_name);   // same order every time
+
+    for (int i = 0; i < k; i++) {
+        char path[512];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && n_ < HOOKS_MAX) {
+            StopHook &h = h_[n_];
+            memset(&h, 0, sizeof(h));
+            snprintf(h.name, sizeof(h.name), "%s", names[i]);
+            h.timeout_s = HOOK_TIMEOUT_S;
+            h.status = -1;
+            h.unit = is_unit(names[i]);
+            if (h.unit) {
+                if (access(SYSTEMD_RUNNING, F_OK) == 0) {
+                    snprintf(h.prog, sizeof(h.prog), "systemctl");
+                    snprintf(h.arg, sizeof(h.arg), "%s", names[i]);
+                } else {                    // no systemd: SysV init script of the same name
+                    snprintf(h.prog, sizeof(h.prog), "/etc/init.d/%.*s",
+                             (int)(strrchr(names[i], '.') - names[i]), names[i]);
+                    snprintf(h.arg, sizeof(h.arg), "stop");
+                }
+                parse(h, path);
+                n_++;
+            } else if (access(path, X_OK) == 0) {
+                snprintf(h.prog, sizeof(h.prog), "%s", path);
+                parse(h, path);
+                n_++;
+            }
+        }
+        free(names[i]);
+    }
+    resolve();
+    return n_;
+}
+
+bool StopHooks::add(const char *path) {
+    if (n_ == HOOKS_MAX || access(path, X_OK) != 0)
+        return false;
+    StopHook &h = h_[n_++];
+    const char *slash = strrchr(path, '/');
+    memset(&h, 0, sizeof(h));
+    snprintf(h.name, sizeof(h.name), "%s", slash ? slash + 1 : path);
+    snprintf(h.prog, sizeof(h.prog), "%s", path);
+    h.timeout_s = HOOK_TIMEOUT_S;
+    h.status = -1;
+    resolve();
+    return true;
+}
+
+void StopHooks::resolve() {
+    for (int i = 0; i < n_; i++)
+        for (int a = 0; a < h_[i].nafter; a++) {
+            h_[i].dep[a] = -1;
+            for (int j = 0; j < n_; j++)
+                if (j != i && same_hook(h_[j].name, h_[i].after[a]))
+                    h_[i].dep[a] = j;
+        }
+}
+
+//---------------------------------------------------------------
+// all hooks it waits for are done (unknown names wait for nothing)
+bool StopHooks::ready(const StopHook &h) const {
+    for (int a = 0; a < h.nafter; a++)
+        if (h.dep[a] >= 0 && h_[h.dep[a]].state != StopHook::DONE)
+            return false;
+    return true;
+}
+
+void StopHooks::start(StopHook &h, const char *what) {
+    posix_spawnattr_t attr;
+    sigset_t none;
+    char *argv[4];
+    int argc = 0;
+
+    argv[argc++] = h.prog;
+    if (h.unit && strcmp(h.prog, "systemctl") == 0)
+        argv[argc++] = const_cast<char *>("stop");
+    argv[argc++] = h.arg[0] ? h.arg : const_cast<char *>(what);
+    argv[argc] = nullptr;
+
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigmask(&attr, &none);
+    h.start = now_ns();
+    if (posix_spawnp(&h.pid, h.prog, nullptr, &attr, argv, environ) == 0) {
+        h.state = StopHook::RUN;
+    } else {
+        h.state = StopHook::DONE;           // not there: the next ones go on
+        h.end = h.start;
+    }
+    posix_spawnattr_destroy(&attr);
+}
+
+void StopHooks::reap() {
+    pid_t pid;
+    int status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        for (int i = 0; i < n_; i++)
+            if (h_[i].state == StopHook::RUN && h_[i].pid == pid) {
+                h_[i].state = StopHook::DONE;
+                h_[i].status = status;
+                h_[i].end = now_ns();
+            }
+}
+
+//---------------------------------------------------------------
+// Function run()
+//  start what is ready, wait for a hook to end or the next timeout,
+//  until all are done or the deadline. None is started at or after
+//  the deadline
+//
+void StopHooks::run(const char *what, uint64_t deadline) {
+    sigset_t chld, old;
+
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &old);
+
+    for (;;) {
+        int running = 0, waiting = 0;
+        bool late = now_ns() >= deadline;   // no new ones, they would be killed at once
+
+        for (int i = 0; i < n_ && !late; i++)
+            if (h_[i].state == StopHook::WAIT && (cycle_ || ready(h_[i])))
+                start(h_[i], what);
+        for (int i = 0; i < n_; i++) {
+            running += h_[i].state == StopHook::RUN;
+            waiting += h_[i].state == StopHook::WAIT;
+        }
+        if (!running && (!waiting || late))
+            break;                          // late: the waiting ones stay "not started"
+        if (!running) {                     // only waiting ones: a cycle
+            cycle_ = true;
+            continue;
+        }
+
+        uint64_t now = now_ns(), wake = deadline;
+        for (int i = 0; i < n_; i++) {
+            StopHook &h = h_[i];
+            if (h.state != StopHook::RUN)
+                continue;
+            uint64_t t = h.start + h.timeout_s * 1000 * MS + h.kills * HOOK_GRACE_MS * MS;
+            if (now >= deadline || (now >= t && h.kills < 2)) {
+                kill(-h.pid, h.kills++ || now >= deadline ? SIGKILL : SIGTERM);
+                t = now + HOOK_GRACE_MS * MS;
+            }
+            if (t < wake)
+                wake = t;
+        }
+        if (now >= deadline + HOOK_GRACE_MS * MS)
+            break;                          // killed and still there: leave them
+        if (wake <= now)
+            wake = now + 10 * MS;
+        struct timespec ts = { (time_t)((wake - now) / 1000000000ull), (long)((wake - now) % 1000000000ull) };
+        sigtimedwait(&chld, nullptr, &ts);
+        reap();
+    }
+    sigprocmask(SIG_SETMASK, &old, nullptr);
+}
+
+//---------------------------------------------------------------
+void StopHooks::report(FILE *f, uint64_t t0) const {
+    uint64_t last = t0;
+
+    if (cycle_)
+        fprintf(f, "iSwitchPi: stop hooks: order has a cycle, started anyway\n");
+    for (int i = 0; i < n_; i++) {
+        const StopHook &h = h_[i];
+        char result[32];
+
+        if (h.state == StopHook::WAIT)
+            snprintf(result, sizeof(result), "not started");
+        else if (h.state == StopHook::RUN)
+            snprintf(result, sizeof(result), "still running");
+        else if (h.status == -1)
+            snprintf(result, sizeof(result), "cannot run");
+        else if (h.kills)
+            snprintf(result, sizeof(result), "killed, timeout %d s", h.timeout_s);
+        else if (WIFEXITED(h.status) && WEXITSTATUS(h.status) == 0)
+            snprintf(result, sizeof(result), "ok");
+        else if (WIFEXITED(h.status))
+            snprintf(result, sizeof(result), "exit %d", WEXITSTATUS(h.status));
+        else
+            snprintf(result, sizeof(result), "signal %d", WTERMSIG(h.status));
+        if (h.state != StopHook::WAIT)
+            fprintf(f, "iSwitchPi: stop hook %-24s +%6llu ms %6llu ms  %s\n", h.name,
+                    (unsigned long long)((h.start - t0) / MS),
+                    (unsigned long long)(((h.state == StopHook::DONE ? h.end : now_ns()) - h.start) / MS),
+                    result);
+        else
+            fprintf(f, "iSwitchPi: stop hook %-24s %s\n", h.name, result);
+        if (h.state == StopHook::DONE && h.end > last)
+            last = h.end;
+    }
+    fprintf(f, "iSwitchPi: %d stop hooks done %llu ms after the command\n",
+            n_, (unsigned long long)((last - t0) / MS));
+}
+
+// Prometheus text, see metrics.h: run time and result of every hook
+// that was started (a running one: so far)
+void StopHooks::metrics(FILE *f) const {
+    if (n_ == 0)
+        return;
+    fprintf(f, "# HELP iswitchpi_stop_hook_seconds Run time of a stop hook before halt/reboot.\n"
+               "# TYPE iswitchpi_stop_hook_seconds gauge\n");
+    for (int i = 0; i < n_; i++)
+        if (h_[i].state != StopHook::WAIT) {
+            fputs("iswitchpi_stop_hook_seconds{hook=", f);
+            metrics_label(f, h_[i].name);
+            fprintf(f, "} %.3f\n", ((h_[i].state == StopHook::DONE ? h_[i].end : now_ns()) - h_[i].start) / 1e9);
+        }
+    fprintf(f, "# HELP iswitchpi_stop_hook_ok 1 if a stop hook exited with 0 in time.\n"
+               "# TYPE iswitchpi_stop_hook_ok gauge\n");
+    for (int i = 0; i < n_; i++) {
+        const StopHook &h = h_[i];
+        fputs("iswitchpi_stop_hook_ok{hook=", f);
+        metrics_label(f, h.name);
+        fprintf(f, "} %d\n", h.state == StopHook::DONE && h.status != -1 && !h.kills
+                && WIFEXITED(h.status) && WEXITSTATUS(h.status) == 0);
+    }
+}
+//  End of Code
+//
@@ -0,0 +1,74 @@
+/* -----------------------------------------------------------------------
+ * Title: Stop hooks, run by iswitchpid before halt/reboot
+ * Every file in the hook directory (HOOK_DIR, iswitchpid -H) is a hook:
+ * - UNIT.service, UNIT.target, ...: a systemd unit, stopped with
+ *   systemctl stop; without systemd /etc/init.d/UNIT stop
+ * - any other executable file: run with halt or reboot as argument
+ * Optional lines in the file (the header of a script, anywhere in a
+ * unit file, which is not read otherwise):
+ *   # after: NAME ...      start only when these hooks are done
+ *                          (file names, the suffix may be left out)
+ *   # timeout: SECONDS     SIGTERM after this, SIGKILL HOOK_GRACE_MS later
+ *                          (default HOOK_TIMEOUT_S)
+ * Hooks without an order between them run at the same time. A hook
+ * that fails or runs out of time does not hold up the ones after it.
+ * Whatever still runs at the overall deadline is killed, and no hook is
+ * started after it. iswitchpid takes the deadline from the halt delay
+ * ISWITCHPI uses (15/30 s, iswitchpid -q set halt), less the time the
+ * rest of the shutdown needs.
+ * Dependency cycles are reported and started anyway.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _STOPHOOKS_H
+#define _STOPHOOKS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#define HOOK_DIR        "/etc/iswitchpi/stop.d"
+#define HOOK_TIMEOUT_S  10                  // per hook
+#define HOOK_GRACE_MS   1000                // SIGTERM to SIGKILL
+#define HOOKS_MAX       32
+#define HOOK_AFTER_MAX  8
+
+struct StopHook {
+    enum { WAIT, RUN, DONE };
+
+    char     name[64];                      // file name
+    char     prog[512];
+    char     arg[64];                       // unit, or empty: halt/reboot
+    bool     unit;                          // systemd unit or init script
+    char     after[HOOK_AFTER_MAX][64];     // names, as in the file
+    int      dep[HOOK_AFTER_MAX];           // resolved, -1: no such hook
+    int      nafter;
+    int      timeout_s;
+    int      state;
+    pid_t    pid;
+    uint64_t start, end;                    // ns, CLOCK_MONOTONIC
+    int      status;                        // of waitpid(), -1: not run
+    int      kills;                         // signals sent at the timeout
+};
+
+class StopHooks {
+public:
+    int  load(const char *dir);             // hooks found, -1: no directory
+    bool add(const char *path);             // one more, no order (the killjobs.sh of old)
+    void run(const char *what, uint64_t deadline);  // all, back by deadline (ns) at the latest
+    void report(FILE *f, uint64_t t0) const;        // one line per hook, times from t0
+    void metrics(FILE *f) const;            // Prometheus text, metrics.h
+    int  count() const { return n_; }
+
+private:
+    bool parse(StopHook &h, const char *path);
+    void resolve();
+    bool ready(const StopHook &h) const;
+    void start(StopHook &h, const char *what);
+    void reap();
+
+    StopHook h_[HOOKS_MAX];
+    int      n_ = 0;
+    bool     cycle_ = false;
+};
+
+#endif  // ifndef _STOPHOOKS_H
@@ -0,0 +1,171 @@
+/* -----------------------------------------------------------------------
+ *   Telemetry Decoder
+ *   Reads the record stream of an iSwitchPi built with make TELEMETRY=1
+ *   (../tiny44/telemetry.h) from a serial port and prints one line per
+ *   record, or one JSON object per line with -j.
+ *
+ *   Wiring: RX of a serial adapter (or of the Pi's UART) to TESTPIN,
+ *   GND to GND, TESTPIN DIP switch open. 1200 baud 8N1.
+ *
+ *   tmdecode [-j] [-r] [DEVICE]    DEVICE default /dev/ttyUSB0, - : stdin
+ *   -j      JSON lines
+ *   -r      raw register values as well
+ *   Records with a bad crc are skipped and counted, gaps in the sequence
+ *   number are reported as lost records.
+ * -----------------------------------------------------------------------*/
+
+#include <telemetry.h>
+#include <frame.h>                          // fr_crc8()
+#include <fsm.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TM_F_CPU        1000000             // F_CPU of ../tiny44/Makefile
+
+static const char *const ev_names[EVENTS] = {
+    "pi_alive", "pi_lost", "key_test", "key_short", "key_long",
+    "pi_down", "timeout", "auto_power", "recover", "vcc_low", "vcc_ok",
+    "key_double", "key_triple", "key_hold", "none"
+};
+
+// serial port raw at TM_BAUD, 8N1
+static int tty_open(const char *dev) {
+    struct termios t;
+    int fd = open(dev, O_RDONLY | O_NOCTTY | O_CLOEXEC);
+
+    if (fd < 0 || tcgetattr(fd, &t) < 0)
+        return -1;
+    cfmakeraw(&t);
+    t.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+    t.c_cflag |= CLOCAL | CREAD | CS8;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    cfsetispeed(&t, B1200);                 // TM_BAUD
+    cfsetospeed(&t, B1200);
+    if (tcsetattr(fd, TCSANOW, &t) < 0)
+        return -1;
+    tcflush(fd, TCIFLUSH);
+    return fd;
+}
+
+// square wave as programmed in Timer1: fast PWM, TOP = OCR1A
+static double t1_hz(const tm_rec &r) {
+    static const unsigned int prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+    unsigned int p = prescale[r.tccr1b & 7];
+    return p ? (double)TM_F_CPU / p / (r.ocr1a + 1) : 0;
+}
+
+static void print(const tm_rec &r, bool json, bool raw, unsigned long lost) {
+    char events[160] = "";
+    char when[32];
+    time_t now = time(nullptr);
+    double hz = t1_hz(r);
+
+    strftime(when, sizeof(when), "%T", localtime(&now));
+    for (int e = 0; e < EVENTS; e++)
+        if (r.events & 1 << e) {
+            if (*events)
+                strcat(events, json ? "\",\"" : ",");
+            strcat(events, ev_names[e]);
+        }
+    if (json) {
+        printf("{\"time\":%ld,\"seq\":%u,\"lost\":%lu,\"state\":%u,\"heartbeats\":%u,\"delay_left_s\":%u,"
+               "\"events\":[%s%s%s],\"inputs\":%u,\"square_hz\":%.2f,\"duty\":%.3f,"
+               "\"isr_max_us\":%u,\"loop_max_us\":%u",
+               (long)now, r.seq, lost, r.state, r.hb_count, r.delay_s,
+               *events ? "\"" : "", events, *events ? "\"" : "", r.inputs,
+               hz, hz > 0 ? (double)(r.ocr1b + 1) / (r.ocr1a + 1) : 0,
+               r.isr_max * TM_T0_US, r.loop_max * TM_T0_US);
+        if (raw)
+            printf(",\"tccr1a\":%u,\"tccr1b\":%u,\"ocr1a\":%u,\"ocr1b\":%u",
+                   r.tccr1a, r.tccr1b, r.ocr1a, r.ocr1b);
+        printf("}\n");
+    } else {
+        printf("%s  #%-3u state%u  hb %-3u left %3u s  isr %5u us  loop %6u us  square %.2f Hz",
+               when, r.seq, r.state, r.hb_count, r.delay_s,
+               r.isr_max * TM_T0_US, r.loop_max * TM_T0_US, hz);
+        if (raw)
+            printf("  T1 %02x %02x %u %u  in %04x",
+                   r.tccr1a, r.tccr1b, r.ocr1a, r.ocr1b, r.inputs);
+        if (*events)
+            printf("  %s", events);
+        if (lost)
+            printf("  (%lu lost)", lost);
+        printf("\n");
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-j] [-r] [DEVICE | -]   (default /dev/ttyUSB0)\n", name);
+}
+
+// Main starts here ---------------------------------------------
+//---------------------------------------------------------------
+int main(int argc, char **argv) {
+    const char *dev = "/dev/ttyUSB0";
+    bool json = false, raw = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jrh")) != -1) {
+        switch (opt) {
+        case 'j': json = true; break;
+        case 'r': raw = true; break;
+        default:  usage(argv[0]); return 2;
+        }
+    }
+    if (optind < argc)
+        dev = argv[optind];
+    int fd = strcmp(dev, "-") == 0 ? 0 : tty_open(dev);
+    if (fd < 0) {
+        fprintf(stderr, "tmdecode: %s: %s\n", dev, strerror(errno));
+        return 1;
+    }
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+
+    uint8_t buf[256];
+    size_t len = 0;
+    unsigned long records = 0, bad = 0;
+    uint8_t seq = 0;
+
+    for (;;) {
+        ssize_t n = read(fd, buf + len, sizeof(buf) - len);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        len += n;
+        size_t pos = 0;
+        while (len - pos >= sizeof(tm_rec)) {
+            const uint8_t *p = buf + pos;
+            uint8_t crc = 0;
+            if (p[0] != TM_SYNC) {          // resync byte by byte
+                pos++;
+                continue;
+            }
+            for (size_t i = 0; i < sizeof(tm_rec); i++)
+                crc = fr_crc8(crc, p[i]);
+            if (crc) {
+                bad++;
+                pos++;
+                continue;
+            }
+            tm_rec r;
+            memcpy(&r, p, sizeof(r));       // little endian, as on the ATtiny
+            pos += sizeof(r);
+            print(r, json, raw, records ? (uint8_t)(r.seq - seq - 1) : 0);
+            seq = r.seq;
+            records++;
+        }
+        memmove(buf, buf + pos, len - pos);
+        len -= pos;
+    }
+    fprintf(stderr, "tmdecode: %lu records, %lu bad\n", records, bad);
+    return 0;
+}
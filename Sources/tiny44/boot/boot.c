@@ -0,0 +1,260 @@
+/************************************************************************/
+/*  Bootloader: firmware update from the Pi over the FROMPI line        */
+/*                                                                      */
+/*  At FB_BOOT, reached through word 0 (reset) or by the firmware       */
+/*  after FR_UPDATE (boot_start()). Boot record in EEPROM, boot.h:      */
+/*  - VALID: jump to the firmware at once, MCUSR untouched, so a        */
+/*    watchdog reset is still a warm restart for it                     */
+/*  - REQUEST or an image that is not whole: stay, the Pi keeps (or     */
+/*    gets) its power, the led toggles on every good frame              */
+/*  - WAITING: the watchdog ran out before the first page, the old      */
+/*    firmware is still whole: VALID again and go to it                 */
+/*                                                                      */
+/*  Pages stream straight into the SPM page buffer as the bits come     */
+/*  in, no RAM buffer; a bad CRC-8 clears the buffer and NAKs. The      */
+/*  first page written makes the flag invalid, page 0 gets word 0       */
+/*  pointed at the bootloader and the firmware's own vector goes to     */
+/*  the boot record. DONE checks the CRC-16 of the whole image, then    */
+/*  VALID and a watchdog reset: the new firmware starts warm.           */
+/*  The watchdog (FB_WAIT_S) is fed by good frames only: a Pi that      */
+/*  stops halfway restarts the bootloader, which waits again.           */
+/*                                                                      */
+/*  Pulses timed by Timer0 at F_CPU / 8, polled, interrupts off.        */
+/*  No .data/.bss, no startup code (make boot): locals only.            */
+/************************************************************************/
+
+#include <hw.h>
+#include <frame.h>
+#include <boot.h>
+
+#define VPOWER          PINA1               // as iswitchpi.c
+#define FROMPI          PINA2
+#define LED1            PINA3
+
+#define BT_PRESCALE     8                   // Timer0 F_CPU / 8
+#define US_PER_COUNT    (BT_PRESCALE / (F_CPU / 1000000))
+#define CNT(us)         ((uint8_t)((us) / (FR_UNIT_US / FB_UNIT_US) / US_PER_COUNT))   // FR_W_xx at FB_UNIT_US
+#define WDT_WAIT        (1<<WDP3 | 1<<WDP0) // 8 s, FB_WAIT_S
+
+#if defined HOST_SIM
+#include <sim.h>
+#define POLL()          _delay_us(US_PER_COUNT)         // the host clock only moves in delays
+#define RUNNING()       (sim_wdt_reset() == SIM_NEVER)  // back to the caller at the reset
+struct boot_ee boot_ee EEMEM = { 0xffff, 0xff };
+#else
+#define POLL()
+#define RUNNING()       1
+#endif
+
+enum { B_ZERO, B_ONE, B_START, B_BAD };
+
+static void wdt_to(uint8_t wdtcsr) {
+    wdt_reset();
+    WDTCSR |= (1<<WDCE) | (1<<WDE);         // timed sequence, next write within 4 cycles
+    WDTCSR = wdtcsr;
+}
+
+//---------------------------------------------------------
+// next pulse: a bit, a start or nothing usable. idle: the low before
+// it may be as long as it likes (waiting for a frame)
+//
+static uint8_t rx_bit(uint8_t idle) {
+    uint8_t t0 = TCNT0, w = 0;
+
+    while (!(PINA & (1<<FROMPI))) {
+        POLL();
+        if (!RUNNING() || (!idle && (uint8_t)(TCNT0 - t0) > CNT(FR_LOW_MAX)))
+            return B_BAD;                   // frame lost
+    }
+    t0 = TCNT0;
+    while (PINA & (1<<FROMPI)) {
+        POLL();
+        if (w <= CNT(FR_W_START_MAX))
+            w = TCNT0 - t0;                 // longer: no frame, wait for its end
+        if (!RUNNING())
+            return B_BAD;
+    }
+    if (w < CNT(FR_W_MIN) || w > CNT(FR_W_START_MAX))
+        return B_BAD;
+    if (w < CNT(FR_W_ONE))
+        return B_ZERO;
+    return w < CNT(FR_W_START) ? B_ONE : B_START;
+}
+
+//---------------------------------------------------------
+// one boot frame from the Pi, returns its op (0: bad). FB_WRITE: the
+// page goes into the page buffer on the way, word 0 of page 0 is the
+// firmware's reset vector: *first, BOOT_VECTOR goes in instead
+//
+static uint8_t rx_frame(uint8_t *arg, uint16_t *first, uint16_t *crc16) {
+    uint8_t n, i, b = 0, bit, op = 0, len = 3, crc = 0;
+    uint16_t lo = 0, a;
+
+    while ((bit = rx_bit(1)) != B_START)
+        if (!RUNNING())
+            return 0;
+    for (n = 0; n < len; n++) {
+        for (i = 0; i < 8; i++) {
+            if ((bit = rx_bit(0)) > B_ONE)
+                return 0;
+            b = b << 1 | bit;
+        }
+        crc = fr_crc8(crc, b);
+        if (n == 0) {
+            op = b;
+            len = 3 + fb_len(op);
+        } else if (n == 1) {
+            *arg = b;
+        } else if (n == len - 1) {
+            break;
+        } else if (op == FB_DONE) {
+            *crc16 = *crc16 << 8 | b;
+        } else if (!(n & 1)) {              // FB_WRITE, low byte of a word
+            lo = b;
+        } else if (*arg < FB_PAGES) {
+            a = (uint16_t)*arg * FB_PAGE + n - 3;
+            if (a == 0) {
+                *first = lo | b << 8;
+                boot_page_fill(a, BOOT_VECTOR);
+            } else
+                boot_page_fill(a, lo | b << 8);
+        }
+    }
+    return crc == 0 ? op : 0;
+}
+
+//---------------------------------------------------------
+// answer: op, arg, crc. The line is only driven high, FR_RESP U after
+// the end of the frame from the Pi
+//
+static void units(uint8_t n) {
+    while (n--)
+        _delay_us(FB_UNIT_US);
+}
+
+static void tx_frame(uint8_t op, uint8_t arg) {
+    uint8_t buf[3], i;
+
+    buf[0] = op;
+    buf[1] = arg;
+    buf[2] = fr_crc8(fr_crc8(0, op), arg);
+    units(FR_RESP);
+    for (i = 0; i < 25; i++) {              // start and 24 bits
+        PORTA |= (1<<FROMPI);
+        DDRA |= (1<<FROMPI);
+        units(i == 0 ? FR_START : (buf[(i - 1) >> 3] & (0x80 >> ((i - 1) & 7))) ? FR_ONE : FR_ZERO);
+        DDRA &= ~(1<<FROMPI);
+        PORTA &= ~(1<<FROMPI);
+        units(FR_LOW);
+    }
+}
+
+// CRC-16 of the image as the Pi sent it: word 0 is the firmware's
+static uint16_t image_crc(uint8_t pages, uint16_t entry) {
+    uint16_t a, crc = 0xffff, first = BOOT_RJMP(0, entry * 2);
+
+    for (a = 0; a < (uint16_t)pages * FB_PAGE; a++)
+        crc = fb_crc16(crc, a < 2 ? (uint8_t)(first >> (a * 8)) : flash_byte(a));
+    return crc;
+}
+
+//---------------------------------------------------------
+// Function boot_main()
+//  returns the entry of a whole firmware, else runs the update until
+//  the watchdog resets
+//
+uint16_t boot_main(void) {
+    struct boot_ee ee;
+    uint16_t first = 0, crc16 = 0;
+    uint8_t op, arg = 0;
+
+    eeprom_read_block(&ee, BOOT_EE, sizeof(ee));
+    if (ee.flag == BOOT_WAITING) {          // nothing came, nothing lost
+        ee.flag = BOOT_VALID;
+        eeprom_update_block(&ee, BOOT_EE, sizeof(ee));
+    }
+    if (ee.flag == BOOT_VALID)
+        return ee.entry;
+    if (ee.flag == BOOT_REQUEST) {
+        ee.flag = BOOT_WAITING;
+        eeprom_update_block(&ee, BOOT_EE, sizeof(ee));
+    }
+
+    cli();
+    MCUSR &= ~(1<<WDRF);                    // else WDE stays forced on
+    wdt_to(1<<WDE | WDT_WAIT);
+    GIMSK = 0;                              // after FR_UPDATE the firmware's timers run
+    TIMSK0 = 0;
+    TIMSK1 = 0;
+    TCCR1B = 0;
+    TCCR1A = 0;
+    PORTA = 1<<VPOWER | 1<<LED1;            // the Pi needs its power for the update
+    DDRA = 1<<VPOWER | 1<<LED1;
+    TCCR0A = 1<<WGM01;                      // CTC at 0xff: free running 8 bit count
+    OCR0A = 0xff;
+    TCCR0B = 1<<CS01;                       // F_CPU / 8
+
+    while (RUNNING()) {
+        op = rx_frame(&arg, &first, &crc16);
+        if (!op) {
+            SPMCSR = 1<<CTPB;               // a half filled page buffer
+            continue;
+        }
+        wdt_reset();
+        PORTA ^= (1<<LED1);
+        switch (op) {
+        case FB_HELLO:
+            tx_frame(FB_READY, FB_PAGES);
+            break;
+
+        case FB_WRITE:
+            if (arg >= FB_PAGES || (arg == 0 && (first & 0xf000) != 0xc000)) {
+                SPMCSR = 1<<CTPB;           // bootloader itself, or no rjmp at word 0
+                tx_frame(FB_NAK, arg);
+                break;
+            }
+            ee.flag = 0xff;                 // from now on the old firmware is gone
+            if (arg == 0)
+                ee.entry = BOOT_TARGET(first);
+            eeprom_update_block(&ee, BOOT_EE, sizeof(ee));
+            boot_page_erase((uint16_t)arg * FB_PAGE);
+            boot_spm_busy_wait();
+            boot_page_write((uint16_t)arg * FB_PAGE);
+            boot_spm_busy_wait();
+            tx_frame(FB_ACK, arg);
+            break;
+
+        case FB_DONE:
+            if (arg == 0 || arg > FB_PAGES || image_crc(arg, ee.entry) != crc16) {
+                tx_frame(FB_NAK, arg);
+                break;
+            }
+            ee.flag = BOOT_VALID;
+            eeprom_update_block(&ee, BOOT_EE, sizeof(ee));
+            tx_frame(FB_ACK, arg);
+            wdt_to(1<<WDE);                 // 16 ms: the new firmware starts after a reset
+            while (RUNNING())
+                POLL();
+            break;
+        }
+    }
+    return ee.entry;
+}
+
+#if defined HOST_SIM
+void boot_start(void) {
+    boot_main();
+}
+#else
+//---------------------------------------------------------
+// at FB_BOOT: no vectors, no startup code. Stack below the firmware's
+// .noinit, a whole firmware is entered with its own reset vector
+//
+__attribute__((naked, section(".vectors"))) void boot_entry(void) {
+    asm volatile ("clr __zero_reg__");
+    SP = BOOT_SP;
+    ((void (*)(void))boot_main())();
+}
+#endif
+//  End of Code
+//
@@ -0,0 +1,48 @@
+/* -----------------------------------------------------------------------
+ * Title: Bootloader of the iSwitchPi, firmware update from the Pi
+ * Hardware: ATtiny44
+ * The top FLASHEND+1-FB_BOOT bytes of the flash, built on its own
+ * (make boot). The ATtiny44 has no boot section: the bootloader comes
+ * in through word 0, the reset vector, which it points at itself when
+ * page 0 of a new image is written. The firmware's own reset vector
+ * is kept in the boot record at the top of the EEPROM.
+ * Protocol: boot frames, see FR_UPDATE in frame.h. Details in boot.c
+ * -----------------------------------------------------------------------*/
+
+#ifndef _BOOT_H
+#define _BOOT_H
+
+#include <stdint.h>
+#include <frame.h>
+
+// rjmp at byte address 'from' to byte address 'to' (12 bit, the 4 KB wrap)
+#define BOOT_RJMP(from, to)     (0xc000 | ((((to) - (from)) / 2 - 1) & 0x0fff))
+#define BOOT_VECTOR             BOOT_RJMP(0, FB_BOOT)   // word 0 once the bootloader is in
+#define BOOT_TARGET(w)          ((1 + ((w) & 0x0fff)) & 0x07ff)    // rjmp at word 0: word it goes to
+
+// RAM the bootloader leaves alone: .noinit of the firmware is linked
+// there (warm restart state), the stack of both starts below it. NOINIT
+// in the Makefile, which checks that .data, .bss and a stack fit below
+#define BOOT_NOINIT             0x15c
+#define BOOT_SP                 (BOOT_NOINIT - 1)
+
+struct boot_ee {                            // top of the EEPROM, the firmware keeps out of it
+    uint16_t entry;                         // word address, the firmware's own reset vector
+    uint8_t  flag;                          // BOOT_xx, anything else: image not whole
+};
+
+#define BOOT_VALID      0xa5                // firmware whole: start it
+#define BOOT_REQUEST    0x5a                // FR_UPDATE: the bootloader takes over
+#define BOOT_WAITING    0x3c                // bootloader waits, no page written yet
+
+#if defined HOST_SIM
+extern struct boot_ee boot_ee;              // EEMEM, see boot.c
+#define BOOT_EE         (&boot_ee)
+uint16_t boot_main(void);                   // sim_boot(): reset vector, returns the entry
+void boot_start(void);                      // runs up to the watchdog reset of the bootloader
+#else
+#define BOOT_EE         ((struct boot_ee *)(E2END + 1 - sizeof(struct boot_ee)))
+#define boot_start()    ((void (*)(void))(FB_BOOT / 2))()   // no return
+#endif
+
+#endif  // ifndef _BOOT_H
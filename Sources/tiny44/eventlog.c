@@ -0,0 +1,227 @@
+/************************************************************************/
+/*  Event log and lifetime counters in EEPROM, make EVENTLOG=1          */
+/*                                                                      */
+/*  Every state change of the FSM is a record: time, cause (the event,  */
+/*  e.g. EV_PI_LOST in state3, EV_KEY_LONG in state5, EV_TIMEOUT in     */
+/*  state2) and the two states. Time is a clock of seconds counted by   */
+/*  the 10 ms tick, in standby by the watchdog, kept across resets.     */
+/*  (In standby the part of a watchdog period before a keypress is      */
+/*  lost, up to 2 s a time.)                                            */
+/*                                                                      */
+/*  Wear levelling:                                                     */
+/*  - the records go round a ring of EL_RECORDS. No index is stored:    */
+/*    the times only go up, the newest record is where they drop        */
+/*  - the counters have EL_SLOTS copies with a crc, each flush writes   */
+/*    the next one. The one with the latest clock is valid, a torn      */
+/*    write leaves the one before                                       */
+/*  Batched: records stay in RAM until the Pi is switched off, the      */
+/*  queue is full or at the hourly flush. Only changed bytes are        */
+/*  written (eeprom_update_block).                                      */
+/*  At 20 power cycles a day (5 records each) a record byte is written  */
+/*  4 times a day, a counter byte 11 times: 100000 writes last 25 years */
+/*                                                                      */
+/*  A mains failure loses the clock and the records since the last      */
+/*  flush. The time without power is not counted, the boot record       */
+/*  (MCUSR: power on, brown out, watchdog) marks it in the log.         */
+/*  So does a watchdog or brown-out reset, counted in resets: the       */
+/*  records in RAM are lost there too.                                  */
+/*                                                                      */
+/*  Functions are called by iswitchpi.c, never from an ISR except       */
+/*  el_clock(): the EEPROM registers are not shared with interrupts.    */
+/************************************************************************/
+
+#ifdef EVENTLOG
+
+#include <string.h>
+#include <hw.h>                             // EEPROM, interrupts (AVR or host sim)
+#include <eventlog.h>
+#include <fsm.h>                            // EV_PI_LOST
+
+#define EL_ERASED       0xffffffffUL
+
+struct el_rec ee_log[EL_RECORDS] EEMEM = { [0 ... EL_RECORDS - 1] = { EL_ERASED, 0xff, 0xff } };
+struct el_life ee_life[EL_SLOTS] EEMEM;
+
+static volatile uint32_t clock_s;           // the clock, seconds
+static uint16_t clock_ms;                   // and ms, counted in the ISRs
+static struct el_life life;                 // counters as of the last el_sync()
+static struct el_rec queue[EL_QUEUE];       // records not yet in EEPROM
+static uint8_t queued;
+static uint8_t head, count;                 // next record in the ring, records in it
+static uint8_t slot;                        // counters last written here
+static uint8_t pi_on;
+static uint32_t on_since;                   // clock at power on, or on time counted up to
+
+//---------------------------------------------------------
+// Function el_clock()
+//  Called by the tick (10 ms) and the standby watchdog
+//
+void el_clock(uint16_t ms) {
+    clock_ms += ms;
+    while (clock_ms >= 1000) {
+        clock_ms -= 1000;
+        clock_s++;
+    }
+}
+
+static uint32_t el_time(void) {
+    uint32_t t;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+        t = clock_s;
+    return t;
+}
+
+static uint8_t life_crc(const struct el_life *l) {
+    uint8_t i, crc = 0x5a;                  // all 0 or all 0xff: not valid
+    for (i = 0; i < sizeof(*l) - 1; i++)
+        crc = fr_crc8(crc, ((const uint8_t *)l)[i]);
+    return crc;
+}
+
+// counters up to now
+static void el_sync(void) {
+    life.clock = el_time();
+    if (pi_on) {
+        life.on += life.clock - on_since;
+        on_since = life.clock;
+    }
+    life.crc = life_crc(&life);
+}
+
+//---------------------------------------------------------
+// Function el_init()
+//  Newest counters and the end of the ring from EEPROM, clock goes on
+//  from the latest time found. mcusr: reset cause, for the boot record.
+//  on: warm restart with the Pi on, its on time goes on (no new cycle)
+//
+void el_init(uint8_t mcusr, uint8_t on) {
+    struct el_life l;
+    struct el_rec r;
+    uint32_t t = 0;
+    uint8_t i;
+
+    for (i = 0; i < EL_SLOTS; i++) {
+        eeprom_read_block(&l, &ee_life[i], sizeof(l));
+        if (l.crc == life_crc(&l) && l.clock >= life.clock) {
+            life = l;
+            slot = i;
+        }
+    }
+    for (i = 0; i < EL_RECORDS; i++) {
+        eeprom_read_block(&r, &ee_log[i], sizeof(r));
+        if (r.t == EL_ERASED || r.t < t)    // never written, or older: the ring ends here
+            break;
+        t = r.t;
+    }
+    head = i % EL_RECORDS;
+    count = (i < EL_RECORDS && r.t == EL_ERASED) ? i : EL_RECORDS;
+    if (t < life.clock)
+        t = life.clock;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+        clock_s = t;
+    life.boots++;
+    if (mcusr & (1<<WDRF | 1<<BORF))
+        life.resets++;
+    pi_on = on;
+    on_since = t;
+    el_log(EL_BOOT, mcusr);
+}
+
+//---------------------------------------------------------
+// Function el_log()
+//  One record, the queue goes to EEPROM when it is full
+//
+void el_log(uint8_t cause, uint8_t states) {
+    struct el_rec *q;
+
+    if (queued == EL_QUEUE)
+        el_flush();
+    q = &queue[queued];
+    q->t = el_time();
+    q->cause = cause;
+    q->states = states;
+    queued++;
+    if (cause == EV_PI_LOST)
+        life.lost++;
+}
+
+//---------------------------------------------------------
+// Function el_power()
+//  5 Volt to the Pi on or off: power cycles and on time
+//
+void el_power(uint8_t on) {
+    el_sync();
+    if (on && !pi_on) {
+        life.cycles++;
+        on_since = life.clock;
+    }
+    pi_on = on;
+}
+
+//---------------------------------------------------------
+// Function el_flush()
+//  Queued records into the ring, counters into the next slot.
+//  Takes 3.4 ms per byte that changed, interrupts stay on
+//
+void el_flush(void) {
+    uint8_t i;
+
+    for (i = 0; i < queued; i++) {
+        eeprom_update_block(&queue[i], &ee_log[head], sizeof(struct el_rec));
+        if (++head == EL_RECORDS)
+            head = 0;
+        if (count < EL_RECORDS)
+            count++;
+    }
+    queued = 0;
+    el_sync();
+    if (++slot == EL_SLOTS)
+        slot = 0;
+    eeprom_update_block(&life, &ee_life[slot], sizeof(life));
+}
+
+//---------------------------------------------------------
+// Function el_poll()
+//  Main loop, before the FSM: the Pi was switched off in the pass
+//  before (not in the same pass, the power goes off first), or the
+//  counters are an hour old
+//
+void el_poll(void) {
+    if ((queued && !pi_on) || el_time() - life.clock >= EL_FLUSH_S)
+        el_flush();
+}
+
+//---------------------------------------------------------
+// Function el_get()
+//  Answer to FR_LOG_GET: 3 bytes at part*3 of record n (0: newest,
+//  the queue first) or of the counters (n = FR_LOG_LIFE).
+//  Returns 1 if there is no such record
+//
+uint8_t el_get(uint8_t n, uint8_t part, uint8_t *buf) {
+    struct el_rec r;
+    const uint8_t *p = (const uint8_t *)&r;
+    uint8_t size = sizeof(r), i;
+
+    if (n == FR_LOG_LIFE) {
+        if (part == 0)                      // the Pi reads part 0 first: one snapshot
+            el_sync();
+        p = (const uint8_t *)&life;
+        size = sizeof(life);
+    }
+    else if (n < queued)
+        r = queue[queued - 1 - n];
+    else if ((uint8_t)(n - queued) < count)
+        eeprom_read_block(&r, &ee_log[(head + EL_RECORDS - 1 - (n - queued)) % EL_RECORDS], sizeof(r));
+    else
+        return 1;
+    if (part >= (size + 2) / 3)
+        return 1;
+    part *= 3;
+    for (i = 0; i < 3; i++, part++)
+        buf[i] = part < size ? p[part] : 0;
+    return 0;
+}
+
+#endif  // ifdef EVENTLOG
+//  End of Code
+//
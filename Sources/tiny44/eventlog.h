@@ -0,0 +1,59 @@
+/* -----------------------------------------------------------------------
+ * Title: Event log and lifetime counters in EEPROM
+ * Hardware: ATtiny44
+ * Every state change of the FSM with its cause and time, and counters
+ * over the whole life of the board. Read by the Pi with FR_LOG_GET
+ * (iswitchpid -q log), layout see frame.h. Details in eventlog.c
+ * Only with make EVENTLOG=1, else the functions below do nothing.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _EVENTLOG_H
+#define _EVENTLOG_H
+
+#include <stdint.h>
+#include <frame.h>
+
+#define EL_RECORDS      24                  // ring in EEPROM
+#define EL_SLOTS        4                   // copies of the counters, written in turn
+#define EL_QUEUE        4                   // records in RAM until the next flush
+#define EL_FLUSH_S      3600                // counters to EEPROM at least every hour
+#define EL_BOOT         FR_LOG_BOOT         // cause: MCU started, states = MCUSR
+
+struct el_rec {
+    uint32_t t;                             // clock, s; 0xffffffff: never written
+    uint8_t  cause;                         // EV_xx (fsm.h) or EL_BOOT
+    uint8_t  states;                        // from << 4 | to
+} __attribute__((packed));
+
+struct el_life {
+    uint32_t clock;                         // s iSwitchPi had power
+    uint32_t on;                            // s the Pi had power
+    uint16_t boots;                         // MCU resets
+    uint16_t cycles;                        // Pi switched on
+    uint16_t lost;                          // heartbeat losses (EV_PI_LOST)
+    uint16_t resets;                        // watchdog and brown-out resets
+    uint8_t  crc;
+} __attribute__((packed));
+
+_Static_assert(sizeof(struct el_rec) == FR_LOG_REC, "LOG record, see frame.h");
+_Static_assert(sizeof(struct el_life) == FR_LOG_LIFE_LEN, "LOG counters, see frame.h");
+
+#ifdef EVENTLOG
+void el_init(uint8_t mcusr, uint8_t on);    // from EEPROM, logs the boot; on: the Pi kept its power
+void el_clock(uint16_t ms);                 // ISRs: time has passed
+void el_log(uint8_t cause, uint8_t states); // one record, in RAM until el_flush()
+void el_power(uint8_t on);                  // 5 Volt to the Pi switched
+void el_flush(void);                        // records and counters to EEPROM
+void el_poll(void);                         // main loop: flush when due
+uint8_t el_get(uint8_t n, uint8_t part, uint8_t *buf);  // FR_LOG answer, 1: no such record
+#else                                       // built without make EVENTLOG=1: nothing logged
+static inline void el_init(uint8_t mcusr, uint8_t on) {}
+static inline void el_clock(uint16_t ms) {}
+static inline void el_log(uint8_t cause, uint8_t states) {}
+static inline void el_power(uint8_t on) {}
+static inline void el_flush(void) {}
+static inline void el_poll(void) {}
+static inline uint8_t el_get(uint8_t n, uint8_t part, uint8_t *buf) { return 1; }  // FR_LOG_GET: NAK
+#endif
+
+#endif  // ifndef _EVENTLOG_H
@@ -0,0 +1,203 @@
+/* -----------------------------------------------------------------------
+ * Title: Framed single-wire protocol on the FROMPI line
+ * Shared by the firmware (iswitchpi.c), the host simulation (sim/simpi.c)
+ * and the Pi daemon (Sources/cpp), plain C, no hardware access.
+ *
+ * The line has an external pulldown. Both sides only ever drive it high
+ * and release it (input) for low, so the two outputs can never fight.
+ * Bits are pulse widths, unit FR_UNIT_US:
+ *
+ *   start  ____|~~~~~~~~~~~~~~~~|____          4U high, 1U low
+ *   0      ____|~~~~|____                      1U high, 1U low
+ *   1      ____|~~~~~~~~|____                  2U high, 1U low
+ *
+ * A frame is: start, header byte, 0..3 payload bytes, CRC-8, each byte
+ * MSB first. The frame ends with the falling edge of its last bit, the
+ * length is in the header. CRC-8 polynomial 0x07, init 0, over header
+ * and payload (same as _crc8_ccitt_update() of avr-libc).
+ *
+ * Turn-taking: a side may start a frame once the line has been low for
+ * FR_IDLE. The Pi sends heartbeats and requests, iSwitchPi answers each
+ * within FR_REPLY_MS. iSwitchPi sends HALT/REBOOT on its own, the Pi
+ * answers with ACK. A frame without answer is sent again, so a rare
+ * collision costs one retry.
+ *
+ * 50 ms heartbeat pulses (iswitchpi.py) and 80 ms command pulses of the
+ * old protocol are much wider than any frame pulse and still understood.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _FRAME_H
+#define _FRAME_H
+
+#include <stdint.h>
+
+#define FR_UNIT_US      1000                // U, one time unit on the line
+#define FR_START        4                   // pulse widths and gaps, U
+#define FR_ZERO         1
+#define FR_ONE          2
+#define FR_LOW          1
+#define FR_RESP         2                   // gap before an answer
+#define FR_IDLE         5                   // line low this long: free to send
+#define FR_REPLY_MS     150                 // answer must be complete by then
+#define FR_RETRIES      3                   // frames sent before giving up
+
+// receiver: pulse width classes (us), see fr_pulse()
+#define FR_W_MIN        400                 // shorter: glitch
+#define FR_W_ONE        1500                // 0 below, 1 above
+#define FR_W_START      3000                // start pulse
+#define FR_W_START_MAX  6000
+#define FR_LOW_MAX      3000                // longer low inside a frame: frame lost
+
+// header byte: opcode in bits 7..2, payload length in bits 1..0
+#define FR_HEADER(op, len)  ((uint8_t)((op) << 2 | (len)))
+#define FR_OP(h)            ((h) >> 2)
+#define FR_LEN(h)           ((h) & 3)
+#define FR_MAX              5               // header, 3 payload, crc
+
+enum {                                      // opcodes
+    FR_HEARTBEAT = 1,                       // Pi:  seq                  -> ACK
+    FR_STATUS_GET,                          // Pi:                       -> STATUS
+    FR_CONFIG_GET,                          // Pi:  key                  -> CONFIG / NAK
+    FR_CONFIG_SET,                          // Pi:  key, value           -> CONFIG / NAK
+    FR_DOWN,                                // Pi:  shutdown complete, cut the power -> ACK
+    FR_SQUARE_GET,                          // Pi:                       -> SQUARE
+    FR_SQUARE_SET,                          // Pi:  dHz hi, dHz lo, duty -> SQUARE / NAK
+    FR_HALT = 8,                            // iSwitchPi: halt the Pi    -> ACK
+    FR_REBOOT,                              // iSwitchPi: reboot the Pi  -> ACK
+    FR_LOG_GET,                             // Pi:  n, part              -> LOG / NAK
+    FR_UPDATE,                              // Pi:  FR_UPDATE_KEY hi, lo -> ACK, then the bootloader
+    FR_ACK = 16,                            // op acknowledged, seq (or 0)
+    FR_NAK,                                 // op refused
+    FR_STATUS,                              // state, FR_ST_xx flags, heartbeats in a row
+    FR_CONFIG,                              // key, value
+    FR_SQUARE,                              // dHz hi, dHz lo, duty | FR_SQ_PI
+    FR_LOG                                  // 3 bytes of a log record or the counters
+};
+
+// STATUS flags: DIP switches and outputs of iSwitchPi
+#define FR_ST_VPOWER    0x01                // 5 Volt to the Pi on
+#define FR_ST_SHORT     0x02                // DELAYTIME: short delays
+#define FR_ST_SQUARE    0x04                // square wave switch on
+#define FR_ST_AUTO      0x08                // auto power on after power failure
+#define FR_ST_FREQ      0x30                // frequency DIP switches PB1, PB2
+
+// SQUARE: square wave on PA5, frequency in 0.1 Hz (dHz), duty in %.
+// SET with dHz 0: back to the DIP switches, duty 0: off
+#define FR_SQ_PI        0x80                // duty byte: set by the Pi, not the DIP switches
+
+// LOG: event log and lifetime counters in the EEPROM of iSwitchPi, see
+// eventlog.h. LOG_GET n, part answers bytes part*3 .. part*3+2 of
+//   n < FR_LOG_LIFE: record n, 0 is the newest, FR_LOG_REC bytes:
+//     time (clock, s, 4 bytes), cause, from state << 4 | to state
+//   n = FR_LOG_LIFE: the counters, FR_LOG_LIFE_LEN bytes: clock (s, 4),
+//     Pi on time (s, 4), MCU boots, Pi power cycles, heartbeat losses,
+//     watchdog and brown-out resets (2 bytes each), crc
+// little endian, as kept in EEPROM. NAK: no such record (end of the log).
+// The clock counts seconds iSwitchPi had power, since it was new.
+// cause: the FSM event of the transition (EV_xx, fsm.h) or FR_LOG_BOOT,
+// iSwitchPi started: the state byte holds MCUSR then (reset cause)
+#define FR_LOG_LIFE     0xff
+#define FR_LOG_REC      6
+#define FR_LOG_LIFE_LEN 17
+#define FR_LOG_BOOT     0x10
+
+// UPDATE: firmware update over this line. UPDATE with FR_UPDATE_KEY is
+// ACKed, then iSwitchPi jumps into its bootloader (boot/boot.c). It takes
+// the new image in boot frames: the same pulses and CRC-8 at FB_UNIT_US,
+// no header byte but op, arg, fb_len(op) data bytes, crc.
+//   Pi: FB_HELLO                     -> FB_READY, arg: pages an image may have
+//   Pi: FB_WRITE n, FB_PAGE bytes    -> FB_ACK n: page n written / FB_NAK n
+//   Pi: FB_DONE n, crc16 hi, lo      -> FB_ACK n: pages 0..n-1 check out, the
+//                                       new firmware starts / FB_NAK n
+// crc16: fb_crc16() from 0xffff over the n pages as sent. Each frame is
+// sent again until its answer comes (FB_REPLY_MS after the frame's end,
+// FB_DONE_MS for DONE, at most FB_TRIES times). The bootloader waits
+// for the next one FB_WAIT_S at most: with the old firmware still whole
+// (no page written yet) it goes back to it, else it starts over.
+#define FR_UPDATE_KEY   0x1d5a              // no update by a stray frame
+#define FB_UNIT_US      100                 // U of the boot frames
+#define FB_PAGE         64                  // bytes, SPM_PAGESIZE of the ATtiny44
+#define FB_BOOT         0x0e00              // bootloader, the image ends below it
+#define FB_PAGES        (FB_BOOT / FB_PAGE)
+#define FB_MAX          (FB_PAGE + 3)       // op, arg, page, crc
+#define FB_REPLY_MS     50                  // a page write takes ~9 ms
+#define FB_DONE_MS      600                 // DONE: the CRC-16 over 3.5 KB takes ~0.3 s at 1 MHz
+#define FB_TRIES        10                  // boot frames sent before giving up
+#define FB_WAIT_S       8                   // watchdog of the bootloader
+
+enum { FB_HELLO = 1, FB_WRITE, FB_DONE, FB_READY, FB_ACK, FB_NAK };
+
+enum {                                      // CONFIG keys
+    FR_CFG_POWERON,                         // s, state2: wait for the Pi to come up
+    FR_CFG_HALT,                            // s, state5: power off delay after halt
+    FR_CFG_REBOOT,                          // s, state5: power off delay after reboot
+    FR_CFG_RECOVER,                         // power cycles of a lost Pi, 0: off (kept in EEPROM)
+    FR_CFG_VCC,                             // 0.1 V, supply low: halt the Pi, 0: off (kept in EEPROM)
+    FR_CFG_MISSED,                          // heartbeats missed: Pi lost (kept in EEPROM)
+    FR_CFG_CLICK,                           // 0.1 s, key up: the next press is the same gesture (EEPROM)
+    FR_CFG_LONG,                            // 0.1 s, key down: long press (EEPROM)
+    FR_CFG_HOLD,                            // 0.1 s, key down: hold, halt at once / TESTMODE (EEPROM)
+    FR_CFG_KEYS                             // value 0: back to the DIP switch default
+};
+
+// pulse width classes returned by fr_pulse()
+enum { FR_P_GLITCH, FR_P_ZERO, FR_P_ONE, FR_P_START, FR_P_LONG };
+
+static inline uint8_t fr_pulse(uint32_t us) {
+    if (us < FR_W_MIN)       return FR_P_GLITCH;
+    if (us < FR_W_ONE)       return FR_P_ZERO;
+    if (us < FR_W_START)     return FR_P_ONE;
+    if (us <= FR_W_START_MAX) return FR_P_START;
+    return FR_P_LONG;                       // heartbeat or command of the old protocol
+}
+
+// boot frames: the same classes at FB_UNIT_US
+static inline uint8_t fb_pulse(uint32_t us) {
+    return fr_pulse(us * (FR_UNIT_US / FB_UNIT_US));
+}
+
+// data bytes of a boot frame
+static inline uint8_t fb_len(uint8_t op) {
+    return op == FB_WRITE ? FB_PAGE : op == FB_DONE ? 2 : 0;
+}
+
+static inline uint8_t fr_crc8(uint8_t crc, uint8_t data) {
+    uint8_t i;
+    crc ^= data;
+    for (i = 0; i < 8; i++)
+        crc = (crc & 0x80) ? (uint8_t)(crc << 1 ^ 0x07) : (uint8_t)(crc << 1);
+    return crc;
+}
+
+// CRC-16/CCITT, polynomial 0x1021, MSB first
+static inline uint16_t fb_crc16(uint16_t crc, uint8_t data) {
+    uint8_t i;
+    crc ^= (uint16_t)data << 8;
+    for (i = 0; i < 8; i++)
+        crc = (crc & 0x8000) ? (uint16_t)(crc << 1 ^ 0x1021) : (uint16_t)(crc << 1);
+    return crc;
+}
+
+// frame into buf (FR_MAX bytes), returns its length in bytes
+static inline uint8_t fr_build(uint8_t *buf, uint8_t op, const uint8_t *data, uint8_t len) {
+    uint8_t i, crc;
+    buf[0] = FR_HEADER(op, len);
+    for (i = 0; i < len; i++)
+        buf[1 + i] = data[i];
+    for (i = crc = 0; i <= len; i++)
+        crc = fr_crc8(crc, buf[i]);
+    buf[1 + len] = crc;
+    return len + 2;
+}
+
+// complete frame in buf: header, payload and crc check out
+static inline uint8_t fr_valid(const uint8_t *buf, uint8_t n) {
+    uint8_t i, crc = 0;
+    if (n < 2 || n != FR_LEN(buf[0]) + 2)
+        return 0;
+    for (i = 0; i < n; i++)
+        crc = fr_crc8(crc, buf[i]);
+    return crc == 0;
+}
+
+#endif  // ifndef _FRAME_H
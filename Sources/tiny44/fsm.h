@@ -0,0 +1,94 @@
+/* -----------------------------------------------------------------------
+ * Title: Table driven Finite State Machine of the iSwitchPi
+ * Hardware: ATtiny44
+ *
+ * States, events and actions shared by iswitchpi.c (which holds the
+ * tables in flash) and tools/fsmdot.c (which draws the state diagram
+ * from the very same tables).
+ *
+ * Transition table fsm_table[state][event], one byte each:
+ *   high nibble: action run on the transition (A_xx)
+ *   low nibble:  next state + 1, S_STAY: no state change
+ *   0x00 means: event is not handled in this state (any T() is not 0)
+ * State tables: fsm_actions[state][] entry action, exit action, action
+ *   run on every pass of the main loop, one byte each; fsm_events[state]
+ *   the events handled (bitmask, without EV_NONE: that one is taken
+ *   wherever the table has it), a 16 bit word, they no longer fit a byte.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _FSM_H
+#define _FSM_H
+
+enum {
+    state0,                                 // initial state, power on of the MCU
+    state1,                                 // standby, Pi off
+    state2,                                 // tentative power on, waiting for Pi
+    state3,                                 // power on, regular operation
+    state4,                                 // power on, Pi not checked
+    state5,                                 // power off sequence
+    state6,                                 // last chance, check Pi again
+    state7,                                 // TESTMODE
+    state8,                                 // recovery: Pi off for the backoff time
+    state9,                                 // supply low: Pi off until it recovers
+    STATES
+};
+#define S_STAY          0x0e                // next state: stay in this state
+
+enum {                                      // events, highest priority first
+                                            // (EV_RECOVER came later: it is checked
+                                            // before EV_TIMEOUT, EV_VCC_xx right after
+                                            // EV_PI_LOST, the other keys with EV_KEY_SHORT,
+                                            // numbers are in the log)
+    EV_PI_ALIVE,                            // heartbeats from the Pi (hb_count >= HB_ALIVE)
+    EV_PI_LOST,                             // FR_CFG_MISSED heartbeats missed
+    EV_KEY_TEST,                            // short keypress with TESTPIN low
+    EV_KEY_SHORT,                           // click, see key_gesture()
+    EV_KEY_LONG,                            // keypress longer than FR_CFG_LONG
+    EV_PI_DOWN,                             // Pi reports shutdown complete (poweroff-ready)
+    EV_TIMEOUT,                             // TMR_DELAY expired (timer.c), delay of the state
+    EV_AUTO_POWER,                          // DIP switch auto power on
+    EV_RECOVER,                             // Pi lost or not up in time: power cycle it
+    EV_VCC_LOW,                             // supply below FR_CFG_VCC (vcc.c)
+    EV_VCC_OK,                              // supply VCC_HYST_MV above it again
+    EV_KEY_DOUBLE,                          // two clicks, the 2nd press within FR_CFG_CLICK
+    EV_KEY_TRIPLE,                          // three
+    EV_KEY_HOLD,                            // key down FR_CFG_HOLD
+    EV_NONE,                                // nothing of the above happened
+    EVENTS
+};
+#define EV(e)           (1<<(e))
+
+enum {                                      // actions, 0..15 for transitions
+    A_NONE,
+    A_HALT,                                 // send halt, power off delay for halt
+    A_REBOOT,                               // send reboot, power off delay for reboot
+    A_LOST,                                 // Pi gone, power off delay for halt
+    A_HALT_NOW,                             // send halt without waiting for a heartbeat
+    A_TESTBLINK,                            // blink orange led
+    A_LEARN,                                // measured delay ends: calibration to EEPROM
+    A_SQUARE,                               // square wave on/off by the key
+    A_INIT,                                 // entry state0
+    A_STANDBY,                              // entry state1
+    A_WAKE,                                 // exit state1
+    A_POWERON,                              // entry state2
+    A_BLINKOFF,                             // exit state2, state5
+    A_RUN,                                  // entry state3, state4
+    A_POWEROFF,                             // entry state5
+    A_CHECK,                                // entry state6
+    A_TEST,                                 // entry state7
+    A_CYCLE,                                // entry state8
+    A_PWM,                                  // every pass: square wave DIP switches
+    A_SLEEP,                                // every pass: tickless standby
+    ACTIONS
+};
+
+#define T(action, next) ((action)<<4 | ((next) + 1))
+#define T_ACTION(t)     ((t) >> 4)
+#define T_NEXT(t)       (((t) & 0x0f) - 1)
+
+#define F_ENTRY         0                   // index into fsm_actions[state][]
+#define F_EXIT          1
+#define F_DO            2
+#define F_ACTIONS       3
+
+#endif  // ifndef _FSM_H
@@ -0,0 +1,33 @@
+/* -----------------------------------------------------------------------
+ * Title: Hardware layer for the iSwitchPi firmware
+ * Hardware: ATtiny44
+ *
+ * All register access, delays, interrupt control and ISR definitions go
+ * through this header.
+ * On the ATtiny44 it simply pulls in the avr-libc headers.
+ * With -DHOST_SIM (make sim) the same names are provided by the host
+ * backend in sim/, driven by a virtual clock.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _HW_H
+#define _HW_H
+
+#if defined HOST_SIM
+#include <hw_host.h>                        // host backend, see sim/hw_host.h
+#else
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <avr/pgmspace.h>
+#include <avr/eeprom.h>
+#include <avr/wdt.h>
+#include <avr/boot.h>                       // self-programming, boot/boot.c
+#include <util/atomic.h>
+#include <util/delay.h>
+#define NOINIT  __attribute__((section(".noinit")))    // not cleared by the startup code
+#define flash_byte(a)   pgm_read_byte((const uint8_t *)(a))     // flash by byte address
+#endif
+
+#include <stdint.h>
+
+#endif  // ifndef _HW_H
@@ -3,6 +3,7 @@
 /*	Intelligent Power Switch for Raspberry Pi                           */
 /*  																    */
 /*	Implements Finite State Machine   with 7 States 	                */
+/*	table driven, tables in flash, see fsm.h and fsm_table[]            */
 /*	Pulsegeneration is done in square.c  [ functions pwm_xx() ]         */
 /* 									                                    */
 /*	See project description for full details				            */
@@ -20,6 +21,25 @@
 /*                                                                      */
 /*	Uses Timer0 for debouncing pushbutton and Timer1 for generation     */
 /*  of square wave on Pin PA5  (Fast PWM mode)   						*/
+/*  Timer0 compare B times the frames to the Pi, see frame.h            */
+/*  make TELEMETRY=1: a record stream on TESTPIN, see telemetry.h       */
+/*  Delays and blinking run on the ms clock and timers of timer.c       */
+/*  Recovery mode (FR_CFG_RECOVER): a hung Pi is power cycled, state8   */
+/*  In standby (state1) Timer0 is stopped and the MCU sleeps in         */
+/*  power-down, woken by the watchdog (led blink) or a pin change       */
+/*  on the pushbutton.                                                  */
+/*  The watchdog also resets a hung MCU: state and VPOWER are kept in   */
+/*  .noinit RAM, after a watchdog or brown-out reset the FSM goes on    */
+/*  where it was and the Pi keeps its power, see warm_state()           */
+/*  FR_UPDATE hands over to the bootloader in boot/: a new firmware     */
+/*  from the Pi, started warm as well                                   */
+/*  Key gestures on top of the debounce: click, double and triple       */
+/*  click, long press, hold, see key_gesture()                          */
+/*  Not all of it fits the flash below the bootloader: event log,       */
+/*  calibration, recovery, supply voltage, config by the Pi, the        */
+/*  gestures beyond click and long press, the square wave set by the    */
+/*  Pi are build options, see the Makefile. TESTMODE is one as well,    */
+/*  on by default                                                       */
 /*											                            */
 /* 	Includes Debouncing 8 Keys with Repeat Function by Peter Dannegger  */
 /* 	Found here:  http://www.mikrocontroller.net/topic/48465             */
@@ -36,11 +56,17 @@
 //  Datum: 16.06.2010 22:28
 //------------------------------------------------------------------------
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <util/atomic.h>
-#include <util/delay.h>
+#include <string.h>
+#include <hw.h>                             // registers, delays, interrupts (AVR or host sim)
+#include <iswitchpi.h>
+#include <fsm.h>                            // states, events and actions of the FSM
+#include <frame.h>                          // framed protocol on the line to the Pi
 #include <square.h>                         // pwm functions for pulse generation
+#include <eventlog.h>                       // event log and lifetime counters in EEPROM
+#include <telemetry.h>                      // record stream on TESTPIN (make TELEMETRY=1)
+#include <timer.h>                          // ms clock and software timers
+#include <vcc.h>                            // supply voltage by the ADC bandgap
+#include <boot.h>                           // bootloader, firmware update from the Pi
 
 // define VERSION if board iswitchpi Version 1
 //#define VERSION1
@@ -65,9 +91,16 @@
 #endif                                       // used in square.c
                                             // square wave output on  PINA5
 // definitions for Debounce Code
-#define REPEAT_MASK     (1<<KEY0)           // repeat: key0
-#define REPEAT_START    100                 // after 1000ms
-#define REPEAT_NEXT     20                  // every 200ms
+#define KEY_CLICK       3                   // 0.1 s, next press of a double click (FR_CFG_CLICK default)
+#define KEY_LONG        10                  // 0.1 s, long press (FR_CFG_LONG default)
+#define KEY_HOLD        50                  // 0.1 s, hold (FR_CFG_HOLD default)
+#if defined TELEMETRY || !defined TESTMODE  // TESTPIN is the telemetry output, or not used
+#define IN_MASK         (IN_A(KEY0) | IN_A(DELAYTIME) | IN_A(SQUARE) \
+                         | IN_B(AUTO_POWER) | IN_B(PINB1) | IN_B(PINB2))
+#else
+#define IN_MASK         (IN_A(KEY0) | IN_A(TESTPIN) | IN_A(DELAYTIME) | IN_A(SQUARE) \
+                         | IN_B(AUTO_POWER) | IN_B(PINB1) | IN_B(PINB2))
+#endif
 // definitions for Debounce Code
 
 #define POWEROFF_Delay_HALT_long     30           // seconds  (use 20 for test)
@@ -76,85 +109,201 @@
 #define POWEROFF_Delay_REBOOT_long   50           // seconds  (use 20 for test)
 #define POWEROFF_Delay_REBOOT_short  20           // seconds  (use 20 for test)
 
-#define PULSCHECK               4           // 10 times 10 ms intervall check pulses from Pi
-#define PULSCHECK_SECONDS       6           // ccount pulses from Pi during this time
+// Line to the Pi: every edge on FROMPI is timestamped by the pin change
+// interrupt and each pulse classified on its falling edge, see ISR(PCINT0_vect).
+// Timestamps count Timer0 clocks (F_CPU/64, 64 us), TICK_COUNTS of them
+// make one 10 ms tick (timer.h). Frames go out bit by bit from Timer0 compare B.
+#define US_PER_COUNT    (T0_PRESCALE / (F_CPU / 1000000))
+#define US2COUNTS(us)   ((uint16_t)((us) / US_PER_COUNT))
+#define MS2COUNTS(ms)   US2COUNTS((ms) * 1000UL)
+#define FR_COUNTS       ((FR_UNIT_US + US_PER_COUNT / 2) / US_PER_COUNT)   // one U of the protocol
+#define HB_WIDTH_MIN    10                  // ms, shorter is a glitch (Pi sends 50 ms)
+#define HB_WIDTH_MAX    250                 // ms, longer is not a heartbeat
+#define HB_PERIOD_MAX   3000                // ms, heartbeats further apart do not count as a row
+#define HB_ALIVE        3                   // heartbeats in a row: Pi alive, two periods
+#define HB_MISSED       2                   // heartbeats missed: Pi lost (FR_CFG_MISSED default)
+#define RX_NONE         0xff                // rx_bits: no frame coming in
 
 #define POWERON_Delay_long      50          // seconds (use 20 for test)
 #define POWERON_Delay_short     20          // seconds (use 20 for test)
 
-#define POWERON_Blink_int  15               // 15 x 10 ms
-#define POWEROFF_Blink_int 60               // 60 x 10 ms
+// Calibrated delays (EEPROM), see cal_learn()
+#define CAL_SAMPLES     3                   // measurements before the calibration is used
+#define CAL_NONE        0xff                // cal_key: nothing measured
+#define CAL_KEYS        (FR_CFG_REBOOT + 1) // the delays, FR_CFG_POWERON .. FR_CFG_REBOOT
+#define CFG_EE          FR_CFG_RECOVER      // this key and the ones after it are kept in EEPROM
+#if defined RECOVER || defined VCC
+#define CFG_EEPROM                          // only needed for these, see cfg_load()
+#endif
+// config keys of the build options left out (Makefile): NAK
+#if defined RECOVER
+#define CFG_NO_RECOVER  0
+#else
+#define CFG_NO_RECOVER  (1<<FR_CFG_RECOVER)
+#endif
+#if defined VCC
+#define CFG_NO_VCC      0
+#else
+#define CFG_NO_VCC      (1<<FR_CFG_VCC)
+#endif
+#if defined GESTURES
+#define CFG_NO_GESTURES 0
+#else
+#define CFG_NO_GESTURES (1<<FR_CFG_CLICK | 1<<FR_CFG_HOLD)
+#endif
+#define CFG_NONE(key)   ((uint16_t)(CFG_NO_RECOVER | CFG_NO_VCC | CFG_NO_GESTURES) >> (key) & 1)
+
+// Recovery of a hung Pi, see rec_due()
+#define REC_OFF_S       5                   // seconds without power, doubled on every try
+#define REC_OFF_MAX_S   240                 // up to this
+#define REC_STABLE_MS   600000UL            // Pi up this long: the next loss starts from REC_OFF_S
+
+#define POWERON_Blink_int  150              // ms, TMR_BLINK
+#define POWEROFF_Blink_int 600              // ms
+#define RECOVER_Blink_int  1200             // ms, state8
 #define TESTMODE_Blink_int 300              // 200 ms
+#if defined TESTMODE
+#define EV_TESTMODE         (EV(EV_KEY_TEST) | EV(EV_KEY_HOLD))   // state1: jumper, or the key held
+#else
+#define EV_TESTMODE         0
+#endif
 #define REGULAR_Blink       1
-#define PULSED_Blink        2
-#define STANDBY_Blink_int_on   3
-#define STANDBY_Blink_int_off  250          // can be max 255
+#define PULSED_Blink        2               // standby, done by the watchdog (WDT_vect)
+#define STANDBY_Blink_on    (1<<WDP0)                       // watchdog 32 ms led on
+#define STANDBY_Blink_off   (1<<WDP2 | 1<<WDP1 | 1<<WDP0)   // watchdog 2 s led off
+#define WDT_RUN             (1<<WDP2 | 1<<WDP1)             // watchdog 1 s reset, tick running
 
 #define PULSELENGTH1  80                    // Signal to PI , ms
 #define PULSELENGTH2  500                    // Signal to PI , ms
+#define PULSELEAD     100                   // give the Pi time to set up its IR Handler, ms
 
-#define STAT0_FIRST     0                      // bit Position für First Time Switch
-#define STAT1_FIRST     1                      // bit Position für First Time Switch
-#define STAT2_FIRST     2                      // bit Position für First Time Switch
-#define STAT3_FIRST     3                      // bit Position für First Time Switch
-#define STAT4_FIRST     4                      // bit Position für First Time Switch
-#define STAT5_FIRST     5                      // bit Position für First Time Switch
-#define STAT6_FIRST     6                      // bit Position für First Time Switch
-#define STAT7_FIRST     7                      // bit Position für First Time Switch
-
-static unsigned char sekunde;
-static unsigned char sekunde2;
-
-static unsigned char tick;				// tick Timer 0
-static unsigned char tick2;				// tick Timer 0
-static unsigned char tick3;				// tick Timer 0
-uint8_t blinkint;                           // blink intervall
-uint8_t blinkwhat;                          // blink intervall
-uint8_t blinkon;                            // blink ON=1  (Standby blink only
-uint8_t poweroff_delay;                     // either POWEROFF_Delay_HALT_long or POWEROFF_Delay_REBOOT_long
-uint8_t key_state;                          // debounced and inverted key state:
-uint8_t poweron_delay;                     //
+#define TX_IDLE         0                   // pulse transmitter phases, see tx_tick()
+#define TX_LEAD         1                   // waiting before the first pulse
+#define TX_HIGH         2                   // pulse on the line
+#define TX_GAP          3                   // pause between two pulses
 
-                                            // bit = 1: key pressed
+uint8_t blinkwhat;                          // blink intervall
+uint8_t timeout;                            // seconds, TMR_DELAY of state2 and state5
+volatile uint16_t in_state;                 // debounced and inverted inputs (IN_MASK):
+                                            // bit = 1: key pressed, switch on
+volatile uint16_t in_change;                // debounced inputs changed
 uint8_t key_press;                          // key press detect
-uint8_t key_rpt;                            // key long press and repeat
 volatile uint8_t key_release;               // key release detect
+static uint8_t kg_clicks;                   // presses of the gesture so far, see key_gesture()
+static uint8_t kg_down;                     // key down, as far as key_gesture() has seen
+static uint8_t kg_done;                     // gesture taken while down: wait for the release
+static uint16_t kg_t;                       // ms_now() of the last press or release
 
-enum {
-    state0,                                      // finite state machins states
-    state1,
-    state2,
-    state3,
-    state4,
-    state5,
-    state6,
-    state7
-    };
-static uint8_t first_time = 0xff;                // first_time run through a state, bitwise, bit 0 means state 1
-static uint8_t state=state0;                       // state variable
-static uint8_t pipulses=0;                          // key press detect
-static uint8_t waslo=1;                  // key press detect
-static uint8_t washi=0;                  // key press detect
+static uint8_t state=state0;                       // state variable, see fsm.h
 volatile static uint8_t sendnow=0;
-static uint8_t pastpulses=0;
+volatile static uint16_t clock_ticks;               // free running, one per tick, for cap_stamp()
+static uint8_t cap_line;                            // FROMPI at the last edge
+static uint16_t rx_rise, rx_fall;                   // last edges, Timer0 clocks
+static uint8_t rx_edge;                             // an edge since fr_send() looked
+static uint8_t rx_bits=RX_NONE;                     // bits of the frame coming in
+static uint8_t rx_buf[FR_MAX];
+volatile static uint8_t rx_ready;                   // bytes of a complete frame, for hb_check()
+volatile static uint8_t hb_pulse;                   // heartbeat pulse (old protocol) seen
+static uint16_t hb_last;                            // ms_now() of the last good heartbeat
+static uint16_t hb_period;                          // ms between heartbeats, average of the row
+volatile static uint8_t hb_count=0;                 // good heartbeats in a row, 0: Pi not alive
+volatile static uint8_t tx_phase=TX_IDLE;           // pulse transmitter
+static uint8_t tx_pulses;                           // pulses still to send
+static uint8_t tx_ticks;                            // ticks left in this phase
+volatile static uint8_t ftx_on;                     // frame transmitter busy
+static uint8_t ftx_buf[FR_MAX];
+static uint8_t ftx_pos, ftx_pulses;                 // pulses sent, pulses of the frame
+static uint8_t peer_framed;                         // the Pi speaks frames
+static uint8_t fr_tries, fr_wait;                   // HALT/REBOOT frames sent, ticks to the next
+#if defined CONFIG
+static uint8_t cfg[FR_CFG_KEYS];                    // set by the Pi, 0: DIP switch default
+#endif
+#if defined CFG_EEPROM
+volatile static uint8_t cfg_dirty;                  // CFG_EE keys to EEPROM, cfg_poll()
+uint8_t ee_cfg[FR_CFG_KEYS - CFG_EE] EEMEM = { [0 ... FR_CFG_KEYS - CFG_EE - 1] = 0xff };  // ~cfg[CFG_EE..], erased: default
+#endif
+#if defined RECOVER
+static uint8_t rec_on;                              // power cycling a lost Pi, until it is up
+static uint8_t rec_tries;                           // power cycles in a row
+static uint32_t rec_up;                             // ms_now() the Pi was up (state3)
+#endif
+static uint8_t pi_down;                             // poweroff-ready from the Pi's shutdown hook
+#if defined CALIBRATE
+volatile static uint32_t hb_alive;                  // ms_now() hb_count reached HB_ALIVE
+#endif
+#if defined EVENTLOG
+volatile static uint8_t log_req;                    // FR_LOG_GET to answer, see fr_log()
+static uint8_t log_n, log_part;
+#endif
+volatile static uint8_t boot_due;                   // FR_UPDATE: bootloader once the ACK is out
+#if defined TELEMETRY
+static uint8_t ftx_lead;                            // frame waits for a telemetry byte
+static uint8_t tm_state=0xff;                       // state in the last record
+static uint16_t tm_at;                              // ms_now() of the last record
+static uint16_t tm_pass;                            // cap_stamp() of the last pass
+static uint16_t tm_loop_max, tm_events;
+static uint8_t tm_slept;                            // no pass time across the standby sleep
+volatile static uint8_t tm_isr_max;
+#endif
+
+#if defined CALIBRATE
+struct cal {                                        // one delay, measured
+    uint16_t est;                                   // running estimate, 10 ms
+    uint16_t dev;                                   // mean deviation, 10 ms
+    uint8_t  n;                                     // measurements, up to 255
+};
+struct cal_block {
+    struct cal c[CAL_KEYS];
+    uint8_t crc;
+};
+static struct cal_block cal;
+struct cal_block ee_cal EEMEM;                      // copy of cal in EEPROM
+static uint8_t cal_key=CAL_NONE;                    // FR_CFG_xx being measured
+static uint32_t cal_t0;                             // ms_now() at the start
+#endif
+
+struct warm {                                       // what a watchdog reset must not lose
+    uint8_t state;
+    uint8_t vpower;                                 // 5 Volt to the Pi on
+    uint8_t crc;
+};
+static struct warm warm NOINIT;                     // not cleared by the reset, see warm_state()
+static volatile uint8_t wdt_fed;                    // main loop ran since the last WDT_vect
 void mytimer(void);
-void sendtopi(int);
-void sendtopi_2(int);
+static void tx_start(uint8_t, uint8_t);
+static void tx_stop(void);
+static void tx_tick(void);
+static void ftx_start(uint8_t, const uint8_t *, uint8_t, uint8_t);
+static void ftx_arm(uint8_t);
+static void ftx_stop(void);
+static void fr_command(uint8_t);
+static void boot_request(void);
+static void hb_check(void);
+static uint8_t cfg_get(uint8_t);
+static void tick_start(void);
+static void standby_sleep(void);
+static void fsm_enter(uint8_t);
+static void fsm_resume(uint8_t, uint8_t);
+static void pi_off(void);
 
 //-------------------------------------------------------------------
 // debounce functions from Peter Dannegger
 // http://www.mikrocontroller.net/topic/tasten-entprellen-bulletproof
 // http://www.mikrocontroller.net/topic/48465
 //-------------------------------------------------------------------
-uint8_t key_clear( uint8_t key_mask )
+static uint8_t key_clear( uint8_t key_mask )
 {
   ATOMIC_BLOCK(ATOMIC_FORCEON){
     key_press &= ~key_mask;                      // clear key(s)
+    key_release &= ~key_mask;
+    kg_down = !!(in_state & key_mask);
   }
+  kg_clicks = 0;                                 // no gesture going on, a key still down
+  kg_done = kg_down;                             // does nothing until released
   return (0x0);
 }
 
-uint8_t get_key_press( uint8_t key_mask )
+static uint8_t get_key_press( uint8_t key_mask )
 {
   ATOMIC_BLOCK(ATOMIC_FORCEON){
     key_mask &= key_press;                      // read key(s)
@@ -163,16 +312,7 @@ uint8_t get_key_press( uint8_t key_mask )
   return key_mask;
 }
 
-uint8_t get_key_rpt( uint8_t key_mask )
-{
-  ATOMIC_BLOCK(ATOMIC_FORCEON){
-    key_mask &= key_rpt;                        // read key(s)
-    key_rpt ^= key_mask;                        // clear key(s)
-  }
-  return key_mask;
-}
-
-uint8_t get_key_release( uint8_t key_mask )
+static uint8_t get_key_release( uint8_t key_mask )
 {
   cli();                     // read and clear atomic !
   key_mask &= key_release;   // read key(s)
@@ -181,30 +321,131 @@ uint8_t get_key_release( uint8_t key_mask )
   return key_mask;
 }
 
-uint8_t get_key_short( uint8_t key_mask )
+uint16_t get_in_change( uint16_t mask )         // DIP switches, same debounce as the key
 {
-  uint8_t i;
-
-  ATOMIC_BLOCK(ATOMIC_FORCEON)
-    i = get_key_press( ~key_state & key_mask );
-  return i;
+  ATOMIC_BLOCK(ATOMIC_FORCEON){
+    mask &= in_change;                          // read change(s)
+    in_change ^= mask;                          // clear change(s)
+  }
+  return mask;
 }
 
-uint8_t get_key_long( uint8_t key_mask )
+// DIP switches as they are now, no debounce needed: Timer0 was stopped
+// (standby) or has not run yet. Key state stays with the debounce.
+// Also called from PCINT0_vect (tick_start()): the I bit is restored
+static void in_seed(void)
 {
-  return get_key_press( get_key_rpt( key_mask ));
+  uint16_t now = ~(KEY_PORT | PINB << 8) & IN_MASK & ~IN_A(KEY0);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE){
+    in_change |= (in_state ^ now) & ~IN_A(KEY0);
+    in_state = (in_state & IN_A(KEY0)) | now;
+  }
 }
+// --- Ende debounce functions   ----------------------
 
-uint8_t get_key_long_r( uint8_t key_mask )      // if repeat function needed
+//----------------------------------------------------
+// --- Key gestures, from the debounced press and release
+//  click, double and triple click (the next press within FR_CFG_CLICK
+//  of the release), long press (FR_CFG_LONG) and hold (FR_CFG_HOLD).
+//  events: what the state handles. A gesture is taken as soon as
+//  nothing else it handles could come of it, so the key is as fast
+//  as the state allows:
+//    click        at the press if the state handles no other key event,
+//                 at the release without double click, else FR_CFG_CLICK later
+//    double click at the 2nd release without triple click
+//    long press   at FR_CFG_LONG while down, at the release if hold is handled
+//    hold         at FR_CFG_HOLD while down
+//  The rest of a press that made a gesture does nothing. A long press
+//  where it is not handled is a click, a gesture the state does not
+//  handle is lost. Returns the event, EV_NONE: none (yet)
+//  Only with make GESTURES=1, else click and long press only: click
+//  at the press, or at the release if the state handles long press.
+//----------------------------------------------------
+#if defined GESTURES
+static uint8_t key_gesture(uint16_t events)
 {
-  return get_key_press( get_key_rpt( key_press & key_mask ));
-}
+    uint16_t now = ms_now(), dt;
+    uint8_t multi, ev = EV_NONE;
 
-uint8_t get_key_rpt_l( uint8_t key_mask )       // if long function needed
+    multi = (events & EV(EV_KEY_TRIPLE)) ? 3 : (events & EV(EV_KEY_DOUBLE)) ? 2 : 1;
+
+    if (get_key_press( 1<<KEY0 )) {
+        kg_down = 1;
+        kg_clicks++;
+        kg_t = now;
+    }
+    dt = now - kg_t;
+    if (get_key_release( 1<<KEY0 )) {
+        kg_down = 0;
+        kg_t = now;
+        if (kg_done) {
+            kg_done = 0;
+            return EV_NONE;
+        }
+        if (kg_clicks == 1 && (events & EV(EV_KEY_LONG)) && dt >= cfg_get(FR_CFG_LONG) * 100U)
+            ev = EV_KEY_LONG;                   // hold handled too, else taken while down
+        dt = 0;
+    }
+    if (!kg_clicks || kg_done)
+        return EV_NONE;
+
+    if (ev != EV_NONE)
+        ;
+    else if (kg_down) {
+        if (kg_clicks > 1)
+            ;                                   // 2nd or 3rd click: at the release
+        else if (events & EV(EV_KEY_HOLD)) {
+            if (dt >= cfg_get(FR_CFG_HOLD) * 100U)
+                ev = EV_KEY_HOLD;
+        } else if (events & EV(EV_KEY_LONG)) {
+            if (dt >= cfg_get(FR_CFG_LONG) * 100U)
+                ev = EV_KEY_LONG;
+        } else if (multi == 1)
+            ev = EV_KEY_SHORT;                  // nothing else it could become
+    } else if (kg_clicks >= multi || dt >= cfg_get(FR_CFG_CLICK) * 100U)
+        ev = kg_clicks == 1 ? EV_KEY_SHORT : kg_clicks == 2 ? EV_KEY_DOUBLE : EV_KEY_TRIPLE;
+
+    if (ev == EV_NONE)
+        return EV_NONE;
+    kg_clicks = 0;
+    kg_done = kg_down;
+    return (events & EV(ev)) ? ev : EV_NONE;
+}
+#else
+static uint8_t key_gesture(uint16_t events)
 {
-  return get_key_rpt( ~key_press & key_mask );
+    uint16_t dt = (uint16_t)ms_now() - kg_t;
+    uint8_t ev;
+
+    if (get_key_press( 1<<KEY0 )) {
+        kg_down = 1;
+        kg_clicks = 1;
+        kg_t = ms_now();
+        dt = 0;
+    }
+    if (get_key_release( 1<<KEY0 )) {
+        kg_down = 0;
+        if (kg_done) {
+            kg_done = 0;
+            return EV_NONE;
+        }
+    }
+    if (!kg_clicks || kg_done)
+        return EV_NONE;
+
+    if (!(events & EV(EV_KEY_LONG)))
+        ev = EV_KEY_SHORT;                      // nothing else it could become
+    else if (dt >= cfg_get(FR_CFG_LONG) * 100U)
+        ev = EV_KEY_LONG;                       // while down, or released late
+    else if (!kg_down)
+        ev = EV_KEY_SHORT;
+    else
+        return EV_NONE;
+    kg_clicks = 0;
+    kg_done = kg_down;
+    return (events & EV(ev)) ? ev : EV_NONE;
 }
-// --- Ende debounce functions   ----------------------
+#endif  // GESTURES
 
 
 //----------------------------------------------------
@@ -214,26 +455,25 @@ uint8_t get_key_rpt_l( uint8_t key_mask )       // if long function needed
 //----------------------------------------------------
 ISR( TIM0_COMPA_vect )                          // every 10ms
 {
-  static uint8_t ct0 = 0xFF, ct1 = 0xFF, rpt;
-  uint8_t i;
+  static uint16_t ct0 = 0xFFFF, ct1 = 0xFFFF;   // both ports, see IN_A()/IN_B()
+  uint16_t i;
 
-  i = key_state ^ ~KEY_PORT;                     // has key-input changed ?
+  i = in_state ^ (~(KEY_PORT | PINB << 8) & IN_MASK);  // has an input changed ?
   ct0 = ~( ct0 & i );                           // reset or count ct0
   ct1 = ct0 ^ (ct1 & i);                        // reset or count ct1
   i &= ct0 & ct1;                               // count until roll over ?
-  key_state ^= i;                               // then toggle debounced state
-  key_press |= key_state & i;                   // 0->1: key press detect
-  key_release |= ~key_state & i;                // 1->0: key release detect
-
-  if( (key_state & REPEAT_MASK) == 0 )          // check repeat function
-     rpt = REPEAT_START;                        // start delay
-  if( --rpt == 0 ){
-    rpt = REPEAT_NEXT;                          // repeat delay
-    key_rpt |= key_state & REPEAT_MASK;
-  }
+  in_state ^= i;                                // then toggle debounced state
+  in_change |= i;                               // change detect (DIP switches)
+  key_press |= (uint8_t)(in_state & i);         // 0->1: key press detect
+  key_release |= (uint8_t)(~in_state & i);      // 1->0: key release detect
+                                                // long press and hold: key_gesture()
 
     mytimer();              // handle my own timer stuff
 
+#if defined TELEMETRY
+    if (TCNT0 > tm_isr_max)                     // Timer0 counts since the compare match
+        tm_isr_max = TCNT0;
+#endif
 }
 
 //----------------------------------------------------
@@ -241,405 +481,1381 @@ ISR( TIM0_COMPA_vect )                          // every 10ms
 //  this code runs every 10 ms activated by Timer 0 compare_match
 //----------------------------------------------------
 void mytimer()   {                       // every 10m{
-// count ticks (one tick every 10 ms)
-    tick++;                             // tick is used for adding seconds
-    tick2++;                            // tick2 is used for led blinking
-    tick3++;                            // tick3 is used for Pi related stuff
+    el_clock(ms_tick());                // ms clock and timers, clock of the event log
+    clock_ticks++;                      // timestamps for the edges from the Pi
+
+// now do Pi related stuff ---------------------
+
+    if (tx_phase != TX_IDLE)            // we are sending to the Pi, the line is ours
+        tx_tick();
+
+    hb_check();                         // heartbeats captured since the last tick
 
-    if(tick > 100) {                     // 100 times 10 ms equals a second
-        sekunde++;                       // seconds used for poweron/off delays
-        sekunde2++;                      // seconds used for pulses from pi
-        tick = 0;
+// done with th Pi related stuff
+
+}
+
+//----------------------------------------------------
+// --- Timestamp for captured edges, called with interrupts off
+//  Timer0 clocks since start: ticks * TICK_COUNTS + TCNT0
+//----------------------------------------------------
+static uint16_t cap_stamp(void) {
+    uint8_t cnt = TCNT0;
+    uint16_t ticks = clock_ticks;
+
+    if (TIFR0 & (1<<OCF0A)) {           // compare match, tick not yet counted
+        cnt = TCNT0;
+        ticks++;
     }
+    return ticks * TICK_COUNTS + cnt;
+}
 
+//----------------------------------------------------
+// --- Interrupt Service Routine for pin change on Port A
+//  FROMPI: timestamp every edge from the Pi, on the falling edge
+//  the pulse width says what it was (see frame.h):
+//  a bit or the start of a frame, or a heartbeat of the old protocol.
+//  Complete frames are handed to hb_check() in the tick.
+//  KEY0 (standby only, see standby_sleep()): start the 10 ms tick again
+//  so the key gets debounced as usual
+//----------------------------------------------------
+ISR( PCINT0_vect )
+{
+    uint8_t line, i, p;
+    uint16_t t, w;
 
-// now do Pi related stuff ---------------------
+    if (PCMSK0 & (1<<PCINT4)) {                     // woken up from standby
+        PCMSK0 = 1<<PCINT2;                         // back to the Pi line only
+        tick_start();
+    }
+    if (tx_phase != TX_IDLE || ftx_on)              // our own pulses to the Pi
+        return;
+    line = KEY_PORT & (1<<FROMPI);
+    if (line == cap_line)                           // not the Pi line
+        return;
+    cap_line = line;
+    t = cap_stamp();
+    rx_edge = 1;
+
+    if (line) {                                     // rising edge: pulse starts
+        if (rx_bits != RX_NONE && t - rx_fall > US2COUNTS(FR_LOW_MAX))
+            rx_bits = RX_NONE;                      // gap too long, frame lost
+        rx_rise = t;
+        return;
+    }
+    rx_fall = t;                                    // falling edge: pulse ends
+    w = t - rx_rise;
+    p = fr_pulse((uint32_t)w * US_PER_COUNT);
+    switch (p) {
+    case FR_P_START:
+        rx_bits = rx_ready ? RX_NONE : 0;           // last frame not taken yet: drop this one
+        break;
 
-    if (tick3 > PULSCHECK)  {            // every PULSCHECK times 10 ms: check pulses from Pi
-        tick3=0;                         // and send signal to Pi if key was pressed (and only then)
-                                          // check signal from Pi every 100 ms
-                                          // Pin FROMPI ist set to Input
-        if (PINA & (1<<FROMPI))       // pin ist high
-            {
-            if (waslo==1)  {             // Pi signals I am alive, pin was low before, goes to high
-                washi=1;
-                pipulses++;              // count pulses from Pi
-                waslo=0;
-                }
-            }
-        else if (washi==1) {            // Input is low again
-            waslo=1;                    // if we have to send something, do it now!!
-            washi=0;
-
-            if (sendnow != 0)  {           // we need to send puls(es) to the Pi
-                _delay_ms(100);             // give the Pi time to set up its IR Handler
-                sendtopi(sendnow);         // variable sendnow says how many (one or two)
-                sendnow=0;                 // no more to be sent
-                }
-            }
-    }       // end check Pi
+    case FR_P_ZERO:
+    case FR_P_ONE:
+        if (rx_bits == RX_NONE)
+            break;
+        i = rx_bits >> 3;
+        rx_buf[i] = rx_buf[i] << 1 | (p == FR_P_ONE);
+        if ((++rx_bits & 7) == 0 && (rx_bits >> 3) == FR_LEN(rx_buf[0]) + 2) {
+            rx_ready = rx_bits >> 3;                // frame complete
+            rx_bits = RX_NONE;
+        }
+        break;
+
+    case FR_P_LONG:
+        if (w >= MS2COUNTS(HB_WIDTH_MIN) && w <= MS2COUNTS(HB_WIDTH_MAX))
+            hb_pulse = 1;                           // heartbeat of the old protocol
+        // fall through
+    default:
+        rx_bits = RX_NONE;
+        break;
+    }
+}
+
+//----------------------------------------------------
+// --- Count a heartbeat from the Pi
+//  hb_count counts them as long as they come at most HB_PERIOD_MAX apart,
+//  alive from HB_ALIVE on. Every heartbeat also updates the period and
+//  starts TMR_HB: FR_CFG_MISSED periods and half a one without the next
+//  and the Pi is lost (no period yet: HB_PERIOD_MAX)
+//----------------------------------------------------
+static void hb_timer(uint16_t p) {                  // TMR_HB for period p, see hb_check()
+    tmr_start(TMR_HB, (uint32_t)p * cfg_get(FR_CFG_MISSED) + p / 2, 0);
+}
+
+static void hb_beat(void) {
+    uint32_t now = ms_now();
+    uint16_t gap = (uint16_t)now - hb_last;
+
+    if (hb_count && gap > HB_PERIOD_MAX)
+        hb_count = 0;                               // a gap, start counting again
+    else if (hb_count == 1)
+        hb_period = gap;                            // first period of the row
+    else if (hb_count)
+        hb_period += (int16_t)(gap - hb_period) / 4;    // follows the Pi, jitter 1/4
+    hb_last = now;
+    if (hb_count < 255)
+        hb_count++;
+#if defined CALIBRATE
+    if (hb_count == HB_ALIVE)
+        hb_alive = now;                             // Pi alive, for the calibration
+#endif
+    hb_timer(hb_count > 1 ? hb_period : HB_PERIOD_MAX);
+}
+
+//----------------------------------------------------
+// --- Effective config value: set by the Pi or the DIP switch default
+//----------------------------------------------------
+static const uint8_t cfg_default[FR_CFG_KEYS][2] PROGMEM = { // long, short (DELAYTIME)
+    [FR_CFG_POWERON] = { POWERON_Delay_long,         POWERON_Delay_short },
+    [FR_CFG_HALT]    = { POWEROFF_Delay_HALT_long,   POWEROFF_Delay_HALT_short },
+    [FR_CFG_REBOOT]  = { POWEROFF_Delay_REBOOT_long, POWEROFF_Delay_REBOOT_short },
+    [FR_CFG_RECOVER] = { 0,                          0 },
+    [FR_CFG_VCC]     = { 0,                          0 },
+    [FR_CFG_MISSED]  = { HB_MISSED,                  HB_MISSED },
+    [FR_CFG_CLICK]   = { KEY_CLICK,                  KEY_CLICK },
+    [FR_CFG_LONG]    = { KEY_LONG,                   KEY_LONG },
+    [FR_CFG_HOLD]    = { KEY_HOLD,                   KEY_HOLD },
+};
+#if defined CALIBRATE
+static const uint8_t cal_margin[CAL_KEYS] PROGMEM = {   // seconds on top of the calibration
+    [FR_CFG_POWERON] = 5,
+    [FR_CFG_HALT]    = 10,                          // Pi without hook: OS still going down
+    [FR_CFG_REBOOT]  = 10,
+};
+
+static uint8_t cal_timeout(uint8_t key) {       // seconds
+    uint32_t t = ((uint32_t)cal.c[key].est + 4UL * cal.c[key].dev + 99) / 100;
+    t += pgm_read_byte(&cal_margin[key]);
+    return t > 255 ? 255 : t;
+}
+#endif
+
+static uint8_t cfg_get(uint8_t key) {
+    uint8_t t;
+
+#if defined CONFIG
+    if (cfg[key])
+        return cfg[key];
+#endif
+    t = pgm_read_byte(&cfg_default[key][!!(in_state & IN_A(DELAYTIME))]);
+#if defined CALIBRATE
+    if (key < CAL_KEYS && cal.c[key].n >= CAL_SAMPLES && cal_timeout(key) < t)
+        t = cal_timeout(key);                       // calibrated, never longer than the DIP value
+#endif
+    return t;
+}
+
+//----------------------------------------------------
+// --- Recovery, supply and heartbeat settings, the config values kept
+//  in EEPROM: after a mains failure a hung Pi could not set them again,
+//  and the supply has to be checked before the Pi is up.
+//  Set by the Pi in the tick, written by the main loop. Only with
+//  make RECOVER=1 or VCC=1, else the Pi sets them again when it starts.
+//----------------------------------------------------
+#if defined CFG_EEPROM
+static void cfg_load(void) {
+    uint8_t v[FR_CFG_KEYS - CFG_EE], i;
+
+    eeprom_read_block(v, ee_cfg, sizeof(v));
+    for (i = 0; i < sizeof(v); i++)
+        cfg[CFG_EE + i] = ~v[i];
+}
+
+static void cfg_poll(void) {
+    uint8_t v[FR_CFG_KEYS - CFG_EE], i;
+
+    if (!cfg_dirty)
+        return;
+    cfg_dirty = 0;
+    for (i = 0; i < sizeof(v); i++)
+        v[i] = ~cfg[CFG_EE + i];
+    eeprom_update_block(v, ee_cfg, sizeof(v));
+}
+#else
+static inline void cfg_load(void) {}
+static inline void cfg_poll(void) {}
+#endif
+
+//----------------------------------------------------
+// --- Recovery of a hung Pi (FR_CFG_RECOVER tries, 0: off)
+//  Heartbeats lost in state3: state5 waits the reboot delay (a reboot
+//  from the commandline looks the same), state6 checks once more.
+//  Still nothing: EV_RECOVER, state8 cuts the power for REC_OFF_S and
+//  state2 boots the Pi again. Not up in time: EV_RECOVER again, each
+//  time twice as long without power, up to REC_OFF_MAX_S. After
+//  FR_CFG_RECOVER tries standby, as without recovery.
+//  Only with make RECOVER=1, else state8 is never entered.
+//----------------------------------------------------
+#if defined RECOVER
+static uint8_t rec_due(void) {
+    return rec_on && rec_tries < cfg_get(FR_CFG_RECOVER) && tmr_expired(TMR_DELAY);
+}
+
+static uint16_t rec_off(void) {                     // seconds, this try
+    uint16_t t = REC_OFF_S;
+    uint8_t i;
+
+    for (i = 1; i < rec_tries && t < REC_OFF_MAX_S; i++)
+        t <<= 1;
+    return t < REC_OFF_MAX_S ? t : REC_OFF_MAX_S;
+}
+#else
+static inline uint8_t rec_due(void) { return 0; }
+#endif
+
+//----------------------------------------------------
+// --- Calibrated delays, kept in EEPROM
+//  POWERON: state2 power on until the Pi is alive (hb_count >= HB_ALIVE)
+//  HALT:    state5 halt until the DOWN frame of the Pi's shutdown hook.
+//           Without the hook every halt runs out and the delay stays
+//           at the DIP switch or Pi value: silence on the line does not
+//           mean the Pi is down
+//  REBOOT:  state5 reboot until the Pi is alive again
+//  cal_start() when the delay starts, cal_learn() (A_LEARN) when it
+//  ends. Estimate and mean deviation like a TCP retransmit timer,
+//  timeout = estimate + 4 deviations + cal_margin. A delay that ran
+//  out is a measurement too (at least that long), so a too tight
+//  calibration grows again.
+//  Only with make CALIBRATE=1, else the DIP switch or Pi values count.
+//----------------------------------------------------
+#if defined CALIBRATE
+static uint8_t cal_crc(void) {
+    uint8_t i, crc = 0x5a;                          // all 0 or all 0xff: no calibration
+    for (i = 0; i < sizeof(cal.c); i++)
+        crc = fr_crc8(crc, ((uint8_t *)cal.c)[i]);
+    return crc;
+}
+
+static void cal_load(void) {
+    eeprom_read_block(&cal, &ee_cal, sizeof(cal));
+    if (cal.crc != cal_crc())
+        memset(&cal, 0, sizeof(cal));
+}
+
+static void cal_start(uint8_t key) {
+    cal_key = key;
+    cal_t0 = ms_now();
+}
+
+static void cal_stop(void) {                        // nothing to measure
+    cal_key = CAL_NONE;
+}
 
-    // store number of pulses that came in within the last PULSCHECK_SECONDS seconds and reset counter
-    if (sekunde2 > PULSCHECK_SECONDS) {           // for PULSCHECK_SECONDS seconds we count pulses from pi
-        pastpulses=pipulses;            // store number of pulses
-        pipulses=0;                     // reset puls counter
-        sekunde2=0;
+static void cal_learn(void) {
+    uint32_t now, alive;
+    uint16_t m;
+    int32_t d;
+    struct cal *c;
+
+    if (cal_key == CAL_NONE)
+        return;
+    ATOMIC_BLOCK(ATOMIC_FORCEON)
+        alive = hb_alive - cal_t0;
+    now = ms_now() - cal_t0;
+    now /= 10;                                      // calibration in 10 ms (ticks of old)
+    alive /= 10;
+    m = now;                                        // POWERON, HALT at the DOWN, or the delay ran out
+    if (cal_key == FR_CFG_REBOOT && hb_count >= HB_ALIVE && alive <= now)
+        m = alive;
+
+    c = &cal.c[cal_key];
+    d = (int32_t)m - c->est;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {                  // cfg_get() also runs in the tick
+        if (c->n == 0) {
+            c->est = m;
+            c->dev = m / 2;
+        } else {
+            c->est += d / 8;
+            c->dev += ((d < 0 ? -d : d) - (int32_t)c->dev) / 4;
         }
+        if (c->n < 255)
+            c->n++;
+    }
+    cal.crc = cal_crc();
+    eeprom_update_block(&cal, &ee_cal, sizeof(cal)); // only changed bytes are written
+    cal_key = CAL_NONE;
+}
+#else
+static inline void cal_load(void) {}
+static inline void cal_start(uint8_t key) {}
+static inline void cal_stop(void) {}
+static inline void cal_learn(void) {}
+#endif
 
-// done with th Pi related stuff
+//----------------------------------------------------
+// --- A frame from the Pi, called by hb_check()
+//  heartbeat, status, config or square wave request: answer after FR_RESP,
+//  the Pi is waiting for it. A pending HALT/REBOOT is the answer to a
+//  heartbeat, no need to wait for the line. ACK ends our HALT/REBOOT.
+//----------------------------------------------------
+static void fr_receive(uint8_t n) {
+    uint8_t reply[3];
+    uint8_t op = FR_OP(rx_buf[0]);
+    uint8_t len = FR_LEN(rx_buf[0]);
+    uint8_t key = rx_buf[1];
+    uint8_t rop = FR_NAK, rlen = 1;                 // a bad request: NAK, reply[0] the op
+
+    if (!fr_valid(rx_buf, n))
+        return;
+    peer_framed = 1;
+    reply[0] = op;
+    switch (op) {
+    case FR_HEARTBEAT:
+        hb_beat();
+        if (sendnow && fr_tries < FR_RETRIES) {
+            fr_command(FR_RESP);
+            return;
+        }
+        reply[1] = key;                             // sequence number back
+        rop = FR_ACK;
+        rlen = 2;
+        break;
+
+    case FR_STATUS_GET:
+        reply[0] = state;
+        reply[1] = (PINA & (1<<VPOWER)      ? FR_ST_VPOWER : 0)
+                 | (in_state & IN_A(DELAYTIME)   ? FR_ST_SHORT : 0)
+                 | (in_state & IN_A(SQUARE)      ? FR_ST_SQUARE : 0)
+                 | (in_state & IN_B(AUTO_POWER)  ? FR_ST_AUTO : 0)
+                 | (~in_state >> 8 & 0x06) << 3;
+        reply[2] = hb_count;
+        rop = FR_STATUS;
+        rlen = 3;
+        break;
+
+#if defined CONFIG
+    case FR_CONFIG_SET:                             // key, value: as FR_CONFIG_GET after
+    case FR_CONFIG_GET:                             // key
+        if (len != (op == FR_CONFIG_SET ? 2 : 1) || key >= FR_CFG_KEYS || CFG_NONE(key))
+            break;
+        if (op == FR_CONFIG_SET) {
+            cfg[key] = rx_buf[2];
+#if defined CFG_EEPROM
+            if (key >= CFG_EE)
+                cfg_dirty = 1;                      // to EEPROM, cfg_poll()
+#endif
+        }
+        reply[0] = key;
+        reply[1] = cfg_get(key);
+        rop = FR_CONFIG;
+        rlen = 2;
+        break;
+#else
+    case FR_CONFIG_SET:                             // make CONFIG=1
+    case FR_CONFIG_GET:
+        break;
+#endif
+
+#if defined SQUARE_PI
+    case FR_SQUARE_SET:
+        if (len != 3 || pwm_remote((uint16_t)key << 8 | rx_buf[2], rx_buf[3]))
+            break;
+        // fall through
+    case FR_SQUARE_GET:
+        reply[0] = pwm_dhz() >> 8;
+        reply[1] = pwm_dhz() & 0xff;
+        reply[2] = pwm_duty() | (pwm_pi() ? FR_SQ_PI : 0);
+        rop = FR_SQUARE;
+        rlen = 3;
+        break;
+#else
+    case FR_SQUARE_SET:                             // make SQUARE_PI=1
+    case FR_SQUARE_GET:
+        break;
+#endif
+
+    case FR_LOG_GET:                                // EEPROM: answered by fr_log()
+#if defined EVENTLOG
+        if (len != 2)
+            break;
+        log_n = key;
+        log_part = rx_buf[2];
+        log_req = 1;
+        return;
+#else
+        break;                                      // make EVENTLOG=1
+#endif
+
+    case FR_UPDATE:                                 // the bootloader takes over, boot_request()
+        if (len != 2 || ((uint16_t)key << 8 | rx_buf[2]) != FR_UPDATE_KEY)
+            break;
+        boot_due = 1;
+        // fall through
+    case FR_DOWN:                                   // last thing the Pi does before halting
+        if (op == FR_DOWN)
+            pi_down = 1;
+        reply[1] = 0;                               // no sequence number to give back
+        rop = FR_ACK;
+        rlen = 2;
+        break;
+
+    case FR_ACK:
+        if (key == FR_HALT || key == FR_REBOOT)
+            sendnow = 0;                            // the Pi has it
+        return;
+
+    default:
+        return;
+    }
+    ftx_start(rop, reply, rlen, FR_RESP);
+}
+
+//----------------------------------------------------
+// --- Answer to FR_LOG_GET, called by the main loop
+//  the log is read from EEPROM, not in the tick: the EEPROM registers
+//  are the main loop's (el_flush()). Late by a pass of the main loop,
+//  well within FR_REPLY_MS.
+//----------------------------------------------------
+#if defined EVENTLOG
+static void fr_log(void) {
+    uint8_t buf[3];
+    uint8_t nak;
+
+    if (!log_req || ftx_on)
+        return;
+    nak = el_get(log_n, log_part, buf);
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        if (nak) {
+            buf[0] = FR_LOG_GET;
+            ftx_start(FR_NAK, buf, 1, FR_RESP);
+        }
+        else
+            ftx_start(FR_LOG, buf, 3, FR_RESP);
+        log_req = 0;
+    }
+}
+#else
+static inline void fr_log(void) {}
+#endif
+
+//----------------------------------------------------
+// --- Firmware update, called by the main loop
+//  FR_UPDATE is acknowledged: the bootloader takes the new image
+//  from the Pi (boot/boot.c). No return: the new firmware, or this
+//  one if the Pi sent nothing, starts after a watchdog reset, warm.
+//----------------------------------------------------
+static void boot_request(void) {
+    uint8_t flag = BOOT_REQUEST;
+
+    if (!boot_due || ftx_on)
+        return;
+    eeprom_update_block(&flag, &BOOT_EE->flag, 1);
+    cli();
+    boot_start();
+}
+
+//----------------------------------------------------
+// --- HALT/REBOOT frame to the Pi, called by hb_check()
+//  sent as soon as the line is free (no edge for a tick, line low),
+//  again after FR_REPLY_MS without ACK. After FR_RETRIES the old
+//  protocol takes over: pulses after the next heartbeat pulse.
+//----------------------------------------------------
+static void fr_send(void) {
+    if (fr_wait) {
+        fr_wait--;
+        return;
+    }
+    if (!sendnow || !peer_framed || ftx_on || tx_phase != TX_IDLE)
+        return;
+    if ((KEY_PORT & (1<<FROMPI)) || rx_bits != RX_NONE || rx_edge) {
+        rx_edge = 0;
+        return;                                     // the Pi is talking
+    }
+    if (fr_tries == FR_RETRIES) {
+        fr_tries = 0;
+        peer_framed = 0;
+        return;
+    }
+    fr_command(1);
+}
+
+static void fr_command(uint8_t lead) {
+    fr_tries++;
+    fr_wait = FR_REPLY_MS / 10;
+    ftx_start(sendnow == 1 ? FR_HALT : FR_REBOOT, 0, 0, lead);
+}
+
+//----------------------------------------------------
+// --- Heartbeat and frames from the Pi, called by mytimer() every tick
+//  No ring of edges: PCINT0_vect takes the width of each pulse at its
+//  falling edge and leaves one result (hb_pulse or a frame), hb_beat()
+//  keeps the period as a running average. Heartbeats are a second or
+//  so apart, the next tick always takes one before the next comes.
+//  A ring the tick could drain would need up to 10 edges of a frame
+//  per tick: 16 timestamps, 33 bytes of RAM against the 4 of rx_rise
+//  and rx_fall, on 256 bytes that hold .noinit and the stack as well
+//  (make checks it, see NOINIT in the Makefile).
+//  A heartbeat pulse (old protocol) is also the moment to send pulses
+//  to the Pi, it is listening right after it.
+//  No heartbeat for FR_CFG_MISSED periods (TMR_HB): hb_count=0.
+//----------------------------------------------------
+static void hb_check(void) {
+    if (hb_pulse) {
+        hb_pulse = 0;
+        peer_framed = 0;                            // the Pi uses the old protocol
+        hb_beat();
+        if (sendnow != 0 && tx_phase == TX_IDLE && !ftx_on) {  // we need to send puls(es) to the Pi
+            tx_start(sendnow, PULSELEAD / 10);      // variable sendnow says how many (one or two)
+            sendnow=0;                              // no more to be sent
+        }
+    }
+    if (rx_ready) {
+        fr_receive(rx_ready);
+        rx_ready = 0;
+    }
+    fr_send();
+
+    if (tmr_fired(TMR(TMR_HB)))
+        hb_count = 0;                               // Pi is silent
+}
+
+//----------------------------------------------------
+// --- Timer0 on/off
+//  the 10 ms tick only runs in states that need it,
+//  in standby (state1) it is stopped, see standby_sleep()
+//----------------------------------------------------
+static void tick_start(void) {
+    in_seed();                                      // DIP switches may have changed meanwhile
+    if (TIMSK0 & (1<<OCIE0A))                       // running (A_WAKE without sleep): keep
+        return;                                     // compare B edges where they are
+    TCNT0 = 0;
+    TIFR0 = 1<<OCF0A;                               // no stale compare match
+    TCCR0B = 1<<CS01 | 1<<CS00;                     // Timer/Counter0 source is F_CPU / 64
+    TIMSK0 = 1<<OCIE0A;                             // Enable compare Match interrupt on Timer/Counter 0
+}
+
+static void tick_stop(void) {
+    TIMSK0 = 0;
+    TCCR0B = 0;                                     // no clock source, timer stopped
+}
+
+//----------------------------------------------------
+// --- Watchdog, always on
+//  wdp 0: reset mode, WDT_RUN, wdt_reset() on every pass of the main loop
+//  wdp: prescaler bits WDP3..0 of the standby blink, interrupt and
+//  reset mode: the interrupt clears WDIE, WDT_vect sets it again only
+//  if the main loop ran in between, else the next timeout resets
+//----------------------------------------------------
+static void wdt_set(uint8_t wdp) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {             // no interrupt inside the timed sequence
+        MCUSR &= ~(1<<WDRF);
+        WDTCSR |= (1<<WDCE) | (1<<WDE);             // next write within 4 cycles
+        WDTCSR = wdp ? (1<<WDIE) | (1<<WDE) | wdp : (1<<WDE) | WDT_RUN;
+    }
+}
+
+//----------------------------------------------------
+// --- Interrupt Service Routine for the watchdog
+//  standby blink of the green led: 32 ms on, 2 s off
+//  the MCU wakes up from power-down for this and goes back to sleep
+//----------------------------------------------------
+ISR( WDT_vect )
+{
+    uint16_t ms = (PORTA & (1<<LED1)) ? 32 : 2048;  // the period that just ended
+
+    PORTA ^= (1<<LED1);
+    if (!(TIMSK0 & (1<<OCIE0A))) {                  // tick stopped: the clocks go on
+        ms_add(ms);
+        el_clock(ms);
+    }
+    if (wdt_fed) {                                  // main loop alive: next blink
+        wdt_fed = 0;
+        wdt_set((PORTA & (1<<LED1)) ? STANDBY_Blink_on : STANDBY_Blink_off);
+    }
+}
+
+//----------------------------------------------------
+// --- State across a watchdog or brown-out reset
+//  warm is in .noinit: the startup code leaves it alone, after power
+//  on it holds garbage and the crc says so. Written on every state
+//  entry; a reset in state0 or any other cause starts from state0.
+//  Returns the state to go on with, state0: a cold start
+//----------------------------------------------------
+static uint8_t warm_crc(void) {
+    return fr_crc8(fr_crc8(0x5a, warm.state), warm.vpower);     // all 0 or 0xff: not valid
+}
 
+static uint8_t warm_state(uint8_t mcusr) {
+    if (!(mcusr & (1<<WDRF | 1<<BORF)) || warm.crc != warm_crc() || warm.state >= STATES)
+        return state0;
+    return warm.state;
+}
+
+//----------------------------------------------------
+// --- Tickless standby
+//  called by state1 on every pass of the main loop.
+//  If the key is up and nothing is pending: stop Timer0 and go to
+//  power-down. Wakeups: the watchdog for the led blink (goes back
+//  to sleep on the next pass) or a pin change on KEY0.
+//  As long as the key is down, being debounced or a gesture is not
+//  taken yet the tick runs, a supply measurement (vcc.c) is waited for.
+//----------------------------------------------------
+static void standby_sleep(void) {
+    cli();
+#if defined TELEMETRY
+    if (!tm_idle() || tm_state != state) {          // the record goes out first
+        sei();
+        return;
+    }
+#endif
+    if ((KEY_PORT & (1<<KEY0)) && !((in_state | key_press | key_release) & (1<<KEY0))
+        && !kg_clicks && !vcc_busy()) {
+        tick_stop();
+        vcc_off();                                  // ADC off, on again at the next sample
+        PCMSK0 = 1<<PCINT4;                         // wake up on KEY0, Pi has no power
+        set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+        sleep_enable();
+#if defined BODS
+        sleep_bod_disable();                        // ATtiny44A: no BOD current while asleep
+#endif
+        sei();                                      // next instruction is executed before any interrupt
+        sleep_cpu();
+        sleep_disable();
+#if defined TELEMETRY
+        tm_slept = 1;
+#endif
+    }
+    sei();
 }
 
 //----------------------------------------------------
 // --- Function blink orange led  (TESTMODE ONLY)
 //----------------------------------------------------
-void blink_led() {
+#if defined TESTMODE
+static void blink_led() {
     PORTA |= (1<<LED2);               //orange led on
     _delay_ms (TESTMODE_Blink_int);
     PORTA &= ~( 1<<LED2);             //one pulse
     _delay_ms (50);
 
     }
+#endif
+
+//----------------------------------------------------
+// --- Pulse transmitter to the Pi
+//  sends one or two pulses of PULSELENGTH1 ms, PULSELENGTH2 ms apart,
+//  driven by the 10 ms tick, nothing ever waits for it.
+//  tx_start() with interrupts off or from the ISR
+//  lead: ticks before the first pulse goes out (at least 1)
+//----------------------------------------------------
+static void tx_start(uint8_t pulses, uint8_t lead) {
+    tx_pulses = pulses;
+    tx_ticks = lead;
+    tx_phase = TX_LEAD;
+}
+
+static void tx_stop(void) {
+    tx_phase = TX_IDLE;
+    DDRA  &= ~(1<<FROMPI);                  // set to Input again (from Pi)
+    PORTA &= ~( 1<<FROMPI);
+}
+
+static void tx_tick(void) {
+    if (--tx_ticks)
+        return;
+    switch (tx_phase) {
+    case TX_LEAD:
+    case TX_GAP:
+        DDRA  |= (1<<FROMPI);               // Switch line to Pi to output
+        PORTA |= (1<<FROMPI);               // pulse start
+        tx_ticks = PULSELENGTH1 / 10;
+        tx_phase = TX_HIGH;
+        break;
+
+    case TX_HIGH:
+        DDRA  &= ~(1<<FROMPI);              // pulse end, release the line (pulldown)
+        PORTA &= ~( 1<<FROMPI);
+        if (--tx_pulses) {
+            tx_ticks = PULSELENGTH2 / 10;
+            tx_phase = TX_GAP;
+            }
+        else
+            tx_stop();
+        break;
+    }
+}
 
 //----------------------------------------------------
-// --- Fuction send pulses to pi
-//  send simple pulses
+// --- Frame transmitter to the Pi, see frame.h
+//  the frame goes out pulse by pulse from Timer0 compare B, at 64 us
+//  resolution while the 10 ms tick goes on. The line is only ever
+//  driven high, low is the pulldown.
+//  Called with interrupts off (from the tick), lead: U before the start
 //----------------------------------------------------
-void sendtopi(int what) {
+static void ftx_start(uint8_t op, const uint8_t *data, uint8_t len, uint8_t lead) {
+    ftx_pulses = fr_build(ftx_buf, op, data, len) * 8 + 1;  // start and all bits
+    ftx_pos = 0;
+    ftx_on = 1;
+    rx_bits = RX_NONE;
+#if defined TELEMETRY
+    ftx_lead = lead;
+    if (tm_busy())                              // compare B is the telemetry's until
+        return;                                 // its byte is out, see TIM0_COMPB_vect
+#endif
+    ftx_arm(lead);
+}
+
+static void ftx_arm(uint8_t lead) {
+    uint8_t o;
+
+    o = TCNT0 + lead * FR_COUNTS;
+    if (o > OCR0A)
+        o -= OCR0A + 1;
+    OCR0B = o;
+    TIFR0 = 1<<OCF0B;                           // no stale compare match
+    TIMSK0 |= 1<<OCIE0B;
+}
+
+static void ftx_stop(void) {
+#if defined TELEMETRY
+    if (!tm_busy())                             // a telemetry byte keeps compare B
+#endif
+    TIMSK0 &= ~(1<<OCIE0B);
+    ftx_on = 0;
+    DDRA  &= ~(1<<FROMPI);
+    PORTA &= ~( 1<<FROMPI);
+}
 
-    DDRA  |= (1<<FROMPI)  ;                 // Switch line to Pi to output
-    PORTA |= (1<<FROMPI);                   //signal to pi halt
-     _delay_ms(PULSELENGTH1);
-    PORTA &= ~( 1<<FROMPI);                 //one pulse
+#if defined TELEMETRY
+// the line to the Pi is quiet: a telemetry byte may start
+static uint8_t tm_quiet(void) {
+    return !ftx_on && rx_bits == RX_NONE && !rx_ready;
+}
+#endif
+
+ISR( TIM0_COMPB_vect )
+{
+    uint8_t d, i, o;
 
-    if (what==2) {
-        _delay_ms(PULSELENGTH2);            //pause
-        PORTA |= (1<<FROMPI);               //signal to pi halt
-        _delay_ms(PULSELENGTH1);
-        PORTA &= ~( 1<<FROMPI);             //one pulse
+#if defined TELEMETRY
+    if (tm_busy()) {                            // telemetry byte on TESTPIN
+        if (!tm_bit(tm_quiet()) && ftx_on)
+            ftx_arm(ftx_lead);                  // the frame waited for it
+        return;
+    }
+#endif
+
+    if (PORTA & (1<<FROMPI)) {                  // pulse ends: release the line
+        DDRA  &= ~(1<<FROMPI);
+        PORTA &= ~( 1<<FROMPI);
+        if (ftx_pos == ftx_pulses) {            // that was the last bit
+            ftx_stop();
+            return;
         }
-    DDRA  &= ~(1<<FROMPI);                  // set to Input again (from Pi)
+        d = FR_LOW;
+    }
+    else {                                      // next pulse: drive the line high
+        DDRA  |= (1<<FROMPI);
+        PORTA |= (1<<FROMPI);
+        i = ftx_pos++ - 1;
+        if (ftx_pos == 1)
+            d = FR_START;
+        else
+            d = (ftx_buf[i >> 3] & (0x80 >> (i & 7))) ? FR_ONE : FR_ZERO;
+    }
+    o = OCR0B + d * FR_COUNTS;                  // next edge, Timer0 counts 0..OCR0A
+    if (o > OCR0A)
+        o -= OCR0A + 1;
+    OCR0B = o;
+}
+
+#if defined TELEMETRY
+//----------------------------------------------------
+// --- Telemetry record, called by the main loop on every pass
+//  measures the pass, sends a record every TM_PERIOD ms and on
+//  every state change, see telemetry.h
+//----------------------------------------------------
+static void tm_poll(void) {
+    struct tm_rec *r;
+    uint16_t t, now = ms_now();
+
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        t = cap_stamp();
+        if (tm_quiet())
+            tm_kick();                          // queued bytes go on
+    }
+    if (!tm_slept && (uint16_t)(t - tm_pass) > tm_loop_max)
+        tm_loop_max = t - tm_pass;
+    tm_pass = t;
+    tm_slept = 0;
+    if (state == tm_state && ((uint16_t)(now - tm_at) < TM_PERIOD || !(TIMSK0 & (1<<OCIE0A))))
+        return;                                 // the ms clock goes on in standby, Timer0 not
+    r = tm_next();
+    if (!r)
+        return;                                 // the one before is still going out
+    tm_state = state;
+    tm_at = now;
+    r->state = state;
+    r->hb_count = hb_count;
+    r->delay_s = (tmr_left(TMR_DELAY) + 999) / 1000;
+    r->events = tm_events;
+    r->tccr1a = TCCR1A;
+    r->tccr1b = TCCR1B;
+    r->ocr1a = OCR1A;
+    r->ocr1b = OCR1B;
+    r->loop_max = tm_loop_max;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        r->inputs = in_state;
+        r->isr_max = tm_isr_max;
+        tm_isr_max = 0;
+    }
+    tm_events = 0;
+    tm_loop_max = 0;
+    tm_send();
+}
+#endif
 
- }
+//----------------------------------------------------
+// --- Halt (1) or reboot (2) to the Pi
+//  as a frame if the Pi speaks frames, else as pulses after its heartbeat
+//----------------------------------------------------
+static void send_pi(uint8_t pulses) {
+    cli();
+    sendnow = pulses;
+    fr_tries = 0;
+    fr_wait = 0;
+    sei();
+}
 
+//-------------------------------------------------------
+// ---- current state of the FSM (used by the host simulation)
+//-------------------------------------------------------
+#if defined HOST_SIM
+uint8_t iswitch_state(void) {
+    return state;
+}
+#endif
 
 //-------------------------------------------------------
-// ---- MAIN Program
+// ---- Initialize Ports, Timers and the FSM
 //-------------------------------------------------------
-int main( void )
+void iswitch_init(void)
 {
-// Set all Ports
-    DDRA   =  1<<LED1 | 1<<VPOWER ;                 // output signals
-    DDRA  &= ~(1<<FROMPI);                          // set to Input (from Pi)
-    DDRA  &= ~(1<<TESTPIN);                        // set to Input (TESTPIN) is used for simulation without pulses from Pi
+    uint8_t mcusr = MCUSR;                          // reset cause, for the event log
+    uint8_t resume, on;
+
+    MCUSR = 0;
+    wdt_set(0);                                     // after a watchdog reset: 16 ms left
+    resume = warm_state(mcusr);
+    on = resume != state0 && warm.vpower;
+
+// Set all Ports, whole registers: after any reset they are 0
+    PORTA  = (on ? 1<<VPOWER : 0)                   // warm restart: the Pi keeps its power
+           | 1<<TESTPIN                             // pullup, TESTPIN is used for simulation without pulses from Pi
                                                     // used for Testing ONLY, must be not connected
                                                     // for normal operation !!
-	DDRB &= ~(1<<AUTO_POWER);                            // input DIP 2 Position 4   auto-power-on
-                                                    
-    PORTA |= (1<<TESTPIN);                         //  set pullup
-    DDRA  &= ~(1<<DELAYTIME);                       // Select Timer values for on/off  (use short for Pi 3)
-    PORTA |= (1<<DELAYTIME);                        //  set pullup
-    PORTB |= (1<<AUTO_POWER);                            // pull up auto-power-on
- 
-    PORTA &= ~(1<<FROMPI);                         // no pullup - has external pulldown
-    PORTA &= ~( 1<<LED1 | 1<<VPOWER );             // all outputs off
-
-    PORTA &= ~(1<<KEY0);                           // no pullup on Key-Input, has external pullup
+           | 1<<DELAYTIME;                          // pullup, Timer values for on/off  (use short for Pi 3)
+                                                    // FROMPI: no pullup - has external pulldown
+                                                    // LED1 off, KEY0: no pullup, has external pullup
+    DDRA   =  1<<LED1 | 1<<VPOWER ;                 // output signals, FROMPI, TESTPIN, DELAYTIME, KEY0 inputs
+    PORTB  =  1<<AUTO_POWER;                        // input DIP 2 Position 4 auto-power-on, pull up
+
+    PCMSK0 = 1<<PCINT2;                            // pin change interrupt on FROMPI: heartbeat capture
+    GIMSK |= 1<<PCIE0;
 
     // TIMER 0 konfig - used for Peter Dannegger's debounce-Functions
     TCCR0A = 1<<WGM01;                             // Timer0 Mode CTC
-    TCCR0B = 1<<CS02 | 1<<CS00;                    // Timer/Counter0 source is F_CPU / 1024
-    OCR0A = F_CPU / 1024.0 * 10e-3 - 0.5;          // 10 ms compare Value for counter/timer (Prescaler: 10ms interrupt)
-    TIMSK0 = 1<<OCIE0A;                             // Enable compare Match interrupt on Timer/Counter 0
+    OCR0A = TICK_COUNTS - 1;                        // 10 ms compare Value for counter/timer (Prescaler: 10ms interrupt)
+    tick_start();                                   // F_CPU / 64, compare match interrupt
                                                     // Achtung: TIMSK für tiny85 und TIMSK0 für tiny44
 
     pwm_init();                                     // setup Timer 1 for variable pulse on PA5 also set PORTB
+    in_seed();                                      // all pull-ups on now: DIP switches as set
     sei();                                          // Interrupt enable
     blinkwhat=0x00;                                 // do not blink
-    first_time = 0xff;                                   //bits for first_time run thru the states
-                                                    // bit 0: state 0
-                                                    // bit 1: state 1
-                                                    // bit 2: state 2
-                                                    // etc.
-    state=state0;                       // state variable
-    PORTA &= ~( 1<<LED1 | 1<<VPOWER);   // all outputs off
-
-    if ( !(PINB & (1<<AUTO_POWER)) )   // check if auto power on is required (dip switch Pos 4 ON)
-            state=state2;           // if YES: next state is state 2   
-        else
-            state=state1;           // if NO: next state is state 1  
+    cal_load();                         // calibrated delays from EEPROM
+    cfg_load();                         // recovery, supply, heartbeat settings from EEPROM
+    el_init(mcusr, on);                 // event log, lifetime counters
+    vcc_init();                         // supply voltage, first value
+#if defined VCC
+    vcc_poll(cfg_get(FR_CFG_VCC) * 100);    // state0 already sees a low supply
+#endif
+
+    if (resume != state0)
+        fsm_resume(resume, on);         // watchdog or brown-out: go on where it was
+    else
+        fsm_enter(state0);              // state0 checks auto power on (dip Switch)
 
    _delay_ms(10);                       // for testing
+}
 
-//
-// ---- Main Loop. forever ---------------------
-// ---- Implements State Machine ---------------
-  for(;;)
-  {
- //   _delay_ms(10);                                // for testing
+//-------------------------------------------------------
+// ---- Transition table: fsm_table[state][event]
+//      T(action on the transition, next state)
+//      see fsm.h, tools/fsmdot.c draws the state diagram from it
+//-------------------------------------------------------
+_Static_assert(STATES <= S_STAY, "next state + 1 in the low nibble of T()");
 
-    switch (state) {
+const uint8_t fsm_table[STATES][EVENTS] PROGMEM = {
 /*------------------------------------------------------------------*/
 /*  state 0  Initial State State                                    */
 /*  is entered upon 5 Volt Power on                                 */
 /*  check if Pi auto power-on is selected  (dip Switch)             */
 /*  if NO --> goto state 1                                          */
 /*  if YES --> goto state 2                                         */
+/*  supply too low: neither, wait for it in state 9                 */
 /*------------------------------------------------------------------*/
-    case state0:
-        if (first_time & (1<<STAT0_FIRST)) {    // first_time time throu ?
-            first_time =0xff;                   // set first_time all other states
-            first_time &= ~(1<<STAT0_FIRST);              // clear first_time this state
-        }
-        tick2=0;
-        pastpulses=0;                       // pulse counter reset (pulses from Pi)
- 
-        if ( !(PINB & (1<<AUTO_POWER)) )   // check if auto power on is required (dip switch Pos 4 ON)
-            state=state2;           // if YES: next state is state 2   
-        else
-            state=state1;           // if NO: next state is state 1  
-
-    break;
- 
+    [state0] = {
+        [EV_VCC_LOW]    = T(A_NONE, state9),
+        [EV_AUTO_POWER] = T(A_NONE, state2),
+        [EV_NONE]       = T(A_NONE, state1),
+    },
 /*------------------------------------------------------------------*/
 /*  state 1  Stand-by State, all is off, waiting for short keypress  */
 /*  Power to Pi ist off, led blinks short pulses                                 */
 /*  Waiting for short keypress                                      */
+/*  if Testpin is low: TESTMODE                                     */
+/*  Key held FR_CFG_HOLD: TESTMODE as well, no jumper needed        */
+/*  supply too low: state 9, the key does nothing there             */
 /*------------------------------------------------------------------*/
-    case state1:
-
-        if (first_time & (1<<STAT1_FIRST)) {    // first_time time throu ?
-            PORTA &= ~( 1<<LED1 | 1<<VPOWER);   // all outputs off
-            key_clear( 1<<KEY0 );
-            blinkwhat=PULSED_Blink;
-            tick2=0;
-            blinkon=1;
-            pwm_stop();							// stop pulse genaration output on PA5
-            pastpulses=0;                       // pulse counter reset (pulses from Pi)
-            first_time =0xff;                   // set first_time all other states
-            first_time &= ~(1<<STAT1_FIRST);    // clear first_time this state
-            }
-        if  (get_key_short( 1<<KEY0 )) {         // get debounced keypress
-            if (!(PINA & (1<<TESTPIN)) )         // if Testpin is low: signalling TESTMODE
-                state=state7;                       // next state is state 7
-            else
-                state=state2;                       // next state is state 2
-            }                                   // leaving standby
-    break;
-
+    [state1] = {
+        [EV_VCC_LOW]    = T(A_NONE, state9),
+        [EV_KEY_SHORT]  = T(A_NONE, state2),
+#if defined TESTMODE
+        [EV_KEY_TEST]   = T(A_NONE, state7),
+        [EV_KEY_HOLD]   = T(A_NONE, state7),
+#endif
+    },
 /*------------------------------------------------------------------*/
 /*  state 2  Tentative Power on, waiting for Pi to come up          */
 /*  Power to Pi ist on, led is blinking fast                        */
 /*  Short keypress switches to state 4   (power on without checking */
 /*  whether Pi is on)                                               */
+/*  Pi did not come on in time: back to stand by                    */
+/*  or, recovering a lost Pi, power cycle it again (state 8)        */
+/*  Time to Pi alive is learned for the power on delay (cal_learn)  */
+/*  Supply too low: halt, like a short keypress in state 4          */
 /*------------------------------------------------------------------*/
-    case state2:
-
-        if (first_time & (1<<STAT2_FIRST)) {     // first_time time throu ?
-            PORTA |= (1<<VPOWER);               //switch 5 volt power on
-            poweron_delay=POWERON_Delay_long;
-            if ( !(PINA & (1<<DELAYTIME)) ) {
-              poweron_delay=POWERON_Delay_short;            // check pin PA6 for delay times (Dip-switch 4 Pos 2 ON)
-            }
-
-            blinkwhat=REGULAR_Blink;
-            blinkint=POWERON_Blink_int;
-            tick2=0;                            //start timer
-            sekunde=0;
-            pwm_start();						            // start pulse generation output on PA5
-            first_time =0xff;                   // set first_time all other states
-            first_time &= ~( 1<<STAT2_FIRST);    // clear first_time this state
-            }
-
-        pwm_check();
-
-        if ((blinkwhat>0) && (sekunde > poweron_delay))  {
-            blinkwhat=0;
-            state=state1;                       // Pi did not come on, so gaback to stand by
-            }
-
-        if  (get_key_short( 1<<KEY0 ))  {        // get debounced keypress short
-            blinkwhat=0;
-            state=state4;
-           }
-                    // how many pi pulses have we received ? if we have Pi is alive
-                    // so we go to state 3 (normal operation state)
-        if (pastpulses > 3) {state=state3;}
-
-    break;
-
+    [state2] = {
+        [EV_PI_ALIVE]   = T(A_LEARN, state3),
+        [EV_VCC_LOW]    = T(A_HALT_NOW, state5),
+        [EV_KEY_SHORT]  = T(A_NONE, state4),
+        [EV_RECOVER]    = T(A_LEARN, state8),
+        [EV_TIMEOUT]    = T(A_LEARN, state1),
+    },
 /*------------------------------------------------------------------*/
 /*  state 3  Power ON Number 1, regular operating state            */
 /*  Power to Pi ist on, led is on                                   */
 /*  Loss of signal from Pi changes state to 5                       */
 /*  Short keypress  signals Pi to shut down, changes state to 5     */
-/*  Long Keypress signals Pi to reboot, stays in state 3            */
+/*  Long Keypress signals Pi to reboot, changes state to 5          */
+/*  and so does a triple click                                      */
+/*  Double click: square wave on/off                                */
+/*  Key held FR_CFG_HOLD: halt at once, without waiting for a       */
+/*  heartbeat (state 5 blinks: let go, a long press cuts the power)  */
+/*  Pi halted from the commandline and is down: power off (state 1) */
+/*  Supply too low: halt, as the short keypress                     */
 /*------------------------------------------------------------------*/
-    case state3:
-        if (first_time & (1<<STAT3_FIRST))  {   // first_time time throu ?
-            PORTA |= (1<<LED1);                // led full on
-            blinkwhat=0;
-            key_clear( 1<<KEY0 );
-            first_time =0xff;                        // set first_time all other states
-            first_time &= ~( 1<<STAT3_FIRST);        // clear first_time this state
-            }
-        pwm_check();						// check various inputs for frequency of pulse on PA5
-
-        if  (get_key_short( 1<<KEY0 )) {         // get debounced keypress short
-            cli();
-            sendnow=1;                          // set flag so IR handler can send signal
-            sei();                               // Interrupt enable
-            state=state5;                          // next state 5
-            poweroff_delay=POWEROFF_Delay_HALT_long;  // Poweroff delay for halt
-            if ( !(PINA & (1<<DELAYTIME)) ) {
-              poweroff_delay=POWEROFF_Delay_HALT_short;        // check pin PA6 for delay times (Dip-switch 4 Pos 2 ON)
-              }
-
-            }
-
-        if( get_key_long( 1<<KEY0 ))   {         // get debounced keypress long
-            cli();
-            sendnow=2;                          // set flag so IR handler can send signal
-            sei();                                 // Interrupt enable
-            state=state5;                          // next state 5
-                                                    // Pi will reboot
-            poweroff_delay=POWEROFF_Delay_REBOOT_long;  // Poweroff delay for halt
-            if ( !(PINA & (1<<DELAYTIME)) ) {
-              poweroff_delay=POWEROFF_Delay_REBOOT_short;   // check pin PA6 for delay times (Dip-switch 4 Pos 2 ON)
-              }
-
-        }
-
-            // check numer of pulses from Pi, zero means: Pi is not alive
-        if (pastpulses < 2 )  {
-            state=state5;                           // ok, start power off sequence
-            poweroff_delay=POWEROFF_Delay_HALT_long;   // Poweroff delay for halt
-        }
-        break;
-
+    [state3] = {
+        [EV_PI_LOST]    = T(A_LOST, state5),
+        [EV_VCC_LOW]    = T(A_HALT, state5),
+        [EV_KEY_SHORT]  = T(A_HALT, state5),
+        [EV_KEY_LONG]   = T(A_REBOOT, state5),
+        [EV_PI_DOWN]    = T(A_NONE, state1),
+        [EV_KEY_DOUBLE] = T(A_SQUARE, S_STAY),
+        [EV_KEY_TRIPLE] = T(A_REBOOT, state5),
+        [EV_KEY_HOLD]   = T(A_HALT_NOW, state5),
+    },
 /*------------------------------------------------------------------*/
 /*  state 4  Power ON Number 2, special operating state             */
 /*  we do not care about pulses from Pi                             */
 /*  Power to Pi ist on, led is on                                   */
 /*  Short keypress  signals Pi to shut down, changes state to 5     */
+/*  and so does a supply too low                                    */
+/*  Double click and key held as in state 3                         */
 /*------------------------------------------------------------------*/
-    case state4:
-        if (first_time & (1<<STAT4_FIRST)) {   // first_time time throu ?
-            PORTA |= (1<<LED1);                // led full on
-            blinkwhat=0;
-            key_clear( 1<<KEY0 );               // ignore keypresses that might have come
-
-            first_time =0xff;                        // set first_time all other states
-            first_time &= ~( 1<<STAT4_FIRST)  ;      // clear first_time this state
-            }
-        pwm_check();                        //  Pulse generation
-                                                //  Check DIP-Switch (PINB0 to PINB2)
-
-        if  (get_key_short( 1<<KEY0 ))  {        // get debounced keypress short
-            cli();
-            sendtopi(1);                        // set flag so IR handler can send signal
-            sei();                               // Interrupt enable
-            state=state5;
-            _delay_ms(10);
-            poweroff_delay=POWEROFF_Delay_HALT_long;  // Poweroff delay for halt
-
-            }
-        break;
-
+    [state4] = {
+        [EV_VCC_LOW]    = T(A_HALT_NOW, state5),
+        [EV_KEY_SHORT]  = T(A_HALT_NOW, state5),
+        [EV_KEY_DOUBLE] = T(A_SQUARE, S_STAY),
+        [EV_KEY_HOLD]   = T(A_HALT_NOW, state5),
+    },
 /*------------------------------------------------------------------*/
 /*  state 5  Activate Power off, prepare to shut off                */
 /*  irrelevant of signals from Pi                                   */
 /*  Power to Pi ist still on, led is blinkng slow                   */
-/*  Short keypress  changes to state 4 (keep power on regardless    */
+/*  Short keypress  changes to state 3 (keep power on regardless    */
 /*  of signal from Pi)                                              */
 /*  Long keypress switches off immediately (goto state 1)           */
-/*  goto stand by state if timer runs out                           */
+/*  Pi reports shutdown complete: switch off at once (goto state 1) */
+/*  goto state 6 if timer runs out (Pi without shutdown hook)       */
+/*  Time to DOWN (halt) or Pi back (reboot) is learned              */
 /*------------------------------------------------------------------*/
-    case state5:
-        if (first_time & (1<<STAT5_FIRST))   {   // first_time time throu ?
-            blinkwhat=REGULAR_Blink;            // set led to blink
-            blinkint=POWEROFF_Blink_int;
-            key_clear( 1<<KEY0 );               // ignore keypresses that might have come
-            pastpulses=0;
-            tick2=0;                            //start timer
-            sekunde=0;
-            first_time =0xff;                        // set first_time all other states
-            first_time &= ~( 1<<STAT5_FIRST)  ;      // clear first_time this state
-            }
-  //          pwm_check();                        //  Pulse generation
-                                                //  Check DIP-Switch (PINB0 to PINB2)
-
-       if  (get_key_short( 1<<KEY0 )) {         // get debounced keypress short
-            state=state3;
-            }
-        if( get_key_long( 1<<KEY0 ))  {          // get debounced keypress long
-            state=state1;                          // next state 5
-                                                    // Pi will reboot
-            }
-
-/*   removed this - not in state diagram
-            // check Signal from Pi, how many pulses have we received
-        if (pastpulses > 4)   {                    // Pi seems to ba alive, ok keep power on
-            state=state3;
-            }
-*/
-            // wait for POWEROFF_Delay sec before switching off 5 Volt supply
-        if ((blinkwhat>0) && (sekunde > poweroff_delay))   {
-            blinkwhat=0;
-            state=state6;                       // next state is state 5
-            }
-
-        break;
+    [state5] = {
+        [EV_KEY_SHORT]  = T(A_NONE, state3),
+        [EV_KEY_LONG]   = T(A_NONE, state1),
+        [EV_PI_DOWN]    = T(A_LEARN, state1),
+        [EV_TIMEOUT]    = T(A_LEARN, state6),
+    },
 /*------------------------------------------------------------------*/
 /*  state 6  Last Chance    (check if Pi rebooted)                  */
 /*  we are about to switch 5 Volt power off                         */
 /*  but before we do that we check the signal from Pi again :       */
 /*  If further pulses came in (Pi rebooted) we keep power on        */
 /*  If no more pulses came in we go to state 1                      */
+/*  or to state 8 if the Pi was lost and recovery is on             */
 /*------------------------------------------------------------------*/
-    case state6:
-        first_time =0xff;                        // set first_time all other states
-        key_clear( 1<<KEY0 );
-
-            // check Signal from Pi
-        if (pastpulses > 3)  {
-            state=state3;
-            }
-        else state=state1;
-
-      break;
-
+    [state6] = {
+        [EV_PI_ALIVE]   = T(A_NONE, state3),
+        [EV_RECOVER]    = T(A_NONE, state8),
+        [EV_NONE]       = T(A_NONE, state1),
+    },
 /*------------------------------------------------------------------*/
-/*  state 7  TESTMODE only                                          */
+/*  state 7  TESTMODE only (make TESTMODE= leaves it out)           */
 /*  Power to Pi is switched on, green led is on                     */
 /*  Orange Led blinks every 3 seconds IF and only if pulses from Pi */
 /*  are ok received.                                                */
 /*  Short keypress: next state is state1 (off)                      */
 /*------------------------------------------------------------------*/
-    case state7:
-        if (first_time & (1<<STAT7_FIRST))   {  // first_time time throu ?
-            PORTA |= (1<<VPOWER);               //switch 5 volt power on
-            PORTA |= (1<<LED1);                // led full on
-            blinkwhat=0;
-            key_clear( 1<<KEY0 );
-            tick2=0;                            //start timer
-            sekunde=0;
-            blink_led();
-            first_time =0xff;                        // set first_time all other states
-            first_time &= ~( 1<<STAT7_FIRST)  ;                // clear first_time this state
-            }
-       if  (get_key_short( 1<<KEY0 )) {         // get debounced keypress short
-            state=state1;
-            }
+    [state7] = {
+        [EV_PI_ALIVE]   = T(A_TESTBLINK, S_STAY),
+        [EV_KEY_SHORT]  = T(A_NONE, state1),
+    },
+/*------------------------------------------------------------------*/
+/*  state 8  Recovery, power cycle of a lost Pi                     */
+/*  Power to Pi is off, led is blinking very slow                   */
+/*  after the backoff time power on again (state 2)                 */
+/*  Short keypress: give up, stand by (state 1)                     */
+/*  Supply too low: no power cycle, state 9                         */
+/*------------------------------------------------------------------*/
+    [state8] = {
+        [EV_VCC_LOW]    = T(A_NONE, state9),
+        [EV_KEY_SHORT]  = T(A_NONE, state1),
+        [EV_TIMEOUT]    = T(A_NONE, state2),
+    },
+/*------------------------------------------------------------------*/
+/*  state 9  Supply too low, waiting for it to recover              */
+/*  Power to Pi is off, led blinks as in stand by                   */
+/*  Keypresses are ignored, no power for the Pi                     */
+/*  Supply VCC_HYST_MV above the threshold: state 0, as after a     */
+/*  mains failure (auto power on or stand by)                       */
+/*------------------------------------------------------------------*/
+    [state9] = {
+        [EV_VCC_OK]     = T(A_NONE, state0),
+        [EV_KEY_SHORT]  = T(A_NONE, S_STAY),
+    },
+};
+
+//-------------------------------------------------------
+// ---- State tables: entry, exit, every pass; events handled
+//-------------------------------------------------------
+const uint8_t fsm_actions[STATES][F_ACTIONS] PROGMEM = {
+    [state0] = { A_INIT,     A_NONE,     A_NONE },
+    [state1] = { A_STANDBY,  A_WAKE,     A_SLEEP },
+    [state2] = { A_POWERON,  A_BLINKOFF, A_PWM },
+    [state3] = { A_RUN,      A_NONE,     A_PWM },
+    [state4] = { A_RUN,      A_NONE,     A_PWM },
+    [state5] = { A_POWEROFF, A_BLINKOFF, A_NONE },
+    [state6] = { A_CHECK,    A_NONE,     A_NONE },
+    [state7] = { A_TEST,     A_NONE,     A_NONE },
+    [state8] = { A_CYCLE,    A_BLINKOFF, A_NONE },
+    [state9] = { A_STANDBY,  A_WAKE,     A_SLEEP },
+};
+
+const uint16_t fsm_events[STATES] PROGMEM = {
+    [state0] = EV(EV_VCC_LOW) | EV(EV_AUTO_POWER),
+    [state1] = EV(EV_VCC_LOW) | EV(EV_KEY_SHORT) | EV_TESTMODE,
+    [state2] = EV(EV_PI_ALIVE) | EV(EV_VCC_LOW) | EV(EV_KEY_SHORT) | EV(EV_RECOVER) | EV(EV_TIMEOUT),
+    [state3] = EV(EV_PI_LOST) | EV(EV_VCC_LOW) | EV(EV_KEY_SHORT) | EV(EV_KEY_LONG) | EV(EV_PI_DOWN)
+               | EV(EV_KEY_DOUBLE) | EV(EV_KEY_TRIPLE) | EV(EV_KEY_HOLD),
+    [state4] = EV(EV_VCC_LOW) | EV(EV_KEY_SHORT) | EV(EV_KEY_DOUBLE) | EV(EV_KEY_HOLD),
+    [state5] = EV(EV_KEY_SHORT) | EV(EV_KEY_LONG) | EV(EV_PI_DOWN) | EV(EV_TIMEOUT),
+    [state6] = EV(EV_PI_ALIVE) | EV(EV_RECOVER),
+    [state7] = EV(EV_PI_ALIVE) | EV(EV_KEY_SHORT),
+    [state8] = EV(EV_VCC_LOW) | EV(EV_KEY_SHORT) | EV(EV_TIMEOUT),
+    [state9] = EV(EV_VCC_OK) | EV(EV_KEY_SHORT),
+};
 
-            // check Signal from Pi blink orange led when 2 pulses have been received
-            if (pastpulses > 2)  {
-                blink_led();
-                pastpulses=0;
-             }
+//-------------------------------------------------------
+// ---- Pi off: 5 Volt, line, square wave (state1, state8, state9)
+//-------------------------------------------------------
+static void pi_off(void)
+{
+    PORTA &= ~( 1<<LED1 | 1<<VPOWER);       // all outputs off
+    cli();
+    tx_stop();                              // Pi has no power, release the line
+    ftx_stop();
+    sendnow=0;
+    peer_framed=0;
+    rx_bits=RX_NONE;
+    rx_ready=0;
+    sei();
+    pi_down=0;
+    pwm_stop();                             // stop pulse genaration output on PA5
+    hb_count=0;
+    el_power(0);                            // log of this power cycle to EEPROM, el_poll()
+}
+
+//-------------------------------------------------------
+// ---- Led blinking every ms, EV_TIMEOUT after s seconds (state2, state5, state8)
+//-------------------------------------------------------
+static void fsm_delay(uint16_t ms, uint16_t s)
+{
+    blinkwhat=REGULAR_Blink;
+    tmr_start(TMR_BLINK, ms, ms);
+    tmr_start(TMR_DELAY, s * 1000UL, 0);        // EV_TIMEOUT
+}
+
+//-------------------------------------------------------
+// ---- Actions of the FSM (entry, exit, transition, every pass)
+//-------------------------------------------------------
+static void fsm_action(uint8_t action)
+{
+    switch (action) {
+    case A_INIT:                                // state0: nothing on yet
+        hb_count=0;                             // heartbeat counter reset (pulses from Pi)
+        break;
+
+    case A_STANDBY:                             // state1, state9: all off, led blink by the watchdog
+        pi_off();
+        key_clear( 1<<KEY0 );
+        blinkwhat=PULSED_Blink;
+        wdt_set(STANDBY_Blink_off);
+#if defined RECOVER
+        rec_on=0;                               // given up, or the key
+        rec_tries=0;
+#endif
+        break;
+
+    case A_WAKE:                                // leaving standby
+        wdt_set(0);                             // standby blink off, reset mode
+        tick_start();
+        break;
+
+    case A_POWERON:                             // state2: switch 5 volt power on
+        PORTA |= (1<<VPOWER);
+        timeout=cfg_get(FR_CFG_POWERON);        // pin PA6 selects delay times (Dip-switch 4 Pos 2 ON)
+        cal_start(FR_CFG_POWERON);              // or the calibration, see cal_learn()
+        fsm_delay(POWERON_Blink_int, timeout);
+        pwm_start();                            // start pulse generation output on PA5
+        el_power(1);
+        break;
+
+    case A_BLINKOFF:
+        blinkwhat=0;
+        tmr_stop(TMR_BLINK);
+        break;
+
+#if defined TESTMODE
+    case A_TEST:                                // state7: power on, green and orange led
+        PORTA |= (1<<VPOWER);
+        el_power(1);
+        blink_led();
+        // fall through
+#endif
+    case A_RUN:                                 // state3, state4: led full on
+        PORTA |= (1<<LED1);
+        blinkwhat=0;
+        key_clear( 1<<KEY0 );                   // ignore keypresses that might have come
+        cal_stop();
+#if defined RECOVER
+        rec_on=0;                               // Pi up (or not checked): recovered
+        rec_up=ms_now();
+#endif
+        break;
+
+    case A_LEARN:
+        cal_learn();
+        break;
+
+    case A_HALT:                                // signal Pi to halt
+        send_pi(1);                             // set flag so the tick can send the signal
+        timeout=cfg_get(FR_CFG_HALT);           // Poweroff delay for halt (DIP, Pi or calibration)
+        cal_start(FR_CFG_HALT);
+        break;
+
+    case A_REBOOT:                              // signal Pi to reboot
+        send_pi(2);
+        timeout=cfg_get(FR_CFG_REBOOT);
+        cal_start(FR_CFG_REBOOT);
+        break;
+
+    case A_LOST:                                // no signal from Pi, start power off sequence
+        timeout=POWEROFF_Delay_HALT_long;
+        cal_stop();                             // Pi silent already, nothing to measure
+#if defined RECOVER
+        if (cfg_get(FR_CFG_RECOVER)) {          // power cycle it, see rec_due()
+            if (ms_now() - rec_up >= REC_STABLE_MS)
+                rec_tries=0;
+            rec_on=1;
+            timeout=cfg_get(FR_CFG_REBOOT);     // a reboot is back by then
+        }
+#endif
+        break;
+
+    case A_HALT_NOW:                            // state4: Pi not checked, send right away
+        send_pi(1);
+        cli();
+        if (!peer_framed) {
+            tx_start(1, 1);                     // halt pulse goes out with the next tick
+            sendnow=0;
+        }
+        sei();
+        timeout=POWEROFF_Delay_HALT_long;
+        cal_stop();
+        break;
+
+    case A_POWEROFF:                            // state5: led blinks slow
+        key_clear( 1<<KEY0 );                   // ignore keypresses that might have come
+        hb_count=0;
+        fsm_delay(POWEROFF_Blink_int, timeout); // timeout set by the transition
+        break;
+
+    case A_CHECK:                               // state6
+        key_clear( 1<<KEY0 );
+        break;
+
+#if defined RECOVER
+    case A_CYCLE:                               // state8: Pi off, led blinks very slow
+        pi_off();
+        rec_tries++;
+        key_clear( 1<<KEY0 );
+        fsm_delay(RECOVER_Blink_int, rec_off());    // EV_TIMEOUT: power on again
+        break;
+#endif
+
+#if defined TESTMODE
+    case A_TESTBLINK:                           // pulses from Pi ok: blink orange led
+        blink_led();
+        hb_count=1;                             // blink again after HB_ALIVE-1 more heartbeats
+        break;
+#endif
+
+#if defined GESTURES
+    case A_SQUARE:                              // state3, state4: double click
+        pwm_toggle();
+        break;
+#endif
+
+    case A_PWM:
+        pwm_check();                            // check various inputs for frequency of pulse on PA5
+        break;
+
+    case A_SLEEP:
+        standby_sleep();                        // power-down until key or watchdog
+        break;
+    }
+}
+
+//-------------------------------------------------------
+// ---- Next event for the current state
+//  only events the state handles are looked at, highest priority
+//  first. Keys: key_gesture() in every state, a gesture the state
+//  does not handle is dropped
+//-------------------------------------------------------
+static uint8_t fsm_event(uint16_t events)
+{
+    uint8_t ev;
+
+    if ((events & EV(EV_PI_ALIVE)) && hb_count >= HB_ALIVE)
+        return EV_PI_ALIVE;
+    if ((events & EV(EV_PI_LOST)) && hb_count == 0)
+        return EV_PI_LOST;
+    if ((events & EV(EV_VCC_LOW)) && vcc_low())
+        return EV_VCC_LOW;                      // before the keys and the DIP switch
+#if defined VCC
+    if ((events & EV(EV_VCC_OK)) && !vcc_low())
+        return EV_VCC_OK;
+#endif
+    if ((ev = key_gesture(events)) != EV_NONE) {
+#if defined TESTMODE
+        if (ev == EV_KEY_SHORT && (events & EV(EV_KEY_TEST)) && (in_state & IN_A(TESTPIN)))
+            return EV_KEY_TEST;                 // Testpin low: signalling TESTMODE
+#endif
+        return ev;
+    }
+    if ((events & EV(EV_PI_DOWN)) && pi_down)
+        return EV_PI_DOWN;
+    if ((events & EV(EV_RECOVER)) && rec_due())
+        return EV_RECOVER;                      // before EV_TIMEOUT, same timer
+    if ((events & EV(EV_TIMEOUT)) && tmr_expired(TMR_DELAY))
+        return EV_TIMEOUT;
+    if ((events & EV(EV_AUTO_POWER)) && (in_state & IN_B(AUTO_POWER)))
+        return EV_AUTO_POWER;                   // dip switch Pos 4 ON
+    return EV_NONE;
+}
+
+//-------------------------------------------------------
+// ---- Enter a state: run its entry action
+//-------------------------------------------------------
+static void fsm_enter(uint8_t next)
+{
+    state=next;
+    fsm_action(pgm_read_byte(&fsm_actions[state][F_ENTRY]));
+    warm.state=state;                   // for a warm restart
+    warm.vpower=(PORTA >> VPOWER) & 1;
+    warm.crc=warm_crc();
+}
+
+//-------------------------------------------------------
+// ---- Warm restart: enter the state the reset interrupted
+//  VPOWER is on already (on), what the reset lost is set up again:
+//  the square wave, the Pi counted as not lost (TMR_HB as without a
+//  period, the next heartbeat starts a new row) and the power off
+//  delay of state5
+//-------------------------------------------------------
+static void fsm_resume(uint8_t s, uint8_t on)
+{
+    if (on) {
+        pwm_start();
+        hb_count=1;
+        hb_last=(uint16_t)ms_now() - HB_PERIOD_MAX - 1;
+        hb_timer(HB_PERIOD_MAX);
+    }
+    if (s == state5)
+        timeout=cfg_get(FR_CFG_HALT);
+    fsm_enter(s);
+}
+
+//-------------------------------------------------------
+// ---- One pass of the Main Loop ----------------
+// ---- Implements State Machine ---------------
+//  look up (state, event) in the table: exit action, transition
+//  action, entry action of the next state. Otherwise the state's
+//  every pass action.
+//-------------------------------------------------------
+void iswitch_loop(void)
+{
+    uint8_t ev, t;
+
+    if (WDTCSR & (1<<WDIE))
+        wdt_fed = 1;                // standby: WDT_vect arms the next blink
+    else
+        wdt_reset();
+    el_poll();                      // event log to EEPROM when due
+    cfg_poll();                     // recovery, supply, heartbeat settings to EEPROM
+#if defined VCC
+    vcc_poll(cfg_get(FR_CFG_VCC) * 100);    // supply voltage, EV_VCC_LOW
+#endif
+
+    ev = fsm_event(pgm_read_word(&fsm_events[state]));
+    t = pgm_read_byte(&fsm_table[state][ev]);
+
+    if (t) {
+#if defined TELEMETRY
+        if (ev != EV_NONE)
+            tm_events |= EV(ev);
+#endif
+        if (T_NEXT(t) != S_STAY) {
+            el_log(ev, state << 4 | T_NEXT(t));
+            fsm_action(pgm_read_byte(&fsm_actions[state][F_EXIT]));
+        }
+        fsm_action(T_ACTION(t));
+        if (T_NEXT(t) != S_STAY)
+            fsm_enter(T_NEXT(t));
     }
+    else
+        fsm_action(pgm_read_byte(&fsm_actions[state][F_DO]));
 
-//----  End of Switch Statement -----------------------------
+//----  End of State Machine -----------------------------
+
+    fr_log();                       // log read by the Pi
+    boot_request();                 // firmware update from the Pi
+#if defined TELEMETRY
+    tm_poll();                      // record stream on TESTPIN
+#endif
 
 //----------------------------------------------------------
 //  Handle Led blinking - fast, slow or pulse
@@ -647,40 +1863,31 @@ int main( void )
     switch (blinkwhat)
     {
 
-    case  REGULAR_Blink:            // blink tempo regular
+    case  REGULAR_Blink:            // blink tempo regular, TMR_BLINK
         {
-        if (tick2==blinkint)        // this is intervall
-            {
+        if (tmr_fired(TMR(TMR_BLINK)))
             PORTA ^= (1<<LED1);
-            tick2=0;
-            }
         }
 
     case PULSED_Blink:              // pulse blink (short pulse)
-        {
-        if (blinkon==1)
-            {
-            if (tick2==STANDBY_Blink_int_off)  {
-                PORTA ^= (1<<LED1);
-                tick2=0;
-                blinkon=0;
-                }
-            }
-        else
-            {
-            if (tick2==STANDBY_Blink_int_on)   {
-                PORTA ^= (1<<LED1);
-                tick2=0;
-                blinkon=1;
-                }
-            }
-        }
-
+        break;                      // done by the watchdog in standby, see WDT_vect
     }
 //---- End Switch blink
-  }
-//---- End of for loop
 }
+
+//-------------------------------------------------------
+// ---- MAIN Program
+//-------------------------------------------------------
+#if !defined HOST_SIM                       // the host simulation has its own main()
+int main( void )
+{
+    iswitch_init();
+
+// ---- Main Loop. forever ---------------------
+    for(;;)
+        iswitch_loop();
+}
+#endif
 //---- End of Program
 /*------------------------------------------------------------*/
 /*------------------------------------------------------------*/
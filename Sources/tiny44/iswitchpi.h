@@ -0,0 +1,25 @@
+/* -----------------------------------------------------------------------
+ * Title: Intelligent Power Switch for Raspberry Pi - FSM entry points
+ * Hardware: ATtiny44
+ * main() calls iswitch_init() once and iswitch_loop() forever.
+ * The host simulation (make sim) drives the same functions.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _ISWITCHPI_H
+#define _ISWITCHPI_H
+
+#include <stdint.h>
+
+void iswitch_init(void);                    // ports, timers, initial state
+void iswitch_loop(void);                    // one pass of the main loop
+uint8_t iswitch_state(void);                // current FSM state (0..9)
+
+// Debounced inputs: key and DIP switches of both ports, debounced
+// together in the 10 ms tick (vertical counters, 4 ticks stable).
+// All are active low, the bits are inverted: 1 = switch on / key down.
+#define IN_A(pin)       (1u << (pin))       // port A in bits 0..7
+#define IN_B(pin)       (1u << ((pin) + 8)) // port B in bits 8..15
+extern volatile uint16_t in_state;
+uint16_t get_in_change(uint16_t mask);      // changed since the last call, cleared
+
+#endif  // ifndef _ISWITCHPI_H
@@ -0,0 +1,188 @@
+/* -----------------------------------------------------------------------
+ * Title: Host backend of the hardware layer (make sim)
+ *
+ * Provides the small subset of avr-libc used by the firmware:
+ * I/O registers and bit names of the ATtiny44, cli()/sei(),
+ * ATOMIC_BLOCK, ISR(), _delay_ms() and the EEPROM block functions.
+ * Registers are plain variables, input registers (PINx) are computed
+ * from the pin model in sim.c. Time only moves forward through the
+ * virtual clock in sim.c, never through the host clock.
+ * Only included via hw.h when compiled with -DHOST_SIM.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _HW_HOST_H
+#define _HW_HOST_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// --- I/O registers -------------------------------------------------
+extern volatile uint8_t PORTA, DDRA, PORTB, DDRB;
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0A, OCR0B, TIMSK0;
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+extern volatile uint16_t OCR1A, OCR1B, TCNT1;
+extern volatile uint8_t TIFR1;              // writes ignored, see the Timer1 model
+extern volatile uint8_t GIMSK, PCMSK0, MCUCR, MCUSR, WDTCSR;
+extern volatile uint8_t ADMUX, ADCSRA;      // ADSC/ADIF follow the conversion model
+
+uint8_t sim_pina(void);                     // pin levels as seen by the MCU
+uint8_t sim_pinb(void);
+#define PINA            sim_pina()
+#define PINB            sim_pinb()
+
+// counter and flag registers follow the virtual clock when read,
+// writes are accepted but ignored (TCNT0=0 / clearing OCF0A)
+volatile uint8_t *sim_tcnt0(void);
+volatile uint8_t *sim_tifr0(void);
+#define TCNT0           (*sim_tcnt0())
+#define TIFR0           (*sim_tifr0())
+
+// ADC result of the last conversion, see sim_vcc()
+volatile uint16_t *sim_adc(void);
+#define ADC             (*sim_adc())
+
+// --- bit names (ATtiny44 datasheet) ---------------------------------
+#define PINA0   0
+#define PINA1   1
+#define PINA2   2
+#define PINA3   3
+#define PINA4   4
+#define PINA5   5
+#define PINA6   6
+#define PINA7   7
+#define PINB0   0
+#define PINB1   1
+#define PINB2   2
+#define PINB3   3
+
+#define WGM00   0                           // TCCR0A
+#define WGM01   1
+#define CS00    0                           // TCCR0B
+#define CS01    1
+#define CS02    2
+#define WGM02   3
+#define TOIE0   0                           // TIMSK0
+#define OCIE0A  1
+#define OCIE0B  2
+#define OCF0A   1                           // TIFR0
+#define OCF0B   2
+
+#define WGM10   0                           // TCCR1A
+#define WGM11   1
+#define COM1B0  4
+#define COM1B1  5
+#define COM1A0  6
+#define COM1A1  7
+#define CS10    0                           // TCCR1B
+#define CS11    1
+#define CS12    2
+#define WGM12   3
+#define WGM13   4
+#define TOIE1   0                           // TIMSK1
+#define OCIE1A  1
+#define OCIE1B  2
+#define TOV1    0                           // TIFR1
+#define OCF1B   2
+
+#define PCIE0   4                           // GIMSK
+#define PCINT2  2                           // PCMSK0
+#define PCINT4  4
+#define SE      5                           // MCUCR
+#define SM1     4
+#define SM0     3
+#define PORF    0                           // MCUSR
+#define EXTRF   1
+#define BORF    2
+#define WDRF    3
+#define WDIF    7                           // WDTCSR
+#define WDIE    6
+#define WDP3    5
+#define WDCE    4
+#define WDE     3
+#define WDP2    2
+#define WDP1    1
+#define WDP0    0
+#define ADEN    7                           // ADCSRA
+#define ADSC    6
+#define ADATE   5
+#define ADIF    4
+#define ADIE    3
+#define ADPS2   2
+#define ADPS1   1
+#define ADPS0   0
+
+// --- interrupts ------------------------------------------------------
+extern volatile uint8_t sim_sreg_i;         // global interrupt flag (I bit in SREG)
+void sim_cli(void);
+void sim_sei(void);
+#define cli()           sim_cli()
+#define sei()           sim_sei()
+
+static inline uint8_t sim_cli_ret(void) { sim_cli(); return 1; }
+static inline void sim_sei_param(const uint8_t *s) { (void)s; sim_sei(); }
+static inline void sim_restore_param(const uint8_t *s) { if (*s) sim_sei(); }
+
+#define ATOMIC_FORCEON      uint8_t sim_sreg_save __attribute__((__cleanup__(sim_sei_param))) = 0
+#define ATOMIC_RESTORESTATE uint8_t sim_sreg_save __attribute__((__cleanup__(sim_restore_param))) = sim_sreg_i
+#define ATOMIC_BLOCK(type)  for (type, sim_todo = sim_cli_ret(); sim_todo; sim_todo = 0)
+
+// interrupt vectors known to the simulator, dispatched from sim.c
+// (vectors the firmware does not define are empty weak functions there)
+#define ISR(vector)     void vector(void)
+void PCINT0_vect(void);
+void WDT_vect(void);
+void TIM1_COMPB_vect(void);
+void TIM1_OVF_vect(void);
+void TIM0_COMPA_vect(void);
+void TIM0_COMPB_vect(void);
+void ADC_vect(void);
+
+// --- sleep modes (avr/sleep.h) ---------------------------------------
+#define SLEEP_MODE_IDLE     0
+#define SLEEP_MODE_ADC      (1<<SM0)
+#define SLEEP_MODE_PWR_DOWN (1<<SM1)
+void sim_sleep(void);
+#define set_sleep_mode(m)   (MCUCR = (MCUCR & ~(1<<SM1 | 1<<SM0)) | (m))
+#define sleep_enable()      (MCUCR |= (1<<SE))
+#define sleep_disable()     (MCUCR &= ~(1<<SE))
+#define sleep_cpu()         sim_sleep()
+
+// --- flash (avr/pgmspace.h), plain memory on the host -----------------
+#define PROGMEM
+#define pgm_read_byte(p)    (*(const uint8_t *)(p))
+#define pgm_read_word(p)    (*(const uint16_t *)(p))
+#define memcpy_P(d, s, n)   memcpy(d, s, n)
+
+// --- self-programming (avr/boot.h), used by boot/boot.c: the flash is
+//     an array in sim.c, carried across sim_boot() like the EEPROM.
+//     A page erase or write costs 4.5 ms of virtual time
+#define SPM_PAGESIZE    64
+#define CTPB            4                   // SPMCSR, writes ignored: a fill overwrites
+extern volatile uint8_t SPMCSR;
+void boot_page_fill(uint16_t a, uint16_t w);
+void boot_page_erase(uint16_t a);
+void boot_page_write(uint16_t a);
+#define boot_spm_busy_wait()
+uint8_t flash_byte(uint16_t a);             // by byte address, as pgm_read_byte() on the AVR
+
+// --- EEPROM (avr/eeprom.h): EEMEM variables are plain memory on the host,
+//     they keep their contents across sim_boot() like the real EEPROM.
+//     A byte written costs 3.4 ms of virtual time, as on the ATtiny44.
+//     All of them in one section: sim.c counts the writes per byte
+#define EEMEM   __attribute__((section("sim_eeprom")))
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+
+// --- RAM not cleared at a reset (.noinit): plain memory on the host,
+//     carried across a simulated watchdog reset like the EEMEM section
+#define NOINIT  __attribute__((section("sim_noinit")))
+
+// --- watchdog (avr/wdt.h)
+void sim_wdr(void);
+#define wdt_reset()     sim_wdr()
+
+// --- delays: advance the virtual clock -------------------------------
+void _delay_ms(double ms);
+void _delay_us(double us);
+
+#endif  // ifndef _HW_HOST_H
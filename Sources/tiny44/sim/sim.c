@@ -0,0 +1,712 @@
+/************************************************************************/
+/*  Host simulation of the ATtiny44 for the iSwitchPi firmware          */
+/*                                                                      */
+/*  Virtual clock, Timer0/Timer1 model, pin model and the main loop     */
+/*  driver. The registers declared in hw_host.h live here.              */
+/*  Time is counted in CPU cycles (F_CPU), it only advances in          */
+/*  _delay_ms() and when the main loop has nothing more to do.          */
+/*                                                                      */
+/*  ADC: a conversion of the bandgap against VCC (sim_vcc()), 13 ADC   */
+/*  clocks, 25 for the first after ADEN. Outside ADC noise reduction    */
+/*  sleep the result has +-1 LSB of noise from the running CPU.         */
+/*                                                                      */
+/*  Watchdog: interrupt and/or reset mode. A reset stops the MCU, the   */
+/*  scenario restarts the firmware in a new process (NOINIT and EEMEM   */
+/*  sections carried over), see sim_main.c                              */
+/*                                                                      */
+/*  Flash: only what the bootloader (boot/boot.c) writes and reads,    */
+/*  the firmware itself is host code. Word 0 is the reset vector: once  */
+/*  it points at FB_BOOT, sim_boot() runs the bootloader first.         */
+/*                                                                      */
+/*  Sleep: sleep_cpu() marks the CPU asleep and returns, the firmware   */
+/*  returns to the main loop right after it. The driver then only       */
+/*  moves on at the next interrupt, exactly like a wakeup.              */
+/************************************************************************/
+
+#include <stdio.h>
+#include <string.h>
+#include <hw.h>
+#include <sim.h>
+#include <iswitchpi.h>
+#include <vcc.h>
+#include <boot.h>
+
+volatile uint8_t PORTA, DDRA, PORTB, DDRB;
+volatile uint8_t TCCR0A, TCCR0B, OCR0A, OCR0B, TIMSK0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1;
+volatile uint16_t OCR1A, OCR1B, TCNT1;
+volatile uint8_t TIFR1;
+volatile uint8_t GIMSK, PCMSK0, MCUCR, MCUSR, WDTCSR;
+volatile uint8_t ADMUX, ADCSRA;
+volatile uint8_t sim_sreg_i;
+volatile uint8_t SPMCSR;
+
+// vectors the firmware does not use
+__attribute__((weak)) void PCINT0_vect(void) {}
+__attribute__((weak)) void WDT_vect(void) {}
+__attribute__((weak)) void TIM0_COMPB_vect(void) {}
+__attribute__((weak)) void TIM1_COMPB_vect(void) {}
+__attribute__((weak)) void TIM1_OVF_vect(void) {}
+__attribute__((weak)) void ADC_vect(void) {}
+
+// pending interrupts, in the priority order of the vector table
+enum { IRQ_PCINT0, IRQ_WDT, IRQ_TIM1_COMPB, IRQ_TIM1_OVF, IRQ_TIM0_COMPA, IRQ_TIM0_COMPB,
+       IRQ_ADC, IRQ_COUNT };
+static void (*const vectors[IRQ_COUNT])(void) = {
+    PCINT0_vect, WDT_vect, TIM1_COMPB_vect, TIM1_OVF_vect, TIM0_COMPA_vect, TIM0_COMPB_vect,
+    ADC_vect };
+
+struct sim_trace sim_trace[SIM_TRACE_MAX];
+uint8_t sim_trace_len;
+uint8_t sim_verbose;
+
+static uint64_t now;                        // virtual clock, cycles
+static uint64_t t0_next;                    // next Timer0 compare match
+static uint32_t t0_ticks;
+static uint64_t wdt_next;                   // next watchdog timeout
+static uint8_t  wdt_last;                   // WDTCSR the timeout was scheduled with
+static uint64_t wdt_reset_at;               // watchdog reset, SIM_NEVER: none
+static uint8_t  stalled;                    // main loop hangs, ISRs go on
+static uint16_t pending;                    // interrupt flags, bit = IRQ_xx
+static uint8_t  in_isr;
+static uint8_t  served;                     // an ISR ran since the last cli()
+static uint8_t  sleeping;
+static uint64_t asleep;                     // cycles spent in sleep mode
+static uint32_t wakeups;
+static uint64_t isr_max;                    // longest ISR, virtual cycles
+static uint8_t  ext_a, ext_b;               // levels driven from outside
+static uint8_t  pina_last;                  // PINA at the last sample
+static uint8_t  state_last;
+static uint32_t contention;                 // both sides drive FROMPI, different levels
+static uint32_t ee_writes;                  // EEPROM bytes written
+static uint32_t ee_wear[512];               // writes per byte of the EEMEM section
+static uint64_t t1_base;                    // start of the running Timer1 period
+static uint64_t t1_end;                     // and its end, the next boundary
+static uint16_t t1_top, t1_ocr;             // OCR1A/OCR1B taken over at its start
+static uint8_t  t1_cs;                      // clock select it runs with
+static uint32_t t1_runts;                   // pulses cut short or stretched
+static uint64_t ux_bit;                     // UART on PA0: cycles per bit, 0: off
+static uint64_t ux_at;                      // next sample point
+static uint8_t  ux_n;                       // bits sampled of this byte, 0: idle
+static uint8_t  ux_level, ux_byte;
+static uint8_t  ux_buf[256];
+static uint16_t ux_len;
+static uint32_t ux_errors;
+static uint16_t vcc_mv;                     // supply voltage, sim_vcc()
+static uint64_t adc_next;                   // end of the running conversion
+static uint8_t  adc_on;                     // ADEN seen: the next one is not the first
+static uint8_t  adc_first;                  // running one is the first after ADEN
+static uint16_t adc_result;
+static uint32_t adc_seed;
+static uint32_t adc_count;
+static uint8_t  flash[FB_BOOT + 512] = {    // as programmed over ISP: the firmware's own
+    0x10, 0xc0, [2 ... FB_BOOT + 511] = 0xff    // reset vector, rjmp past the vector table
+};
+static uint8_t  spm_buf[SPM_PAGESIZE];      // temporary page buffer
+
+static void sample(void);
+static void t1_sync(void);
+static void ux_edge(uint8_t level);
+
+static const uint16_t prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+//---------------------------------------------------------
+// pin model: outputs read back PORTx, inputs the external level
+//
+uint8_t sim_pina(void) {
+    uint8_t ext = ext_a & ~(1<<PINA2);
+    uint8_t pin = (DDRA & PORTA) | (~DDRA & ext);
+    if (simpi_drive())
+        pin |= (1<<PINA2);                  // FROMPI: external pulldown, high wins
+    return pin;
+}
+
+uint8_t sim_pinb(void) {
+    return ((DDRB & PORTB) | (~DDRB & ext_b)) & 0x0f;
+}
+
+void sim_pin(char port, uint8_t bit, uint8_t level) {
+    uint8_t *p = (port == 'A') ? &ext_a : &ext_b;
+    if (level) *p |= (1<<bit);
+    else       *p &= ~(1<<bit);
+    sample();
+}
+
+void sim_key(uint8_t pressed) { sim_pin('A', PINA4, !pressed); }
+uint8_t sim_vpower(void)      { return (DDRA & PORTA) >> PINA1 & 1; }
+uint8_t sim_led1(void)        { return (DDRA & PORTA) >> PINA3 & 1; }
+
+// pin changes: let the Pi model see the shared line, raise PCINT0
+static void sample(void) {
+    uint8_t pina, changed;
+    t1_sync();
+    pina = sim_pina();
+    changed = pina ^ pina_last;
+    if (!changed)
+        return;
+    pina_last = pina;
+    if ((DDRA & ~PORTA & (1<<PINA2)) && simpi_drive())
+        contention++;                       // ATtiny drives low, Pi drives high
+    if ((changed & PCMSK0) && (GIMSK & (1<<PCIE0)))
+        pending |= 1<<IRQ_PCINT0;
+    if (changed & (1<<PINA2))
+        simpi_sample(pina >> PINA2 & 1);
+    if (changed & (1<<PINA0))
+        ux_edge(pina & 1);
+}
+
+//---------------------------------------------------------
+// serial receiver on PA0: samples each bit in its middle, like a UART
+//
+static void ux_run(uint64_t until) {        // sample points before 'until' see ux_level
+    while (ux_n && ux_at < until) {
+        if (ux_n == 1 && ux_level)
+            ux_n = 0;                       // start bit too short: glitch
+        else if (ux_n == 10) {
+            if (!ux_level)
+                ux_errors++;
+            else if (ux_len < sizeof(ux_buf))
+                ux_buf[ux_len++] = ux_byte;
+            ux_n = 0;
+        } else {
+            if (ux_n > 1)
+                ux_byte = ux_byte >> 1 | ux_level << 7;     // LSB first
+            ux_n++;
+        }
+        ux_at += ux_bit;
+    }
+}
+
+static void ux_edge(uint8_t level) {
+    if (!ux_bit)
+        return;
+    ux_run(now);
+    ux_level = level;
+    if (!ux_n && !level) {                  // start bit
+        ux_n = 1;
+        ux_at = now + ux_bit / 2;
+    }
+}
+
+void sim_uart(uint32_t baud) {
+    ux_bit = baud ? F_CPU / baud : 0;
+    ux_n = ux_len = 0;
+    ux_errors = 0;
+    ux_level = sim_pina() & 1;
+}
+
+int sim_uart_read(uint8_t *buf, int max) {
+    int n;
+    ux_run(now + 1);
+    n = ux_len < max ? ux_len : max;
+    memcpy(buf, ux_buf, n);
+    memmove(ux_buf, ux_buf + n, ux_len - n);
+    ux_len -= n;
+    return n;
+}
+
+uint32_t sim_uart_errors(void) { return ux_errors; }
+
+//---------------------------------------------------------
+// Timer0 in CTC mode, compare match A
+//
+static uint32_t t0_period(void) {
+    return (uint32_t)prescale[TCCR0B & 0x07] * (OCR0A + 1);
+}
+
+static void t0_sync(void) {
+    if (t0_period() == 0)
+        t0_next = SIM_NEVER;                // clock source off
+    else if (t0_next == SIM_NEVER)
+        t0_next = now + t0_period();
+}
+
+//---------------------------------------------------------
+// Watchdog, 128 kHz oscillator. WDIE: interrupt, WDE: system reset,
+// both: the interrupt first (WDIE is cleared), the reset at the next
+// timeout unless the ISR sets WDIE again
+//
+static uint64_t wdt_period(void) {
+    return SIM_MS(16) * (1u << ((WDTCSR & 0x07) | (WDTCSR >> 2 & 0x08)));
+}
+
+static void wdt_sync(void) {
+    if (!(WDTCSR & (1<<WDIE | 1<<WDE)))
+        wdt_next = SIM_NEVER;
+    else if (wdt_next == SIM_NEVER || WDTCSR != wdt_last)
+        wdt_next = now + wdt_period();
+    wdt_last = WDTCSR;
+}
+
+void sim_wdr(void) {
+    if (WDTCSR & (1<<WDIE | 1<<WDE))
+        wdt_next = now + wdt_period();
+}
+
+static void wdt_timeout(void) {
+    wdt_next = now + wdt_period();
+    if (WDTCSR & (1<<WDIE)) {
+        pending |= 1<<IRQ_WDT;
+        if (WDTCSR & (1<<WDE))
+            wdt_last = WDTCSR &= ~(1<<WDIE);
+    } else
+        wdt_reset_at = now;                 // the MCU stops here, see sim_run()
+}
+
+volatile uint8_t *sim_tcnt0(void) {
+    static volatile uint8_t tcnt0;
+    uint16_t p = prescale[TCCR0B & 0x07];
+    uint32_t per = t0_period();
+    tcnt0 = 0;
+    if (p && t0_next != SIM_NEVER && t0_next - now <= per)
+        tcnt0 = (per - (uint32_t)(t0_next - now)) / p;   // within a period: 32 bits
+    return &tcnt0;
+}
+
+volatile uint8_t *sim_tifr0(void) {
+    static volatile uint8_t tifr0;
+    tifr0 = (pending & (1<<IRQ_TIM0_COMPA)) ? (1<<OCF0A) : 0;
+    return &tifr0;
+}
+
+//---------------------------------------------------------
+// ADC, input bandgap against VCC (VCC_MUX) whatever ADMUX says
+//
+volatile uint16_t *sim_adc(void) {
+    static volatile uint16_t adc;
+    adc = adc_result;
+    return &adc;
+}
+
+void sim_vcc(uint16_t mv) { vcc_mv = mv; }
+uint32_t sim_adc_conversions(void) { return adc_count; }
+
+static void adc_sync(void) {
+    uint16_t p = 1 << (ADCSRA & 0x07);
+    if (!(ADCSRA & (1<<ADEN))) {
+        ADCSRA &= ~(1<<ADSC);
+        adc_next = SIM_NEVER;
+        adc_on = 0;
+        return;
+    }
+    if (ADCSRA & (1<<ADIF)) {               // written 1: cleared
+        ADCSRA &= ~(1<<ADIF);
+        pending &= ~(1<<IRQ_ADC);
+    }
+    if ((ADCSRA & (1<<ADSC)) && adc_next == SIM_NEVER) {
+        adc_first = !adc_on;
+        adc_on = 1;
+        adc_next = now + (uint64_t)(adc_first ? 25 : 13) * (p < 2 ? 2 : p);
+    }
+}
+
+static void adc_done(uint8_t quiet) {
+    uint32_t r = vcc_mv ? (VCC_BANDGAP_MV * 1024UL + vcc_mv / 2) / vcc_mv : 1023;
+    if (adc_first)
+        r = r * 3 / 4;                      // bandgap not settled yet
+    if (!quiet) {                           // CPU running: +-1 LSB
+        adc_seed = adc_seed * 1103515245 + 12345;
+        r += (adc_seed >> 16) % 3;
+        r -= 1;
+    }
+    adc_result = r > 1023 ? 1023 : r;
+    adc_next = SIM_NEVER;
+    adc_count++;
+    ADCSRA &= ~(1<<ADSC);
+    if (ADCSRA & (1<<ADIE))
+        pending |= 1<<IRQ_ADC;
+}
+
+// the timers keep running in idle sleep only
+static uint8_t clock_off(void) {
+    return sleeping && (MCUCR & (1<<SM1 | 1<<SM0));
+}
+
+static uint64_t t0_due(void) {
+    return clock_off() ? SIM_NEVER : t0_next;
+}
+
+// compare match B: TCNT0 reaches OCR0B, once per Timer0 period
+static uint64_t t0b_due(void) {
+    uint64_t m;
+    if (!(TIMSK0 & (1<<OCIE0B)) || t0_due() == SIM_NEVER || OCR0B > OCR0A)
+        return SIM_NEVER;
+    m = t0_next - t0_period() + (uint64_t)OCR0B * prescale[TCCR0B & 0x07];
+    while (m <= now)
+        m += t0_period();
+    return m;
+}
+
+//---------------------------------------------------------
+// Timer1 square wave (fast PWM, TOP=OCR1A, OC1B on PA5)
+// OCR1A/OCR1B are double buffered, a period runs with the values
+// they had at its start. The clock select bits are not: changed
+// anywhere else than at a period boundary (where the overflow ISR
+// runs) or while OC1B is high, the pulse on PA5 comes out wrong.
+//
+static uint32_t t1_period(void) {
+    return (uint32_t)prescale[t1_cs] * (t1_top + 1);
+}
+
+// end of the high part of the running period
+static uint64_t t1_compb(void) {
+    return t1_base + (uint64_t)(t1_ocr + 1) * prescale[t1_cs];
+}
+
+// periods go by event to event: the clock is moved on only at events,
+// at most once per period, t1_end is the one check on every sample()
+static void t1_sync(void) {
+    uint8_t cs = TCCR1B & 0x07;
+    uint64_t c;
+
+    if (t1_cs && now >= t1_end) {
+        t1_base += (now - t1_base) / t1_period() * t1_period();
+        t1_top = OCR1A;                     // buffers taken over at the boundary
+        t1_ocr = OCR1B;
+        t1_end = t1_base + t1_period();
+    }
+    if (cs == t1_cs)
+        return;
+    if (!t1_cs) {                           // started
+        t1_base = now;
+        t1_top = OCR1A;
+        t1_ocr = OCR1B;
+    } else if (cs) {                        // new prescaler inside the period
+        c = (now - t1_base) / prescale[t1_cs];
+        if (now != t1_base)
+            t1_runts++;
+        t1_base = now - c * prescale[cs];
+    } else if (now > t1_base && now < t1_compb()) {
+        t1_runts++;                         // stopped while the output is high
+    }
+    t1_cs = cs;
+    t1_end = t1_base + t1_period();
+}
+
+// overflow (TOP) and compare match B interrupts
+static uint64_t t1_ovf_due(void) {
+    if (!t1_cs || !(TIMSK1 & (1<<TOIE1)) || clock_off())
+        return SIM_NEVER;
+    return t1_end;
+}
+
+static uint64_t t1_compb_due(void) {
+    if (!t1_cs || !(TIMSK1 & (1<<OCIE1B)) || clock_off())
+        return SIM_NEVER;
+    return t1_compb() > now ? t1_compb() : t1_compb() + t1_period();
+}
+
+double sim_timer1_hz(void) {
+    t1_sync();
+    if (!t1_cs || !(TCCR1A & (1<<COM1B1)))
+        return 0;
+    return (double)F_CPU / t1_period();
+}
+
+double sim_timer1_duty(void) {
+    return sim_timer1_hz() > 0 ? (double)(t1_ocr + 1) / (t1_top + 1) : 0;
+}
+
+uint32_t sim_timer1_runts(void) { return t1_runts; }
+
+static void service(void) {
+    uint64_t start;
+    uint8_t i;
+    while (pending && sim_sreg_i && !in_isr) {
+        for (i = 0; !(pending & (1<<i)); i++)
+            ;
+        pending &= ~(1<<i);
+        if (sleeping) {
+            sleeping = 0;                   // any interrupt wakes the CPU
+            wakeups++;
+        }
+        if (i == IRQ_TIM0_COMPA)
+            t0_ticks++;
+        start = now;
+        in_isr = 1;
+        sim_sreg_i = 0;
+        vectors[i]();
+        sim_sreg_i = 1;
+        in_isr = 0;
+        if (now - start > isr_max)
+            isr_max = now - start;          // only a delay in the ISR moves the clock
+        served = 1;
+        sample();
+    }
+}
+
+// next cycle something happens: timers, watchdog, Pi model. The
+// sources are kept for fire(), the clock goes from event to event
+static uint64_t due_t0, due_t0b, due_t1o, due_t1b, due_pi;
+
+static uint64_t next_event(void) {
+    uint64_t next;
+    t0_sync();
+    t1_sync();
+    wdt_sync();
+    adc_sync();
+    next = due_t0 = t0_due();
+    if ((due_t0b = t0b_due()) < next) next = due_t0b;
+    if ((due_t1o = t1_ovf_due()) < next) next = due_t1o;
+    if ((due_t1b = t1_compb_due()) < next) next = due_t1b;
+    if ((due_pi = simpi_next_event()) < next) next = due_pi;
+    if (wdt_next < next) next = wdt_next;
+    if (adc_next < next) next = adc_next;
+    return next;
+}
+
+// move the clock to 'next' (from next_event()), serve what is due there
+static void fire(uint64_t next) {
+    uint64_t adc = adc_next;
+    if (sleeping)
+        asleep += next - now;
+    now = next;
+    if (now == due_pi)
+        simpi_event();
+    if (now == due_t0b)
+        pending |= 1<<IRQ_TIM0_COMPB;
+    if (now == due_t1o)
+        pending |= 1<<IRQ_TIM1_OVF;
+    if (now == due_t1b)
+        pending |= 1<<IRQ_TIM1_COMPB;
+    if (now == due_t0) {
+        t0_next += t0_period();
+        if (TIMSK0 & (1<<OCIE0A))
+            pending |= 1<<IRQ_TIM0_COMPA;
+    }
+    if (now == adc)
+        adc_done(clock_off());
+    if (now == wdt_next)
+        wdt_timeout();
+    if (wdt_reset_at != SIM_NEVER)
+        return;                             // the MCU is in reset, nothing runs
+    sample();
+    service();
+}
+
+// advance the virtual clock up to cycle 'until', serving all events
+static void advance(uint64_t until) {
+    for (;;) {
+        uint64_t next = next_event();
+        if (next > until) break;
+        fire(next);
+        if (wdt_reset_at != SIM_NEVER)
+            return;
+    }
+    if (until <= now)                       // a delay in the main loop went past it
+        return;
+    if (sleeping)
+        asleep += until - now;
+    now = until;
+}
+
+void sim_cli(void) { sim_sreg_i = 0; served = 0; }
+void sim_sei(void) { sim_sreg_i = 1; service(); }
+
+// an interrupt that became pending before sleep_cpu() wakes at once,
+// ADC noise reduction mode starts a conversion
+void sim_sleep(void) {
+    if ((MCUCR & (1<<SE)) && !served)
+        sleeping = 1;
+    if (sleeping && (MCUCR & (1<<SM1 | 1<<SM0)) == SLEEP_MODE_ADC && (ADCSRA & (1<<ADEN)))
+        ADCSRA |= 1<<ADSC;
+}
+
+void _delay_ms(double ms) {
+    sample();
+    advance(now + (uint64_t)(ms * (F_CPU / 1000)));
+}
+
+void _delay_us(double us) {
+    sample();
+    advance(now + (uint64_t)(us * F_CPU / 1000000));
+}
+
+//---------------------------------------------------------
+// EEPROM, only bytes that differ are written (eeprom_update_block)
+//
+#define EE_WRITE_US     3400
+
+extern uint8_t __start_sim_eeprom[], __stop_sim_eeprom[];  // see EEMEM in hw_host.h
+
+void eeprom_read_block(void *dst, const void *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n) {
+    const uint8_t *s = src;
+    uint8_t *d = dst;
+    for (; n; n--, s++, d++)
+        if (*d != *s) {
+            *d = *s;
+            ee_writes++;
+            if (d >= __start_sim_eeprom && d < __start_sim_eeprom + 512)
+                ee_wear[d - __start_sim_eeprom]++;
+            _delay_us(EE_WRITE_US);
+        }
+}
+
+//---------------------------------------------------------
+// flash, self-programming: erase sets a page to 0xff, write takes the
+// page buffer and empties it
+//
+#define SPM_US          4500
+
+void boot_page_fill(uint16_t a, uint16_t w) {
+    spm_buf[a % SPM_PAGESIZE & ~1] = w;
+    spm_buf[a % SPM_PAGESIZE | 1] = w >> 8;
+}
+
+void boot_page_erase(uint16_t a) {
+    memset(flash + (a % sizeof(flash) & ~(SPM_PAGESIZE - 1)), 0xff, SPM_PAGESIZE);
+    _delay_us(SPM_US);
+}
+
+void boot_page_write(uint16_t a) {
+    memcpy(flash + (a % sizeof(flash) & ~(SPM_PAGESIZE - 1)), spm_buf, SPM_PAGESIZE);
+    memset(spm_buf, 0xff, SPM_PAGESIZE);
+    _delay_us(SPM_US);
+}
+
+uint8_t flash_byte(uint16_t a) {
+    return flash[a % sizeof(flash)];
+}
+
+uint8_t *sim_flash(uint32_t *size) {
+    *size = sizeof(flash);
+    return flash;
+}
+
+//---------------------------------------------------------
+// firmware driver
+//
+static void trace(void) {
+    uint8_t s = iswitch_state();
+    if (s == state_last)
+        return;
+    state_last = s;
+    if (sim_verbose)
+        printf("    %9.3f s  state%u\n", sim_seconds(), s);
+    if (sim_trace_len < SIM_TRACE_MAX) {
+        sim_trace[sim_trace_len].at = now;
+        sim_trace[sim_trace_len].state = s;
+        sim_trace_len++;
+    }
+}
+
+void sim_reset(void) {
+    PORTA = DDRA = PORTB = DDRB = 0;
+    TCCR0A = TCCR0B = OCR0A = OCR0B = TIMSK0 = 0;
+    TCCR1A = TCCR1B = TIMSK1 = 0;
+    OCR1A = OCR1B = TCNT1 = 0;
+    TIFR1 = 0;
+    GIMSK = PCMSK0 = MCUCR = WDTCSR = 0;
+    ADMUX = ADCSRA = 0;
+    vcc_mv = 5000;
+    adc_next = SIM_NEVER;
+    adc_on = 0;
+    adc_result = 0;
+    adc_count = 0;
+    MCUSR = 1<<PORF;                        // power-on reset
+    simpi_reset();
+    sim_sreg_i = 0;
+    now = 0;
+    t0_next = wdt_next = SIM_NEVER;
+    t0_ticks = 0;
+    wdt_last = 0;
+    wdt_reset_at = SIM_NEVER;
+    stalled = 0;
+    pending = 0;
+    in_isr = served = sleeping = 0;
+    asleep = 0;
+    wakeups = 0;
+    isr_max = 0;
+    ext_a = 0xff & ~(1<<PINA2);             // pull-ups everywhere, FROMPI pulled down
+    ext_b = 0x0f;
+    pina_last = sim_pina();
+    state_last = 0xff;
+    contention = 0;
+    t1_cs = 0;
+    t1_runts = 0;
+    ux_bit = 0;
+    SPMCSR = 0;
+    memset(spm_buf, 0xff, sizeof(spm_buf));
+    sim_trace_len = 0;
+}
+
+// reset vector: the bootloader first if it is in (it returns the
+// firmware's entry, or its watchdog reset is pending)
+void sim_boot(void) {
+    if ((flash[0] | flash[1] << 8) == BOOT_VECTOR) {
+        boot_main();
+        if (wdt_reset_at != SIM_NEVER)
+            return;
+    }
+    iswitch_init();
+    trace();
+}
+
+void sim_run(uint64_t cycles) {
+    uint64_t end = now + cycles;
+    service();                              // pin changes made by the scenario
+    while (now < end && wdt_reset_at == SIM_NEVER) {
+        uint64_t next;
+        uint8_t n, before;
+        for (n = 0; n < 8 && !sleeping && !stalled; n++) {  // run the loop until the FSM settles
+            before = iswitch_state();
+            iswitch_loop();
+            sample();
+            trace();
+            if (iswitch_state() == before)
+                break;
+        }
+        next = next_event();                // then jump to the next event
+        if (next <= end)
+            fire(next);
+        else
+            advance(end);
+    }
+}
+
+uint64_t sim_now(void)          { return now; }
+double   sim_seconds(void)      { return (double)now / F_CPU; }
+uint32_t sim_timer0_ticks(void) { return t0_ticks; }
+uint32_t sim_wakeups(void)      { return wakeups; }
+uint64_t sim_isr_max(void)      { return isr_max; }
+uint32_t sim_contention(void)   { return contention; }
+uint32_t sim_eeprom_writes(void) { return ee_writes; }
+
+uint32_t sim_eeprom_wear(void) {
+    uint32_t i, max = 0;
+    for (i = 0; i < 512; i++)
+        if (ee_wear[i] > max)
+            max = ee_wear[i];
+    return max;
+}
+
+// host layout, a few bytes more than on the ATtiny44 (alignment)
+uint8_t *sim_eeprom(uint32_t *size) {
+    *size = __stop_sim_eeprom - __start_sim_eeprom;
+    return __start_sim_eeprom;
+}
+
+extern uint8_t __start_sim_noinit[], __stop_sim_noinit[];  // see NOINIT in hw_host.h
+
+uint8_t *sim_noinit(uint32_t *size) {
+    *size = __stop_sim_noinit - __start_sim_noinit;
+    return __start_sim_noinit;
+}
+
+void sim_stall(void)            { stalled = 1; }
+uint64_t sim_wdt_reset(void)    { return wdt_reset_at; }
+
+// busy cycles plus an estimated cost for every wakeup from sleep
+uint64_t sim_awake_cycles(void) {
+    return now - asleep + (uint64_t)wakeups * SIM_WAKE_CYCLES;
+}
+
+void sim_press(uint32_t ms) {
+    sim_key(1);
+    sim_run(SIM_MS(ms));
+    sim_key(0);
+}
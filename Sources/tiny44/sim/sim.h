@@ -0,0 +1,127 @@
+/* -----------------------------------------------------------------------
+ * Title: iSwitchPi host simulation - virtual clock, pin model, Pi model
+ *
+ * The virtual clock counts CPU cycles at F_CPU. Timer0 compare matches
+ * are generated from TCCR0B/OCR0A exactly like on the ATtiny44, so the
+ * firmware runs unchanged on top of it. Between two events (timer
+ * compare, Pi model activity) the main loop is run until it is idle and
+ * the clock then jumps straight to the next event. This is what makes a
+ * full day of firmware time replay in well under a second.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _SIM_H
+#define _SIM_H
+
+#include <stdint.h>
+
+#define SIM_MS(ms)      ((uint64_t)(ms) * (F_CPU / 1000))
+#define SIM_SEC(s)      ((uint64_t)(s) * F_CPU)
+#define SIM_NEVER       UINT64_MAX
+
+// --- clock and firmware driver --------------------------------------
+void     sim_reset(void);                   // registers and pins to power-on state
+void     sim_boot(void);                    // run firmware init (main() up to the loop),
+                                            // the bootloader first once word 0 points to it
+void     sim_run(uint64_t cycles);          // run firmware for this many cycles
+uint64_t sim_now(void);
+double   sim_seconds(void);
+uint32_t sim_timer0_ticks(void);            // Timer0 compare interrupts served
+uint64_t sim_isr_max(void);                 // longest busy wait inside an ISR, cycles
+uint32_t sim_contention(void);              // FROMPI driven low by the ATtiny, high by the Pi
+uint32_t sim_eeprom_writes(void);           // EEPROM bytes written so far
+uint32_t sim_eeprom_wear(void);             // most writes to one byte (wear levelling)
+uint8_t *sim_eeprom(uint32_t *size);        // the EEMEM variables, as one block
+uint8_t *sim_noinit(uint32_t *size);        // the NOINIT variables, as one block
+uint8_t *sim_flash(uint32_t *size);         // the flash as the bootloader sees it, see boot/boot.h
+void     sim_stall(void);                   // the main loop hangs from now on, ISRs go on
+uint64_t sim_wdt_reset(void);               // cycle of a watchdog reset (sim_run() stops), or SIM_NEVER
+
+// --- power: the CPU is awake unless sleep_cpu() was called ----------
+// Cost of one wakeup from power-down: start-up, ISR entry/exit and a
+// short ISR body. An estimate, the firmware code runs in zero virtual time.
+#define SIM_WAKE_CYCLES 100
+uint32_t sim_wakeups(void);                 // interrupts that ended a sleep
+uint64_t sim_awake_cycles(void);
+
+// --- external pins (level seen at the pin, pull-ups included) -------
+void sim_pin(char port, uint8_t bit, uint8_t level);
+void sim_key(uint8_t pressed);              // pushbutton on KEY0 (active low)
+void sim_press(uint32_t ms);                // press, hold for ms, release
+uint8_t sim_vpower(void);                   // 5 Volt to the Pi on ?
+uint8_t sim_led1(void);
+
+// --- Timer1 square wave as programmed by square.c -------------------
+double sim_timer1_hz(void);                 // 0 if stopped
+double sim_timer1_duty(void);
+uint32_t sim_timer1_runts(void);            // pulses cut short or stretched by a change
+
+// --- supply voltage, read by the ADC through its bandgap (vcc.c) ---
+void sim_vcc(uint16_t mv);                  // from now on, 5000 after sim_reset()
+uint32_t sim_adc_conversions(void);
+
+// --- serial receiver on PA0 (TESTPIN), for the telemetry build -----
+void sim_uart(uint32_t baud);               // decode 8N1 at this rate, 0: off
+int  sim_uart_read(uint8_t *buf, int max);  // bytes received since the last call
+uint32_t sim_uart_errors(void);             // stop bit low: framing errors
+
+// --- state trace -----------------------------------------------------
+#define SIM_TRACE_MAX   64
+struct sim_trace {
+    uint64_t at;                            // cycle of the transition
+    uint8_t  state;                         // state entered
+};
+extern struct sim_trace sim_trace[SIM_TRACE_MAX];
+extern uint8_t sim_trace_len;
+extern uint8_t sim_verbose;
+
+// --- simulated Raspberry Pi (behaves like Sources/python/iswitchpi.py,
+//     or like Sources/cpp/iswitchpid with framed = 1)
+enum sim_pi_state {
+    PI_OFF,                                 // no power
+    PI_BOOTING,
+    PI_RUNNING,                             // script sends heartbeat pulses
+    PI_HALTING,
+    PI_HALTED,                              // down, but still powered
+    PI_REBOOTING,
+    PI_HUNG                                 // powered, but script no longer runs
+};
+struct sim_pi {
+    uint8_t  state;
+    uint32_t boot_ms;                       // power on to first heartbeat
+    uint32_t halt_ms;                       // halt command to down
+    uint32_t reboot_ms;                     // reboot command to first heartbeat
+    uint32_t pulse_ms;                      // heartbeat pulse width (PULSE)
+    uint8_t  framed;                        // speaks the framed protocol, see frame.h
+    uint8_t  hook;                          // framed: shutdown hook sends DOWN when halted
+    uint32_t heartbeats;                    // pulses sent to iSwitchPi
+    uint32_t halts;                         // commands decoded
+    uint32_t reboots;
+    uint32_t boots;
+    uint32_t acks;                          // framed: heartbeats acknowledged
+    uint32_t bad;                           // framed: frames with a bad crc
+    uint64_t cmd_at;                        // cycle the last HALT/REBOOT was decoded
+    uint8_t  reply[4];                      // framed: answer to sim_pi_request(), header first
+    uint8_t  reply_len;                     // 0: none (yet)
+    const uint8_t *image;                   // sim_pi_update(): firmware going up, FB_PAGE each page
+    uint8_t  pages;
+    uint8_t  corrupt;                       // this page goes out once with a bit flipped, 0xff: none
+    uint8_t  quit;                          // the uploader stops before this page, 0xff: not
+    uint32_t written;                       // boot frames: pages ACKed
+    uint32_t naks;                          //              NAKs and frames without answer
+    uint8_t  updated;                       // DONE acknowledged
+};
+extern struct sim_pi sim_pi;
+void sim_pi_hang(void);                     // Pi stops sending heartbeats
+void sim_pi_up(void);                       // powered and running, without a boot (warm restart)
+void sim_pi_halt(void);                     // halt from the Pi's commandline
+void sim_pi_request(uint8_t op, const uint8_t *data, uint8_t len);  // framed: send a request
+void sim_pi_update(const uint8_t *image, uint8_t pages);    // framed: iswitchpid -q update
+
+// --- used by sim.c only ----------------------------------------------
+uint64_t simpi_next_event(void);
+void     simpi_event(void);
+void     simpi_sample(uint8_t line);
+uint8_t  simpi_drive(void);                 // level the Pi drives, 0 if input
+void     simpi_reset(void);
+
+#endif  // ifndef _SIM_H
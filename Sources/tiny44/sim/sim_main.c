@@ -0,0 +1,1303 @@
+/************************************************************************/
+/*  iSwitchPi host simulation - scenario runner                         */
+/*                                                                      */
+/*  Every scenario boots the unchanged firmware on the virtual clock,   */
+/*  drives the pushbutton, DIP switches and the simulated Pi and checks */
+/*  the state transitions. Each scenario runs in its own process, so    */
+/*  all static variables of the firmware start from scratch.            */
+/*                                                                      */
+/*  Usage: iswitchpi-sim [-v] [scenario ...]                            */
+/************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <hw.h>
+#include <sim.h>
+#include <iswitchpi.h>
+#include <frame.h>
+#include <fsm.h>
+#include <eventlog.h>
+#include <telemetry.h>
+#include <timer.h>
+#include <boot.h>
+
+static int failed;
+
+#define CHECK(cond) do { if (!(cond)) { failed++; \
+    printf("    FAIL %s:%d at %.3f s: %s\n", __FILE__, __LINE__, sim_seconds(), #cond); } } while (0)
+
+// run until the FSM is in 'state', at most 'cycles', returns 1 if reached
+static int run_until(uint8_t state, uint64_t cycles) {
+    uint64_t end = sim_now() + cycles;
+    while (sim_now() < end) {
+        if (iswitch_state() == state)
+            return 1;
+        sim_run(SIM_MS(10));
+    }
+    return iswitch_state() == state;
+}
+
+// did the FSM ever enter 'state' ?
+static int visited(uint8_t state) {
+    uint8_t i;
+    for (i = 0; i < sim_trace_len; i++)
+        if (sim_trace[i].state == state)
+            return 1;
+    return 0;
+}
+
+// cycle the FSM last entered 'state'
+static uint64_t entered(uint8_t state) {
+    uint8_t i;
+    uint64_t at = SIM_NEVER;
+    for (i = 0; i < sim_trace_len; i++)
+        if (sim_trace[i].state == state)
+            at = sim_trace[i].at;
+    return at;
+}
+
+// a click where a double click is handled (state3, state4) is taken
+// FR_CFG_CLICK (300 ms) after the release
+static void short_press(void) {
+    sim_press(150);
+    sim_run(SIM_MS(400));
+}
+
+static void long_press(void) {
+    sim_press(1500);
+    sim_run(SIM_MS(100));
+}
+
+// standby, press the button and let the Pi come up
+static void power_on(void) {
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    CHECK(iswitch_state() == 1);
+    short_press();
+    CHECK(iswitch_state() == 2 && sim_vpower());
+    CHECK(run_until(3, SIM_SEC(30)));
+}
+
+//---------------------------------------------------------
+// scenarios
+//
+static void sc_halt(void) {
+    power_on();
+    short_press();                          // state3 -> state5, halt to the Pi
+    CHECK(iswitch_state() == 5);
+    CHECK(run_until(1, SIM_SEC(40)));
+    CHECK(visited(6));
+    CHECK(sim_pi.halts == 1 && sim_pi.reboots == 0);
+    CHECK(!sim_vpower());
+    CHECK(sim_isr_max() == 0);              // no ISR ever waits
+    CHECK(sim_contention() == 0);
+}
+
+static void sc_reboot(void) {
+    power_on();
+    long_press();                           // state3 -> state5, reboot to the Pi
+    CHECK(iswitch_state() == 5);
+    sim_run(SIM_SEC(60));
+    CHECK(visited(6));
+    CHECK(iswitch_state() == 3);            // Pi came back, power stays on
+    CHECK(sim_pi.reboots == 1 && sim_pi.halts == 0);
+    CHECK(sim_vpower());
+    CHECK(sim_isr_max() == 0);
+}
+
+static void sc_pi_dies(void) {
+    power_on();
+    sim_run(SIM_SEC(60));
+    CHECK(iswitch_state() == 3);
+    sim_pi_hang();                          // heartbeats stop
+    CHECK(run_until(5, SIM_SEC(20)));
+    CHECK(run_until(1, SIM_SEC(40)));
+    CHECK(!sim_vpower());
+}
+
+static void sc_short_pulses(void) {
+    sim_pi.pulse_ms = 15;                   // shorter than the old 50 ms sampling
+    power_on();
+    sim_run(SIM_SEC(120));
+    CHECK(iswitch_state() == 3);
+    CHECK(sim_trace_len == 4);              // 0, 1, 2, 3
+}
+
+static void sc_no_boot(void) {
+    uint64_t t0;
+    double d;
+
+    sim_pi.boot_ms = 3600000;               // Pi never comes up
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    short_press();
+    CHECK(iswitch_state() == 2);
+    t0 = sim_trace[sim_trace_len - 1].at;
+    CHECK(run_until(1, SIM_SEC(60)));
+    d = (double)(sim_trace[sim_trace_len - 1].at - t0) / F_CPU;
+    printf("    power on delay %.3f s (POWERON_Delay_long 50 s)\n", d);
+    CHECK(d > 49.99 && d < 50.03);          // TMR_DELAY to a tick, plus a tick or two to the FSM
+    CHECK(!sim_vpower());
+}
+
+static void sc_autopower(void) {
+    sim_pin('B', PINB0, 0);                 // DIP: auto power on
+    sim_boot();
+    sim_run(SIM_MS(100));
+    CHECK(iswitch_state() == 2 && sim_vpower());
+    CHECK(run_until(3, SIM_SEC(30)));
+}
+
+static void sc_state4(void) {
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    short_press();                          // state1 -> state2
+    short_press();                          // state2 -> state4, no Pi check
+    CHECK(iswitch_state() == 4);
+    sim_run(SIM_SEC(30));
+    CHECK(iswitch_state() == 4);
+    short_press();                          // halt, state5
+    CHECK(run_until(1, SIM_SEC(40)));
+    CHECK(sim_pi.halts == 1);
+}
+
+#if defined TESTMODE && !defined TELEMETRY
+static void sc_testmode(void) {
+    sim_pin('A', PINA0, 0);                 // TESTPIN jumper
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    short_press();
+    CHECK(iswitch_state() == 7 && sim_vpower());
+    sim_run(SIM_SEC(1));                    // entry blink of the orange led
+    short_press();
+    CHECK(iswitch_state() == 1);
+}
+#endif
+
+static void sc_square(void) {
+    static const struct { uint8_t b2, b1; double hz; } dip[] = {
+        { 1, 1, 1.0 }, { 1, 0, 10.0 }, { 0, 1, 50.0 }, { 0, 0, 100.0 } };
+    uint8_t i;
+
+    sim_pin('A', PINA7, 0);                 // DIP: square wave on
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    CHECK(sim_timer1_hz() == 0);            // stopped in standby
+    short_press();
+    for (i = 0; i < sizeof dip / sizeof dip[0]; i++) {
+        sim_pin('B', PINB2, dip[i].b2);
+        sim_pin('B', PINB1, dip[i].b1);
+        sim_run(SIM_MS(1100));              // at the end of the running period
+        CHECK(sim_timer1_hz() > dip[i].hz * 0.99 && sim_timer1_hz() < dip[i].hz * 1.01);
+        CHECK(sim_timer1_duty() > 0.05 && sim_timer1_duty() < 0.15);
+    }
+    for (i = 0; i < 6; i++) {               // PB1 bounces, shorter than the debounce
+        sim_pin('B', PINB1, !(i & 1));
+        sim_run(SIM_MS(5));
+    }
+    sim_pin('B', PINB0, 0);                 // auto power on: not a square wave switch
+    sim_run(SIM_MS(100));
+    CHECK(!(TIMSK1 & (1<<TOIE1)) && sim_timer1_hz() > 99 && sim_timer1_hz() < 101);
+    sim_pin('A', PINA7, 1);                 // DIP: square wave off
+    sim_run(SIM_MS(100));
+    CHECK(sim_timer1_hz() == 0);
+    sim_pin('A', PINA7, 0);
+    sim_run(SIM_MS(100));
+    CHECK(sim_timer1_hz() > 99 && sim_timer1_hz() < 101);
+#if defined SQUARE_PI
+    CHECK(sim_timer1_runts() == 0);         // no pulse cut short by a change
+#endif
+    sim_pi_hang();                          // back to standby stops Timer1
+    CHECK(run_until(1, SIM_SEC(120)));
+    CHECK(sim_timer1_hz() == 0);
+}
+
+static void sc_standby(void) {
+    uint64_t awake;
+    uint32_t wakes, ticks;
+    uint8_t i, led = 0, blinks = 0;
+
+    sim_boot();
+    sim_run(SIM_SEC(10));
+    CHECK(iswitch_state() == 1 && !sim_vpower());
+    awake = sim_awake_cycles();
+    wakes = sim_wakeups();
+    ticks = sim_timer0_ticks();
+    sim_run(SIM_SEC(3600));
+    awake = sim_awake_cycles() - awake;
+    printf("    standby: %llu cycles awake per hour (%.4f %%), %u wakeups, %u Timer0 ticks\n",
+           (unsigned long long)awake, 100.0 * awake / SIM_SEC(3600),
+           sim_wakeups() - wakes, sim_timer0_ticks() - ticks);
+    for (i = 0; i < 250; i++) {             // standby blink still there ?
+        sim_run(SIM_MS(20));
+        if (sim_led1() && !led)
+            blinks++;
+        led = sim_led1();
+    }
+    CHECK(blinks >= 1);
+    short_press();                          // the key still wakes it up
+    CHECK(iswitch_state() == 2 && sim_vpower());
+    CHECK(run_until(3, SIM_SEC(30)));
+}
+
+static void sc_day(void) {
+    struct timespec a, b;
+    double host;
+    uint32_t ticks, ms;
+
+    power_on();
+    ticks = sim_timer0_ticks();
+    ms = ms_now();
+    clock_gettime(CLOCK_MONOTONIC, &a);
+    sim_run(SIM_SEC(86400));
+    clock_gettime(CLOCK_MONOTONIC, &b);
+    host = (b.tv_sec - a.tv_sec) + (b.tv_nsec - a.tv_nsec) / 1e9;
+    ticks = sim_timer0_ticks() - ticks;
+    ms = ms_now() - ms;
+    printf("    24 h firmware time: %u Timer0 ticks, %u heartbeats in %.3f s host time\n",
+           ticks, sim_pi.heartbeats, host);
+    printf("    ms clock: %u ms for 86400000\n", ms);
+    CHECK(iswitch_state() == 3);
+    CHECK(sim_trace_len == 4);              // 0, 1, 2, 3 and nothing after
+    CHECK(ticks > 8000000);
+    CHECK(ms > 86400000 - 20 && ms < 86400000 + 20);
+#if defined TELEMETRY
+    CHECK(host < 3.0);                      // the record stream: 190 compare B interrupts a second more
+#else
+    CHECK(host < 1.0);                      // event to event, one main loop pass per interrupt
+#endif
+}
+
+// Pi speaks frames: command from the key to the Pi in well under 100 ms
+static void sc_framed_halt(void) {
+    uint64_t t;
+
+    sim_pi.framed = 1;
+    power_on();
+    sim_run(SIM_SEC(10));
+    CHECK(sim_pi.acks > 0 && sim_pi.acks + 1 >= sim_pi.heartbeats);
+    short_press();
+    CHECK(iswitch_state() == 5);
+    t = sim_now();
+    while (!sim_pi.halts && sim_now() - t < SIM_SEC(2))
+        sim_run(SIM_MS(10));
+    CHECK(sim_pi.halts == 1 && sim_pi.reboots == 0);
+    printf("    halt: decoded by the Pi %.1f ms after state5\n",
+           (double)(sim_pi.cmd_at - entered(5)) * 1000 / F_CPU);
+    CHECK(sim_pi.cmd_at - entered(5) < SIM_MS(100));
+    CHECK(run_until(1, SIM_SEC(40)));
+    CHECK(sim_pi.bad == 0 && sim_contention() == 0);
+    CHECK(sim_isr_max() == 0);
+}
+
+static void sc_framed_reboot(void) {
+    sim_pi.framed = 1;
+    power_on();
+    long_press();
+    CHECK(iswitch_state() == 5);
+    sim_run(SIM_MS(200));
+    CHECK(sim_pi.reboots == 1 && sim_pi.halts == 0);
+    // here the press falls into a heartbeat frame: REBOOT is its answer
+    CHECK(sim_pi.cmd_at - entered(5) < SIM_MS(120));
+    sim_run(SIM_SEC(60));
+    CHECK(iswitch_state() == 3 && sim_vpower());
+    CHECK(sim_pi.bad == 0 && sim_contention() == 0);
+}
+
+// from standby: power on, then the Pi hangs. Seconds from its first
+// heartbeat to state3 and from its last one to state5, back in state1
+static void liveness(double *boot, double *lost) {
+    uint64_t first, last;
+    uint32_t hb;
+
+    hb = sim_pi.heartbeats;
+    short_press();
+    CHECK(iswitch_state() == 2);
+    while (sim_pi.heartbeats == hb && iswitch_state() == 2)
+        sim_run(SIM_MS(1));
+    first = sim_now();
+    CHECK(run_until(3, SIM_SEC(10)));
+    *boot = (double)(entered(3) - first) / F_CPU;
+    sim_run(SIM_SEC(20));
+    hb = sim_pi.heartbeats;
+    while (sim_pi.heartbeats == hb)
+        sim_run(SIM_MS(1));
+    last = sim_now();
+    sim_run(SIM_MS(500));                   // the heartbeat is through
+    sim_pi_hang();
+    CHECK(run_until(5, SIM_SEC(20)));
+    *lost = (double)(entered(5) - last) / F_CPU;
+    CHECK(run_until(1, SIM_SEC(60)));
+}
+
+// liveness on every heartbeat: alive after 3 of them (two periods),
+// lost after 2 missed ones (two and a half periods), or FR_CFG_MISSED
+static void sc_liveness(void) {
+#if defined CONFIG
+    uint8_t set[2] = { FR_CFG_MISSED, 4 };
+#endif
+    double boot, lost;
+
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    liveness(&boot, &lost);                 // old protocol: 50 ms pulse, 50 ms, 1100 ms
+    printf("    pulses 1.2 s apart: alive %.2f s after the first, lost %.2f s after the last\n",
+           boot, lost);
+    CHECK(boot > 2.4 && boot < 2.5 && lost > 3.0 && lost < 3.1);
+
+    sim_pi.framed = 1;                      // frames 1.1 s apart
+    liveness(&boot, &lost);
+    printf("    frames 1.1 s apart: alive %.2f s after the first, lost %.2f s after the last\n",
+           boot, lost);
+    CHECK(boot > 2.2 && boot < 2.35 && lost > 2.75 && lost < 2.9);
+
+#if defined CONFIG
+    short_press();
+    CHECK(run_until(3, SIM_SEC(30)));
+    sim_pi_request(FR_CONFIG_SET, set, 2);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 3 && sim_pi.reply[2] == 4);
+    long_press();                           // reboot, and cut it: state5 -> state1
+    long_press();
+    CHECK(iswitch_state() == 1);
+    liveness(&boot, &lost);
+    printf("    4 heartbeats missed: lost %.2f s after the last\n", lost);
+    CHECK(lost > 4.94 && lost < 5.1);
+#endif
+}
+
+// status query and config set/get from the Pi
+static void sc_framed_config(void) {
+    uint8_t set[2] = { FR_CFG_HALT, 5 };
+#if defined CONFIG
+    uint8_t bad[2] = { FR_CFG_KEYS, 1 };
+#if !defined VCC
+    uint8_t vcc[2] = { FR_CFG_VCC, 46 };
+#endif
+    uint32_t writes;
+#endif
+
+    sim_pi.framed = 1;
+    sim_pin('A', PINA6, 0);                 // DIP: short delays
+    power_on();
+    sim_pi_request(FR_STATUS_GET, 0, 0);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 4 && sim_pi.reply[0] == FR_HEADER(FR_STATUS, 3));
+    CHECK(sim_pi.reply[1] == 3);
+    CHECK(sim_pi.reply[2] == (FR_ST_VPOWER | FR_ST_SHORT | FR_ST_FREQ));
+    CHECK(sim_pi.reply[3] >= 3);            // heartbeats in a row, alive
+
+#if !defined CONFIG
+    sim_pi_request(FR_CONFIG_GET, set, 1);  // not in this build
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 2 && sim_pi.reply[0] == FR_HEADER(FR_NAK, 1));
+    short_press();                          // halt, the DIP power off delay
+    CHECK(iswitch_state() == 5);
+    CHECK(run_until(1, SIM_SEC(30)));
+    CHECK(entered(6) - entered(5) > SIM_SEC(14));
+#else
+    sim_pi_request(FR_CONFIG_GET, set, 1);  // DIP default, short
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 3 && sim_pi.reply[0] == FR_HEADER(FR_CONFIG, 2));
+    CHECK(sim_pi.reply[1] == FR_CFG_HALT && sim_pi.reply[2] == 15);
+    sim_pi_request(FR_CONFIG_SET, set, 2);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 3 && sim_pi.reply[2] == 5);
+    sim_pi_request(FR_CONFIG_GET, bad, 1);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 2 && sim_pi.reply[0] == FR_HEADER(FR_NAK, 1));
+    writes = sim_eeprom_writes();
+    sim_pi_request(FR_CONFIG_SET, bad, 2);  // no such key: nothing stored
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 2 && sim_pi.reply[0] == FR_HEADER(FR_NAK, 1));
+    sim_pi_request(FR_CONFIG_SET, set, 1);  // value missing
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 2 && sim_pi.reply[0] == FR_HEADER(FR_NAK, 1));
+#if !defined VCC
+    sim_pi_request(FR_CONFIG_SET, vcc, 2);  // not in this build
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 2 && sim_pi.reply[0] == FR_HEADER(FR_NAK, 1));
+#endif
+    CHECK(sim_eeprom_writes() == writes);
+
+    short_press();                          // halt, power off delay now 5 s
+    CHECK(iswitch_state() == 5);
+    CHECK(run_until(1, SIM_SEC(20)));
+    CHECK(entered(6) - entered(5) < SIM_SEC(7));   // DIP short would be 16 s
+#endif
+    CHECK(sim_pi.bad == 0 && sim_contention() == 0);
+}
+
+#if defined SQUARE_PI
+// square wave set by the Pi, 0.1 Hz to 5 kHz
+static void sc_framed_square(void) {
+    static const uint8_t fast[3] = { 50000 >> 8, 50000 & 0xff, 25 };   // 5 kHz, 25 %
+    static const uint8_t slow[3] = { 0, 1, 50 };                        // 0.1 Hz, 50 %
+    static const uint8_t off[3]  = { 0, 10, 0 };
+    static const uint8_t dip[3]  = { 0, 0, 0 };
+    static const uint8_t bad[3]  = { 50001 >> 8, 50001 & 0xff, 10 };
+
+    sim_pi.framed = 1;
+    sim_pin('A', PINA7, 0);                 // DIP: square wave on, 1 Hz
+    power_on();
+    sim_pi_request(FR_SQUARE_SET, fast, 3);
+    sim_run(SIM_SEC(3));                    // 1 Hz period ends first
+    CHECK(sim_pi.reply_len == 4 && sim_pi.reply[0] == FR_HEADER(FR_SQUARE, 3));
+    CHECK(sim_pi.reply[1] == fast[0] && sim_pi.reply[2] == fast[1]);
+    CHECK(sim_pi.reply[3] == (25 | FR_SQ_PI));
+    CHECK(sim_timer1_hz() == 5000 && sim_timer1_duty() == 0.25);
+
+    sim_pi_request(FR_SQUARE_SET, slow, 3);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_timer1_hz() > 0.0999 && sim_timer1_hz() < 0.1001);
+    CHECK(sim_timer1_duty() > 0.499 && sim_timer1_duty() < 0.501);
+    sim_pi_request(FR_SQUARE_SET, off, 3);  // off when the output goes low
+    sim_run(SIM_SEC(12));
+    CHECK(sim_timer1_hz() == 0);
+    sim_pi_request(FR_SQUARE_SET, bad, 3);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 2 && sim_pi.reply[0] == FR_HEADER(FR_NAK, 1));
+    sim_pi_request(FR_SQUARE_SET, dip, 3);  // back to the DIP switches
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 4 && sim_pi.reply[3] == 9);
+    CHECK(sim_timer1_hz() > 0.99 && sim_timer1_hz() < 1.01);
+    CHECK(sim_timer1_runts() == 0);
+    CHECK(sim_pi.bad == 0 && sim_contention() == 0);
+}
+#else
+// built without SQUARE_PI: the DIP switches only, the Pi gets a NAK
+static void sc_framed_square(void) {
+    static const uint8_t fast[3] = { 50000 >> 8, 50000 & 0xff, 25 };
+
+    sim_pi.framed = 1;
+    sim_pin('A', PINA7, 0);                 // DIP: square wave on, 1 Hz
+    power_on();
+    sim_pi_request(FR_SQUARE_SET, fast, 3);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 2 && sim_pi.reply[0] == FR_HEADER(FR_NAK, 1));
+    CHECK(sim_timer1_hz() > 0.99 && sim_timer1_hz() < 1.01);
+    CHECK(sim_pi.bad == 0 && sim_contention() == 0);
+}
+#endif
+
+// shutdown hook on the Pi: power off as soon as it is down, not after the delay
+static void sc_framed_down(void) {
+    sim_pi.framed = 1;
+    sim_pi.hook = 1;
+    power_on();
+    short_press();
+    CHECK(iswitch_state() == 5);
+    CHECK(run_until(1, SIM_SEC(40)));
+    CHECK(!visited(6) && !sim_vpower());
+    printf("    halt: power off %.1f s after state5 (fallback delay 30 s)\n",
+           (double)(entered(1) - entered(5)) / F_CPU);
+    CHECK(entered(1) - entered(5) < SIM_MS(sim_pi.halt_ms + 300));
+    CHECK(sim_pi.bad == 0 && sim_contention() == 0);
+}
+
+// halt typed on the Pi: standby once it is down, not after the 30 s delay
+static void sc_framed_cmdline_halt(void) {
+    sim_pi.framed = 1;
+    sim_pi.hook = 1;
+    power_on();
+    sim_pi_halt();
+    CHECK(run_until(1, SIM_MS(sim_pi.halt_ms + 300)));
+    CHECK(!visited(6) && !sim_vpower());       // Pi lost after 6 s, then down
+}
+
+#if defined CALIBRATE || defined RECOVER
+// config value as iSwitchPi uses it (DIP, set by the Pi or calibrated)
+static uint8_t config_get(uint8_t key) {
+    sim_pi_request(FR_CONFIG_GET, &key, 1);
+    sim_run(SIM_SEC(2));
+    return sim_pi.reply_len == 3 ? sim_pi.reply[2] : 0;
+}
+#endif
+
+#if defined CALIBRATE
+// boot and shutdown delays calibrate themselves, a slower Pi gets longer ones
+static void sc_calibrate(void) {
+    uint8_t i, boot, halt;
+
+    sim_pi.framed = 1;
+    sim_pi.hook = 1;
+    power_on();
+    CHECK(config_get(FR_CFG_POWERON) == 50 && config_get(FR_CFG_HALT) == 30);
+    for (i = 0; i < 4; i++) {               // halt and power on again
+        short_press();
+        CHECK(run_until(1, SIM_SEC(40)));
+        short_press();
+        CHECK(run_until(3, SIM_SEC(60)));
+    }
+    boot = config_get(FR_CFG_POWERON);
+    halt = config_get(FR_CFG_HALT);
+    printf("    calibrated: power on %u s, halt %u s (DIP 50 s, 30 s), %u EEPROM bytes written, "
+           "at most %u times the same\n", boot, halt, sim_eeprom_writes(), sim_eeprom_wear());
+    CHECK(boot > 15 && boot < 50 && halt > 8 && halt < 30);
+    CHECK(sim_eeprom_wear() <= 10);         // 5 power cycles: calibration and event log
+
+    sim_pi.boot_ms = boot * 1000;           // new Pi, boots slower than the calibration
+    short_press();
+    CHECK(run_until(1, SIM_SEC(40)));
+    for (i = 0; i < 6 && iswitch_state() != 3; i++) {
+        short_press();                      // times out, the delay grows
+        run_until(3, SIM_SEC(90));
+    }
+    printf("    slower Pi up after %u tries, power on %u s\n", i, config_get(FR_CFG_POWERON));
+    CHECK(iswitch_state() == 3 && i < 6);
+}
+
+// no shutdown hook: nothing tells when the Pi is down, a halt delay
+// learned from the Pi going quiet would cut it off while still halting
+static void sc_calibrate_nohook(void) {
+    uint8_t i, halt;
+
+    sim_pi.framed = 1;
+    sim_pi.halt_ms = 25000;                 // slow to halt, well after the last frame
+    power_on();
+    for (i = 0; i < 5; i++) {
+        short_press();
+        CHECK(run_until(1, SIM_SEC(40)));
+        short_press();
+        CHECK(run_until(3, SIM_SEC(60)));
+    }
+    halt = config_get(FR_CFG_HALT);
+    printf("    halt %u s, the Pi takes %u s\n", halt, (unsigned)(sim_pi.halt_ms / 1000));
+    CHECK(halt == 30 && halt * 1000UL >= sim_pi.halt_ms);
+}
+#endif
+
+// the firmware starts from scratch. 'before' runs in a child process and
+// takes all statics of the firmware with it, its EEPROM and flash come
+// back through a pipe. mcusr 0: mains failure, only EEPROM and flash keep
+// their contents. Else a reset with power (WDRF: 'before' ends in the
+// watchdog reset), the NOINIT RAM comes back too and the Pi model keeps
+// running
+static void restart(void (*before)(void), uint8_t mcusr) {
+    uint32_t size, ni_size, fl_size, got = 0;
+    uint8_t *ee = sim_eeprom(&size);
+    uint8_t *ni = sim_noinit(&ni_size);
+    uint8_t *fl = sim_flash(&fl_size);
+    uint32_t all = size + ni_size + fl_size;
+    uint8_t buf[all];
+    int fd[2], status;
+    ssize_t n;
+
+    if (pipe(fd) < 0)
+        exit(2);
+    fflush(stdout);
+    if (fork() == 0) {
+        before();
+        memcpy(buf, ee, size);
+        memcpy(buf + size, ni, ni_size);
+        memcpy(buf + size + ni_size, fl, fl_size);
+        if (write(fd[1], buf, all) != (ssize_t)all)
+            failed++;
+        fflush(stdout);
+        _exit(failed ? 1 : 0);
+    }
+    close(fd[1]);
+    while (got < all && (n = read(fd[0], buf + got, all - got)) > 0)
+        got += n;
+    close(fd[0]);
+    wait(&status);
+    CHECK(got == all && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    memcpy(ee, buf, size);
+    memcpy(fl, buf + size + ni_size, fl_size);
+    sim_reset();
+    if (mcusr) {
+        memcpy(ni, buf + size, ni_size);
+        MCUSR = mcusr;
+        if (mcusr & (1<<WDRF))
+            WDTCSR = 1<<WDE;                // still on after its reset, 16 ms
+        sim_pi_up();
+    }
+}
+
+#if defined EVENTLOG || defined RECOVER || defined VCC
+static void mains_cycle(void (*before)(void)) {
+    restart(before, 0);
+}
+#endif
+
+// a record of the event log (or the counters, n = FR_LOG_LIFE) as the Pi
+// reads it: FR_LOG_GET for every 3 bytes. 0: NAK, no such record
+static int log_read(uint8_t n, void *buf, uint8_t size) {
+    uint8_t part, req[2] = { n, 0 };
+    uint64_t end;
+
+    for (part = 0; part * 3 < size; part++) {
+        req[1] = part;
+        sim_pi_request(FR_LOG_GET, req, 2);
+        for (end = sim_now() + SIM_SEC(3); !sim_pi.reply_len && sim_now() < end; )
+            sim_run(SIM_MS(10));
+        if (sim_pi.reply_len != 4 || sim_pi.reply[0] != FR_HEADER(FR_LOG, 3))
+            return 0;
+        memcpy((uint8_t *)buf + part * 3, sim_pi.reply + 1, size - part * 3 < 3 ? size - part * 3 : 3);
+    }
+    return 1;
+}
+
+#if defined EVENTLOG
+// before the mains failure: state4 cycles until the ring wraps, then the
+// Pi dies, does not boot, and a long press cuts the power in state5
+static void eventlog_before(void) {
+    uint8_t i;
+
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    for (i = 0; i < 4; i++) {               // 1 -> 2 -> 4 -> 5 -> 1
+        short_press();
+        short_press();
+        short_press();
+        long_press();
+        CHECK(iswitch_state() == 1);
+    }
+    short_press();
+    CHECK(run_until(3, SIM_SEC(30)));
+    sim_pi_hang();                          // 3 -> 5 lost, 5 -> 6, 6 -> 1
+    CHECK(run_until(5, SIM_SEC(20)));
+    CHECK(run_until(1, SIM_SEC(40)));
+    sim_pi.boot_ms = 3600000;               // 1 -> 2, 2 -> 1 timeout
+    short_press();
+    CHECK(run_until(1, SIM_SEC(60)));
+    sim_pi.boot_ms = 15000;
+    short_press();                          // 1 -> 2 -> 3, reboot 3 -> 5, cut 5 -> 1
+    CHECK(run_until(3, SIM_SEC(30)));
+    long_press();
+    long_press();
+    CHECK(iswitch_state() == 1);
+    printf("    before the mains failure: %u EEPROM bytes written, at most %u times the same\n",
+           sim_eeprom_writes(), sim_eeprom_wear());
+}
+
+// event log and counters survive a mains failure, the Pi reads them
+static void sc_eventlog(void) {
+    static const struct { uint8_t cause, states; } want[] = {     // newest first
+        { EV_PI_ALIVE, 0x23 }, { EV_KEY_SHORT, 0x12 }, { EV_NONE, 0x01 }, { EL_BOOT, 1<<PORF },
+        { EV_KEY_LONG, 0x51 }, { EV_KEY_LONG, 0x35 }, { EV_PI_ALIVE, 0x23 }, { EV_KEY_SHORT, 0x12 },
+        { EV_TIMEOUT, 0x21 }, { EV_KEY_SHORT, 0x12 }, { EV_NONE, 0x61 }, { EV_TIMEOUT, 0x56 },
+        { EV_PI_LOST, 0x35 }, { EV_PI_ALIVE, 0x23 }, { EV_KEY_SHORT, 0x12 }, { EV_KEY_LONG, 0x51 },
+    };
+    struct el_life life;
+    struct el_rec r;
+    uint32_t t = UINT32_MAX;
+    uint8_t n;
+
+    mains_cycle(eventlog_before);
+    sim_pi.framed = 1;
+    power_on();
+    CHECK(log_read(FR_LOG_LIFE, &life, sizeof(life)));
+    printf("    clock %u s, Pi on %u s, %u boots, %u power cycles, %u heartbeat losses\n",
+           life.clock, life.on, life.boots, life.cycles, life.lost);
+    CHECK(life.boots == 2 && life.cycles == 8 && life.lost == 1);
+    CHECK(life.clock > 140 && life.on > 130 && life.on < life.clock);
+    for (n = 0; log_read(n, &r, sizeof(r)); n++) {
+        if (sim_verbose)
+            printf("    %2u: %6u s  cause %2u  state%u -> state%u\n",
+                   n, r.t, r.cause, r.states >> 4, r.states & 15);
+        if (n < sizeof want / sizeof want[0])
+            CHECK(r.cause == want[n].cause && r.states == want[n].states);
+        CHECK(r.t <= t);
+        t = r.t;
+    }
+    CHECK(n == EL_RECORDS + 2);             // ring full, 1 -> 2 and 2 -> 3 still in RAM
+    CHECK(iswitch_state() == 3 && sim_pi.bad == 0 && sim_contention() == 0);
+}
+#endif
+
+#if defined RECOVER
+// before the mains failure: the Pi switches recovery on
+static void recover_before(void) {
+    uint8_t set[2] = { FR_CFG_RECOVER, 3 };
+
+    sim_pi.framed = 1;
+    power_on();
+    sim_pi_request(FR_CONFIG_SET, set, 2);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 3 && sim_pi.reply[2] == 3);
+}
+
+// a hung Pi is power cycled (FR_CFG_RECOVER 3, kept in EEPROM), each
+// time twice as long without power, after 3 tries standby
+static void sc_recover(void) {
+    uint64_t t0, at8 = 0;
+    double off[4] = { 0 };
+    uint8_t i, n = 0;
+
+    mains_cycle(recover_before);
+    sim_pi.framed = 1;
+    sim_pin('A', PINA6, 0);                 // DIP: short delays
+    power_on();
+    CHECK(config_get(FR_CFG_RECOVER) == 3);
+    sim_pi_hang();
+    t0 = sim_now();
+    CHECK(run_until(8, SIM_SEC(40)) && !sim_vpower());
+    CHECK(run_until(3, SIM_SEC(40)));
+    printf("    hung Pi up again after %.1f s\n", (double)(sim_now() - t0) / F_CPU);
+    CHECK(sim_now() - t0 < SIM_SEC(60) && sim_pi.boots == 2);
+
+    sim_run(SIM_SEC(60));                   // up again, but not for long
+    sim_pi.boot_ms = 3600000;               // and then it does not boot any more
+    sim_pi_hang();
+    CHECK(run_until(1, SIM_SEC(300)));
+    for (i = 0; i < sim_trace_len; i++) {
+        if (sim_trace[i].state == 8)
+            at8 = sim_trace[i].at;
+        else if (at8 && n < 4) {
+            off[n++] = (double)(sim_trace[i].at - at8) / F_CPU;
+            at8 = 0;
+        }
+    }
+    printf("    without power %.1f s, %.1f s, %.1f s, then standby\n", off[0], off[1], off[2]);
+    CHECK(n == 3 && off[0] < 5.1 && off[1] > 9.9 && off[1] < 10.1 && off[2] > 19.9 && off[2] < 20.1);
+    CHECK(!sim_vpower() && sim_pi.bad == 0 && sim_contention() == 0);
+}
+#endif
+
+#if defined VCC
+// supply threshold 4.6 V (FR_CFG_VCC 46): a sag to 4.4 V halts the Pi as
+// the key does, it stays off until the supply is 4.8 V again
+static void vcc_before(void) {
+    uint8_t set[2] = { FR_CFG_VCC, 46 };
+    uint64_t t0;
+
+    sim_pi.framed = 1;
+    power_on();
+    sim_pi_request(FR_CONFIG_SET, set, 2);
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 3 && sim_pi.reply[2] == 46);
+    sim_run(SIM_SEC(10));
+    CHECK(iswitch_state() == 3 && sim_pi.halts == 0);
+
+    sim_vcc(4400);
+    t0 = sim_now();
+    CHECK(run_until(5, SIM_SEC(2)));
+    sim_run(SIM_SEC(1));
+    printf("    supply 5.0 V -> 4.4 V: halt decoded by the Pi after %.0f ms, %u conversions\n",
+           (double)(sim_pi.cmd_at - t0) * 1000 / F_CPU, sim_adc_conversions());
+    CHECK(sim_pi.halts == 1 && sim_pi.cmd_at > t0 && sim_pi.cmd_at - t0 < SIM_MS(600));
+    CHECK(run_until(9, SIM_SEC(60)) && !sim_vpower());
+    short_press();                          // no power while the supply is low
+    sim_run(SIM_SEC(5));
+    CHECK(iswitch_state() == 9 && !sim_vpower());
+    sim_vcc(4700);                          // above the threshold, not above the hysteresis
+    sim_run(SIM_SEC(20));
+    CHECK(iswitch_state() == 9);
+    sim_vcc(5000);
+    CHECK(run_until(1, SIM_SEC(10)));
+    short_press();
+    CHECK(iswitch_state() == 2 && sim_vpower());
+}
+
+// and the threshold is still there after a mains failure: with the
+// DIP on auto power no power for the Pi until the supply is good
+static void sc_vcc(void) {
+    mains_cycle(vcc_before);
+    sim_vcc(4400);
+    sim_pin('B', PINB0, 0);                 // DIP: auto power on
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    CHECK(iswitch_state() == 9 && !sim_vpower());
+    sim_vcc(5000);
+    CHECK(run_until(2, SIM_SEC(10)) && sim_vpower());
+    CHECK(sim_contention() == 0);
+}
+#endif
+
+// the main loop hangs: the watchdog resets the MCU, 'stall' for at most
+// this long. The Pi keeps its power up to the reset
+static void hang(uint64_t stall) {
+    uint64_t t0 = sim_now();
+    uint8_t on = sim_vpower();
+
+    sim_stall();
+    sim_run(stall);
+    printf("    main loop hangs in state%u: watchdog reset after %.0f ms\n", iswitch_state(),
+           (double)(sim_wdt_reset() - t0) * 1000 / F_CPU);
+    CHECK(sim_wdt_reset() != SIM_NEVER && sim_wdt_reset() - t0 <= stall);
+    CHECK(sim_vpower() == on);
+}
+
+// before the watchdog reset: the Pi is up, then the main loop hangs
+static void warm_before(void) {
+    power_on();
+    sim_run(SIM_SEC(10));
+    CHECK(iswitch_state() == 3);
+    hang(SIM_MS(1100));                     // 1 s watchdog with the tick running
+}
+
+// after the watchdog reset state3 goes on at once, the Pi keeps its
+// power and its heartbeats keep it there. The reset is counted
+static void sc_warm(void) {
+    struct el_life life;
+#if defined EVENTLOG
+    struct el_rec r;
+#endif
+
+    sim_pi.framed = 1;
+    restart(warm_before, 1<<WDRF);
+    sim_boot();
+    CHECK(iswitch_state() == 3 && sim_vpower() && sim_led1());
+    sim_run(SIM_SEC(30));
+    CHECK(iswitch_state() == 3 && sim_trace_len == 1);      // no state0, nothing after
+    CHECK(sim_pi.boots == 0 && sim_pi.state == PI_RUNNING);  // never without power
+    CHECK(sim_wdt_reset() == SIM_NEVER);
+#if defined EVENTLOG
+    CHECK(log_read(FR_LOG_LIFE, &life, sizeof(life)));
+    printf("    %u boots, %u power cycles, %u resets\n", life.boots, life.cycles, life.resets);
+    CHECK(life.boots == 2 && life.resets == 1);     // the cycle was not flushed yet: lost
+    CHECK(log_read(0, &r, sizeof(r)) && r.cause == EL_BOOT && r.states == 1<<WDRF);
+#else
+    CHECK(!log_read(FR_LOG_LIFE, &life, sizeof(life)));    // no event log: NAK
+#endif
+    short_press();                          // and a halt works as ever
+    CHECK(run_until(1, SIM_SEC(40)) && !sim_vpower());
+    CHECK(sim_pi.halts == 1 && sim_pi.bad == 0 && sim_contention() == 0);
+}
+
+// before the watchdog reset: standby, with the DIP on auto power on
+static void warm_standby_before(void) {
+    sim_pin('B', PINB0, 0);
+    sim_boot();
+    CHECK(run_until(3, SIM_SEC(30)));
+    short_press();
+    CHECK(run_until(1, SIM_SEC(60)) && !sim_vpower());
+    sim_run(SIM_SEC(5));
+    hang(SIM_MS(4200));                     // one blink period unfed, then the next one
+}
+
+// in standby the watchdog blinks and guards: a hang is reset as well, the
+// Pi stays off although auto power on is set (the Pi model follows VPOWER)
+static void sc_warm_standby(void) {
+    restart(warm_standby_before, 1<<WDRF);
+    sim_pin('B', PINB0, 0);
+    sim_boot();
+    sim_run(SIM_SEC(10));
+    CHECK(iswitch_state() == 1 && !sim_vpower() && sim_trace_len == 1);
+    CHECK(sim_pi.state == PI_OFF);
+    short_press();
+    CHECK(run_until(3, SIM_SEC(30)));
+}
+
+// a power on reset with the same RAM is a cold start: state0, auto power on
+static void sc_cold_reset(void) {
+    restart(warm_standby_before, 1<<PORF);
+    sim_pin('B', PINB0, 0);
+    sim_boot();
+    CHECK(run_until(2, SIM_SEC(1)) && sim_vpower() && visited(0));
+}
+
+//---------------------------------------------------------
+// firmware update: a made-up image, word 0 an rjmp past the vectors
+//
+#define UP_PAGES        47
+static uint8_t image[UP_PAGES * FB_PAGE];
+
+static void image_make(void) {
+    uint32_t i, x = 1;
+    for (i = 0; i < sizeof(image); i++) {
+        x = x * 1103515245 + 12345;
+        image[i] = x >> 16;
+    }
+    image[0] = 0x10;                        // rjmp to word 0x11
+    image[1] = 0xc0;
+}
+
+// the image is in: word 0 to the bootloader, the rest as sent, the
+// firmware's own vector and VALID in the boot record
+static int image_in(void) {
+    uint32_t size, i;
+    uint8_t *fl = sim_flash(&size);
+    for (i = 2; i < sizeof(image); i++)
+        if (fl[i] != image[i])
+            return 0;
+    return (fl[0] | fl[1] << 8) == BOOT_VECTOR && boot_ee.entry == 0x11 && boot_ee.flag == BOOT_VALID;
+}
+
+// before: the Pi is up and sends an update, one page with a bit wrong.
+// Ends in the watchdog reset that starts the new firmware
+static void update_before(void) {
+    uint64_t t0;
+
+    power_on();
+    sim_run(SIM_SEC(5));
+    sim_pi_update(image, UP_PAGES);
+    sim_pi.corrupt = 7;
+    t0 = sim_now();
+    sim_run(SIM_SEC(60));
+    printf("    %u pages in %.1f s, %u NAK\n", sim_pi.written,
+           (double)(sim_wdt_reset() - t0) / F_CPU, sim_pi.naks);
+    CHECK(sim_wdt_reset() != SIM_NEVER && sim_pi.updated);
+    CHECK(sim_pi.written == UP_PAGES && sim_pi.naks == 1);
+    CHECK(sim_vpower() && sim_pi.state == PI_RUNNING && sim_pi.boots == 1);     // power all along
+}
+
+// the new firmware comes in through the bootloader and goes on warm in
+// state3, the Pi never lost its power
+static void sc_update(void) {
+    image_make();
+    sim_pi.framed = 1;
+    restart(update_before, 1<<WDRF);
+    CHECK(image_in());
+    sim_boot();
+    CHECK(iswitch_state() == 3 && sim_vpower() && sim_trace_len == 1);
+    sim_run(SIM_SEC(30));
+    CHECK(iswitch_state() == 3 && sim_pi.acks > 20 && sim_pi.bad == 0);
+    short_press();
+    CHECK(run_until(1, SIM_SEC(40)) && !sim_vpower() && sim_pi.halts == 1);
+}
+
+// before: UPDATE is ACKed, the uploader dies before the first page
+static void fallback_before(void) {
+    power_on();
+    sim_run(SIM_SEC(5));
+    sim_pi_update(image, UP_PAGES);
+    sim_pi.quit = 0;
+    sim_run(SIM_SEC(30));
+    CHECK(sim_wdt_reset() != SIM_NEVER && !sim_pi.updated && sim_pi.written == 0);
+    CHECK(boot_ee.flag == BOOT_WAITING && sim_vpower());
+}
+
+// the bootloader's watchdog runs out, the old firmware is untouched and
+// goes on warm (word 0 is still its own)
+static void sc_update_fallback(void) {
+    uint32_t size;
+    uint8_t *fl = sim_flash(&size);
+
+    image_make();
+    sim_pi.framed = 1;
+    restart(fallback_before, 1<<WDRF);
+    CHECK(fl[0] == 0x10 && fl[1] == 0xc0);
+    sim_boot();
+    CHECK(iswitch_state() == 3 && sim_vpower() && sim_trace_len == 1);
+    sim_run(SIM_SEC(10));
+    CHECK(iswitch_state() == 3 && sim_pi.acks > 5);
+}
+
+// before: the uploader dies after 20 pages
+static void interrupted_before(void) {
+    power_on();
+    sim_run(SIM_SEC(5));
+    sim_pi_update(image, UP_PAGES);
+    sim_pi.quit = 20;
+    sim_run(SIM_SEC(60));
+    CHECK(sim_wdt_reset() != SIM_NEVER && sim_pi.written == 20 && boot_ee.flag == 0xff);
+}
+
+// then: the reset goes to the bootloader, which waits with the Pi powered.
+// The Pi's UPDATE frames go unanswered, HELLO gets through
+static void resume_before(void) {
+    sim_pi_update(image, UP_PAGES);
+    sim_boot();
+    CHECK(sim_wdt_reset() != SIM_NEVER && sim_pi.updated && sim_vpower());
+    CHECK(sim_trace_len == 0);              // the firmware never ran
+}
+
+// an update cut off halfway: no firmware, the bootloader stays until
+// the image is whole
+static void sc_update_interrupted(void) {
+    image_make();
+    sim_pi.framed = 1;
+    restart(interrupted_before, 1<<WDRF);
+    restart(resume_before, 1<<WDRF);
+    CHECK(image_in());
+    sim_boot();
+    CHECK(iswitch_state() == 3 && sim_vpower());
+}
+
+#if defined GESTURES
+// ms from 'at' to the last entry of 'state'
+static double since(uint8_t state, uint64_t at) {
+    return (double)(int64_t)(entered(state) - at) * 1000.0 / F_CPU;
+}
+
+// key gestures, each taken as soon as the state can tell it apart
+static void sc_gestures(void) {
+    uint64_t t;
+
+    sim_pin('A', PINA7, 0);                 // DIP: square wave on, 1 Hz
+    sim_boot();
+    sim_run(SIM_SEC(1));
+    sim_press(150);                         // standby: hold is handled, the click at the release
+    t = sim_now();
+    sim_run(SIM_MS(100));
+    CHECK(iswitch_state() == 2 && since(2, t) < 50);
+    printf("    click: state1 -> state2 %.0f ms after the release\n", since(2, t));
+    sim_key(1);                             // state2: nothing but the click, at the press
+    t = sim_now();
+    sim_run(SIM_MS(100));
+    CHECK(iswitch_state() == 4 && since(4, t) < 50);
+    printf("    click: state2 -> state4 %.0f ms after the press\n", since(4, t));
+    sim_run(SIM_MS(500));
+    sim_key(0);                             // the rest of that press does nothing
+    sim_run(SIM_SEC(1));
+    CHECK(iswitch_state() == 4 && sim_timer1_hz() > 0.99 && sim_timer1_hz() < 1.01);
+
+    sim_press(100);                         // double click: square wave off
+    sim_run(SIM_MS(150));
+    sim_press(100);
+    sim_run(SIM_MS(1200));                  // at the end of the running period
+    CHECK(iswitch_state() == 4 && sim_timer1_hz() == 0);
+    sim_press(100);                         // and on again
+    sim_run(SIM_MS(150));
+    sim_press(100);
+    sim_run(SIM_MS(1200));
+    CHECK(iswitch_state() == 4 && sim_timer1_hz() > 0.99 && sim_timer1_hz() < 1.01);
+    CHECK(sim_timer1_runts() == 0);
+
+    sim_run(SIM_SEC(10));                   // the Pi is up
+    sim_key(1);                             // hold: halt at once, the power stays on
+    t = sim_now();
+    CHECK(run_until(5, SIM_SEC(6)));
+    printf("    hold: halt %.0f ms after the press\n", since(5, t));
+    CHECK(since(5, t) >= 5000 && since(5, t) < 5050);
+    sim_run(SIM_SEC(3));                    // held on: no long press, no power off
+    CHECK(iswitch_state() == 5 && sim_vpower() && sim_pi.halts == 1);
+    sim_key(0);
+    sim_run(SIM_SEC(1));
+    CHECK(iswitch_state() == 5);            // the release is no click
+    CHECK(run_until(1, SIM_SEC(60)));       // Pi down: off as after any halt
+
+    sim_key(1);                             // standby, hold: TESTMODE without the jumper
+    CHECK(run_until(7, SIM_SEC(6)));
+    CHECK(sim_vpower());
+    sim_run(SIM_SEC(1));
+    sim_key(0);
+    sim_run(SIM_SEC(1));
+    CHECK(iswitch_state() == 7);
+    sim_key(1);                             // state7: off at the press
+    sim_run(SIM_MS(100));
+    CHECK(iswitch_state() == 1);
+    sim_key(0);
+
+    sim_run(SIM_SEC(1));
+    short_press();
+    CHECK(run_until(3, SIM_SEC(30)));
+    sim_press(150);                         // state3: click once no double click can come
+    t = sim_now();
+    CHECK(run_until(5, SIM_SEC(1)));
+    printf("    click: state3 -> state5 %.0f ms after the release (FR_CFG_CLICK 300 ms)\n", since(5, t));
+    CHECK(since(5, t) >= 300 && since(5, t) < 360);   // plus the debounce
+    CHECK(run_until(1, SIM_SEC(40)));
+    CHECK(sim_pi.halts == 2 && sim_pi.reboots == 0);   // the hold and this one
+}
+
+// key timing set by the Pi: a slow triple click, a short hold
+static void sc_gesture_config(void) {
+    uint8_t click[2] = { FR_CFG_CLICK, 5 }, hold[2] = { FR_CFG_HOLD, 20 };
+    uint64_t t;
+    uint8_t i;
+
+    sim_pi.framed = 1;
+    power_on();
+    sim_pi_request(FR_CONFIG_SET, click, 2);        // 500 ms
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 3 && sim_pi.reply[1] == FR_CFG_CLICK && sim_pi.reply[2] == 5);
+    sim_pi_request(FR_CONFIG_SET, hold, 2);         // 2 s
+    sim_run(SIM_SEC(2));
+    CHECK(sim_pi.reply_len == 3 && sim_pi.reply[2] == 20);
+
+    for (i = 0; i < 3; i++) {               // 400 ms apart: one gesture
+        if (i)
+            sim_run(SIM_MS(400));
+        sim_press(100);
+    }
+    t = sim_now();
+    CHECK(run_until(5, SIM_MS(100)));       // triple click: nothing longer, at the release
+    printf("    triple click: reboot %.0f ms after the release\n", since(5, t));
+    CHECK(since(5, t) < 50);
+    CHECK(run_until(3, SIM_SEC(60)));
+    CHECK(sim_pi.reboots == 1 && sim_pi.halts == 0);
+
+    sim_key(1);
+    t = sim_now();
+    CHECK(run_until(5, SIM_SEC(3)));        // hold: halt
+    CHECK(since(5, t) >= 2000 && since(5, t) < 2050 && sim_vpower());
+    sim_key(0);
+    CHECK(run_until(1, SIM_SEC(60)));
+    CHECK(sim_pi.halts == 1);
+    CHECK(sim_pi.bad == 0 && sim_contention() == 0);
+}
+#endif
+
+#if defined TELEMETRY
+// telemetry records decoded from TESTPIN, see tm_run()
+static struct {
+    uint32_t records, bad, lost;
+    uint8_t  seq, states;
+    uint16_t events;
+    struct tm_rec last;
+    uint8_t  buf[64];
+    uint8_t  len;
+} tm;
+
+// run, decode the UART on TESTPIN on the way
+static void tm_run(uint64_t cycles) {
+    uint64_t end = sim_now() + cycles;
+    struct tm_rec r;
+    uint8_t i, crc;
+
+    while (sim_now() < end) {
+        sim_run(SIM_MS(100));
+        tm.len += sim_uart_read(tm.buf + tm.len, sizeof(tm.buf) - tm.len);
+        while (tm.len >= sizeof(r)) {
+            if (tm.buf[0] != TM_SYNC) {
+                memmove(tm.buf, tm.buf + 1, --tm.len);
+                continue;
+            }
+            for (i = crc = 0; i < sizeof(r); i++)
+                crc = fr_crc8(crc, tm.buf[i]);
+            if (crc) {
+                tm.bad++;
+                memmove(tm.buf, tm.buf + 1, --tm.len);
+                continue;
+            }
+            memcpy(&r, tm.buf, sizeof(r));
+            tm.len -= sizeof(r);
+            memmove(tm.buf, tm.buf + sizeof(r), tm.len);
+            if (tm.records && r.seq != (uint8_t)(tm.seq + 1))
+                tm.lost += (uint8_t)(r.seq - tm.seq - 1);
+            tm.seq = r.seq;
+            tm.records++;
+            tm.states |= 1 << r.state;
+            tm.events |= r.events;
+            tm.last = r;
+            if (sim_verbose)
+                printf("    %9.3f s  tm %3u state%u hb %u left %u ev %03x in %04x isr %u loop %u\n",
+                       sim_seconds(), r.seq, r.state, r.hb_count, r.delay_s, r.events,
+                       r.inputs, r.isr_max, r.loop_max);
+        }
+    }
+}
+
+// telemetry build: records on TESTPIN, the frames to the Pi go on undisturbed
+static void sc_telemetry(void) {
+    uint8_t i, key = FR_CFG_HALT;
+
+    sim_uart(TM_BAUD);
+    sim_pi.framed = 1;
+    sim_boot();
+    tm_run(SIM_SEC(1));
+    short_press();
+    tm_run(SIM_SEC(20));
+    CHECK(iswitch_state() == 3);
+    sim_pi_request(FR_CONFIG_GET, &key, 1);
+    tm_run(SIM_SEC(5));
+    CHECK(sim_pi.reply_len == 3 && sim_pi.reply[1] == key);
+    short_press();
+    for (i = 0; i < 40 && iswitch_state() != 1; i++)
+        tm_run(SIM_SEC(1));
+    CHECK(iswitch_state() == 1 && sim_pi.halts == 1);
+    tm_run(SIM_SEC(1));                     // the record of state1
+    i = tm.records;
+    tm_run(SIM_SEC(10));                    // standby: asleep, no more records
+    printf("    %u records, %u bad, %u lost, %u framing errors\n",
+           tm.records, tm.bad, tm.lost, sim_uart_errors());
+    CHECK(tm.records > 50 && tm.records == i);
+    CHECK(tm.bad == 0 && tm.lost == 0 && sim_uart_errors() == 0);
+    CHECK((tm.states & 0x2e) == (1<<state1 | 1<<state2 | 1<<state3 | 1<<state5));
+    CHECK(tm.events & EV(EV_KEY_SHORT) && tm.events & EV(EV_PI_ALIVE));
+    CHECK(tm.last.state == 1 && (sim_pina() & 1));
+    CHECK(sim_pi.acks + 1 >= sim_pi.heartbeats && sim_pi.bad == 0 && sim_contention() == 0);
+}
+#endif
+
+static const struct {
+    const char *name;
+    void (*run)(void);
+} scenarios[] = {
+    { "halt",      sc_halt },
+    { "reboot",    sc_reboot },
+    { "pi_dies",   sc_pi_dies },
+    { "short_pulses", sc_short_pulses },
+    { "no_boot",   sc_no_boot },
+    { "autopower", sc_autopower },
+    { "state4",    sc_state4 },
+#if defined TESTMODE && !defined TELEMETRY  // TESTPIN is the telemetry output
+    { "testmode",  sc_testmode },
+#endif
+    { "square",    sc_square },
+    { "standby",   sc_standby },
+    { "day",       sc_day },
+    { "framed_halt",   sc_framed_halt },
+    { "framed_reboot", sc_framed_reboot },
+    { "liveness",      sc_liveness },
+    { "framed_config", sc_framed_config },
+    { "framed_square", sc_framed_square },
+    { "framed_down",   sc_framed_down },
+    { "framed_cmdline_halt", sc_framed_cmdline_halt },
+#if defined CALIBRATE
+    { "calibrate",     sc_calibrate },
+    { "calibrate_nohook",   sc_calibrate_nohook },
+#endif
+#if defined EVENTLOG
+    { "eventlog",      sc_eventlog },
+#endif
+#if defined RECOVER
+    { "recover",       sc_recover },
+#endif
+#if defined VCC
+    { "vcc",           sc_vcc },
+#endif
+    { "warm",          sc_warm },
+    { "warm_standby",  sc_warm_standby },
+    { "cold_reset",    sc_cold_reset },
+    { "update",        sc_update },
+    { "update_fallback",    sc_update_fallback },
+    { "update_interrupted", sc_update_interrupted },
+#if defined GESTURES
+    { "gestures",      sc_gestures },
+    { "gesture_config",     sc_gesture_config },
+#endif
+#if defined TELEMETRY
+    { "telemetry",     sc_telemetry },
+#endif
+};
+
+#define NSCENARIOS (sizeof scenarios / sizeof scenarios[0])
+
+static int selected(const char *name, int argc, char **argv) {
+    int i, any = 0;
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-')
+            continue;
+        any = 1;
+        if (strcmp(argv[i], name) == 0)
+            return 1;
+    }
+    return !any;
+}
+
+int main(int argc, char **argv) {
+    unsigned i, bad = 0, run = 0;
+    int status;
+
+    if (argc > 1 && strcmp(argv[1], "-v") == 0)
+        sim_verbose = 1;
+
+    for (i = 0; i < NSCENARIOS; i++) {
+        if (!selected(scenarios[i].name, argc, argv))
+            continue;
+        run++;
+        printf("--- %s\n", scenarios[i].name);
+        fflush(stdout);
+        if (fork() == 0) {
+            sim_reset();
+            scenarios[i].run();
+            fflush(stdout);
+            _exit(failed ? 1 : 0);
+        }
+        wait(&status);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            bad++;
+            printf("    FAILED\n");
+        }
+    }
+    printf("%u of %u scenarios passed\n", run - bad, run);
+    return bad ? 1 : 0;
+}
@@ -0,0 +1,480 @@
+/************************************************************************/
+/*  Simulated Raspberry Pi for the iSwitchPi host simulation            */
+/*                                                                      */
+/*  Behaves like Sources/python/iswitchpi.py on the shared line:        */
+/*  - every ~1.2 s: if pulses came in during the last interval do       */
+/*    halt (1 pulse) or reboot (2 or more), else send a 50 ms heartbeat */
+/*  - rising edges from iSwitchPi are counted while the pin is input    */
+/*  With sim_pi.framed like Sources/cpp/iswitchpid (see frame.h):       */
+/*  - every ~1.1 s a HEARTBEAT frame, requests from the scenario        */
+/*  - HALT/REBOOT frames from iSwitchPi are answered with ACK and       */
+/*    acted upon at once                                                */
+/*  - with sim_pi.hook a DOWN frame once halted (shutdown hook)         */
+/*  - sim_pi_update(): UPDATE, then the image in boot frames to the     */
+/*    bootloader (boot/boot.c), no heartbeats meanwhile                 */
+/*  Power follows the VPOWER pin of the simulated ATtiny.               */
+/************************************************************************/
+
+#include <hw.h>
+#include <sim.h>
+#include <frame.h>
+
+#define SLEEP_MS        100                 // sleeptime
+#define INTERVAL_MS     1100                // INTERVALLMAX plus one sleeptime
+#define U               SIM_MS(FR_UNIT_US / 1000.0)
+#define UB              (U / (FR_UNIT_US / FB_UNIT_US))     // boot frames
+#define US(c)           ((c) * 1000000 / F_CPU)
+
+struct sim_pi sim_pi;
+
+static uint64_t next;                       // next scheduled activity
+static uint8_t  phase;                      // heartbeat pulse phase
+static uint8_t  drive;                      // level the Pi drives
+static uint8_t  listen;                     // pin is input with edge detect
+static uint8_t  anzir;                      // IRQ counter, as in the script
+static uint8_t  powered;
+
+static uint8_t  seq;                        // framed: heartbeat sequence number
+static uint8_t  line;                       // level on the line
+static uint64_t rise, fall;                 // last edges, cycles
+static uint8_t  high;                       // rising edge seen, pulse pending
+static uint8_t  rx_bits, rx_buf[FR_MAX];
+static uint8_t  tx_on, tx_buf[FB_MAX];
+static uint16_t tx_pos, tx_pulses;
+static uint64_t tx_next;                    // next edge of the frame going out
+static uint64_t tx_u;                       // its U, cycles
+static uint8_t  down;                       // state to enter when the ACK is out
+static uint8_t  req[FR_MAX], req_len;       // request from the scenario
+static uint64_t hb_at;                      // framed: next heartbeat, requests go in between
+static uint8_t  up;                         // uploader: UP_xx
+static uint8_t  up_page, up_tries;
+
+enum { UP_NONE, UP_REQUEST, UP_HELLO, UP_WRITE, UP_DONE };
+
+void simpi_reset(void) {
+    struct sim_pi cfg = sim_pi;
+    sim_pi = (struct sim_pi){ 0 };
+    sim_pi.boot_ms   = cfg.boot_ms   ? cfg.boot_ms   : 12000;
+    sim_pi.halt_ms   = cfg.halt_ms   ? cfg.halt_ms   : 8000;
+    sim_pi.reboot_ms = cfg.reboot_ms ? cfg.reboot_ms : 20000;
+    sim_pi.pulse_ms  = cfg.pulse_ms  ? cfg.pulse_ms  : 50;      // PULSE in iswitchpi.py
+    sim_pi.framed    = cfg.framed;
+    sim_pi.hook      = cfg.hook;
+    sim_pi.state = PI_OFF;
+    next = tx_next = SIM_NEVER;
+    phase = drive = listen = anzir = powered = 0;
+    seq = line = high = tx_on = down = req_len = up = 0;
+    hb_at = 0;
+    rx_bits = 0xff;
+}
+
+void sim_pi_hang(void) {
+    sim_pi.state = PI_HUNG;
+    drive = listen = tx_on = 0;
+    next = tx_next = SIM_NEVER;
+}
+
+void sim_pi_up(void) {
+    powered = 1;
+    sim_pi.state = PI_RUNNING;
+    phase = 0;
+    listen = 1;
+    next = sim_now();
+}
+
+void sim_pi_halt(void) {
+    sim_pi.state = PI_HALTING;
+    next = sim_now() + SIM_MS(sim_pi.halt_ms);
+}
+
+uint8_t simpi_drive(void) { return powered && drive; }
+
+// follow the 5 Volt rail switched by the ATtiny
+static void power(void) {
+    uint8_t on = sim_vpower();
+    if (on == powered)
+        return;
+    powered = on;
+    drive = listen = high = tx_on = up = 0;
+    tx_next = SIM_NEVER;
+    rx_bits = 0xff;
+    if (on) {
+        sim_pi.state = PI_BOOTING;
+        next = sim_now() + SIM_MS(sim_pi.boot_ms);
+    } else {
+        sim_pi.state = PI_OFF;
+        next = SIM_NEVER;
+    }
+}
+
+uint64_t simpi_next_event(void) {
+    power();
+    return tx_next < next ? tx_next : next;
+}
+
+//---------------------------------------------------------
+// framed protocol
+//
+static void tx_frame(uint8_t n, uint32_t lead, uint64_t u) {
+    tx_pulses = n * 8 + 1;
+    tx_pos = 0;
+    tx_on = 1;
+    tx_u = u;
+    rx_bits = 0xff;
+    tx_next = sim_now() + lead * u;
+}
+
+static void fr_send(uint8_t op, const uint8_t *data, uint8_t len, uint32_t lead) {
+    tx_frame(fr_build(tx_buf, op, data, len), lead, U);
+}
+
+// one edge of the frame going out, like TIM0_COMPB_vect of the firmware
+static void fr_tx(void) {
+    uint16_t i;
+    uint8_t d;
+
+    if (drive) {
+        drive = 0;
+        if (tx_pos == tx_pulses) {
+            tx_on = 0;
+            tx_next = SIM_NEVER;
+            if (up >= UP_HELLO)             // boot frame out: answer by then, else again
+                next = sim_now() + SIM_MS(up == UP_DONE ? FB_DONE_MS : FB_REPLY_MS);
+            if (down) {                     // ACK for HALT/REBOOT is out
+                sim_pi.state = down;
+                next = sim_now() + SIM_MS(down == PI_HALTING ? sim_pi.halt_ms : sim_pi.reboot_ms);
+                down = 0;
+            }
+            return;
+        }
+        d = FR_LOW;
+    } else {
+        drive = 1;
+        i = tx_pos++ - 1;
+        d = tx_pos == 1 ? FR_START : (tx_buf[i >> 3] & (0x80 >> (i & 7))) ? FR_ONE : FR_ZERO;
+    }
+    tx_next = sim_now() + d * tx_u;
+}
+
+//---------------------------------------------------------
+// uploader, as iswitchpid -q update: UPDATE until ACKed (or not
+// answered: the bootloader may be waiting already), then HELLO,
+// the pages and DONE, each one again until its answer comes
+//
+void sim_pi_update(const uint8_t *image, uint8_t pages) {
+    sim_pi.image = image;
+    sim_pi.pages = pages;
+    sim_pi.corrupt = sim_pi.quit = 0xff;
+    sim_pi.written = sim_pi.naks = sim_pi.updated = 0;
+    up = UP_REQUEST;
+    up_tries = 0;
+    if (sim_pi.state == PI_RUNNING)
+        next = sim_now();
+}
+
+static void up_send(uint64_t t) {
+    uint8_t buf[FB_MAX], n = 2, i, crc = 0;
+    uint8_t key[2] = { FR_UPDATE_KEY >> 8, FR_UPDATE_KEY & 0xff };
+    uint16_t crc16 = 0xffff;
+    uint32_t a;
+
+    if (up == UP_WRITE && up_page == sim_pi.quit) {
+        up = UP_NONE;                       // killed halfway: heartbeats again
+        next = t;
+        return;
+    }
+    if (up == UP_REQUEST && up_tries++ < FR_RETRIES) {
+        fr_send(FR_UPDATE, key, 2, 0);
+        next = t + SIM_MS(FR_REPLY_MS);
+        return;
+    }
+    if (up == UP_REQUEST) {
+        up = UP_HELLO;
+        up_tries = 0;
+    }
+    if (up_tries++ == FB_TRIES) {
+        up = UP_NONE;                       // no bootloader: give up
+        next = t;
+        return;
+    }
+    if (up_tries > 1 && up != UP_HELLO)
+        sim_pi.naks++;                      // no answer to the last one
+    buf[0] = up == UP_HELLO ? FB_HELLO : up == UP_WRITE ? FB_WRITE : FB_DONE;
+    buf[1] = up == UP_WRITE ? up_page : up == UP_DONE ? sim_pi.pages : 0;
+    if (up == UP_WRITE)
+        for (i = 0; i < FB_PAGE; i++)
+            buf[n++] = sim_pi.image[up_page * FB_PAGE + i];
+    if (up == UP_DONE) {
+        for (a = 0; a < (uint32_t)sim_pi.pages * FB_PAGE; a++)
+            crc16 = fb_crc16(crc16, sim_pi.image[a]);
+        buf[n++] = crc16 >> 8;
+        buf[n++] = crc16 & 0xff;
+    }
+    for (i = 0; i < n; i++)
+        crc = fr_crc8(crc, buf[i]);
+    buf[n++] = crc;
+    if (up == UP_WRITE && up_page == sim_pi.corrupt) {
+        buf[10] ^= 0x04;                    // one bit wrong on the line
+        sim_pi.corrupt = 0xff;
+    }
+    for (i = 0; i < n; i++)
+        tx_buf[i] = buf[i];
+    tx_frame(n, 0, UB);
+    next = SIM_NEVER;                       // FB_REPLY_MS from its end, fr_tx()
+}
+
+static void up_got(uint8_t n) {
+    uint8_t i, crc = 0;
+
+    for (i = 0; i < n; i++)
+        crc = fr_crc8(crc, rx_buf[i]);
+    if (crc) {
+        sim_pi.bad++;
+        return;
+    }
+    switch (rx_buf[0]) {
+    case FB_READY:
+        if (up == UP_HELLO && sim_pi.pages <= rx_buf[1]) {
+            up = UP_WRITE;
+            up_page = 0;
+        }
+        break;
+    case FB_ACK:
+        if (up == UP_WRITE && rx_buf[1] == up_page) {
+            sim_pi.written++;
+            if (++up_page == sim_pi.pages)
+                up = UP_DONE;
+        } else if (up == UP_DONE) {
+            sim_pi.updated = 1;
+            up = UP_NONE;                   // heartbeats again, to the new firmware
+        }
+        break;
+    case FB_NAK:
+        sim_pi.naks++;                      // the same one again
+        break;
+    }
+    up_tries = 0;
+    next = sim_now();
+}
+
+static void fr_got(uint8_t n) {
+    uint8_t op = FR_OP(rx_buf[0]);
+    uint8_t ack[2] = { op, 0 };
+
+    if (!fr_valid(rx_buf, n)) {
+        sim_pi.bad++;
+        return;
+    }
+    switch (op) {
+    case FR_HALT:
+    case FR_REBOOT:
+        if (sim_pi.state != PI_RUNNING)
+            break;
+        sim_pi.cmd_at = sim_now();
+        if (op == FR_HALT) {
+            sim_pi.halts++;
+            down = PI_HALTING;
+        } else {
+            sim_pi.reboots++;
+            down = PI_REBOOTING;
+        }
+        sim_pi.state = PI_HALTED;           // no more heartbeats from now on
+        next = SIM_NEVER;
+        fr_send(FR_ACK, ack, 2, FR_RESP);
+        break;
+    case FR_ACK:
+        if (rx_buf[1] == FR_HEARTBEAT)
+            sim_pi.acks++;
+        if (rx_buf[1] == FR_UPDATE && up == UP_REQUEST) {
+            up = UP_HELLO;                  // the bootloader is starting
+            up_tries = 0;
+            next = sim_now() + SIM_MS(FR_REPLY_MS);
+        }
+        break;
+    default:                                // answer to a request
+        for (sim_pi.reply_len = 0; sim_pi.reply_len < n - 1; sim_pi.reply_len++)
+            sim_pi.reply[sim_pi.reply_len] = rx_buf[sim_pi.reply_len];
+        break;
+    }
+}
+
+// edges on the line, kernel timestamps in the daemon
+static void fr_rx(uint8_t level) {
+    uint64_t t = sim_now();
+    uint8_t boot = up >= UP_HELLO;          // boot frames, FB_UNIT_US
+    uint8_t p, i;
+
+    if (level) {
+        if (rx_bits != 0xff && US(t - fall) > FR_LOW_MAX / (boot ? FR_UNIT_US / FB_UNIT_US : 1))
+            rx_bits = 0xff;
+        rise = t;
+        high = 1;
+        return;
+    }
+    fall = t;
+    if (!high)                              // end of our own frame
+        return;
+    high = 0;
+    p = boot ? fb_pulse(US(t - rise)) : fr_pulse(US(t - rise));
+    if (p == FR_P_START) {
+        rx_bits = 0;
+    } else if ((p == FR_P_ZERO || p == FR_P_ONE) && rx_bits != 0xff) {
+        i = rx_bits >> 3;
+        rx_buf[i] = rx_buf[i] << 1 | (p == FR_P_ONE);
+        if ((++rx_bits & 7) == 0 && (rx_bits >> 3) == (boot ? 3 + fb_len(rx_buf[0]) : FR_LEN(rx_buf[0]) + 2)) {
+            if (boot)
+                up_got(rx_bits >> 3);
+            else
+                fr_got(rx_bits >> 3);
+            rx_bits = 0xff;
+        }
+    } else {
+        if (p == FR_P_LONG)
+            anzir++;                        // command pulse of the old protocol
+        rx_bits = 0xff;
+    }
+}
+
+void sim_pi_request(uint8_t op, const uint8_t *data, uint8_t len) {
+    req_len = fr_build(req, op, data, len);
+    sim_pi.reply_len = 0;
+}
+
+// heartbeat or request frame, or the old protocol's command. As iswitchpid:
+// the heartbeat keeps its time, requests only fill the gaps
+static void fr_interval(uint64_t t) {
+    uint8_t b[1];
+
+    if (line || t - (rise > fall ? rise : fall) < FR_IDLE * (up >= UP_HELLO ? UB : U) || rx_bits != 0xff) {
+        next = t + FR_IDLE * (up >= UP_HELLO ? UB : U);     // iSwitchPi is talking
+        return;
+    }
+    if (up) {                               // update: no heartbeats meanwhile
+        up_send(t);
+        return;
+    }
+    if (anzir > 0) {                        // pulses instead of a frame
+        sim_pi.cmd_at = t;
+        if (anzir == 1) {
+            sim_pi.halts++;
+            sim_pi.state = PI_HALTING;
+            next = t + SIM_MS(sim_pi.halt_ms);
+        } else {
+            sim_pi.reboots++;
+            sim_pi.state = PI_REBOOTING;
+            next = t + SIM_MS(sim_pi.reboot_ms);
+        }
+        anzir = 0;
+        return;
+    }
+    if (t >= hb_at) {
+        b[0] = ++seq;
+        fr_send(FR_HEARTBEAT, b, 1, 0);
+        sim_pi.heartbeats++;
+        hb_at = t + SIM_MS(INTERVAL_MS);
+        next = t + SIM_MS(FR_REPLY_MS);     // a request after the answer
+        return;
+    }
+    if (req_len) {
+        fr_send(FR_OP(req[0]), req + 1, FR_LEN(req[0]), 0);
+        req_len = 0;
+        next = t + SIM_MS(FR_REPLY_MS);
+        return;
+    }
+    next = hb_at;
+}
+
+//---------------------------------------------------------
+
+void simpi_sample(uint8_t level) {
+    power();
+    line = level;
+    if (sim_pi.framed) {
+        if (!tx_on && sim_pi.state == PI_RUNNING)
+            fr_rx(level);
+        return;
+    }
+    if (level && listen)
+        anzir++;                            // my_callback() on rising edge
+}
+
+void simpi_event(void) {
+    uint64_t t = sim_now();
+
+    if (t == tx_next) {
+        fr_tx();
+        return;
+    }
+
+    switch (sim_pi.state) {
+    case PI_BOOTING:
+        sim_pi.boots++;
+        sim_pi.state = PI_RUNNING;
+        phase = 0;
+        listen = 1;
+        next = t;
+        break;
+
+    case PI_RUNNING:
+        if (sim_pi.framed) {
+            fr_interval(t);
+            break;
+        }
+        switch (phase) {
+        case 0:                             // interval over
+            if (anzir > 0) {
+                listen = 0;
+                drive = 0;
+                sim_pi.cmd_at = t;
+                if (anzir == 1) {
+                    sim_pi.halts++;
+                    sim_pi.state = PI_HALTING;
+                    next = t + SIM_MS(sim_pi.halt_ms);
+                } else {
+                    sim_pi.reboots++;
+                    sim_pi.state = PI_REBOOTING;
+                    next = t + SIM_MS(sim_pi.reboot_ms);
+                }
+                anzir = 0;
+                return;
+            }
+            listen = 0;                     // sendpulse()
+            drive = 1;
+            sim_pi.heartbeats++;
+            phase = 1;
+            next = t + SIM_MS(sim_pi.pulse_ms);
+            break;
+        case 1:
+            drive = 0;
+            phase = 2;
+            next = t + SIM_MS(sim_pi.pulse_ms);
+            break;
+        default:
+            listen = 1;                     // back to input, edge detect armed
+            phase = 0;
+            next = t + SIM_MS(INTERVAL_MS);
+            break;
+        }
+        break;
+
+    case PI_HALTING:
+        sim_pi.state = PI_HALTED;
+        next = SIM_NEVER;
+        if (sim_pi.framed && sim_pi.hook)
+            fr_send(FR_DOWN, 0, 0, FR_IDLE);    // systemd shutdown hook, iswitchpid -D
+        break;
+
+    case PI_REBOOTING:
+        sim_pi.boots++;
+        sim_pi.state = PI_RUNNING;
+        phase = 0;
+        listen = 1;
+        anzir = 0;
+        next = t;
+        break;
+
+    default:
+        next = SIM_NEVER;
+        break;
+    }
+}
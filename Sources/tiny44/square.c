@@ -12,10 +12,22 @@
 /*    1      0       1         10 HZ                                     */
 /*    1      1       0         50 HZ                                     */
 /*    1      1       1         100 HZ                                    */
-/*                                                                      */ 
 /*                                                                      */
+/*  Duty Cycle is ~10% for the DIP switch settings                      */
 /*                                                                      */
-/*  Duty Cycle is ~10%, set with  OCR1B                                 */
+/*  make SQUARE_PI=1: the Pi can set any frequency from 0.1 Hz to 5 kHz */
+/*  and duty cycle (FR_SQUARE_SET, iswitchpid -q square HZ DUTY),       */
+/*  pwm_set() picks the smallest prescaler whose TOP fits 16 bit:       */
+/*  finest frequency steps. The DIP waves are worked out the same way   */
+/*  at compile time, see T1().                                          */
+/*  Changes are taken over at the end of the running period: OCR1A and  */
+/*  OCR1B are double buffered, the clock select is written in the       */
+/*  overflow ISR. Off is done in the compare B ISR, right after the     */
+/*  output went low. No runt pulses either way. Without SQUARE_PI a     */
+/*  DIP switch change restarts Timer1 at once, as it always did.        */
+/*  A double click on the key (pwm_toggle()) switches the square wave   */
+/*  off if it runs, on with the DIP frequency if it does not, until     */
+/*  the next double click, the Pi sets it or the Pi's power goes off.   */
 /*                                                                      */
 /*  Functions are  called by iswitch.c                                  */
 /*                                                                      */
@@ -25,157 +37,288 @@
 /* Peter K. Boxler, December 2016                                         */
 /************************************************************************/
 
-#include <avr/io.h>
-#include <util/delay.h>
-#include <stdint.h>
+#include <string.h>
+#include <hw.h>                             // registers, delays (AVR or host sim)
 
 /* Fast PWM */
 #include <square.h>
+#include <iswitchpi.h>                      // debounced DIP switches
 
-static uint8_t  pinold,was, first=1, generate_pulse;
+#define MODE_A      ((1<<COM1B1) | (1<<WGM11) | (1<<WGM10))    // OC1B non inverting, fast PWM
+#define MODE_B      ((1<<WGM13) | (1<<WGM12))                   // TOP = OCR1A (mode 15)
+#define CS_MASK     ((1<<CS12) | (1<<CS11) | (1<<CS10))
+#define DIP_WAVE    (IN_A(PINA7) | IN_B(PINB2) | IN_B(PINB1))
+
+// Timer1 clocks per period, prescaler ps
+#define T1_CLOCKS(dhz, ps)      ((F_CPU * 10 + (ps) * (dhz) / 2) / ((ps) * (dhz)))
+// TOP, compare B and clock select of a wave, ps: prescaler of clock select cs
+#define T1(dhz, duty, cs, ps)   { T1_CLOCKS(dhz, ps) - 1, (T1_CLOCKS(dhz, ps) * (duty) + 50) / 100 - 1, cs }
+
+struct wave {
+    uint16_t dhz;                           // 0.1 Hz
+    uint8_t  duty;                          // %
+};
+
+struct t1 {                                 // Timer1 set up for a wave
+    uint16_t top;                           // OCR1A
+    uint16_t ocr;                           // OCR1B
+    uint8_t  cs;                            // clock select, 0: off
+};
+
+struct dip {
+#if defined SQUARE_PI
+    struct wave w;                          // for pwm_dhz()
+#endif
+    struct t1 t;                            // the smallest prescaler, as pwm_set() would
+};
+#if defined SQUARE_PI
+#define DIP(dhz, duty, cs, ps)  { { dhz, duty }, T1(dhz, duty, cs, ps) }
+#else
+#define DIP(dhz, duty, cs, ps)  { T1(dhz, duty, cs, ps) }
+#endif
+
+const struct dip dip_wave[4] PROGMEM = {    // index: PINB2, PINB1 on (low)
+    DIP(  10,  9, 3, 64),                   // 1 Hz / 1000 ms
+    DIP( 100,  9, 2,  8),                   // 10 Hz / 100 ms
+    DIP( 500, 10, 1,  1),                   // 50 Hz / 20 ms
+    DIP(1000, 10, 1,  1),                   // 100 Hz / 10 ms
+};
+
+#if defined SQUARE_PI
+const uint16_t prescaler[] PROGMEM = { 1, 8, 64, 256, 1024 };     // CS1 = index + 1
+static struct wave wave;                    // programmed, dhz 0: off
+static struct wave pi_wave;                 // set by the Pi, dhz 0: DIP switches
+#endif
+
+#if defined SQUARE_PI
+static volatile struct t1 new_t1;           // for the overflow ISR
+#endif
+static struct t1 t1;                        // programmed, cs 0: off
+static uint8_t  enabled;                    // between pwm_start() and pwm_stop()
+static uint8_t  dip_new;                    // DIP switches to be looked at
+static uint8_t  flip;                       // key: on/off the other way round, pwm_toggle()
 
 //---------------------------------------------------------
-// Function pwm_init()                          
+// Function pwm_init()
 //  Initialize Ports and Timer on the ATtiny44
 //
 void pwm_init(void) {
 	DDRA |= (1<<PINA5);	                // Outpu Compare Pin OC1B als Ausgang (PA5)
-
-	DDRA &= ~(1<<PINA7);                 // input DIP 2 Position 1
+                                        // PINA7, PINB1, PINB2: inputs DIP 2 Position 1, 3, 2 (after reset)
 //	DDRB &= ~(1<<PINB0);                 // input DIP 2 Position 4   defined in iswitchpi.c
-	DDRB &= ~(1<<PINB1);                 // input DIP 2 Position 3
-	DDRB &= ~(1<<PINB2);                 // input DIP 2 Position 2
-//    DDRA |= (1<<PINA0);                  // TestLED nur für Test
 
-//	PORTB |= (1<<PINB0)| (1<<PINB1)  | (1<<PINB2);    // pull upp
-    	 
 	PORTB |= (1<<PINB1)  | (1<<PINB2);    // pull upp
-	PORTA |= (1<<PINA7);                              // pull upp
-
-  generate_pulse=0;
-  if ( !(PINA & (1<<PINA7)) ) {
-    generate_pulse=1;                 // check if pulse generation is required (Dip switch Pos 1 ON)
-  
-    TCCR1A |=  (1<<COM1B1) ;            // OC1A als nicht invertierender Ausgang
-    OCR1A=5;                            // Toggle OC1A/OC1B on Compare Match, set OC0A/OC0B at BOTTOM
-                                      // (non-inverting mode)
-    TCCR1B |= (1<<WGM12)| (1<<WGM13);   // CTC (Clear Timer on Compare), see Table 12-5
-    TCCR1A |= (1<<WGM10)| (1<<WGM11);   // CTC (Clear Timer on Compare), see Table 12-5
-
-    TCCR1B |=  (1<<CS10) |  (1<<CS12);  // Clock select for Counter: Prescaler /1024  Table 12-6
-    TIMSK1 &= ~((1<<OCIE1A));           // Timer Interrupt OC1A deaktivieren , no IR needed
-
-	}
-	
-  else {
-	TCCR1B = 0x00;                     // Timer 0 not running if no pulses are required
-    TCCR1A = 0x00;                       // 
-    PORTA &= ~( 1<<PINA5 );             // orange Led off 
-  }
-	                          
+	PORTA = (PORTA | (1<<PINA7)) & ~(1<<PINA5);  // pull upp, orange Led off, also PA5 when OC1B is disconnected
+                                        // Timer 1 not running until pwm_start(): TCCR1A/B, TIMSK1 0 after reset
 }
 
 //---------------------------------------------------------
-// Function pwm_start()                          
-//  Start Timer1
+// Function pwm_start()
+//  Pi has power: square wave as set by the Pi or the DIP switches
 //
 void pwm_start(void) {
-
-  if ( !(PINA & (1<<PINA7)) ) {
-    generate_pulse=1;                 // check if pulse generation is required (Dip switch Pos 1 ON)
-    TCCR1B |= (1<<WGM12)| (1<<WGM13);           // Set fast pwm mode, see Table 12-5
-    TCCR1A |= (1<<WGM10)| (1<<WGM11);           
-	TCCR1B |=  (1<<CS10) |  (1<<CS12);          // Clock select for Counter: Prescaler /1024  Table 12-6
-	TCCR1A |=  (1<<COM1B1) ;                    // OC1A als nicht invertierender Ausgang
-	TIMSK1 &= ~((1<<OCIE1A));                   // Timer Interrupt OC1A deaktivieren , no IR needed
-  }
-  else {
-    TCCR1B = 0x00;                              //do not start timer, not requested
-    TCCR1A = 0x00;
-    generate_pulse=0;     
-  }
-  
+    enabled=1;
+    dip_new=1;
+#if defined SQUARE_PI
+    if (pi_wave.dhz)
+        pwm_set(pi_wave.dhz, pi_wave.duty);
+    else
+#endif
+        pwm_check();
 }
 
 
 //---------------------------------------------------------
-// Function pwm_stop()                          
-//  Stop Timer 1 -> stops pulse generation
+// Function pwm_stop()
+//  Stop Timer 1 at once -> stops pulse generation, the Pi is off
 //
 void pwm_stop(void) {
+    TIMSK1 = 0x00;
     TCCR1B = 0x00;                              //stop Timer/Counter 1
     TCCR1A = 0x00;
-    first=1;
+    enabled=0;
+    flip=0;
+    t1.cs=0;
+#if defined SQUARE_PI
+    wave.dhz=0;
+#endif
 }
 
 
 //---------------------------------------------------------
-// Function pwm_acheck)                          
-//  Check if Inputs from DIP-Switch (PINB0/PINB1/PINB2) has changed
-//  Set OCR1A accordingly or activate ADC
+// Function pwm_load()
+//  Timer1 as in t, cs 0: off. Stopped: starts right away. Running:
+//  the overflow ISR takes it over at TOP. At prescaler 1 or 8 the ISR
+//  is too late for the buffered OCR1A/OCR1B of the period just
+//  starting: a change of the prescaler gives one period of in-between
+//  length, same duty cycle.
+//  Without SQUARE_PI Timer1 restarts at once: only a DIP switch or the
+//  Pi's power changes the wave there.
+//
+static void pwm_load(const struct t1 *t) {
+    if (t->cs == t1.cs && t->top == t1.top && t->ocr == t1.ocr)
+        return;                                 // running like this already
+    t1 = *t;
+#if defined SQUARE_PI
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        if (!t->cs) {
+            TIMSK1 &= ~(1<<TOIE1);
+            if (TCCR1B & CS_MASK) {
+                TIFR1 = 1<<OCF1B;               // old flag: not this period
+                TIMSK1 |= 1<<OCIE1B;            // stop when the output goes low
+            }
+        } else {
+            new_t1 = *t;
+            TIMSK1 &= ~(1<<OCIE1B);             // pending stop cancelled
+            if (TCCR1B & CS_MASK) {             // running: at the end of this period
+                TIFR1 = 1<<TOV1;
+                TIMSK1 |= 1<<TOIE1;
+            } else {                            // normal mode: OCR1x not buffered yet
+                OCR1A = t->top;
+                OCR1B = t->ocr;
+                TCNT1 = 0;
+                TCCR1A = MODE_A;
+                TCCR1B = MODE_B | t->cs;
+            }
+        }
+    }
+#else
+    TCCR1B = 0x00;                              // stop Timer/Counter 1
+    TCCR1A = 0x00;                              // PA5 back to PORTA: low
+    if (t->cs) {                                // normal mode: OCR1x not buffered
+        OCR1A = t->top;
+        OCR1B = t->ocr;
+        TCNT1 = 0;
+        TCCR1A = MODE_A;
+        TCCR1B = MODE_B | t->cs;
+    }
+#endif
+}
+
+#if defined SQUARE_PI
+//---------------------------------------------------------
+// Function pwm_set()
+//  Square wave with dhz (0.1 Hz) and duty (%), dhz or duty 0: off,
+//  see pwm_load(). Returns 1 if out of range.
+//
+uint8_t pwm_set(uint16_t dhz, uint8_t duty) {
+    struct t1 t = { 0, 0, 0 };
+    uint32_t n, top, ocr;
+    uint8_t cs;
+
+    if (dhz > PWM_DHZ_MAX || duty > 100)
+        return 1;
+    if (dhz == 0 || duty == 0) {
+        wave.dhz=0;
+        pwm_load(&t);
+        return 0;
+    }
+
+    for (cs = 1; ; cs++) {                      // smallest prescaler: finest steps
+        n = (uint32_t)pgm_read_word(&prescaler[cs - 1]) * dhz;
+        top = (F_CPU * 10 + n / 2) / n;         // timer clocks per period
+        if (top <= 0x10000 || cs == 5)
+            break;
+    }
+    ocr = (top * duty + 50) / 100;              // clocks high
+    if (ocr == 0)
+        ocr = 1;
+    wave.dhz=dhz;
+    wave.duty=duty;
+    t.top = top - 1;
+    t.ocr = ocr - 1;
+    t.cs = cs;
+    pwm_load(&t);
+    return 0;
+}
+
+//---------------------------------------------------------
+// Function pwm_remote()
+//  Square wave set by the Pi (FR_SQUARE_SET), overrides the DIP
+//  switches until the Pi sets dhz 0.
+//
+uint8_t pwm_remote(uint16_t dhz, uint8_t duty) {
+    if (dhz > PWM_DHZ_MAX || duty > 100)
+        return 1;
+    pi_wave.dhz=dhz;
+    pi_wave.duty=duty;
+    dip_new=1;
+    flip=0;                                     // the Pi's word counts, not the key's
+    if (enabled && dhz)
+        pwm_set(dhz, duty);
+    pwm_check();
+    return 0;
+}
+
+uint16_t pwm_dhz(void)  { return wave.dhz; }
+uint8_t  pwm_duty(void) { return wave.dhz ? wave.duty : 0; }
+uint8_t  pwm_pi(void)   { return pi_wave.dhz != 0; }
+#endif  // SQUARE_PI
+
+#if defined GESTURES
+//---------------------------------------------------------
+// Function pwm_toggle()
+//  Key: square wave off if it is on and the other way round, the
+//  Pi's wave comes back as it was
+//
+void pwm_toggle(void) {
+    flip ^= 1;
+    dip_new=1;
+#if defined SQUARE_PI
+    if (enabled && pi_wave.dhz && !flip)
+        pwm_set(pi_wave.dhz, pi_wave.duty);
+#endif
+    pwm_check();
+}
+#endif  // GESTURES
+
+#if defined SQUARE_PI
+//---------------------------------------------------------
+// Timer1 at TOP: the period ends, new frequency from the next one
+//
+ISR( TIM1_OVF_vect )
+{
+    OCR1A = new_t1.top;                         // double buffered
+    OCR1B = new_t1.ocr;
+    TCCR1B = MODE_B | new_t1.cs;                // clock select is not
+    TIMSK1 &= ~(1<<TOIE1);
+}
+
+// compare match B: output just went low, stop here
+ISR( TIM1_COMPB_vect )
+{
+    TCCR1A = 0x00;                              // PA5 back to PORTA: low
+    TCCR1B = 0x00;
+    TIMSK1 &= ~(1<<OCIE1B);
+}
+#endif
+
+
+//---------------------------------------------------------
+// Function pwm_check()
+//  React to a debounced change of the DIP-Switch (PINA7/PINB1/PINB2)
+//  and set the square wave accordingly, unless the Pi has set it.
+//  flip (pwm_toggle()): DIP switch 1 the other way round, the Pi's
+//  wave off. No port reads here, see get_in_change()
 void pwm_check(void) {
+    struct dip d = { 0 };
+    uint8_t pi = 0, i;
 
-  if (!generate_pulse)  {
-        return; }       // DIP Switch 1 is off, do nothing
-
-//    if (TCCR1B== 0x00) {return;}      // Timer not on, do nothing
-
-	//    _delay_ms(10);                // for testing
-        was= (PINB & 0x6);              // get input from 2 DipSwitches
-        if ((first==1) || (pinold != PINB))             // has input changed
-        {  
-            pinold=PINB;
-            first=0;                    // first time thru
-//			PORTA &= ~(1<<PINA0);       // shut down test led
-            TCCR1B &= ~(1<<CS10) ;      // Clock select for Counter: Prescaler /256  Table 12-6
-            TCCR1B &= ~(1<<CS11) ;      // Clock select for Counter: Prescaler /256  Table 12-6
-            TCCR1B &= ~(1<<CS12) ;      // Clock select for Counter: Prescaler /256  Table 12-6
-
-          switch (was)                  // what is set on the Dip Switch ? Selects frequency
-          {
-            case 6:                     // switch 0 0
-              TCCR1B |=  (1<<CS10) |  (1<<CS11);  // Clock select for Counter: Prescaler /64  Table 12-6
-              OCR1A=15624;                        // 1 HZ / 1000 ms
-              OCR1B=1400;                         // set OCR1B value for Timer1 (sets duty cycle)
-              break;
-            
-            case 4:                      // switch 0 1
-            
-              TCCR1B |=  (1<<CS10) |  (1<<CS11);  // Clock select for Counter: Prescaler /64  Table 12-6
-              OCR1A=1562;                         // 10HZ / 100ms
-              OCR1B=140;                          // set OCR1B value for Timer1 (sets duty cycle)
-              break;
-            
-            case 2:                     // switch 1 0 
-            
-              TCCR1B |=  (1<<CS11);             // Clock select for Counter: Prescaler /8  Table 12-6
-              OCR1A=2499;                         // 50HZ / 20ms
-              OCR1B=250;                          // set OCR1B value for Timer1 (sets duty cycle)
-              break;
-            
-            case 0:                     // switch 1 1
-            
-              TCCR1B |=  (1<<CS11);         // Clock select for Counter: Prescaler /8  Table 12-6
-              OCR1A=1249;                         // 100HZ / 10 ms
-              OCR1B=125;                          // set OCR1B value for Timer1 (sets duty cycle)
-              break;
-            
-            default:                            // do 1 sec (as in case 2)
-            
-              TCCR1B |=  (1<<CS10) |  (1<<CS11);  // Clock select for Counter: Prescaler /64  Table 12-6
-              OCR1A=15624;                        // 1 HZ
-              OCR1B=1400;                         // set OCR1B value for Timer1 (sets duty cycle)
-              break;
-            }
-            
-            return;
-
-        }   // end change input
-            
-        else // no input change
-        {
-        
-           }       // ende 
+#if defined SQUARE_PI
+    pi = pi_wave.dhz != 0;
+#endif
+    if (!get_in_change(DIP_WAVE) && !dip_new)   // has input changed
+        return;
+    if (!enabled || (pi && !flip))
+        return;
+    dip_new=0;
+    i = in_state >> (PINB1 + 8) & 3;
+    if (!pi && !(in_state & IN_A(PINA7)) != !flip)     // DIP Switch 1 is on
+        memcpy_P(&d, &dip_wave[i], sizeof(d));
+#if defined SQUARE_PI
+    wave = d.w;
+#endif
+    pwm_load(&d.t);
 }
 //  End of Code
 //
@@ -1,18 +1,35 @@
 /* -----------------------------------------------------------------------
- * Title: Analog input changes Frequence of square wave - with PWM
+ * Title: Square wave on PA5 (OC1B), Timer1 fast PWM
  * Hardware: ATtiny44
- * Diese Version 7 Hz bis ca 160 Hz
+ * Frequency in 0.1 Hz (dHz) from PWM_DHZ_MIN to PWM_DHZ_MAX, duty in %.
+ * Set by the DIP switches or, make SQUARE_PI=1, by the Pi (FR_SQUARE_SET),
+ * see square.c
  * -----------------------------------------------------------------------*/
 
 #ifndef _SQUARE_H
 #define _SQUARE_H
 
+#include <stdint.h>
+
+#define PWM_DHZ_MIN     1                   // 0.1 Hz
+#define PWM_DHZ_MAX     50000               // 5 kHz
+
 /* Fast PWM */
 void pwm_init(void);
 void pwm_adc(void);
 void pwm_stop(void);
 void pwm_start(void);
 void pwm_check(void);
+#ifdef GESTURES
+void pwm_toggle(void);                          // key: off if on, on if off
+#endif
+#ifdef SQUARE_PI
+uint8_t pwm_set(uint16_t dhz, uint8_t duty);    // 0: ok, at the end of the running period
+uint8_t pwm_remote(uint16_t dhz, uint8_t duty); // from the Pi, dhz 0: DIP switches again
+uint16_t pwm_dhz(void);                         // what is programmed, 0: off
+uint8_t pwm_duty(void);                         // %
+uint8_t pwm_pi(void);                           // set by the Pi, not the DIP switches
+#endif
 
 
 #endif  // ifndef _SQUARE_H_
@@ -0,0 +1,112 @@
+/************************************************************************/
+/*  Telemetry: software UART on TESTPIN, build with make TELEMETRY=1    */
+/*                                                                      */
+/*  Record layout and wiring see telemetry.h. The main loop fills a     */
+/*  record (tm_next(), tm_send()), the bits go out from Timer0 compare  */
+/*  B, TM_COUNTS apart, while the 10 ms tick goes on. No _delay_ms:     */
+/*  nothing ever waits for the stream.                                  */
+/*                                                                      */
+/*  Compare B also times the frames to the Pi. iswitchpi.c hands it     */
+/*  over byte by byte: a byte starts only while the line to the Pi is   */
+/*  quiet (tm_kick(), more in tm_bit()), a frame due meanwhile waits    */
+/*  for the end of the byte (8.3 ms), well within FR_REPLY_MS.          */
+/*                                                                      */
+/*  A bit edge is late by the interrupt that runs at its compare match, */
+/*  at most isr_max of the record. Up to ~400 us (half a bit) the       */
+/*  receiver still samples the right bit.                               */
+/************************************************************************/
+
+#ifdef TELEMETRY
+
+#include <hw.h>
+#include <frame.h>                          // fr_crc8()
+#include <telemetry.h>
+
+#define TM_PIN          PINA0               // TESTPIN (board version 2)
+#define TM_LOW()        (PORTA &= ~(1<<TM_PIN), DDRA |= (1<<TM_PIN))
+#define TM_HIGH()       (DDRA &= ~(1<<TM_PIN), PORTA |= (1<<TM_PIN))   // pull-up
+
+static struct tm_rec rec;
+static uint8_t seq;
+static volatile uint8_t pos, len;           // next byte of rec, bytes queued
+static volatile uint16_t shift;             // bits of the byte on the line, LSB first,
+                                            // 1 on top: done when only that is left
+
+struct tm_rec *tm_next(void) {
+    return len ? 0 : &rec;
+}
+
+void tm_send(void) {
+    uint8_t i, crc = 0;
+
+    rec.sync = TM_SYNC;
+    rec.seq = seq++;
+    for (i = 0; i < sizeof(rec) - 1; i++)
+        crc = fr_crc8(crc, ((uint8_t *)&rec)[i]);
+    rec.crc = crc;
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+        pos = 0;
+        len = sizeof(rec);
+    }
+}
+
+uint8_t tm_busy(void) {
+    return shift != 0;
+}
+
+uint8_t tm_idle(void) {
+    return !len && !shift;
+}
+
+//---------------------------------------------------------
+// Function tm_kick()
+//  Queued bytes and compare B free: first bit at the next Timer0 count
+//
+void tm_kick(void) {
+    uint8_t o;
+
+    if (shift || pos == len)
+        return;
+    shift = 1;                              // tm_bit() loads the byte
+    o = TCNT0 + 1;
+    if (o > OCR0A)
+        o = 0;
+    OCR0B = o;
+    TIFR0 = 1<<OCF0B;                       // no stale compare match
+    TIMSK0 |= 1<<OCIE0B;
+}
+
+//---------------------------------------------------------
+// Function tm_bit()
+//  Timer0 compare B: next bit on the line. At the end of a byte (stop
+//  bit out) the next one follows if more is set, else compare B is
+//  released: returns 0
+//
+uint8_t tm_bit(uint8_t more) {
+    uint8_t o;
+
+    if (shift == 1) {                       // stop bit is out
+        if (!more || pos == len) {
+            shift = 0;
+            if (pos == len)
+                pos = len = 0;              // record done, tm_next() may fill it
+            TIMSK0 &= ~(1<<OCIE0B);
+            return 0;
+        }
+        shift = 0x600 | ((uint8_t *)&rec)[pos++] << 1;  // stop, data, start 0
+    }
+    if (shift & 1)
+        TM_HIGH();
+    else
+        TM_LOW();
+    shift >>= 1;
+    o = OCR0B + TM_COUNTS;                  // next edge, Timer0 counts 0..OCR0A
+    if (o > OCR0A)
+        o -= OCR0A + 1;
+    OCR0B = o;
+    return 1;
+}
+
+#endif  // ifdef TELEMETRY
+//  End of Code
+//
@@ -0,0 +1,58 @@
+/* -----------------------------------------------------------------------
+ * Title: Telemetry stream on TESTPIN (build with make TELEMETRY=1)
+ * Hardware: ATtiny44
+ * Shared by the firmware (telemetry.c, iswitchpi.c), the host simulation
+ * and the decoder on the Pi or a PC (Sources/cpp/tmdecode.cpp).
+ *
+ * Software UART, 8N1 at TM_BAUD, LSB first, on TESTPIN (PA0). The line
+ * is open drain: low is driven, high is the pull-up, so a closed TESTPIN
+ * DIP switch only shorts the stream, never the output. Connect RX of a
+ * 3.3 V/5 V serial adapter to TESTPIN, GND to GND, DIP switch open.
+ * TESTMODE (state7) is not available in this build.
+ *
+ * One record every TM_PERIOD ms and on every state change:
+ * TM_SYNC, seq, then the fields below, crc (CRC-8 of frame.h over all
+ * bytes before it). Multi-byte fields are little endian.
+ * Times are Timer0 counts of 64 us (F_CPU / 64):
+ *   isr_max   longest TIM0_COMPA_vect, compare match to its end, i.e.
+ *             the latency behind other interrupts included
+ *   loop_max  longest pass of the main loop, the standby sleep not counted
+ * Both are the maxima since the record before.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _TELEMETRY_H
+#define _TELEMETRY_H
+
+#include <stdint.h>
+
+#define TM_BAUD         1200
+#define TM_COUNTS       13                  // Timer0 counts per bit: 832 us, 1202 baud
+#define TM_PERIOD       1000                // ms between two records
+#define TM_SYNC         0xa5
+#define TM_T0_US        64                  // one Timer0 count
+
+struct tm_rec {
+    uint8_t  sync;                          // TM_SYNC
+    uint8_t  seq;                           // +1 per record, gaps: records lost
+    uint8_t  state;                         // FSM state (fsm.h)
+    uint8_t  hb_count;                      // good heartbeats in a row (pastpulses of old)
+    uint8_t  delay_s;                       // seconds left of the state2/state5 delay (TMR_DELAY)
+    uint16_t events;                        // EV(e) taken by the FSM since the last record
+    uint16_t inputs;                        // debounced key and DIP switches, IN_A()/IN_B()
+    uint8_t  tccr1a, tccr1b;                // Timer1: square wave on PA5 (square.c)
+    uint16_t ocr1a, ocr1b;                  //   TOP and compare B
+    uint8_t  isr_max;                       // Timer0 counts, see above
+    uint16_t loop_max;                      // Timer0 counts
+    uint8_t  crc;
+} __attribute__((packed));
+
+#ifdef TELEMETRY
+struct tm_rec *tm_next(void);               // main loop: record to fill, 0 while one goes out
+void tm_send(void);                         //   it is filled: seq and crc, queued
+void tm_kick(void);                         // interrupts off, Timer0 compare B free: start
+uint8_t tm_bit(uint8_t more);               // compare B ISR: next bit, 0: byte done, B released
+uint8_t tm_busy(void);                      // a byte is on the line, compare B is taken
+uint8_t tm_idle(void);                      // nothing queued, nothing on the line
+#endif
+
+#endif  // ifndef _TELEMETRY_H
@@ -0,0 +1,131 @@
+/************************************************************************/
+/*  Millisecond clock and software timers                               */
+/*                                                                      */
+/*  A tick is TICK_COUNTS Timer0 counts of 64 us: 9.984 ms at 1 MHz,    */
+/*  not 10. The clock adds the whole ms of a tick and carries the rest  */
+/*  in us, so it does not drift against the crystal (the RC oscillator  */
+/*  is another matter, +-1 % after factory calibration).                */
+/*                                                                      */
+/*  Each timer holds the clock_ms it is due at, next_due the earliest   */
+/*  of them. A tick compares the clock with next_due and is done: the   */
+/*  cost per tick does not grow with the timers. Only when one is due   */
+/*  the tick goes over all TIMERS (three) and finds the next one, far   */
+/*  less code than a sorted list. Start has the next tick do that as    */
+/*  well, stop leaves next_due alone: at worst one look for nothing.    */
+/*  A fired timer sets its flag in tmr_flags, a periodic one starts     */
+/*  again one period after the moment it was due (no drift by late      */
+/*  ticks, a very late one catches up a tick at a time). Times compare  */
+/*  as (int32_t)(a - b), the clock wraps after 49 days. No callbacks:   */
+/*  ISR time stays what it is.                                          */
+/************************************************************************/
+
+#include <hw.h>
+#include <timer.h>
+
+static struct {
+    uint32_t due;                           // clock_ms it fires at
+    uint16_t period;                        // ms, 0: one-shot
+} tmr[TIMERS];
+static uint8_t tmr_on;                      // TMR(t): running
+static uint32_t next_due;                   // no timer fires before
+static volatile uint8_t tmr_flags;          // TMR(t): fired
+static volatile uint32_t clock_ms;
+static uint16_t clock_us;                   // and the us of the ms to come
+
+#define BEFORE(a, b)    ((int32_t)((a) - (b)) < 0)
+
+// time has passed, called by the ISRs
+static void run(uint16_t ms) {
+    uint32_t now = clock_ms + ms, next = now + INT32_MAX;  // none running: as far as it goes
+    uint8_t t, bit;
+
+    clock_ms = now;
+    if (BEFORE(now, next_due))
+        return;
+    for (t = 0, bit = 1; t < TIMERS; t++, bit <<= 1) {
+        if (!(tmr_on & bit))
+            continue;
+        if (!BEFORE(now, tmr[t].due)) {
+            tmr_flags |= bit;
+            tmr[t].due += tmr[t].period;    // the next period starts where t was due
+            if (!tmr[t].period)
+                tmr_on &= ~bit;
+        }
+        if (BEFORE(tmr[t].due, next))
+            next = tmr[t].due;
+    }
+    next_due = next;
+}
+
+//---------------------------------------------------------
+// Function ms_tick()
+//  Timer0 compare A, every tick
+//
+uint8_t ms_tick(void) {
+    uint8_t ms = TICK_US / 1000;
+
+    clock_us += TICK_US % 1000;
+    if (clock_us >= 1000) {
+        clock_us -= 1000;
+        ms++;
+    }
+    run(ms);
+    return ms;
+}
+
+//---------------------------------------------------------
+// Function ms_add()
+//  Watchdog in standby, the tick is stopped
+//
+void ms_add(uint16_t ms) {
+    run(ms);
+}
+
+uint32_t ms_now(void) {
+    uint32_t t;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        t = clock_ms;
+    return t;
+}
+
+void tmr_start(uint8_t t, uint32_t ms, uint16_t period) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        tmr_flags &= ~TMR(t);
+        tmr[t].period = period;
+        tmr[t].due = clock_ms + ms;         // 0: the next tick
+        next_due = clock_ms;                // the next tick finds the next one
+        tmr_on |= TMR(t);
+    }
+}
+
+void tmr_stop(uint8_t t) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        tmr_on &= ~TMR(t);
+        tmr_flags &= ~TMR(t);
+    }
+}
+
+uint8_t tmr_fired(uint8_t mask) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        mask &= tmr_flags;
+        tmr_flags ^= mask;
+    }
+    return mask;
+}
+
+uint8_t tmr_expired(uint8_t t) {
+    return tmr_flags & TMR(t);
+}
+
+#if defined TELEMETRY                       // for the record only
+uint32_t tmr_left(uint8_t t) {
+    uint32_t ms = 0;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+        if (tmr_on & TMR(t))
+            ms = tmr[t].due - clock_ms;
+    return ms;
+}
+#endif
+//  End of Code
+//
@@ -0,0 +1,38 @@
+/* -----------------------------------------------------------------------
+ * Title: Millisecond clock and software timers
+ * Hardware: ATtiny44
+ * The 10 ms tick of Timer0 advances a monotonic ms clock, the watchdog
+ * does it in standby. The timers run on that clock: one-shot or
+ * periodic, a fired timer sets its flag (TMR(t)) for the main loop or
+ * the tick, like the key flags. Details in timer.c
+ * -----------------------------------------------------------------------*/
+
+#ifndef _TIMER_H
+#define _TIMER_H
+
+#include <stdint.h>
+
+#define T0_PRESCALE     64
+#define TICK_COUNTS     ((uint8_t)(F_CPU / 64.0 * 10e-3 - 0.5) + 1)      // Timer0 counts per tick, OCR0A + 1
+#define TICK_US         ((uint16_t)(TICK_COUNTS * (T0_PRESCALE * 1e6 / F_CPU) + 0.5))  // 9984 us at 1 MHz
+
+enum {
+    TMR_BLINK,                              // led blink of state2 and state5, periodic
+    TMR_DELAY,                              // power on/off delay of state2 and state5: EV_TIMEOUT
+    TMR_HB,                                 // heartbeats missed (hb_beat()): Pi is silent
+    TIMERS
+};
+#define TMR(t)          (1 << (t))
+
+uint8_t ms_tick(void);                      // Timer0 ISR: one tick, returns its ms (9 or 10)
+void ms_add(uint16_t ms);                   // watchdog ISR: time without tick
+uint32_t ms_now(void);                      // ms since power on
+void tmr_start(uint8_t t, uint32_t ms, uint16_t period);   // (re)start, period 0: one-shot
+void tmr_stop(uint8_t t);
+uint8_t tmr_fired(uint8_t mask);            // TMR() flags of fired timers, cleared
+uint8_t tmr_expired(uint8_t t);             // fired, flag stays until the next start
+#ifdef TELEMETRY
+uint32_t tmr_left(uint8_t t);               // ms until it fires, 0: not running
+#endif
+
+#endif  // ifndef _TIMER_H
@@ -0,0 +1,386 @@
+/************************************************************************/
+/*  avrprofile - cycle profile of iswitchpi.elf in simavr               */
+/*                                                                      */
+/*  Runs the real firmware (avr-gcc build, not the host sim) one        */
+/*  instruction at a time on a simulated ATtiny44 and plays a script   */
+/*  on the pins: key presses, a Pi sending heartbeats while it has      */
+/*  power, DIP switch changes. Reports in CPU cycles (1 us at 1 MHz):   */
+/*  - every ISR and mytimer(): calls, min, mean, 99 %, max per call     */
+/*  - the longest time with interrupts off, in ISRs and in main code    */
+/*    (cli, ATOMIC_BLOCK), with the function it happened in             */
+/*  - one pass of iswitch_loop() per state, standby sleep not counted   */
+/*  - the deepest stack, against STACK in the Makefile                  */
+/*                                                                      */
+/*  make profile       builds the elf, avr-nm symbols, this, runs it    */
+/*  avrprofile FILE.elf FILE.sym [SECONDS]                              */
+/*                                                                      */
+/*  Needs simavr (libsimavr, headers) and libelf on the host.           */
+/************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_io.h>
+#include <avr_ioport.h>
+
+#define MCU             "attiny44"
+#define RUN_S           120                 // simulated seconds
+#define CYC(ms)         ((uint64_t)(ms) * F_CPU / 1000)
+#define ENTRY_CYCLES    6                   // interrupt response (4) and rjmp of the vector
+#define CALL_CYCLES     3                   // rcall
+#define HIST            4096                // cycles, longer ones counted as HIST
+#define PROFILES        20
+#define SYMBOLS         400
+#define STATES          10
+#define SRAM            0x800000            // avr-nm address of the data space
+#define STACK_TOP       0x15b               // __stack, NOINIT - 1 in the Makefile
+
+// pins, see iswitchpi.c (VERSION2)
+#define VPOWER          1                   // PA1
+#define FROMPI          2                   // PA2
+#define KEY0            4                   // PA4
+#define DELAYTIME       6                   // PA6
+#define SQUARE          7                   // PA7
+
+#define HB_PERIOD_MS    1100                // Pi: heartbeat every 1.1 s
+#define HB_WIDTH_MS     50
+#define PI_BOOT_MS      2000                // power on to the first heartbeat
+
+struct sym {
+    uint32_t addr;
+    char type;
+    char name[64];
+};
+
+struct profile {
+    const char *name;
+    uint32_t addr;                          // flash, bytes
+    uint8_t entry;                          // cycles before the first instruction
+    uint32_t calls;
+    uint64_t sum;
+    uint32_t min, max;
+    uint32_t hist[HIST + 1];
+};
+
+struct active {                             // ISR or function running
+    struct profile *p;
+    uint16_t sp;                            // SP at entry, return address on the stack
+    uint64_t start;
+};
+
+static struct sym syms[SYMBOLS];
+static int nsyms;
+static struct profile prof[PROFILES];
+static int nprof;
+static struct active act[8];
+static int depth;
+
+static avr_t *avr;
+static avr_irq_t *pin_a[8], *pin_b[3];
+static uint8_t powered;                     // VPOWER output of the ATtiny
+static uint64_t powered_at;
+
+static const char *vector_name[] = {
+    "RESET", "INT0", "PCINT0", "PCINT1", "WDT", "TIM1_CAPT", "TIM1_COMPA",
+    "TIM1_COMPB", "TIM1_OVF", "TIM0_COMPA", "TIM0_COMPB", "TIM0_OVF",
+    "ANA_COMP", "ADC", "EE_RDY", "USI_STR", "USI_OVF",
+};
+
+//---------------------------------------------------------
+// symbols: avr-nm -n output, "00000068 T __vector_9"
+//
+static void sym_load(const char *file) {
+    char line[128], name[64];
+    unsigned int addr;
+    char type;
+    FILE *f = fopen(file, "r");
+
+    if (!f) {
+        perror(file);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), f) && nsyms < SYMBOLS)
+        if (sscanf(line, "%x %c %63s", &addr, &type, name) == 3) {
+            syms[nsyms].addr = addr;
+            syms[nsyms].type = type;
+            snprintf(syms[nsyms].name, sizeof(syms[nsyms].name), "%s", name);
+            nsyms++;
+        }
+    fclose(f);
+}
+
+static const struct sym *sym_find(const char *name) {
+    int i;
+    for (i = 0; i < nsyms; i++)
+        if (strcmp(syms[i].name, name) == 0)
+            return &syms[i];
+    return NULL;
+}
+
+// function a flash address belongs to (symbols sorted by address)
+static const char *sym_at(uint32_t pc) {
+    static char buf[80];
+    const struct sym *best = NULL;
+    int i;
+
+    for (i = 0; i < nsyms; i++)
+        if ((syms[i].type == 'T' || syms[i].type == 't') && syms[i].addr <= pc)
+            best = &syms[i];
+    if (!best)
+        return "?";
+    snprintf(buf, sizeof(buf), "%s+0x%x", best->name, pc - best->addr);
+    return buf;
+}
+
+static void prof_add(const char *name, uint32_t addr, uint8_t entry) {
+    struct profile *p = &prof[nprof++];
+    p->name = name;
+    p->addr = addr;
+    p->entry = entry;
+    p->min = UINT32_MAX;
+}
+
+static struct profile *prof_at(uint32_t pc) {
+    int i;
+    for (i = 0; i < nprof; i++)
+        if (prof[i].addr == pc)
+            return &prof[i];
+    return NULL;
+}
+
+static void prof_count(struct profile *p, uint32_t c) {
+    p->calls++;
+    p->sum += c;
+    if (c < p->min)
+        p->min = c;
+    if (c > p->max)
+        p->max = c;
+    p->hist[c < HIST ? c : HIST]++;
+}
+
+static uint32_t percentile(const uint32_t *hist, uint32_t n, unsigned int pc) {
+    uint64_t want = ((uint64_t)n * pc + 99) / 100, seen = 0;
+    uint32_t c;
+    for (c = 0; c <= HIST; c++)
+        if ((seen += hist[c]) >= want)
+            return c;
+    return HIST;
+}
+
+static uint16_t sp_get(void) {
+    return avr->data[R_SPL] | avr->data[R_SPH] << 8;
+}
+
+//---------------------------------------------------------
+// the outside world
+//
+static void vpower_hook(struct avr_irq_t *irq, uint32_t value, void *param) {
+    (void)irq;
+    (void)param;
+    if (value && !powered)
+        powered_at = avr->cycle;
+    powered = value;
+}
+
+static void pin_set(avr_irq_t *pin, uint8_t level) {
+    avr_raise_irq(pin, level);
+}
+
+enum { S_KEY, S_DIP_A, S_DIP_B, S_PI_HALT, S_END };
+
+static const struct {
+    uint32_t ms;
+    uint8_t what, pin, level;               // level: 0 = key pressed / switch closed
+    const char *text;
+} script[] = {
+    {      0, S_DIP_A, DELAYTIME, 0, "DIP short delays" },
+    {   1000, S_KEY,   KEY0,      0, "key: power on" },
+    {   1300, S_KEY,   KEY0,      1, "" },
+    {  10000, S_DIP_A, SQUARE,    0, "DIP square wave on" },
+    {  13000, S_DIP_B, 1,         0, "DIP square frequency" },
+    {  16000, S_DIP_B, 2,         0, "" },
+    {  19000, S_DIP_B, 1,         1, "" },
+    {  22000, S_DIP_A, SQUARE,    1, "DIP square wave off" },
+    {  25000, S_KEY,   KEY0,      0, "key: halt" },
+    {  25300, S_KEY,   KEY0,      1, "" },
+    {  26500, S_PI_HALT, 0,       0, "Pi halts, no more heartbeats" },
+    {  80000, S_DIP_B, 2,         1, "DIP change in standby" },
+    {      0, S_END,   0,         0, NULL },
+};
+
+// Main starts here ---------------------------------------------
+//---------------------------------------------------------------
+int main(int argc, char **argv) {
+    elf_firmware_t f;
+    const struct sym *s;
+    struct profile *p;
+    uint64_t end, next_hb = UINT64_MAX, hb_off = UINT64_MAX;
+    uint64_t slept = 0, cli_start = 0, cli_isr = 0, cli_main = 0;
+    uint64_t pass_start = 0, pass_slept = 0;
+    uint64_t pass_sum[STATES] = { 0 };
+    uint32_t pass_n[STATES] = { 0 }, pass_max[STATES] = { 0 };
+    uint32_t cli_main_pc = 0, cli_pc = 0, loop_addr, state_addr;
+    uint16_t sp_min = STACK_TOP, sp_min_pc = 0;
+    uint8_t cli_in_isr = 0, pi_halted = 0, pass_state = 0, i_flag = 1;
+    char vec[16];
+    int step = 0, i;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s FILE.elf FILE.sym [SECONDS]\n", argv[0]);
+        return 2;
+    }
+    end = CYC(1000ULL * (argc > 3 ? atoi(argv[3]) : RUN_S));
+    sym_load(argv[2]);
+    for (i = 1; i < (int)(sizeof(vector_name) / sizeof(*vector_name)); i++) {
+        snprintf(vec, sizeof(vec), "__vector_%d", i);
+        if ((s = sym_find(vec)) && nprof < PROFILES)
+            prof_add(vector_name[i], s->addr, ENTRY_CYCLES);
+    }
+    if ((s = sym_find("mytimer")))
+        prof_add("mytimer()", s->addr, CALL_CYCLES);
+    if (!(s = sym_find("iswitch_loop"))) {
+        fprintf(stderr, "avrprofile: no iswitch_loop in %s\n", argv[2]);
+        return 1;
+    }
+    loop_addr = s->addr;
+    if (!(s = sym_find("state")) || s->addr < SRAM) {
+        fprintf(stderr, "avrprofile: no state in %s\n", argv[2]);
+        return 1;
+    }
+    state_addr = s->addr - SRAM;
+
+    memset(&f, 0, sizeof(f));
+    if (elf_read_firmware(argv[1], &f)) {
+        fprintf(stderr, "avrprofile: can not read %s\n", argv[1]);
+        return 1;
+    }
+    strcpy(f.mmcu, MCU);
+    f.frequency = F_CPU;
+    if (!(avr = avr_make_mcu_by_name(f.mmcu))) {
+        fprintf(stderr, "avrprofile: simavr has no %s\n", MCU);
+        return 1;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &f);
+    avr->log = 0;
+
+    for (i = 0; i < 8; i++)                 // all inputs open: pull-ups, key up
+        pin_set(pin_a[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), i), i != FROMPI);
+    for (i = 0; i < 3; i++)
+        pin_set(pin_b[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i), 1);
+    avr_irq_register_notify(pin_a[VPOWER], vpower_hook, NULL);
+
+    while (avr->cycle < end) {
+        uint64_t before = avr->cycle;
+        uint8_t sleeping = avr->state == cpu_Sleeping;
+        uint32_t pc;
+        int st;
+
+        // script and the Pi
+        while (script[step].what != S_END && avr->cycle >= CYC(script[step].ms)) {
+            if (*script[step].text)
+                printf("  %6.1f s  %s\n", script[step].ms / 1000.0, script[step].text);
+            switch (script[step].what) {
+            case S_KEY:
+            case S_DIP_A:   pin_set(pin_a[script[step].pin], script[step].level); break;
+            case S_DIP_B:   pin_set(pin_b[script[step].pin], script[step].level); break;
+            case S_PI_HALT: pi_halted = 1; break;
+            }
+            step++;
+        }
+        if (!powered || pi_halted)
+            next_hb = UINT64_MAX;
+        else if (next_hb == UINT64_MAX)
+            next_hb = powered_at + CYC(PI_BOOT_MS);
+        if (avr->cycle >= next_hb) {
+            pin_set(pin_a[FROMPI], 1);
+            hb_off = next_hb + CYC(HB_WIDTH_MS);
+            next_hb += CYC(HB_PERIOD_MS);
+        }
+        if (avr->cycle >= hb_off) {
+            pin_set(pin_a[FROMPI], 0);
+            hb_off = UINT64_MAX;
+        }
+
+        st = avr_run(avr);
+        if (st == cpu_Done || st == cpu_Crashed) {
+            fprintf(stderr, "avrprofile: firmware stopped at %s, %.3f s\n",
+                    sym_at(avr->pc), (double)avr->cycle / F_CPU);
+            return 1;
+        }
+        if (sleeping) {
+            slept += avr->cycle - before;
+            continue;
+        }
+        pc = avr->pc;
+        if (sp_get() < sp_min) {
+            sp_min = sp_get();
+            sp_min_pc = pc;
+        }
+
+        // end of an ISR or function: its return address is off the stack
+        while (depth && sp_get() > act[depth - 1].sp) {
+            depth--;
+            prof_count(act[depth].p, avr->cycle - act[depth].start);
+        }
+        if ((p = prof_at(pc)) && depth < 8) {
+            act[depth].p = p;
+            act[depth].sp = sp_get();
+            act[depth].start = avr->cycle - p->entry;
+            depth++;
+        }
+
+        // interrupts off: ISRs (depth or vector table) or cli in main code
+        if (i_flag && !avr->sreg[S_I]) {
+            cli_start = before;
+            cli_pc = pc;
+            cli_in_isr = depth || pc < sizeof(vector_name) / sizeof(*vector_name) * 2;
+        }
+        else if (!i_flag && avr->sreg[S_I]) {
+            uint64_t w = avr->cycle - cli_start;
+            if (cli_in_isr && w > cli_isr)
+                cli_isr = w;
+            if (!cli_in_isr && w > cli_main) {
+                cli_main = w;
+                cli_main_pc = cli_pc;
+            }
+        }
+        i_flag = avr->sreg[S_I];
+
+        // main loop passes, by the state at the start of the pass
+        if (pc == loop_addr) {
+            if (pass_start && pass_state < STATES) {
+                uint32_t c = avr->cycle - pass_start - (slept - pass_slept);
+                pass_n[pass_state]++;
+                pass_sum[pass_state] += c;
+                if (c > pass_max[pass_state])
+                    pass_max[pass_state] = c;
+            }
+            pass_start = avr->cycle;
+            pass_slept = slept;
+            pass_state = avr->data[state_addr];
+        }
+    }
+
+    printf("\n%.0f s simulated, %.1f %% asleep, cycles = us at %lu Hz\n\n",
+           (double)avr->cycle / F_CPU, 100.0 * slept / avr->cycle, (unsigned long)F_CPU);
+    printf("%-12s %8s %6s %7s %6s %6s\n", "ISR", "calls", "min", "mean", "99%", "max");
+    for (p = prof; p < prof + nprof; p++)
+        if (p->calls)
+            printf("%-12s %8u %6u %7.1f %6u %6u%s\n", p->name, p->calls, p->min,
+                   (double)p->sum / p->calls, percentile(p->hist, p->calls, 99), p->max,
+                   p->max >= HIST ? "  (histogram capped)" : "");
+    printf("\ninterrupts off: longest %llu cycles in an ISR, %llu in main code at %s\n",
+           (unsigned long long)cli_isr, (unsigned long long)cli_main, sym_at(cli_main_pc));
+    printf("stack: %u bytes at the deepest, in %s\n", STACK_TOP - sp_min, sym_at(sp_min_pc));
+    printf("\n%-12s %8s %7s %6s\n", "loop pass", "passes", "mean", "max");
+    for (i = 0; i < STATES; i++)
+        if (pass_n[i])
+            printf("state%-7d %8u %7.1f %6u\n", i, pass_n[i], (double)pass_sum[i] / pass_n[i], pass_max[i]);
+    return 0;
+}
+//  End of Code
+//
@@ -0,0 +1,426 @@
+/************************************************************************/
+/*  avrupdate - firmware update end to end in simavr                    */
+/*                                                                      */
+/*  Runs the real flash (avr-gcc build: firmware and bootloader, as     */
+/*  make flash_boot puts them in) on a simulated ATtiny44 and plays     */
+/*  the Pi on the FROMPI line like iswitchpid -q update:                */
+/*  - key: power on, heartbeat frames until the Pi is alive             */
+/*  - UPDATE, then HELLO, the pages and DONE in boot frames, each one   */
+/*    again until its answer comes (frame.h)                            */
+/*  - heartbeats again, to the new firmware                             */
+/*  Passes if the Pi had its power all the time, the flash holds the    */
+/*  image (word 0: the bootloader), the boot record is VALID with the   */
+/*  image's entry and the new firmware answers the heartbeats.          */
+/*                                                                      */
+/*  make update_test   builds both hex files, this, runs it             */
+/*  avrupdate FLASH.hex IMAGE.hex                                       */
+/*                                                                      */
+/*  Needs simavr (libsimavr, headers) and libelf on the host, with      */
+/*  self-programming (SPM) for the attiny44 core.                       */
+/************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sim_avr.h>
+#include <sim_elf.h>
+#include <sim_io.h>
+#include <avr_ioport.h>
+#include <avr_eeprom.h>
+#include <frame.h>
+#include <boot.h>
+
+#define MCU             "attiny44"
+#define FLASH           4096
+#define EEPROM          256
+#define EE_RECORD       (EEPROM - 3)        // struct boot_ee: entry lo, hi, flag
+#define RAMEND          0x15f
+#define RUN_S           60                  // simulated seconds at most
+#define NEVER           UINT64_MAX
+#define CYC_US(us)      ((uint64_t)(us) * F_CPU / 1000000)
+#define CYC_MS(ms)      CYC_US((uint64_t)(ms) * 1000)
+#define US(c)           ((c) * 1000000 / F_CPU)
+
+// pins and registers (data space), see iswitchpi.c (VERSION2)
+#define VPOWER          1                   // PA1
+#define FROMPI          2                   // PA2
+#define KEY0            4                   // PA4
+#define DELAYTIME       6                   // PA6
+#define DDRA_ADDR       0x3a
+#define PORTA_ADDR      0x3b
+
+#define HB_PERIOD_MS    1100                // Pi: heartbeat every 1.1 s
+#define HB_ALIVE        3                   // heartbeats ACKed: update, and after it: passed
+#define PI_BOOT_MS      2000                // power on to the first heartbeat
+#define KEY_MS          1000                // key pressed for 300 ms: power on
+#define RESET_MS        10                  // VPOWER low this long: more than a reset
+
+enum { P_OFF, P_HB, P_REQUEST, P_HELLO, P_WRITE, P_DONE, P_NEW, P_END };
+
+static avr_t *avr;
+static avr_irq_t *pin_a[8], *pin_b[3];
+static uint8_t flash[FLASH], image[FLASH];
+static uint8_t pages;
+
+static uint8_t phase = P_OFF, tries, page, seq, acks;
+static uint64_t next = NEVER;               // next step of the Pi
+static uint64_t hb_at;                      // next heartbeat, the rest goes in between
+static uint64_t update_at, done_at;
+static uint32_t written, resent, naks, bad;
+
+static uint8_t pi_drive, line;              // level the Pi drives, level on the line
+static uint64_t rise, fall;                 // last edges, cycles
+static uint8_t rx_bits = 0xff, rx_buf[FB_MAX];
+static uint8_t tx_on, tx_buf[FB_MAX];
+static uint16_t tx_pos, tx_pulses;
+static uint64_t tx_next = NEVER, tx_u;
+
+static void say(const char *text) {
+    printf("  %6.1f s  %s\n", (double)avr->cycle / F_CPU, text);
+}
+
+static void fail(const char *text) {
+    say(text);
+    printf("update: FAILED\n");
+    exit(1);
+}
+
+//---------------------------------------------------------
+// Intel hex into buf (erased: 0xff), returns the end address
+//
+static uint32_t hex_load(const char *file, uint8_t *buf) {
+    char line[128];
+    unsigned int n, addr, type, b, i, end = 0;
+    FILE *f = fopen(file, "r");
+
+    if (!f) {
+        perror(file);
+        exit(1);
+    }
+    memset(buf, 0xff, FLASH);
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, ":%2x%4x%2x", &n, &addr, &type) != 3 || type == 1)
+            break;
+        for (i = 0; type == 0 && i < n && addr + i < FLASH; i++)
+            if (sscanf(line + 9 + 2 * i, "%2x", &b) == 1)
+                buf[addr + i] = b;
+        if (type == 0 && addr + n > end)
+            end = addr + n;
+    }
+    fclose(f);
+    return end;
+}
+
+//---------------------------------------------------------
+// the Pi on the line, as sim/simpi.c
+//
+static uint8_t boot_frames(void) {
+    return phase >= P_HELLO && phase <= P_DONE;
+}
+
+static uint64_t unit(void) {
+    return CYC_US(boot_frames() ? FB_UNIT_US : FR_UNIT_US);
+}
+
+static void tx_frame(uint8_t n) {
+    tx_pulses = n * 8 + 1;
+    tx_pos = 0;
+    tx_on = 1;
+    tx_u = unit();
+    rx_bits = 0xff;
+    tx_next = avr->cycle;
+    next = NEVER;                           // answer by tx_edge()
+}
+
+static void fr_send(uint8_t op, const uint8_t *data, uint8_t len) {
+    tx_frame(fr_build(tx_buf, op, data, len));
+}
+
+// one edge of the frame going out
+static void tx_edge(void) {
+    uint16_t i;
+    uint8_t d;
+
+    if (pi_drive) {
+        pi_drive = 0;
+        avr_raise_irq(pin_a[FROMPI], 0);    // released: the pulldown
+        if (tx_pos == tx_pulses) {
+            tx_on = 0;
+            tx_next = NEVER;
+            next = avr->cycle + CYC_MS(phase == P_DONE ? FB_DONE_MS : boot_frames() ? FB_REPLY_MS
+                                                                                    : FR_REPLY_MS);
+            return;
+        }
+        d = FR_LOW;
+    } else {
+        pi_drive = 1;
+        avr_raise_irq(pin_a[FROMPI], 1);
+        i = tx_pos++ - 1;
+        d = tx_pos == 1 ? FR_START : (tx_buf[i >> 3] & (0x80 >> (i & 7))) ? FR_ONE : FR_ZERO;
+    }
+    tx_next = avr->cycle + d * tx_u;
+}
+
+static void boot_send(void) {
+    uint8_t n = 2, i, crc = 0;
+    uint16_t crc16 = 0xffff;
+    uint32_t a;
+
+    if (tries++ == FB_TRIES)
+        fail("no answer from the bootloader");
+    if (tries > 1)
+        resent++;
+    tx_buf[0] = phase == P_HELLO ? FB_HELLO : phase == P_WRITE ? FB_WRITE : FB_DONE;
+    tx_buf[1] = phase == P_WRITE ? page : phase == P_DONE ? pages : 0;
+    if (phase == P_WRITE)
+        for (i = 0; i < FB_PAGE; i++)
+            tx_buf[n++] = image[page * FB_PAGE + i];
+    if (phase == P_DONE) {
+        for (a = 0; a < (uint32_t)pages * FB_PAGE; a++)
+            crc16 = fb_crc16(crc16, image[a]);
+        tx_buf[n++] = crc16 >> 8;
+        tx_buf[n++] = crc16 & 0xff;
+    }
+    for (i = 0; i < n; i++)
+        crc = fr_crc8(crc, tx_buf[i]);
+    tx_buf[n++] = crc;
+    tx_frame(n);
+}
+
+// heartbeat, UPDATE or boot frame once the line is free
+static void pi_step(void) {
+    uint8_t key[2] = { FR_UPDATE_KEY >> 8, FR_UPDATE_KEY & 0xff };
+
+    if (line || rx_bits != 0xff || avr->cycle - (rise > fall ? rise : fall) < FR_IDLE * unit()) {
+        next = avr->cycle + FR_IDLE * unit();   // iSwitchPi is talking
+        return;
+    }
+    if (phase == P_HB && acks >= HB_ALIVE) {
+        say("Pi alive: UPDATE");
+        update_at = avr->cycle;
+        phase = P_REQUEST;
+        tries = 0;
+    }
+    switch (phase) {
+    case P_HB:
+    case P_NEW:
+        if (avr->cycle < hb_at) {
+            next = hb_at;
+            break;
+        }
+        fr_send(FR_HEARTBEAT, &seq, 1);
+        seq++;
+        hb_at = avr->cycle + CYC_MS(HB_PERIOD_MS);
+        break;
+    case P_REQUEST:
+        if (tries++ < FR_RETRIES) {
+            fr_send(FR_UPDATE, key, 2);
+            break;
+        }
+        phase = P_HELLO;                    // not answered: the bootloader may be waiting
+        tries = 0;
+        /* fall through */
+    default:
+        boot_send();
+        break;
+    }
+}
+
+// a frame from iSwitchPi: boot frames op, arg, crc
+static void rx_got(uint8_t n) {
+    uint8_t i, crc = 0;
+
+    for (i = 0; i < n; i++)
+        crc = fr_crc8(crc, rx_buf[i]);
+    if (crc) {
+        bad++;
+        return;
+    }
+    if (!boot_frames()) {
+        if (FR_OP(rx_buf[0]) != FR_ACK)
+            return;
+        if (rx_buf[1] == FR_HEARTBEAT)
+            acks++;
+        if (rx_buf[1] == FR_UPDATE && phase == P_REQUEST) {
+            say("UPDATE ACKed: bootloader");
+            phase = P_HELLO;
+            tries = 0;
+            next = avr->cycle + CYC_MS(FR_REPLY_MS);
+        }
+        return;
+    }
+    switch (rx_buf[0]) {
+    case FB_READY:
+        if (phase != P_HELLO)
+            break;
+        if (pages > rx_buf[1])
+            fail("image too big for the bootloader");
+        phase = P_WRITE;
+        page = 0;
+        break;
+    case FB_ACK:
+        if (phase == P_WRITE && rx_buf[1] == page) {
+            written++;
+            if (++page == pages)
+                phase = P_DONE;
+        } else if (phase == P_DONE) {
+            say("DONE ACKed: the new firmware starts");
+            done_at = avr->cycle;
+            phase = P_NEW;
+            acks = 0;
+        }
+        break;
+    case FB_NAK:
+        naks++;                             // the same one again
+        break;
+    }
+    tries = 0;
+    next = avr->cycle;
+}
+
+// edges on the line, not the Pi's own
+static void rx_edge(uint8_t level) {
+    uint64_t t = avr->cycle;
+    uint8_t boot = boot_frames();
+    uint8_t p, i;
+
+    if (level) {
+        if (rx_bits != 0xff && US(t - fall) > FR_LOW_MAX / (boot ? FR_UNIT_US / FB_UNIT_US : 1))
+            rx_bits = 0xff;
+        rise = t;
+        return;
+    }
+    fall = t;
+    p = boot ? fb_pulse(US(t - rise)) : fr_pulse(US(t - rise));
+    if (p == FR_P_START) {
+        rx_bits = 0;
+    } else if ((p == FR_P_ZERO || p == FR_P_ONE) && rx_bits != 0xff) {
+        i = rx_bits >> 3;
+        rx_buf[i] = rx_buf[i] << 1 | (p == FR_P_ONE);
+        if ((++rx_bits & 7) == 0 && (rx_bits >> 3) == (boot ? 3 : FR_LEN(rx_buf[0]) + 2)) {
+            rx_got(rx_bits >> 3);
+            rx_bits = 0xff;
+        }
+    } else {
+        rx_bits = 0xff;
+    }
+}
+
+// Main starts here ---------------------------------------------
+//---------------------------------------------------------------
+int main(int argc, char **argv) {
+    elf_firmware_t f;
+    avr_eeprom_desc_t ee = { .offset = 0, .size = EEPROM };
+    uint8_t noinit[RAMEND + 1 - BOOT_NOINIT];
+    uint64_t boot_at = NEVER, off_at = NEVER;
+    uint8_t key = 0, mcu;
+    uint32_t end, a;
+    uint16_t entry;
+    int i, st;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s FLASH.hex IMAGE.hex\n", argv[0]);
+        return 2;
+    }
+    hex_load(argv[1], flash);
+    end = hex_load(argv[2], image);
+    if (end < 2 || end > FB_BOOT) {
+        fprintf(stderr, "avrupdate: %s: %u bytes, not a firmware below 0x%x\n", argv[2], end, FB_BOOT);
+        return 1;
+    }
+    pages = (end + FB_PAGE - 1) / FB_PAGE;
+
+    memset(&f, 0, sizeof(f));
+    strcpy(f.mmcu, MCU);
+    f.frequency = F_CPU;
+    f.flash = flash;
+    f.flashsize = FLASH;
+    if (!(avr = avr_make_mcu_by_name(f.mmcu))) {
+        fprintf(stderr, "avrupdate: simavr has no %s\n", MCU);
+        return 1;
+    }
+    avr_init(avr);
+    avr_load_firmware(avr, &f);
+    avr->log = 0;
+
+    for (i = 0; i < 8; i++)                 // all inputs open: pull-ups, key up
+        avr_raise_irq(pin_a[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('A'), i), i != FROMPI);
+    for (i = 0; i < 3; i++)
+        avr_raise_irq(pin_b[i] = avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('B'), i), 1);
+    avr_raise_irq(pin_a[DELAYTIME], 0);     // DIP short delays
+    memcpy(noinit, avr->data + BOOT_NOINIT, sizeof(noinit));
+
+    printf("%u pages to send, %s\n", pages, argv[2]);
+    while (phase != P_END) {
+        if (avr->cycle >= CYC_MS(1000UL * RUN_S))
+            fail(phase == P_NEW ? "the new firmware does not answer" : "update not done in time");
+
+        // key and power
+        if (key == 0 && avr->cycle >= CYC_MS(KEY_MS)) {
+            say("key: power on");
+            avr_raise_irq(pin_a[KEY0], 0);
+            key = 1;
+        }
+        if (key == 1 && avr->cycle >= CYC_MS(KEY_MS + 300)) {
+            avr_raise_irq(pin_a[KEY0], 1);
+            key = 2;
+        }
+        if (avr->data[DDRA_ADDR] & avr->data[PORTA_ADDR] & (1<<VPOWER)) {
+            off_at = NEVER;
+            if (boot_at == NEVER)
+                boot_at = avr->cycle + CYC_MS(PI_BOOT_MS);
+        } else if (boot_at != NEVER && off_at == NEVER) {
+            off_at = avr->cycle;            // the pins are inputs during a reset
+        } else if (boot_at != NEVER && avr->cycle - off_at > CYC_MS(RESET_MS)) {
+            fail("the Pi lost its power");
+        }
+        if (phase == P_OFF && avr->cycle >= boot_at) {
+            phase = P_HB;
+            next = avr->cycle;
+        }
+
+        // the line: the Pi's edges are its own, the others are received
+        mcu = !!(avr->data[DDRA_ADDR] & avr->data[PORTA_ADDR] & (1<<FROMPI));
+        if ((pi_drive | mcu) != line) {
+            line = pi_drive | mcu;
+            if (!tx_on)
+                rx_edge(line);
+        }
+        if (avr->cycle >= tx_next)
+            tx_edge();
+        else if (phase != P_OFF && avr->cycle >= next)
+            pi_step();
+        if (phase == P_NEW && acks >= HB_ALIVE) {
+            say("the new firmware ACKs the heartbeats");
+            phase = P_END;
+        }
+
+        st = avr_run(avr);
+        if (st == cpu_Done || st == cpu_Crashed)
+            fail("firmware stopped");
+        if (avr->pc == 0) {                 // reset: a real ATtiny keeps its RAM, .noinit
+            memcpy(avr->data + BOOT_NOINIT, noinit, sizeof(noinit));
+            continue;
+        }
+        memcpy(noinit, avr->data + BOOT_NOINIT, sizeof(noinit));
+    }
+
+    printf("\n%u pages in %.1f s, %u resent, %u NAK, %u bad frames\n", written,
+           (double)(done_at - update_at) / F_CPU, resent, naks, bad);
+    entry = image[0] | image[1] << 8;
+    if ((avr->flash[0] | avr->flash[1] << 8) != BOOT_VECTOR)
+        fail("word 0 does not point at the bootloader");
+    for (a = 2; a < (uint32_t)pages * FB_PAGE; a++)
+        if (avr->flash[a] != image[a]) {
+            printf("  flash 0x%04x: 0x%02x, image 0x%02x\n", a, avr->flash[a], image[a]);
+            fail("the flash does not hold the image (SPM?)");
+        }
+    avr_ioctl(avr, AVR_IOCTL_EEPROM_GET, &ee);
+    if (ee.ee[EE_RECORD + 2] != BOOT_VALID || (ee.ee[EE_RECORD] | ee.ee[EE_RECORD + 1] << 8) != BOOT_TARGET(entry))
+        fail("boot record not VALID with the image's entry");
+    printf("update: ok\n");
+    return 0;
+}
+//  End of Code
+//
@@ -0,0 +1,77 @@
+/************************************************************************/
+/*  fsmdot - draw the iSwitchPi state diagram from the FSM tables       */
+/*                                                                      */
+/*  Links against the firmware (host build) and reads fsm_table,        */
+/*  fsm_actions and fsm_events, the bytes that go into flash. Graphviz  */
+/*  dot on stdout:   make diagram                                       */
+/*                   dot -Tpdf iswitchpi_state-diagram.dot -o x.pdf     */
+/************************************************************************/
+
+#include <stdio.h>
+#include <hw.h>
+#include <fsm.h>
+
+extern const uint8_t fsm_table[STATES][EVENTS];
+extern const uint8_t fsm_actions[STATES][F_ACTIONS];
+extern const uint16_t fsm_events[STATES];
+
+static const char *state_name[STATES] = {
+    "Initial state\\nMCU power on",
+    "Stand-by\\nPi off, led pulses",
+    "Tentative power on\\nwaiting for Pi, led fast",
+    "Power on\\nregular operation, led on",
+    "Power on\\nPi not checked, led on",
+    "Power off\\ndelay, led slow",
+    "Last chance\\ncheck Pi again",
+    "TESTMODE\\nPi on, orange led",
+    "Recovery\\nPi off, led very slow",
+    "Supply low\\nPi off, led pulses",
+};
+
+static const char *event_name[EVENTS] = {
+    "Pi alive", "Pi lost", "short key (TESTPIN low)", "short key",
+    "long key", "Pi down", "timeout", "DIP auto power on", "recover",
+    "supply low", "supply ok", "double click", "triple click",
+    "key held", "else",
+};
+
+static const char *action_name[ACTIONS] = {
+    "", "send halt", "send reboot", "delay halt", "send halt now",
+    "blink orange", "learn", "square on/off", "init", "standby", "wake", "power on", "blink off",
+    "led on", "power off", "check", "test", "power cycle", "square wave", "sleep",
+};
+
+int main(void) {
+    uint8_t s, e, t, a;
+
+    printf("// generated by tools/fsmdot.c from the tables in iswitchpi.c - do not edit\n");
+    printf("digraph iswitchpi {\n");
+    printf("    rankdir=LR;\n");
+    printf("    node [shape=box, style=rounded, fontname=Helvetica];\n");
+    printf("    edge [fontname=Helvetica, fontsize=10];\n");
+
+    for (s = 0; s < STATES; s++) {
+        printf("    state%u [label=\"state%u\\n%s", s, s, state_name[s]);
+        if ((a = fsm_actions[s][F_ENTRY]))
+            printf("\\nentry: %s", action_name[a]);
+        if ((a = fsm_actions[s][F_DO]))
+            printf("\\ndo: %s", action_name[a]);
+        if ((a = fsm_actions[s][F_EXIT]))
+            printf("\\nexit: %s", action_name[a]);
+        printf("\"];\n");
+    }
+    for (s = 0; s < STATES; s++) {
+        for (e = 0; e < EVENTS; e++) {
+            t = fsm_table[s][e];
+            if (!t || (e != EV_NONE && !(fsm_events[s] & EV(e))))
+                continue;
+            printf("    state%u -> state%u [label=\"%s", s,
+                   T_NEXT(t) == S_STAY ? s : T_NEXT(t), event_name[e]);
+            if (T_ACTION(t))
+                printf(" / %s", action_name[T_ACTION(t)]);
+            printf("\"];\n");
+        }
+    }
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,147 @@
+/************************************************************************/
+/*  Supply voltage, measured against the ADC bandgap, make VCC=1        */
+/*                                                                      */
+/*  VCC is the ADC reference, the input is the 1.1 V bandgap:           */
+/*  VCC = 1100 mV * 1024 / ADC, no pin and no divider needed.           */
+/*  One conversion every VCC_PERIOD_MS, started from the main loop and  */
+/*  finished in ADC_vect (13 ADC clocks of 8 us at 1 MHz).              */
+/*                                                                      */
+/*  Standby (Timer0 stopped): the ADC is off during power-down, it      */
+/*  draws current with ADEN. At a wakeup the conversion runs in ADC     */
+/*  noise reduction sleep, the first one after ADEN is thrown away      */
+/*  (bandgap not settled yet).                                          */
+/*  Pi on: noise reduction sleep would stop Timer0 and Timer1 (ms       */
+/*  clock, frames to the Pi, square wave), the CPU only idles during    */
+/*  the conversion. The filter takes care of the rest.                  */
+/*                                                                      */
+/*  Filter: exponential average over 2^VCC_FILTER samples, a step of    */
+/*  the supply is 3/4 in after 5 samples (VCC_PERIOD_MS each).          */
+/*  Low below low_mv, good again VCC_HYST_MV above it.                  */
+/************************************************************************/
+
+#ifdef VCC
+
+#include <hw.h>
+#include <vcc.h>
+#include <timer.h>
+
+#define VCC_ADPS        (1<<ADPS1 | 1<<ADPS0)       // F_CPU / 8: 125 kHz ADC clock at 1 MHz
+#define VCC_ADCSRA      (1<<ADEN | 1<<ADIE | VCC_ADPS)
+
+static volatile uint16_t raw;               // result of the last conversion
+static volatile uint8_t done;               // ADC_vect since the start
+static uint8_t busy;                        // conversion started, not yet taken
+static uint8_t skip;                        // ADC just switched on: throw the result away
+static uint32_t at;                         // ms_now() of the last sample
+static uint16_t avg;                        // mV << VCC_FILTER
+static uint8_t low;
+
+ISR( ADC_vect )
+{
+    raw = ADC;
+    done = 1;
+}
+
+static uint16_t vcc_mv(uint16_t adc) {
+    uint32_t mv;
+
+    if (adc == 0)
+        return 0x3fff;
+    mv = (VCC_BANDGAP_MV * 1024UL + adc / 2) / adc;
+    return mv > 0x3fff ? 0x3fff : mv;       // avg must not overflow
+}
+
+//---------------------------------------------------------
+// start a conversion, with the CPU asleep until it is done
+//
+static void vcc_start(void) {
+    uint8_t quiet = !(TIMSK0 & (1<<OCIE0A));        // no tick: standby
+
+    if (!(ADCSRA & (1<<ADEN))) {
+        ADCSRA = VCC_ADCSRA;
+        skip = 1;
+    }
+    done = 0;
+    busy = 1;
+    cli();
+    if (quiet)
+        set_sleep_mode(SLEEP_MODE_ADC);             // the sleep starts the conversion
+    else {
+        ADCSRA |= 1<<ADSC;
+        set_sleep_mode(SLEEP_MODE_IDLE);
+    }
+    sleep_enable();
+    sei();                                          // next instruction is executed before any interrupt
+    sleep_cpu();
+    sleep_disable();
+    if (!done && !(ADCSRA & (1<<ADSC)))
+        ADCSRA |= 1<<ADSC;                          // woken before it started
+}
+
+//---------------------------------------------------------
+// Function vcc_init()
+//  first value for the filter, by polling: the ISR is not on yet
+//
+void vcc_init(void) {
+    ADMUX = VCC_MUX;
+    ADCSRA = 1<<ADEN | 1<<ADSC | VCC_ADPS;          // the first one is off
+    _delay_ms(1);
+    ADCSRA |= 1<<ADSC;
+    _delay_ms(1);
+    avg = vcc_mv(ADC) << VCC_FILTER;
+    ADCSRA = 1<<ADIF | VCC_ADCSRA;                  // ADIF: cleared by writing 1
+    at = ms_now();
+}
+
+//---------------------------------------------------------
+// Function vcc_poll()
+//  main loop, every pass: take a finished conversion, start the
+//  next one when due, low flag with hysteresis. low_mv 0: never
+//  low, no more samples
+//
+void vcc_poll(uint16_t low_mv) {
+    uint16_t mv;
+
+    if (busy && done) {
+        busy = 0;
+        if (skip)
+            skip = 0;                               // at once another one
+        else {
+            avg += vcc_mv(raw) - (avg >> VCC_FILTER);
+            at = ms_now();
+        }
+    }
+    if (low_mv == 0) {                              // off: no current for the ADC
+        low = 0;
+        return;
+    }
+    if (!busy && ms_now() - at >= VCC_PERIOD_MS)
+        vcc_start();
+
+    mv = vcc_now();
+    if (mv < low_mv)
+        low = 1;
+    else if (mv >= low_mv + VCC_HYST_MV)
+        low = 0;
+}
+
+void vcc_off(void) {
+    ADCSRA = 0;                                     // a running conversion is lost
+    busy = 0;
+}
+
+uint8_t vcc_busy(void) {
+    return busy;
+}
+
+uint8_t vcc_low(void) {
+    return low;
+}
+
+uint16_t vcc_now(void) {
+    return avg >> VCC_FILTER;
+}
+
+#endif  // ifdef VCC
+//  End of Code
+//
@@ -0,0 +1,37 @@
+/* -----------------------------------------------------------------------
+ * Title: Supply voltage, measured against the ADC bandgap
+ * Hardware: ATtiny44
+ * The ADC reads its 1.1 V bandgap with VCC as the reference, so the
+ * result goes down as VCC goes up: VCC = 1.1 V * 1024 / ADC. Sampled
+ * every VCC_PERIOD_MS from the main loop, filtered, with a low flag
+ * that has hysteresis. Details in vcc.c
+ * Only with make VCC=1, else the supply is never low.
+ * -----------------------------------------------------------------------*/
+
+#ifndef _VCC_H
+#define _VCC_H
+
+#include <stdint.h>
+
+#define VCC_PERIOD_MS   100                 // between two samples (standby: every wakeup)
+#define VCC_FILTER      2                   // exponential average over 2^VCC_FILTER samples
+#define VCC_HYST_MV     200                 // low until this much above the threshold again
+#define VCC_BANDGAP_MV  1100
+#define VCC_MUX         0x21                // ADMUX: VCC reference, input 1.1 V bandgap
+
+#ifdef VCC
+void vcc_init(void);                        // ADC on, first measurement (waits ~2 ms)
+void vcc_poll(uint16_t low_mv);             // main loop: sample when due, low_mv 0: off
+void vcc_off(void);                         // before power-down, the ADC draws current
+uint8_t vcc_busy(void);                     // conversion not yet taken: no power-down yet
+uint8_t vcc_low(void);                      // below low_mv, not yet VCC_HYST_MV above it
+uint16_t vcc_now(void);                     // mV, filtered
+#else                                       // built without make VCC=1: ADC off
+static inline void vcc_init(void) {}
+static inline void vcc_poll(uint16_t low_mv) {}
+static inline void vcc_off(void) {}
+static inline uint8_t vcc_busy(void) { return 0; }
+static inline uint8_t vcc_low(void) { return 0; }
+#endif
+
+#endif  // ifndef _VCC_H